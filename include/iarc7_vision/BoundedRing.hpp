@@ -0,0 +1,376 @@
+#ifndef IARC7_VISION_BOUNDED_RING_HPP_
+#define IARC7_VISION_BOUNDED_RING_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <ros/assert.h>
+
+namespace iarc7_vision {
+
+/// What BoundedRing::push does when the ring is full
+enum class RingPolicy
+{
+    /// Throw away the oldest item to make room
+    DropOldest,
+    /// Throw away everything, so the consumer only ever sees the newest item
+    KeepLatest,
+    /// Wait for the consumer to make room
+    Block
+};
+
+/// Parse a RingPolicy from drop_oldest, keep_latest, or block
+///
+/// @returns  False if str is not a valid policy
+inline bool parseRingPolicy(const std::string& str, RingPolicy& policy)
+{
+    if (str == "drop_oldest") policy = RingPolicy::DropOldest;
+    else if (str == "keep_latest") policy = RingPolicy::KeepLatest;
+    else if (str == "block") policy = RingPolicy::Block;
+    else return false;
+    return true;
+}
+
+struct RingStats {
+    size_t capacity;
+    /// Number of items currently in the ring
+    size_t occupancy;
+    /// Highest occupancy seen so far
+    size_t max_occupancy;
+    uint64_t pushed;
+    uint64_t popped;
+    uint64_t dropped;
+};
+
+/// Fixed capacity queue between a producer thread and a consumer thread
+///
+/// Capacity must be at least 2.
+///
+/// Neither push nor pop takes a lock or allocates.  The ring is based on
+/// Vyukov's bounded queue, which allows more than one thread to pop; this is
+/// what lets the producer drop the oldest item when the ring is full while
+/// the consumer is popping concurrently.  The only locks are used by popWait
+/// when the ring is empty, and by push with RingPolicy::Block when it's
+/// full.
+///
+/// tryPop, popWait, clear and skipped are for the consumer thread only.
+template<class T>
+class BoundedRing {
+  public:
+    BoundedRing(size_t capacity, RingPolicy policy)
+        : capacity_(capacity),
+          policy_(policy),
+          cells_(new Cell[capacity]),
+          enqueue_pos_(0),
+          dequeue_pos_(0),
+          pushed_(0),
+          popped_(0),
+          dropped_(0),
+          max_occupancy_(0),
+          consumer_position_(0),
+          skipped_(0),
+          consumer_waiting_(false),
+          producer_waiting_(false),
+          closed_(false)
+    {
+        // A single cell can't tell full from empty using sequence numbers
+        ROS_ASSERT_MSG(capacity_ >= 2, "BoundedRing capacity must be >= 2");
+
+        for (size_t i = 0; i < capacity_; i++) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedRing(const BoundedRing&) = delete;
+    BoundedRing& operator=(const BoundedRing&) = delete;
+
+    /// Add an item, handling a full ring according to the policy
+    ///
+    /// @returns  False if the ring was closed while blocked
+    bool push(T item)
+    {
+        T dropped;
+        size_t dropped_position;
+        switch (policy_)
+        {
+            case RingPolicy::DropOldest:
+                while (!tryPush(item)) {
+                    if (tryPopInternal(dropped, dropped_position)) {
+                        dropped_++;
+                    } else {
+                        // The consumer is in the middle of a pop
+                        std::this_thread::yield();
+                    }
+                }
+                break;
+            case RingPolicy::KeepLatest:
+                while (tryPopInternal(dropped, dropped_position)) {
+                    dropped_++;
+                }
+                while (!tryPush(item)) {
+                    if (tryPopInternal(dropped, dropped_position)) {
+                        dropped_++;
+                    } else {
+                        // The consumer is in the middle of a pop
+                        std::this_thread::yield();
+                    }
+                }
+                break;
+            case RingPolicy::Block:
+                if (!tryPush(item)) {
+                    std::unique_lock<std::mutex> lock(space_mutex_);
+                    producer_waiting_.store(true, std::memory_order_relaxed);
+                    // Pairs with the fence in consumerTook, either we see
+                    // the free cell or the consumer sees that we are waiting
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                    bool pushed = false;
+                    space_cv_.wait(lock, [&]() {
+                        pushed = tryPush(item);
+                        return pushed || closed_.load();
+                    });
+
+                    producer_waiting_.store(false, std::memory_order_relaxed);
+                    if (!pushed) {
+                        return false;
+                    }
+                }
+                break;
+        }
+
+        pushed_++;
+
+        size_t occupancy = size();
+        size_t max_occupancy = max_occupancy_.load(std::memory_order_relaxed);
+        while (occupancy > max_occupancy
+            && !max_occupancy_.compare_exchange_weak(max_occupancy,
+                                                     occupancy)) {
+        }
+
+        // Pairs with the fence in popWait, either the consumer sees the new
+        // item or we see that it is waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (consumer_waiting_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            wait_cv_.notify_one();
+        }
+
+        return true;
+    }
+
+    /// Take the oldest item without waiting
+    ///
+    /// @returns  False if the ring was empty
+    bool tryPop(T& item)
+    {
+        size_t position;
+        if (!tryPopInternal(item, position)) {
+            return false;
+        }
+
+        popped_++;
+        consumerTook(position);
+        return true;
+    }
+
+    /// Take the oldest item, waiting up to timeout for one to arrive
+    ///
+    /// @returns  False if no item arrived or the ring was closed
+    template<class Rep, class Period>
+    bool popWait(T& item, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        if (tryPop(item)) {
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+        consumer_waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool got_item = false;
+        wait_cv_.wait_for(lock, timeout, [&]() {
+            got_item = tryPop(item);
+            return got_item || closed_.load();
+        });
+
+        consumer_waiting_.store(false, std::memory_order_relaxed);
+        return got_item;
+    }
+
+    /// Throw away everything in the ring, counted as drops but not as
+    /// skipped
+    void clear()
+    {
+        T dropped;
+        size_t position;
+        while (tryPopInternal(dropped, position)) {
+            dropped_++;
+            consumerTook(position);
+        }
+    }
+
+    /// Wake up anyone blocked on the ring and make them return
+    void close()
+    {
+        closed_.store(true);
+        {
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            wait_cv_.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(space_mutex_);
+        space_cv_.notify_all();
+    }
+
+    /// Approximate number of items in the ring
+    size_t size() const
+    {
+        const size_t enqueue_pos = enqueue_pos_.load(std::memory_order_relaxed);
+        const size_t dequeue_pos = dequeue_pos_.load(std::memory_order_relaxed);
+        return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+    }
+
+    /// Number of items dropped so far
+    uint64_t dropped() const { return dropped_.load(); }
+
+    /// Number of items dropped between the ones the consumer has taken
+    ///
+    /// Worked out from the positions of the items popped, so it already
+    /// counts a gap when tryPop or popWait returns the item after it.
+    /// dropped() can lag behind, since the producer counts a drop after it
+    /// has made it.
+    uint64_t skipped() const { return skipped_; }
+
+    RingStats stats() const
+    {
+        RingStats stats;
+        stats.capacity = capacity_;
+        stats.occupancy = size();
+        stats.max_occupancy = max_occupancy_.load();
+        stats.pushed = pushed_.load();
+        stats.popped = popped_.load();
+        stats.dropped = dropped_.load();
+        return stats;
+    }
+
+  private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    bool tryPush(T& item)
+    {
+        Cell* cell;
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos % capacity_];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence)
+                                - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(
+                            pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Bookkeeping for an item the consumer popped at position
+    void consumerTook(size_t position)
+    {
+        // Every item between the last one we took and this one was dropped
+        skipped_ += position - consumer_position_;
+        consumer_position_ = position + 1;
+
+        if (policy_ == RingPolicy::Block) {
+            // Pairs with the fence in push, either the producer sees the
+            // free cell or we see that it is waiting
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (producer_waiting_.load(std::memory_order_relaxed)) {
+                std::lock_guard<std::mutex> lock(space_mutex_);
+                space_cv_.notify_one();
+            }
+        }
+    }
+
+    /// @param[out] position  Index of the item among everything pushed
+    bool tryPopInternal(T& item, size_t& position)
+    {
+        Cell* cell;
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos % capacity_];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence)
+                                - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(
+                            pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Empty
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        item = std::move(cell->data);
+        // Don't hold on to the item (e.g. an image buffer) until the cell
+        // is reused
+        cell->data = T();
+        cell->sequence.store(pos + capacity_, std::memory_order_release);
+        position = pos;
+        return true;
+    }
+
+    const size_t capacity_;
+    const RingPolicy policy_;
+
+    std::unique_ptr<Cell[]> cells_;
+
+    std::atomic<size_t> enqueue_pos_;
+    std::atomic<size_t> dequeue_pos_;
+
+    std::atomic<uint64_t> pushed_;
+    std::atomic<uint64_t> popped_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<size_t> max_occupancy_;
+
+    /// Position after the last item the consumer took, consumer only
+    size_t consumer_position_;
+    uint64_t skipped_;
+
+    std::atomic<bool> consumer_waiting_;
+    std::atomic<bool> producer_waiting_;
+    std::atomic<bool> closed_;
+    /// popWait waits on this for an item
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cv_;
+    /// push waits on this for a free cell, never locked with wait_mutex_
+    /// held by the producer
+    std::mutex space_mutex_;
+    std::condition_variable space_cv_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -0,0 +1,47 @@
+#ifndef IARC7_VISION_CAMERA_SETTINGS_HPP_
+#define IARC7_VISION_CAMERA_SETTINGS_HPP_
+
+#include <string>
+
+namespace iarc7_vision {
+
+/// One camera the vision node subscribes to, and the stages its frames go
+/// through
+///
+/// See the cameras section of vision_node_params.yaml for descriptions
+struct CameraSettings {
+    /// Also the camera id on its roomba detections
+    std::string name;
+    std::string topic;
+    /// Optical frame of the camera
+    std::string frame;
+    /// Wait for an image from this camera on startup
+    bool required;
+
+    // Stages
+    bool undistort;
+    bool color_correct;
+    bool roomba;
+    bool grid;
+    bool floor;
+    bool flow;
+
+    /// Namespaces of the models, relative to the node's private namespace,
+    /// only set if undistort is
+    std::string distortion_model_ns;
+    std::string color_correction_model_ns;
+    /// Only set if undistort is
+    std::string corrected_image_topic;
+
+    /// Namespace of the roomba estimator, relative to the node's private
+    /// namespace, only set if roomba is
+    std::string roomba_estimator_ns;
+
+    /// Camera whose roomba detections are masked out of the flow image,
+    /// only set if flow is, empty for none
+    std::string flow_roomba_mask_camera;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -1,20 +1,58 @@
 #ifndef IARC7_VISION_COLOR_CORRECTION_MODEL_HPP_
 #define IARC7_VISION_COLOR_CORRECTION_MODEL_HPP_
 
+#include <array>
+
 #include <opencv2/opencv.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/cudaimgproc.hpp>
 #include <opencv2/imgproc.hpp>
 #include <ros/ros.h>
 
+#include "iarc7_vision/kernels/ColorCorrection.hpp"
+
 namespace iarc7_vision {
 
+/// Intermediate buffers used by ColorCorrectionModel::correct
+///
+/// Callers which correct several images concurrently on different streams
+/// need one of these per stream
+struct ColorCorrectionBuf {
+    cv::cuda::GpuMat in_post_gamma;
+    std::array<cv::cuda::GpuMat, 3> in_channels;
+    std::array<cv::cuda::GpuMat, 3> saturated_masks;
+    cv::cuda::GpuMat gbr_order;
+    cv::cuda::GpuMat brg_order;
+    cv::cuda::GpuMat out1;
+    cv::cuda::GpuMat out2;
+    cv::cuda::GpuMat out3;
+    cv::cuda::GpuMat out_float1;
+    cv::cuda::GpuMat out_float2;
+    cv::cuda::GpuMat out_float;
+    cv::cuda::GpuMat out_before_gamma;
+    cv::cuda::GpuMat out_after_gamma;
+    std::array<cv::cuda::GpuMat, 3> out_channels;
+};
+
 class ColorCorrectionModel {
   public:
     ColorCorrectionModel(const ros::NodeHandle& nh);
+
+    /// Color correct an image using the model's internal buffers
+    ///
+    /// Not safe to call concurrently on multiple streams, use the overload
+    /// taking a ColorCorrectionBuf for that
+    ///
+    /// Uses the fused kernel unless use_fused_kernel is false, in which case
+    /// the multi-pass reference implementation is used
     void correct(const cv::cuda::GpuMat& in,
                  cv::cuda::GpuMat& out,
                  cv::cuda::Stream& stream) const;
+
+    void correct(const cv::cuda::GpuMat& in,
+                 cv::cuda::GpuMat& out,
+                 ColorCorrectionBuf& buf,
+                 cv::cuda::Stream& stream) const;
   private:
     const double a00_;
     const double a01_;
@@ -30,24 +68,17 @@ class ColorCorrectionModel {
     const double offset2_;
     const double gamma_;
     const double final_gamma_;
+    const bool use_fused_kernel_;
 
     cv::Ptr<cv::cuda::LookUpTable> gamma_lut_;
     cv::Ptr<cv::cuda::LookUpTable> final_lut_;
 
-    mutable cv::cuda::GpuMat in_post_gamma_;
-    mutable std::array<cv::cuda::GpuMat, 3> in_channels_;
-    mutable std::array<cv::cuda::GpuMat, 3> saturated_masks_;
-    mutable cv::cuda::GpuMat gbr_order_;
-    mutable cv::cuda::GpuMat brg_order_;
-    mutable cv::cuda::GpuMat out1_;
-    mutable cv::cuda::GpuMat out2_;
-    mutable cv::cuda::GpuMat out3_;
-    mutable cv::cuda::GpuMat out_float1_;
-    mutable cv::cuda::GpuMat out_float2_;
-    mutable cv::cuda::GpuMat out_float_;
-    mutable cv::cuda::GpuMat out_before_gamma_;
-    mutable cv::cuda::GpuMat out_after_gamma_;
-    mutable std::array<cv::cuda::GpuMat, 3> out_channels_;
+    // Single channel versions of the luts for the fused kernel
+    cv::cuda::GpuMat gamma_lut_gpu_;
+    cv::cuda::GpuMat final_lut_gpu_;
+    kernels::ColorCorrectionParams kernel_params_;
+
+    mutable ColorCorrectionBuf buf_;
 
 };
 
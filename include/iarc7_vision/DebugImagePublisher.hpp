@@ -0,0 +1,95 @@
+#ifndef IARC7_VISION_DEBUG_IMAGE_PUBLISHER_HPP_
+#define IARC7_VISION_DEBUG_IMAGE_PUBLISHER_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <opencv2/core.hpp>
+#include <ros/ros.h>
+#include <std_msgs/Header.h>
+
+#include "iarc7_vision/ImageMessagePool.hpp"
+
+namespace iarc7_vision {
+
+/// Publishes a debug image topic without slowing down the estimator that
+/// produces it
+///
+/// The topic is always advertised, but an image is only made when wanted()
+/// says so: someone is subscribed, the rate limit allows another image, and
+/// the last one is done.  The caller then takes a snapshot of whatever the
+/// image is drawn from (downloads, copies of detections) and hands over a
+/// function which draws it.  Drawing and publishing happen on a background
+/// thread at idle priority, so they only use cpu the pipeline doesn't want.
+class DebugImagePublisher {
+  public:
+    /// Draws the image to publish, runs on the background thread so it
+    /// must only use what it captured
+    using Render = std::function<cv::Mat()>;
+
+    /// @param[in]  nh        Node handle to advertise on
+    /// @param[in]  topic     Topic to publish on
+    /// @param[in]  max_rate  Most images to publish per second, 0 for no
+    ///                       limit
+    DebugImagePublisher(ros::NodeHandle& nh,
+                        const std::string& topic,
+                        double max_rate);
+
+    ~DebugImagePublisher();
+
+    DebugImagePublisher(const DebugImagePublisher&) = delete;
+    DebugImagePublisher& operator=(const DebugImagePublisher&) = delete;
+
+    /// Whether an image offered now would be published
+    ///
+    /// Cheap enough to call every frame, nothing should be downloaded or
+    /// drawn for this topic unless it returns true
+    bool wanted() const;
+
+    /// Draw and publish an image in the background
+    ///
+    /// Images offered when wanted() is false are dropped
+    ///
+    /// @param[in]  header    Header for the message
+    /// @param[in]  encoding  Encoding of the rendered image
+    /// @param[in]  render    Draws the image
+    void publish(const std_msgs::Header& header,
+                 const std::string& encoding,
+                 Render render);
+
+  private:
+    /// Body of the background thread
+    void run();
+
+    bool wantedLocked() const;
+
+    ros::Publisher publisher_;
+    const std::chrono::steady_clock::duration min_interval_;
+
+    /// Only touched from the background thread
+    ImageMessagePool message_pool_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable job_cv_;
+
+    /// A job is waiting or being drawn
+    bool busy_;
+    bool shutdown_;
+    std::chrono::steady_clock::time_point last_publish_;
+
+    std_msgs::Header header_;
+    std::string encoding_;
+    Render render_;
+
+    /// Started with the first image, so topics nobody looks at don't cost
+    /// a thread
+    std::thread thread_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
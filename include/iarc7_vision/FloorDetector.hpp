@@ -0,0 +1,188 @@
+#ifndef IARC7_VISION_FLOOR_DETECTOR_HPP_
+#define IARC7_VISION_FLOOR_DETECTOR_HPP_
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <geometry_msgs/TransformStamped.h>
+#include <opencv2/core.hpp>
+#include <opencv2/core/cuda.hpp>
+#include <ros/ros.h>
+
+#include "iarc7_vision/DebugImagePublisher.hpp"
+#include "iarc7_vision/ImagePyramid.hpp"
+#include "iarc7_vision/TransformSource.hpp"
+#include "iarc7_vision/kernels/FloorFeatures.hpp"
+
+namespace iarc7_vision {
+
+struct FloorDetectorSettings {
+    /// Fewest patches on the floor side of the boundary
+    int min_floor_patches;
+    /// Fraction of the patches on the floor side which must be floor
+    double min_floor_appearance_ratio;
+    /// Fewest patches on the far side of the boundary
+    int min_anti_floor_patches;
+    /// Fraction of the patches on the far side which must not be floor
+    double min_anti_floor_appearance_ratio;
+    /// Fewest non floor patches on the far side touching the image edge
+    int min_anti_floor_on_edge;
+
+    /// C of the linear svm splitting the patches into the two sides
+    double boundary_svm_c;
+
+    /// Diagonal angle of view of the camera, in radians
+    double afov;
+
+    /// Fewest recent frames, and detections of a boundary, before it's
+    /// published
+    int min_boundary_detections;
+    /// Most recent frames to consider
+    int max_detections_queued;
+    /// Oldest frame to consider, in seconds before the newest
+    double max_detection_lag;
+    /// Most spread in a boundary's position to publish it, in meters
+    double max_boundary_std_dev;
+
+    double transform_timeout;
+    double debug_image_max_rate;
+};
+
+/// Finds the edge of the arena in downward facing camera frames
+///
+/// Each frame is cropped to the ground area seen from the classifier's
+/// min_height, shrunk to its target size, and split into square patches.
+/// An svm labels each patch floor or not floor from its filterbank and color
+/// features.  A linear svm fit to the labelled patch centers gives the
+/// boundary, which has to pass a few sanity checks (enough of each class on
+/// each side, the non floor side touching the edge of the image).  The
+/// boundary's center is projected onto the floor and reported as the x or y
+/// position of the arena edge, once enough recent frames agree on it.
+///
+/// Publishes iarc7_msgs::Boundary on floor_detector/boundaries.  A left or
+/// right boundary runs along the map's x axis on the +y or -y side of the
+/// floor, a top or bottom one runs along the y axis on the +x or -x side.
+class FloorDetector {
+  public:
+    /// @param[in]  settings          Detector settings
+    /// @param[in]  classifier_nh     Namespace of the floor classifier, as
+    ///                               written by export_floor_classifier.py
+    /// @param[in]  transform_source  Source of the camera pose, must outlive
+    ///                               the detector
+    /// @param[in]  camera_frame      Optical frame of the camera
+    FloorDetector(const FloorDetectorSettings& settings,
+                  const ros::NodeHandle& classifier_nh,
+                  const TransformSource& transform_source,
+                  const std::string& camera_frame);
+
+    FloorDetector(const FloorDetector&) = delete;
+    FloorDetector& operator=(const FloorDetector&) = delete;
+
+    /// Look for the arena boundary in a frame
+    ///
+    /// Blocks until the gpu work queued on stream is done
+    ///
+    /// @param[in]  pyramid  Current frame (in rgb8)
+    /// @param[in]  time     Timestamp of the frame
+    /// @param[in]  stream   Stream to queue gpu work on
+    void update(ImagePyramid& pyramid,
+                const ros::Time& time,
+                cv::cuda::Stream& stream = cv::cuda::Stream::Null());
+
+  private:
+    /// Result of one frame
+    struct Detection {
+        bool found;
+        /// iarc7_msgs::Boundary type, if found
+        uint8_t type;
+        /// Position of the boundary along the map axis the type is
+        /// measured on, if found
+        double position;
+        ros::Time stamp;
+    };
+
+    /// Labelled patches of a frame and the boundary fit to them
+    struct FrameResult {
+        /// (cols x rows) of patches
+        cv::Size grid;
+        /// Patch centers in target size pixels, row major
+        std::vector<cv::Point2f> points;
+        /// True for patches which aren't floor
+        std::vector<bool> anti_floor;
+
+        bool have_line;
+        /// The boundary is line . (x, y) + line_offset = 0, with the non
+        /// floor side positive
+        cv::Vec2d line;
+        double line_offset;
+        bool failed_checks;
+    };
+
+    /// Label the patches of the target size image in resized_, queued on
+    /// stream, and wait for the labels
+    void classifyPatches(cv::cuda::Stream& stream, FrameResult& result);
+
+    /// Fit the boundary and run the sanity checks on it
+    ///
+    /// @returns  False if there's no usable boundary
+    bool fitBoundary(FrameResult& result) const;
+
+    /// Turn the boundary into a detection in the map frame
+    ///
+    /// @param[in]  crop  Area of the pyramid level the target size image
+    ///                  came from
+    ///
+    /// @returns  False if the boundary doesn't cross the image, or doesn't
+    ///           hit the floor
+    bool locateBoundary(const FrameResult& result,
+                        const cv::Rect& crop,
+                        const cv::Size& level_size,
+                        const geometry_msgs::TransformStamped& camera_to_map,
+                        Detection& detection) const;
+
+    /// Add a frame's detection and publish every boundary recent frames
+    /// agree on
+    void filterDetections(const Detection& detection);
+
+    void publishBoundaryMarker(uint8_t type, double position);
+
+    void publishDebugImage(const FrameResult& result,
+                           const ros::Time& time,
+                           cv::cuda::Stream& stream);
+
+    const FloorDetectorSettings settings_;
+    const TransformSource& transform_source_;
+    const std::string camera_frame_;
+
+    // Classifier, loaded from rosparam
+    cv::Size target_size_;
+    double min_height_;
+    kernels::FloorFeatureParams feature_params_;
+    bool rbf_;
+    float gamma_;
+    float intercept_;
+    cv::cuda::GpuMat filters_;
+    cv::cuda::GpuMat support_vectors_;
+    cv::cuda::GpuMat dual_coefs_;
+
+    // Per frame buffers
+    cv::cuda::GpuMat resized_;
+    cv::cuda::GpuMat features_;
+    cv::cuda::GpuMat decisions_;
+    cv::cuda::HostMem decisions_cpu_;
+
+    /// Oldest first
+    std::deque<Detection> detections_;
+
+    ros::NodeHandle nh_;
+    ros::Publisher boundary_pub_;
+    ros::Publisher line_marker_pub_;
+    ros::Publisher boundary_marker_pub_;
+    DebugImagePublisher debug_image_pub_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
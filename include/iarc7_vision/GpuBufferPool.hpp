@@ -0,0 +1,125 @@
+#ifndef IARC7_VISION_GPU_BUFFER_POOL_HPP_
+#define IARC7_VISION_GPU_BUFFER_POOL_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <cuda_runtime.h>
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+struct GpuBufferPoolStats {
+    /// Allocations served from the pool
+    uint64_t hits;
+    /// Allocations that had to go to cudaMalloc
+    uint64_t misses;
+    /// Bytes currently handed out
+    size_t in_use_bytes;
+    /// Bytes held by the pool for reuse
+    size_t cached_bytes;
+};
+
+/// GpuMat allocator which keeps freed buffers around for reuse
+///
+/// Nearly every per-frame temporary has the same size every frame, so after
+/// the first frame at each size no more calls to cudaMalloc or cudaFree
+/// (which synchronizes the whole device) are made.  Installed for every
+/// GpuMat with install().
+///
+/// The allocator isn't told which stream a buffer was used on, so when a
+/// buffer is released an event is recorded on the default stream and every
+/// stream passed to addStream, and it's only handed out again once all of
+/// them have completed.  Work queued before the release can still
+/// use the buffer, whichever of those streams it's on, without the release
+/// waiting for it like cudaFree would.  Buffers beyond max_cached_bytes are
+/// freed for real.
+class GpuBufferPool : public cv::cuda::GpuMat::Allocator {
+  public:
+    explicit GpuBufferPool(size_t max_cached_bytes);
+
+    ~GpuBufferPool() override;
+
+    GpuBufferPool(const GpuBufferPool&) = delete;
+    GpuBufferPool& operator=(const GpuBufferPool&) = delete;
+
+    /// Make this the allocator for every GpuMat allocated from now on
+    ///
+    /// The pool must outlive every GpuMat allocated from it
+    void install();
+
+    /// Order reuse of released buffers after the work queued on stream
+    ///
+    /// Every non-blocking stream gpu work is queued on must be added before
+    /// any GpuMat used on it is released, and must outlive the pool.
+    /// Streams created by cv::cuda::Stream() don't need to be, the event on
+    /// the default stream already waits for them.
+    void addStream(const cv::cuda::Stream& stream);
+
+    /// Allocate count buffers for GpuMats of this size up front, so the
+    /// first frames at a size known at startup don't go to cudaMalloc
+    ///
+    /// Buffers which don't fit in max_cached_bytes aren't allocated
+    void reserve(int rows, int cols, size_t elem_size, size_t count);
+
+    bool allocate(cv::cuda::GpuMat* mat,
+                  int rows,
+                  int cols,
+                  size_t elem_size) override;
+
+    void free(cv::cuda::GpuMat* mat) override;
+
+    GpuBufferPoolStats stats() const;
+
+  private:
+    struct FreeBuffer {
+        void* data;
+        /// Recorded on each of streams_ when the buffer was released
+        std::vector<cudaEvent_t> released;
+    };
+
+    /// Bytes allocate uses for a GpuMat of this size, and its step
+    size_t getSize(int rows, int cols, size_t elem_size, size_t& step) const;
+
+    /// Take a cached buffer of at least size bytes whose work is done, or
+    /// allocate one
+    void* take(size_t size, size_t& actual_size);
+
+    /// Record an event on each of streams_, call with mutex_ held
+    void recordRelease(std::vector<cudaEvent_t>& events);
+
+    /// True once all work queued before the release has run, call with
+    /// mutex_ held
+    bool releaseDone(const FreeBuffer& buffer) const;
+
+    /// Give back the events of a buffer leaving the cache, call with
+    /// mutex_ held
+    void recycleEvents(FreeBuffer& buffer);
+
+    /// Free every cached buffer, call with mutex_ held
+    void clearCache();
+
+    const size_t max_cached_bytes_;
+    size_t pitch_alignment_;
+
+    mutable std::mutex mutex_;
+    /// Streams released buffers are ordered after, starting with the
+    /// default stream
+    std::vector<cudaStream_t> streams_;
+    /// Events not recorded for any cached buffer
+    std::vector<cudaEvent_t> spare_events_;
+    /// Cached buffers by size
+    std::multimap<size_t, FreeBuffer> free_buffers_;
+    /// Size of each buffer handed out
+    std::unordered_map<void*, size_t> used_buffers_;
+
+    GpuBufferPoolStats stats_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -0,0 +1,109 @@
+#ifndef IARC7_VISION_GPU_SCHEDULER_HPP_
+#define IARC7_VISION_GPU_SCHEDULER_HPP_
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+enum class GpuPriority {
+    /// Stages whose output is only useful if it's fresh (optical flow)
+    Latency,
+    /// Stages which only need to keep up on average (roomba, floor, grid)
+    Throughput
+};
+
+/// Shares a fixed number of cuda streams between all the camera pipelines
+///
+/// Each stage leases a stream for the gpu work of a frame, so adding a
+/// camera adds work to the same few streams instead of more streams all
+/// competing for the gpu.  The first stream is created with the device's
+/// highest priority and goes to latency stages first, so their kernels are
+/// started ahead of anything queued on the others.  Throughput stages share
+/// the rest at the lowest priority.  A latency stage takes any free stream
+/// if the first is leased, and once every stream is leased waiting latency
+/// stages are served before throughput ones.
+///
+/// With a single stream everything shares it at the default priority, and
+/// only the order waiting stages are served in is prioritized.
+///
+/// The streams don't synchronize with the default stream or each other, so
+/// a stage's work only waits behind work queued on the stream it leased.
+class GpuScheduler {
+  public:
+    /// Stream leased from the scheduler, given back on destruction
+    ///
+    /// Work still queued on the stream when it is given back runs before
+    /// whatever the next holder queues.
+    class Lease {
+      public:
+        /// Lease holding no stream
+        Lease();
+
+        Lease(Lease&& other);
+        Lease& operator=(Lease&& other);
+
+        ~Lease();
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        /// Stream to queue the stage's gpu work on
+        cv::cuda::Stream& stream() const;
+
+        /// Give the stream back before destruction
+        void release();
+
+      private:
+        friend class GpuScheduler;
+
+        Lease(GpuScheduler& scheduler, size_t index);
+
+        GpuScheduler* scheduler_;
+        size_t index_;
+    };
+
+    /// @param[in]  num_streams  Number of streams to share, at least one
+    explicit GpuScheduler(size_t num_streams);
+
+    /// All leases must have been given back
+    ~GpuScheduler();
+
+    GpuScheduler(const GpuScheduler&) = delete;
+    GpuScheduler& operator=(const GpuScheduler&) = delete;
+
+    /// Lease a stream, waiting for one to be given back if none are free
+    ///
+    /// Safe to call from any thread.  Don't call while holding another
+    /// lease, two stages doing that can wait on each other forever.
+    Lease acquire(GpuPriority priority);
+
+    size_t size() const { return streams_.size(); }
+
+    /// Every stream leased out, for things which have to be ordered after
+    /// work on any of them
+    const std::vector<cv::cuda::Stream>& streams() const { return streams_; }
+
+  private:
+    /// Index of a free stream for the priority, or size() if there isn't
+    /// one, call with mutex_ held
+    size_t findFree(GpuPriority priority) const;
+
+    void release(size_t index);
+
+    std::vector<cv::cuda::Stream> streams_;
+
+    std::mutex mutex_;
+    std::condition_variable released_cv_;
+    std::vector<bool> leased_;
+    /// Latency stages waiting in acquire
+    size_t latency_waiting_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
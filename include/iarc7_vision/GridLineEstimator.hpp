@@ -10,15 +10,21 @@
 #pragma GCC diagnostic pop
 // END BAD HEADERS
 
+#include <memory>
+#include <string>
+
 #include <opencv2/opencv.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/cudaimgproc.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <ros/ros.h>
-#include <ros_utils/SafeTransformWrapper.hpp>
 #include <tf2_ros/transform_listener.h>
 
+#include "iarc7_vision/DebugImagePublisher.hpp"
+#include "iarc7_vision/SettingsMailbox.hpp"
+#include "iarc7_vision/TransformSource.hpp"
+
 namespace iarc7_vision {
 
 struct LineExtractorSettings {
@@ -42,6 +48,9 @@ struct GridEstimatorSettings {
     double line_rejection_angle_threshold;
     double min_extraction_altitude;
     double allowed_position_stamp_error;
+    /// Find the exact minimum of the orientation and translation losses,
+    /// instead of sweeping over them at theta_step and grid_step
+    bool exact_search;
 };
 
 struct GridLineDebugSettings {
@@ -50,25 +59,75 @@ struct GridLineDebugSettings {
     bool debug_edges;
     bool debug_lines;
     bool debug_line_markers;
+    /// Most edge and line images to publish per second, 0 for no limit
+    double debug_image_max_rate;
     double debug_height;
 };
 
 class GridLineEstimator {
   public:
+    /// The line extractor settings are copied, changes after construction
+    /// go through stageSettings.  The others are referenced and must not
+    /// change.
+    ///
+    /// camera_frame is the optical frame of the camera the images come from
     GridLineEstimator(const LineExtractorSettings& line_estimator_settings,
                       const GridEstimatorSettings& grid_estimator_settings,
                       const GridLineDebugSettings& debug_settings,
-                      const std::string& expected_image_format);
+                      const std::string& expected_image_format,
+                      const TransformSource& transform_source,
+                      const std::string& camera_frame);
 
-    void update(const cv::cuda::GpuMat& image, const ros::Time& time);
+    /// Extract the grid position from an image and publish it
+    ///
+    /// @param[in]  image   Image from the camera
+    /// @param[in]  time    Timestamp of the image
+    /// @param[in]  stream  Stream to queue gpu work on, done when this
+    ///                     returns
+    void update(const cv::cuda::GpuMat& image,
+                const ros::Time& time,
+                cv::cuda::Stream& stream = cv::cuda::Stream::Null());
     bool __attribute__((warn_unused_result)) waitUntilReady(
             const ros::Duration& timeout);
 
-    /// MUST be called when either of the settings objects passed into the
-    /// constructor have their variables changed
-    bool __attribute__((warn_unused_result)) onSettingsChanged();
+    /// Stage new line extractor settings, which take effect at the start
+    /// of the next update
+    ///
+    /// Safe to call from any thread, including while update is running
+    void stageSettings(const LineExtractorSettings& settings);
+
+    /// Width the last image was resized to for line extraction, or 0 if
+    /// no lines have been extracted yet
+    ///
+    /// Doesn't depend on the size of the image passed to update, so it can
+    /// be used to pick a pyramid level for the next frame
+    int getLineImageWidth() const { return line_image_width_; }
+
+    /// Width of the last line image divided by the camera height it was
+    /// made at (in px/m), or 0 if no lines have been extracted yet
+    ///
+    /// The line image width is proportional to the height, so this gives
+    /// the width needed at another height
+    double getLineImageWidthPerHeight() const
+    {
+        return line_image_width_per_height_;
+    }
 
   private:
+    friend class MicroBenchmarkAccess;
+
+    /// Exact minimum over s in [0, period) of
+    ///     sum_i min_j circular_dist(s, candidates[i*per_point + j])^2
+    ///
+    /// Between the points where a datapoint's nearest candidate changes its
+    /// term is a quadratic in s, so this sweeps over those points keeping
+    /// running sums and minimizes each piece in closed form, in O(n log n)
+    /// instead of evaluating the loss at every step of a sweep
+    ///
+    /// Expects every candidate to be in [0, period)
+    static double circularLeastSquaresMin(const std::vector<double>& candidates,
+                                          size_t per_point,
+                                          double period);
 
     /// Returns the current angle of the quad from +x (with positive towards +y)
     double getCurrentTheta(const ros::Time& time) const;
@@ -90,7 +149,8 @@ class GridLineEstimator {
     /// TODO: change units of height parameter to pixels
     void getLines(std::vector<cv::Vec2f>& lines,
                   const cv::cuda::GpuMat& image,
-                  double height) const;
+                  double height,
+                  cv::cuda::Stream& stream) const;
 
     /// Computes the normal vectors of the planes defined by the given lines
     /// seen by the camera.
@@ -189,7 +249,9 @@ class GridLineEstimator {
                     double dist) const;
 
     /// Extract grid position from the image and publish if possible
-    void processImage(const cv::cuda::GpuMat& image, const ros::Time& time) const;
+    void processImage(const cv::cuda::GpuMat& image,
+                      const ros::Time& time,
+                      cv::cuda::Stream& stream) const;
 
     /// Process lines extracted from the image
     void processLines(double height,
@@ -235,31 +297,41 @@ class GridLineEstimator {
 
     void updateFilteredPosition(const ros::Time& time);
 
+    /// Swap in the last settings passed to stageSettings, if there are new
+    /// ones
+    void applyStagedSettings();
+
     uint32_t hsv_conversion_constant_;
     std::string image_encoding_;
 
     ros::Publisher pose_pub_;
     ros::Publisher yaw_pub_;
 
-    const LineExtractorSettings& line_extractor_settings_;
+    /// Only changed by applyStagedSettings, between frames
+    LineExtractorSettings line_extractor_settings_;
+    SettingsMailbox<LineExtractorSettings> staged_settings_;
     const GridEstimatorSettings& grid_estimator_settings_;
 
     const GridLineDebugSettings& debug_settings_;
     ros::Publisher debug_direction_marker_pub_;
-    ros::Publisher debug_edges_pub_;
-    ros::Publisher debug_lines_pub_;
+    std::unique_ptr<DebugImagePublisher> debug_edges_pub_;
+    std::unique_ptr<DebugImagePublisher> debug_lines_pub_;
     ros::Publisher debug_line_markers_pub_;
 
     cv::Ptr<cv::cuda::CannyEdgeDetector> gpu_canny_edge_detector_;
     cv::Ptr<cv::cuda::HoughLinesDetector> gpu_hough_lines_detector_;
 
-    /// Position of bottom_camera_rgb_optical_frame in the map frame
+    mutable int line_image_width_;
+    mutable double line_image_width_per_height_;
+
+    /// Position of the camera frame in the map frame
     /// when we received the last frame
     Eigen::Vector3d last_filtered_position_;
 
     ros::Time last_filtered_position_stamp_;
 
-    ros_utils::SafeTransformWrapper transform_wrapper_;
+    const TransformSource& transform_source_;
+    const std::string camera_frame_;
 
     ros::Time last_update_time_;
 };
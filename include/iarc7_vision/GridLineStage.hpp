@@ -0,0 +1,119 @@
+#ifndef IARC7_VISION_GRID_LINE_STAGE_HPP_
+#define IARC7_VISION_GRID_LINE_STAGE_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <nav_msgs/Odometry.h>
+#include <opencv2/core/cuda.hpp>
+#include <ros/ros.h>
+
+#include "iarc7_vision/GpuScheduler.hpp"
+#include "iarc7_vision/GridLineEstimator.hpp"
+#include "iarc7_vision/ImagePyramid.hpp"
+
+namespace iarc7_vision {
+
+/// Runs a GridLineEstimator on its own thread at a reduced rate
+///
+/// Frames are offered by the grid camera's thread after preprocessing.  A
+/// frame is only taken if the estimator is idle and the rate limit allows
+/// it, so grid estimation never holds up roomba detection; frames offered
+/// while it is busy are skipped.
+///
+/// The stage runs on every frame_interval'th frame, or on every frame it
+/// can while the filtered position is less certain than
+/// max_position_stddev.
+///
+/// Each run holds a throughput lease from the gpu scheduler and queues the
+/// estimator's work on the leased stream.
+class GridLineStage {
+  public:
+    /// @param[in]  estimator            Estimator to run, only updated by
+    ///                                  the stage's thread
+    /// @param[in]  frame_interval       Run on at most every Nth frame
+    ///                                  offered while the position is
+    ///                                  certain
+    /// @param[in]  max_position_stddev  Position standard deviation (in
+    ///                                  meters) above which every frame is
+    ///                                  wanted
+    /// @param[in]  scheduler            Scheduler to lease a stream from for
+    ///                                  each run, must outlive the stage
+    GridLineStage(GridLineEstimator& estimator,
+                  int frame_interval,
+                  double max_position_stddev,
+                  GpuScheduler& scheduler);
+
+    ~GridLineStage();
+
+    GridLineStage(const GridLineStage&) = delete;
+    GridLineStage& operator=(const GridLineStage&) = delete;
+
+    /// Width the estimator would resize the next frame to for line
+    /// extraction at the current height, or 0 if it isn't known yet
+    ///
+    /// Safe to call from any thread
+    int getTargetWidth() const;
+
+    /// Offer a frame to the stage
+    ///
+    /// If it is taken the smallest pyramid level at least getTargetWidth()
+    /// wide is copied, so the estimator never has to upsample it.  If the
+    /// base of the pyramid is narrower than that, full_size is used
+    /// instead if there is one.  The caller can reuse the images as soon as
+    /// this returns.  Doesn't wait for grid estimation.
+    ///
+    /// @param[in]  pyramid    Pyramid of the detection image
+    /// @param[in]  full_size  Full size corrected image, may be empty
+    /// @param[in]  time       Timestamp of the frame
+    /// @param[in]  stream     Stream to queue the copy on, done when this
+    ///                        returns
+    ///
+    /// @returns  True if the frame was taken
+    bool offer(ImagePyramid& pyramid,
+               const cv::cuda::GpuMat& full_size,
+               const ros::Time& time,
+               cv::cuda::Stream& stream);
+
+  private:
+    void odometryCallback(const nav_msgs::Odometry::ConstPtr& message);
+
+    void run();
+
+    GridLineEstimator& estimator_;
+    const int frame_interval_;
+    const double max_position_variance_;
+    GpuScheduler& scheduler_;
+
+    /// Frames offered since the last one taken, only used by offer
+    int frames_since_taken_;
+
+    /// Largest of the x and y variances of the last filtered position
+    std::atomic<double> position_variance_;
+    /// Height of the last filtered position
+    std::atomic<double> height_;
+    ros::Subscriber odometry_sub_;
+
+    /// Line image width per meter of height from the estimator's last run,
+    /// 0 before it has run
+    std::atomic<double> line_image_width_per_height_;
+
+    cv::cuda::GpuMat image_;
+    ros::Time image_time_;
+
+    std::mutex mutex_;
+    std::condition_variable image_cv_;
+    /// True from when a frame is taken until the estimator is done with it
+    bool busy_;
+    /// True once a taken frame has been copied and is ready to process
+    bool pending_;
+    bool shutdown_;
+
+    std::thread thread_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
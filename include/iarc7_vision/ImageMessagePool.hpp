@@ -0,0 +1,45 @@
+#ifndef IARC7_VISION_IMAGE_MESSAGE_POOL_HPP_
+#define IARC7_VISION_IMAGE_MESSAGE_POOL_HPP_
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <sensor_msgs/Image.h>
+#include <std_msgs/Header.h>
+
+namespace iarc7_vision {
+
+/// Image messages for publishing which are reused once nothing else holds
+/// them
+///
+/// Filling one is a single copy from the image into a buffer that's already
+/// allocated, instead of going through cv_bridge which allocates a new
+/// message and copies into it every frame.  A message is only reused after
+/// roscpp and every intraprocess subscriber have let go of it, otherwise a
+/// new one takes its place in the pool.
+class ImageMessagePool {
+  public:
+    /// @param[in]  size  Number of messages to keep around
+    explicit ImageMessagePool(size_t size);
+
+    /// Get a message with the contents of image
+    ///
+    /// @param[in]  image     Image to copy, 8 bit with any number of
+    ///                       channels
+    /// @param[in]  header    Header for the message
+    /// @param[in]  encoding  Encoding of image
+    sensor_msgs::ImageConstPtr fill(const cv::Mat& image,
+                                    const std_msgs::Header& header,
+                                    const std::string& encoding);
+
+  private:
+    std::vector<sensor_msgs::ImagePtr> messages_;
+
+    /// Next message to try
+    size_t next_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
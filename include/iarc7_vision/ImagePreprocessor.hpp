@@ -0,0 +1,182 @@
+#ifndef IARC7_VISION_IMAGE_PREPROCESSOR_HPP_
+#define IARC7_VISION_IMAGE_PREPROCESSOR_HPP_
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/cuda.hpp>
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+
+#include "iarc7_vision/ColorCorrectionModel.hpp"
+#include "iarc7_vision/StageTimings.hpp"
+#include "iarc7_vision/UndistortionModel.hpp"
+
+namespace iarc7_vision {
+
+/// Uploads, undistorts, and color corrects bottom camera frames
+///
+/// Every frame in flight gets its own slot with pinned staging buffers, and
+/// is queued on the stream passed to push, so the preprocessing of one frame
+/// can overlap whatever is done with the previous frame on another stream.
+/// With a depth of one this is equivalent to processing each frame
+/// synchronously.
+///
+/// With composite maps enabled the image used for detection is undistorted
+/// straight to the detection size, and the full size corrected image is
+/// only produced when it is going to be published.
+///
+/// With mapped memory (only on devices sharing memory with the host) the
+/// staging buffers are read and written by the kernels directly, which
+/// saves the upload and the download of the corrected image.
+///
+/// Messages are copied straight from their buffers into the staging
+/// buffers, and converted to rgb on the gpu based on their encoding.  Bayer
+/// images are demosaiced before undistortion, everything else is converted
+/// after.
+class ImagePreprocessor {
+  public:
+    struct Frame {
+        sensor_msgs::Image::ConstPtr message;
+
+        /// Undistorted and color corrected image (in rgb8)
+        ///
+        /// Only valid if has_corrected
+        cv::cuda::GpuMat corrected;
+
+        /// True if corrected was produced for this frame, which it is if it
+        /// was requested in push or composite maps are off
+        bool has_corrected = false;
+
+        /// Host copy of corrected, empty unless requested in push
+        cv::Mat corrected_cpu;
+
+        /// Undistorted and color corrected image to run detection on, at the
+        /// detection size with composite maps, otherwise the same as
+        /// corrected
+        cv::cuda::GpuMat detection;
+
+        /// Recorded after all work for this frame has been queued, other
+        /// streams can wait on this instead of blocking the host
+        cv::cuda::Event ready {cv::cuda::Event::DISABLE_TIMING};
+    };
+
+    /// @param[in]  undistortion_model      Model to undistort with
+    /// @param[in]  color_correction_model  Model to color correct with
+    /// @param[in]  color_conversion_code   cvtColor code to convert images
+    ///                                     to rgb, or 0, for encodings
+    ///                                     which don't give the channel
+    ///                                     order (8UC3 and 8UC4)
+    /// @param[in]  depth                   Max number of frames in flight
+    /// @param[in]  use_composite_maps      Undistort straight to the size
+    ///                                     passed to push for detection
+    /// @param[in]  use_mapped_memory       Use the staging buffers on the
+    ///                                     gpu instead of copying them, must
+    ///                                     only be set if
+    ///                                     deviceSharesHostMemory()
+    /// @param[in]  gpu_timer               Times the gpu work for each
+    ///                                     frame, may be null
+    ImagePreprocessor(const UndistortionModel& undistortion_model,
+                      const ColorCorrectionModel& color_correction_model,
+                      int color_conversion_code,
+                      size_t depth,
+                      bool use_composite_maps,
+                      bool use_mapped_memory,
+                      GpuStageTimer* gpu_timer);
+
+    /// True if push can take images with this encoding
+    bool supportsEncoding(const std::string& encoding) const;
+
+    /// True if no more frames can be pushed until one is popped
+    bool full() const { return in_flight_ == slots_.size(); }
+
+    /// True if there are no frames in flight
+    bool empty() const { return in_flight_ == 0; }
+
+    /// Queue all preprocessing for a frame, returns without waiting on it
+    ///
+    /// @param[in]  message             Raw image from the camera, with an
+    ///                                 encoding supportsEncoding accepts
+    /// @param[in]  detection_size      Size detection will run at
+    /// @param[in]  produce_corrected   Also produce the full size corrected
+    ///                                 image
+    /// @param[in]  download_corrected  Also produce the full size corrected
+    ///                                 image and copy it back to the host
+    /// @param[in]  stream              Stream to queue the work on, may be
+    ///                                 given to other work once this returns
+    void push(const sensor_msgs::Image::ConstPtr& message,
+              const cv::Size& detection_size,
+              bool produce_corrected,
+              bool download_corrected,
+              cv::cuda::Stream& stream);
+
+    /// Wait for the oldest frame in flight to finish
+    ///
+    /// The returned frame is valid until the next call to pop
+    const Frame& front();
+
+    /// Release the oldest frame so its slot can be reused
+    void pop();
+
+  private:
+    /// How to get rgb8 from an encoding
+    struct Conversion {
+        /// Type of the message data
+        int type;
+        /// cvtColor or demosaicing code, 0 for none
+        int code;
+        bool demosaic;
+    };
+
+    /// @returns  False if the encoding isn't supported
+    bool getConversion(const std::string& encoding,
+                       Conversion& conversion) const;
+
+    struct Slot {
+        Frame frame;
+
+        cv::cuda::HostMem upload_staging;
+        cv::cuda::HostMem download_staging;
+
+        /// True if frame.corrected is a view of download_staging
+        bool corrected_is_mapped = false;
+
+        cv::cuda::GpuMat distorted;
+        cv::cuda::GpuMat demosaiced;
+        cv::cuda::GpuMat undistorted;
+        cv::cuda::GpuMat undistorted_rgb;
+        ColorCorrectionBuf color_correction_buf;
+
+        // Separate buffers for the detection size, so they don't get
+        // reallocated when both sizes are produced
+        cv::cuda::GpuMat undistorted_detection;
+        cv::cuda::GpuMat undistorted_detection_rgb;
+        ColorCorrectionBuf detection_color_correction_buf;
+    };
+
+    /// Convert an undistorted image to rgb and color correct it
+    void convertAndCorrect(int color_conversion_code,
+                           const cv::cuda::GpuMat& undistorted,
+                           cv::cuda::GpuMat& undistorted_rgb,
+                           ColorCorrectionBuf& color_correction_buf,
+                           cv::cuda::GpuMat& out,
+                           cv::cuda::Stream& stream) const;
+
+    const UndistortionModel& undistortion_model_;
+    const ColorCorrectionModel& color_correction_model_;
+    const int color_conversion_code_;
+    const bool use_composite_maps_;
+    const bool use_mapped_memory_;
+    GpuStageTimer* const gpu_timer_;
+
+    std::vector<Slot> slots_;
+
+    /// Index of the oldest slot in flight
+    size_t oldest_;
+    size_t in_flight_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -0,0 +1,63 @@
+#ifndef IARC7_VISION_IMAGE_PYRAMID_HPP_
+#define IARC7_VISION_IMAGE_PYRAMID_HPP_
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+/// Power of two pyramid of a frame, shared by everything that runs on it
+///
+/// Each level is half the size of the one above it.  Levels are only built
+/// when someone asks for them, and at most once per frame, so consumers
+/// which want the same resolution don't each resize the frame.  Because the
+/// level sizes only change when the base size changes the buffers (and
+/// anything a consumer keeps per level) get reused from frame to frame.
+class ImagePyramid {
+  public:
+    /// @param[in]  max_level  Number of levels below the base, 0 for just
+    ///                        the base
+    explicit ImagePyramid(int max_level);
+
+    /// Start a new frame
+    ///
+    /// The base isn't copied, it has to stay valid until the next reset.
+    /// Levels from the previous frame are overwritten as they're rebuilt.
+    void reset(const cv::cuda::GpuMat& base);
+
+    int maxLevel() const { return max_level_; }
+
+    /// Size of a level, whether or not it has been built
+    cv::Size levelSize(int level) const;
+
+    /// Size of a level of a pyramid with a base of this size
+    static cv::Size levelSize(const cv::Size& base, int level);
+
+    /// Coarsest level at least width pixels wide, 0 if there isn't one
+    int levelForWidth(int width) const;
+
+    /// Get a level, building it and any levels above it on stream if they
+    /// haven't been built for this frame
+    ///
+    /// Levels built on another stream are waited on (by stream, not the
+    /// host), so it's fine for consumers to use different streams.
+    const cv::cuda::GpuMat& level(int level, cv::cuda::Stream& stream);
+
+  private:
+    const int max_level_;
+
+    /// levels_[0] is a header for the base
+    std::vector<cv::cuda::GpuMat> levels_;
+
+    /// Number of levels built for the current frame, including the base
+    int built_;
+
+    /// Recorded after the last level was built
+    cv::cuda::Event built_event_ {cv::cuda::Event::DISABLE_TIMING};
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -1,6 +1,10 @@
 #ifndef IARC7_VISION_OPTICAL_FLOW_ESTIMATOR_HPP_
 #define IARC7_VISION_OPTICAL_FLOW_ESTIMATOR_HPP_
 
+#include <memory>
+#include <mutex>
+#include <string>
+
 #include <opencv2/opencv.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/cudaoptflow.hpp>
@@ -9,9 +13,12 @@
 #include <ros/ros.h>
 
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
-#include <ros_utils/SafeTransformWrapper.hpp>
 
+#include "iarc7_vision/DebugImagePublisher.hpp"
 #include "iarc7_vision/RoombaImageLocation.hpp"
+#include "iarc7_vision/SettingsMailbox.hpp"
+#include "iarc7_vision/TransformSource.hpp"
+#include "iarc7_vision/kernels/FlowVectorFilter.hpp"
 
 #include <geometry_msgs/TwistWithCovarianceStamped.h>
 #include <image_transport/image_transport.h>
@@ -33,9 +40,15 @@ struct OpticalFlowEstimatorSettings {
     int win_size;
     int max_level;
     int iters;
+    bool use_cached_pyramids;
+    bool grayscale_flow;
+    bool gpu_vector_filter;
+    bool mask_roomba_features;
     int points;
     double quality_level;
     int min_dist;
+    bool tracking_mode;
+    int redetect_interval;
     double scale_factor;
     bool crop;
     int crop_width;
@@ -83,6 +96,9 @@ struct OpticalFlowDebugSettings {
     bool debug_times;
     bool debug_vectors_image;
     bool debug_hist;
+    /// Most images to publish per second on each debug image topic, 0 for
+    /// no limit
+    double debug_image_max_rate;
 };
 
 class OpticalFlowEstimator {
@@ -92,24 +108,41 @@ class OpticalFlowEstimator {
     // CONSTRUCTORS //
     //////////////////
 
+    /// The flow settings are copied, changes after construction go through
+    /// stageSettings.  The debug settings are referenced and must not
+    /// change.
+    ///
+    /// camera_frame is the optical frame of the camera the images come from
     OpticalFlowEstimator(
             const OpticalFlowEstimatorSettings& flow_estimator_settings,
             const OpticalFlowDebugSettings& debug_settings,
-            const std::string& expected_image_format);
+            const std::string& expected_image_format,
+            const TransformSource& transform_source,
+            const std::string& camera_frame);
 
     ////////////////////
     // PUBLIC METHODS //
     ////////////////////
 
-    /// MUST be called when either of the settings objects passed into the
-    /// constructor have their variables changed
-    bool __attribute__((warn_unused_result)) onSettingsChanged();
+    /// Stage new settings, which take effect at the start of the next
+    /// update
+    ///
+    /// Safe to call from any thread, including while update is running.
+    /// A new corner detector is built here if the new settings need one, so
+    /// update only swaps it in.  Flow history is only thrown out if the new
+    /// settings change the images or pyramids it was built from.
+    void stageSettings(const OpticalFlowEstimatorSettings& settings);
 
     /// Process a new image message
+    ///
+    /// All the gpu work is queued on stream.  Work left on it when this
+    /// returns may still write the images kept for the next frame, so wait
+    /// for it before the next update if that uses another stream.
     void update(const cv::cuda::GpuMat& curr_image,
                 const ros::Time& time,
                 const std::vector<RoombaImageLocation>& roomba_image_locations,
-                const bool images_skipped);
+                const bool images_skipped,
+                cv::cuda::Stream& stream = cv::cuda::Stream::Null());
 
     /// MUST be called successfully before `update` is called
     bool __attribute__((warn_unused_result)) waitUntilReady(
@@ -166,7 +199,11 @@ class OpticalFlowEstimator {
     /// @param[in]  debug      {Whether to spit out debug info, like
     ///                         images from intermediate steps or with
     ///                         arrows drawn}
+    /// @param[in]  gpu_filter_counts {Counts from the gpu filter if the
+    ///                                vectors were already filtered by
+    ///                                region on the gpu, nullptr otherwise}
     /// @param[out] average    Average movement of the features in the frame
+    /// @param[in]  stream     Stream to queue gpu work on
     ///
     /// @return                {True if result is valid (i.e. at least one
     ///                         valid point)}
@@ -181,7 +218,10 @@ class OpticalFlowEstimator {
                                          const cv::cuda::GpuMat& curr_frame,
                                          const ros::Time& time,
                                          const bool debug,
-                                         cv::Point2f& average) const;
+                                         const kernels::FlowFilterCounts*
+                                             gpu_filter_counts,
+                                         cv::Point2f& average,
+                                         cv::cuda::Stream& stream) const;
 
     /// Process the given current and last frames to find flow vectors
     ///
@@ -189,21 +229,93 @@ class OpticalFlowEstimator {
     /// @param[in]  curr_gray_frame  The current frame, in grayscale
     /// @param[in]  last_frame       The last frame, in RGB8
     /// @param[in]  last_gray_frame  The last frame, in grayscale
+    /// @param[in]  roomba_image_locations {Roombas to keep features away
+    ///                                     from}
     /// @param[out] tails            The tails of the flow vectors
     /// @param[out] heads            The heads of the flow vectors
     /// @param[out] status           {The status of each flow vector, nonzero
     ///                               for valid}
+    /// @param[out] filter_counts    {Counts from the gpu filter, only set if
+    ///                               this returns true}
     /// @param[in]  debug            {Whether to spit out debug info, like
     ///                               images from intermediate steps or with
     ///                               arrows drawn}
-    void findFeatureVectors(const cv::cuda::GpuMat& curr_frame,
+    /// @param[in]  stream           Stream to queue gpu work on
+    ///
+    /// @return                      {True if the vectors were already
+    ///                               filtered by region on the gpu}
+    bool findFeatureVectors(const cv::cuda::GpuMat& curr_frame,
                             const cv::cuda::GpuMat& curr_gray_frame,
                             const cv::cuda::GpuMat& last_frame,
                             const cv::cuda::GpuMat& last_gray_frame,
+                            const std::vector<RoombaImageLocation>&
+                                roomba_image_locations,
                             std::vector<cv::Point2f>& tails,
                             std::vector<cv::Point2f>& heads,
                             std::vector<uchar>& status,
-                            bool debug=false) const;
+                            kernels::FlowFilterCounts& filter_counts,
+                            bool debug,
+                            cv::cuda::Stream& stream) const;
+
+    /// Run the gpu filter on the flow vectors and download the accepted ones
+    ///
+    /// @return  False if the filter can't be used for these roombas
+    bool filterFeatureVectorsGpu(const cv::cuda::GpuMat& d_prev_pts,
+                                 const cv::cuda::GpuMat& d_next_pts,
+                                 const cv::cuda::GpuMat& d_status,
+                                 const std::vector<RoombaImageLocation>&
+                                     roomba_image_locations,
+                                 std::vector<cv::Point2f>& tails,
+                                 std::vector<cv::Point2f>& heads,
+                                 std::vector<uchar>& status,
+                                 kernels::FlowFilterCounts& filter_counts,
+                                 cv::cuda::Stream& stream) const;
+
+    /// Get the transform from points in the scaled image to the units of
+    /// the roomba image locations, s = p * scale + offset
+    void getRoombaTransform(const cv::Size& image_size,
+                            double& scale,
+                            double& offset_x,
+                            double& offset_y) const;
+
+    /// Get the points to track from the last frame
+    ///
+    /// In tracking mode this reuses the points successfully tracked into the
+    /// last frame, and only runs the corner detector when there aren't
+    /// enough of them or they are too old.  Otherwise every point comes from
+    /// the corner detector.
+    ///
+    /// With mask_roomba_features no corners are detected on the roombas.
+    ///
+    /// @param[in]  last_gray_frame  The last frame, in grayscale
+    /// @param[in]  roomba_image_locations {Roombas to keep features away
+    ///                                     from}
+    /// @param[out] d_prev_pts       Points in the last frame, 1xN CV_32FC2
+    /// @param[in]  stream           Stream to queue gpu work on
+    void getPointsToTrack(const cv::cuda::GpuMat& last_gray_frame,
+                          const std::vector<RoombaImageLocation>&
+                              roomba_image_locations,
+                          cv::cuda::GpuMat& d_prev_pts,
+                          cv::cuda::Stream& stream) const;
+
+    /// Save the successfully tracked points to track in the next frame
+    ///
+    /// @param[in]  heads       Positions of all the tracked points in the
+    ///                         current frame, before filtering
+    /// @param[in]  status      Status of each point, nonzero for valid
+    /// @param[in]  image_size  Size of the current frame
+    void updateTrackedPoints(const std::vector<cv::Point2f>& heads,
+                             const std::vector<uchar>& status,
+                             const cv::Size& image_size) const;
+
+    /// Build an image pyramid with max_level levels above the base image
+    ///
+    /// @param[in]  image    Base of the pyramid
+    /// @param[out] pyramid  Levels of the pyramid, existing buffers are reused
+    /// @param[in]  stream   Stream to queue gpu work on
+    void buildPyramid(const cv::cuda::GpuMat& image,
+                      std::vector<cv::cuda::GpuMat>& pyramid,
+                      cv::cuda::Stream& stream) const;
 
     /// Compute the focal length (in px) from image size and dfov
     ///
@@ -228,24 +340,65 @@ class OpticalFlowEstimator {
     /// @param[in] roomba_image_locations {Vector of roomba image locations
     ///                                   in resolution indpenedent units}
     /// @param[in] debug        Whether to spit out messages on debug topics
+    /// @param[in] stream       Stream to queue gpu work on
     void processImage(const cv::cuda::GpuMat& image,
                       const cv::cuda::GpuMat& gray_image,
                       const ros::Time& time,
                       const std::vector<RoombaImageLocation>&
                           roomba_image_locations,
-                      bool debug=false) const;
+                      bool debug,
+                      cv::cuda::Stream& stream) const;
+
+    /// Whether the color frames are needed for this frame, always true
+    /// unless in grayscale mode
+    ///
+    /// @param[in] debug  Whether debug info is being produced this frame
+    bool needColorImages(bool debug) const;
 
     /// Resize image and convert to grayscale
     ///
     /// All three of the inputs should be different images (or either of the
     /// outputs can be empty)
     ///
-    /// @param[in]  image   Image to resize
-    /// @param[out] scaled  Image resized to target_size_
-    /// @param[out] gray    Grayscale image resized to target_size_
+    /// @param[in]  image        Image to resize
+    /// @param[out] scaled       Image resized to target_size_
+    /// @param[out] gray         Grayscale image resized to target_size_
+    /// @param[in]  need_scaled  {If false, scaled is left empty in grayscale
+    ///                           mode and gray is made in a single pass}
+    /// @param[in]  stream       Stream to queue gpu work on
     void resizeAndConvertImages(const cv::cuda::GpuMat& image,
                                 cv::cuda::GpuMat& scaled,
-                                cv::cuda::GpuMat& gray) const;
+                                cv::cuda::GpuMat& gray,
+                                bool need_scaled,
+                                cv::cuda::Stream& stream) const;
+
+    /// Settings from stageSettings, with anything built for them
+    struct StagedSettings {
+        OpticalFlowEstimatorSettings settings;
+        /// Corner detector for settings, the same one as the last
+        /// snapshot's if its settings didn't change
+        cv::Ptr<cv::cuda::CornersDetector> features_detector;
+    };
+
+    /// Swap in the last settings passed to stageSettings, if there are new
+    /// ones
+    ///
+    /// @param[in]  stream  Stream to rescale the last image on, if the new
+    ///                     settings change its size
+    void applyStagedSettings(cv::cuda::Stream& stream);
+
+    /// Say if the cached pyramid tracker has no kernel specialized for the
+    /// window size
+    void logPyrLKKernel() const;
+
+    /// Recompute the target size and fov from the settings
+    ///
+    /// @returns  False if the settings give an empty target size
+    bool __attribute__((warn_unused_result)) updateTargetSize();
+
+    /// Throw out the tracks and pyramid, and rescale the last image to the
+    /// target size on stream
+    void resetFlowHistory(cv::cuda::Stream& stream);
 
     /// Update altitude measurement and camera transform
     ///
@@ -265,19 +418,79 @@ class OpticalFlowEstimator {
     uint32_t grayscale_conversion_constant_;
     std::string image_encoding_;
 
-    const OpticalFlowEstimatorSettings& flow_estimator_settings_;
+    /// Only changed by applyStagedSettings, between frames
+    OpticalFlowEstimatorSettings flow_estimator_settings_;
     const OpticalFlowDebugSettings& debug_settings_;
 
+    SettingsMailbox<StagedSettings> staged_settings_;
+    /// Held by stageSettings
+    std::mutex stage_mutex_;
+    /// Last settings passed to stageSettings, what the next ones are
+    /// compared against
+    OpticalFlowEstimatorSettings last_staged_settings_;
+    /// Corner detector in the last snapshot, only used by stageSettings
+    cv::Ptr<cv::cuda::CornersDetector> staged_features_detector_;
+
     cv::Ptr<cv::cuda::CornersDetector> gpu_features_detector_;
     cv::Ptr<cv::cuda::SparsePyrLKOpticalFlow> gpu_d_pyrLK_;
 
     bool have_valid_last_image_;
     size_t images_skipped_;
 
+    /// Points tracked into the last frame, only used in tracking mode
+    mutable std::vector<cv::Point2f> tracked_points_;
+    /// Frames since the corner detector was last run on every point
+    mutable int frames_since_detection_;
+    mutable cv::Mat detection_mask_;
+    mutable cv::cuda::GpuMat gpu_detection_mask_;
+
+    /// Pyramids for the custom LK implementation, the current frame's
+    /// pyramid is kept as the last pyramid for the next frame
+    mutable std::vector<cv::cuda::GpuMat> last_pyramid_;
+    mutable std::vector<cv::cuda::GpuMat> curr_pyramid_;
+    mutable bool last_pyramid_valid_;
+
+    /// Per-frame vectors used by findAverageVector, kept around so they
+    /// don't have to be reallocated every frame
+    struct VectorScratch {
+        /// Vectors which made it through the region filters
+        std::vector<float> dx;
+        std::vector<float> dy;
+        std::vector<float> rejection_region_dx;
+        std::vector<float> rejection_region_dy;
+        std::vector<float> roomba_region_dx;
+        std::vector<float> roomba_region_dy;
+
+        /// The vectors in dx and dy, only filled in for the debug image
+        std::vector<cv::Point2f> filtered_tails;
+        std::vector<cv::Point2f> filtered_heads;
+        std::vector<uchar> filtered_status;
+
+        void clear()
+        {
+            dx.clear();
+            dy.clear();
+            rejection_region_dx.clear();
+            rejection_region_dy.clear();
+            roomba_region_dx.clear();
+            roomba_region_dy.clear();
+            filtered_tails.clear();
+            filtered_heads.clear();
+            filtered_status.clear();
+        }
+    };
+    mutable VectorScratch vector_scratch_;
+
+    /// Outputs of the gpu vector filter
+    mutable cv::cuda::GpuMat d_filtered_tails_;
+    mutable cv::cuda::GpuMat d_filtered_heads_;
+    mutable cv::cuda::GpuMat d_filter_counts_;
+
     cv::cuda::GpuMat last_scaled_image_;
     cv::cuda::GpuMat last_scaled_grayscale_image_;
 
-    const ros_utils::SafeTransformWrapper transform_wrapper_;
+    const TransformSource& transform_source_;
+    const std::string camera_frame_;
 
     double current_altitude_;
     tf2::Quaternion current_orientation_;
@@ -294,17 +507,20 @@ class OpticalFlowEstimator {
     double fov_;
 
     /// Publishers
+    ///
+    /// The debug image publishers are mutable since they keep track of when
+    /// they last published
     ros::NodeHandle local_nh_;
     const ros::Publisher debug_orientation_rate_pub_;
-    const ros::Publisher debug_average_velocity_vector_image_pub_;
+    mutable DebugImagePublisher debug_average_velocity_vector_image_pub_;
     const ros::Publisher debug_level_quad_raw_pub_;
     const ros::Publisher debug_camera_rel_raw_pub_;
     const ros::Publisher debug_correction_pub_;
-    const ros::Publisher debug_hist_pub_;
+    mutable DebugImagePublisher debug_hist_pub_;
     const ros::Publisher debug_raw_pub_;
     const ros::Publisher debug_unrotated_vel_pub_;
-    const ros::Publisher debug_velocity_vector_image_pub_;
-    const ros::Publisher debug_filtered_velocity_vector_image_pub_;
+    mutable DebugImagePublisher debug_velocity_vector_image_pub_;
+    mutable DebugImagePublisher debug_filtered_velocity_vector_image_pub_;
     const ros::Publisher debug_flow_quality_pub_;
     const ros::Publisher orientation_pub_;
     const ros::Publisher twist_pub_;
@@ -0,0 +1,102 @@
+#ifndef IARC7_VISION_POSE_CACHE_HPP_
+#define IARC7_VISION_POSE_CACHE_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <geometry_msgs/TransformStamped.h>
+#include <ros/callback_queue.h>
+#include <ros/ros.h>
+#include <tf2/buffer_core.h>
+#include <tf2_msgs/TFMessage.h>
+
+#include "iarc7_vision/TransformSource.hpp"
+
+namespace iarc7_vision {
+
+/// Keeps a short history of the transforms the estimators use, so looking
+/// them up doesn't have to go through tf
+///
+/// Every tf message is handled on the cache's own thread, which looks up
+/// the newest transform for each tracked frame pair and appends it to that
+/// pair's history.  Lookups inside the history are interpolated without
+/// blocking.  Lookups newer than the history wait to be woken by the next
+/// tf message instead of polling, so they return as soon as the transform
+/// exists.  Anything else (untracked pairs, or times older than the history)
+/// goes to the fallback source.
+class PoseCache : public TransformSource {
+  public:
+    /// (target frame, source frame)
+    using FramePair = std::pair<std::string, std::string>;
+
+    /// @param[in]  fallback  Used for lookups the cache can't answer, must
+    ///                       outlive the cache
+    /// @param[in]  pairs     Transforms to keep a history of
+    /// @param[in]  length    Length of the history to keep
+    PoseCache(const TransformSource& fallback,
+              const std::vector<FramePair>& pairs,
+              const ros::Duration& length);
+
+    ~PoseCache();
+
+    PoseCache(const PoseCache&) = delete;
+    PoseCache& operator=(const PoseCache&) = delete;
+
+    bool getTransformAtTime(
+            geometry_msgs::TransformStamped& transform,
+            const std::string& target_frame,
+            const std::string& source_frame,
+            const ros::Time& time,
+            const ros::Duration& timeout) const override;
+
+  private:
+    struct History {
+        FramePair pair;
+        /// Oldest first
+        std::deque<geometry_msgs::TransformStamped> transforms;
+    };
+
+    enum class LookupResult {
+        Found,
+        /// Newer than the newest transform in the history
+        TooNew,
+        /// Untracked pair, or older than the history
+        Unavailable
+    };
+
+    void tfCallback(const tf2_msgs::TFMessage::ConstPtr& message);
+    void tfStaticCallback(const tf2_msgs::TFMessage::ConstPtr& message);
+
+    /// Add transforms to the buffer and extend every history
+    void addTransforms(const tf2_msgs::TFMessage& message, bool is_static);
+
+    /// Interpolate a transform from the history
+    ///
+    /// Must be called with mutex_ held
+    LookupResult lookup(const FramePair& pair,
+                        const ros::Time& time,
+                        geometry_msgs::TransformStamped& transform) const;
+
+    const TransformSource& fallback_;
+    const ros::Duration length_;
+
+    /// Only touched from the callback thread
+    tf2::BufferCore buffer_;
+
+    mutable std::mutex mutex_;
+    mutable std::condition_variable updated_cv_;
+    std::vector<History> histories_;
+
+    ros::CallbackQueue callback_queue_;
+    ros::Subscriber tf_sub_;
+    ros::Subscriber tf_static_sub_;
+    ros::AsyncSpinner spinner_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
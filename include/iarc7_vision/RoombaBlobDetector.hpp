@@ -1,12 +1,19 @@
 #ifndef _IARC_VISION_ROOMBA_BLOB_DETECTOR_HPP_
 #define _IARC_VISION_ROOMBA_BLOB_DETECTOR_HPP_
 
+#include <memory>
+
 #include <opencv2/core/core.hpp>
 #include <opencv2/opencv.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <ros/ros.h>
 
+#include "iarc7_vision/cv_utils.hpp"
+#include "iarc7_vision/DebugImagePublisher.hpp"
+#include "iarc7_vision/kernels/BlobLabeling.hpp"
+#include "iarc7_vision/kernels/HsvSegmentation.hpp"
+#include "iarc7_vision/kernels/PatchSampling.hpp"
 #include "iarc7_vision/RoombaEstimatorSettings.hpp"
 
 namespace iarc7_vision
@@ -25,14 +32,50 @@ class RoombaBlobDetector {
     ///
     /// @param[in]   image           Current frame to process (in rgb8)
     /// @param[out]  bounding_rects  Bounding rectangles of detected top plates
+    /// @param[in]   stream          Stream to queue gpu work on
     void detect(const cv::cuda::GpuMat& image,
                 std::vector<cv::RotatedRect>& bounding_rects,
-                std::vector<double>& flip_certainties) const;
+                std::vector<double>& flip_certainties,
+                cv::cuda::Stream& stream = cv::cuda::Stream::Null()) const;
+
+    /// Processes only the given regions of the current frame
+    ///
+    /// Saturation is normalized with the statistics of the last frame given
+    /// to detect, so this can only be used after detect has run with fused
+    /// segmentation (see hasFrameStatistics).  Regions should not overlap,
+    /// or roombas in the overlap are detected more than once.
+    ///
+    /// @param[in]   image           Current frame to process (in rgb8)
+    /// @param[in]   regions         Parts of image to search
+    /// @param[out]  bounding_rects  Bounding rectangles of detected top
+    ///                              plates, in image coordinates
+    /// @param[in]   stream          Stream to queue gpu work on
+    void detectInRegions(const cv::cuda::GpuMat& image,
+                         const std::vector<cv::Rect>& regions,
+                         std::vector<cv::RotatedRect>& bounding_rects,
+                         std::vector<double>& flip_certainties,
+                         cv::cuda::Stream& stream) const;
+
+    /// True if detectInRegions can be used
+    bool hasFrameStatistics() const { return frame_sums_area_ > 0; }
   private:
+    friend class MicroBenchmarkAccess;
 
     /// Find roomba rotated bounding rects in mask
     void boundMask(const cv::cuda::GpuMat& mask,
-                   std::vector<cv::RotatedRect>& boundRect) const;
+                   std::vector<cv::RotatedRect>& boundRect,
+                   cv::cuda::Stream& stream) const;
+
+    /// Version of boundMask which labels blobs on the gpu, only the blob
+    /// statistics are downloaded instead of the whole mask
+    void boundMaskGpu(const cv::cuda::GpuMat& mask,
+                      std::vector<cv::RotatedRect>& boundRect,
+                      cv::cuda::Stream& stream) const;
+
+    /// Image of contours for the debug topic
+    static cv::Mat drawContourImage(
+            const std::vector<std::vector<cv::Point>>& contours,
+            const cv::Size& size);
 
     /// Examine four corners of each detection rect.  Based on which corners
     /// are white, rotate rect 180 degrees to point in the correct direction.
@@ -43,7 +86,16 @@ class RoombaBlobDetector {
                       const cv::Scalar& mean,
                       const cv::Scalar& stddev,
                       std::vector<cv::RotatedRect>& rects,
-                      std::vector<double>& flip_certainties) const;
+                      std::vector<double>& flip_certainties,
+                      cv::cuda::Stream& stream) const;
+
+    /// Mean color of each window, computed on the gpu in one batch
+    ///
+    /// Gives the same results as calling cv_utils::sumPatch on each window
+    void samplePatchesGpu(const cv::cuda::GpuMat& image,
+                          const std::vector<cv::RotatedRect>& windows,
+                          std::vector<cv::Vec3b>& patch_means,
+                          cv::cuda::Stream& stream) const;
 
     /// Perform HSV slice and morphology to get pixels which are likely
     /// to be roomba top plates
@@ -52,20 +104,30 @@ class RoombaBlobDetector {
     /// @param[out]  dst    mono8 output mask, nonzero pixels are top plates
     void thresholdFrame(const cv::cuda::GpuMat& image,
                         cv::cuda::GpuMat& dst,
-                        cv::Scalar& mean,
-                        cv::Scalar& stddev) const;
+                        cv::cuda::Stream& stream) const;
+
+    /// Saturation mean and stddev of the last frame given to thresholdFrame
+    ///
+    /// With fused segmentation these are downloaded on the stream, so it
+    /// has to have been waited on since thresholdFrame
+    void getSaturationStatistics(cv::Scalar& mean, cv::Scalar& stddev) const;
+
+    /// Slices from the settings in the form the fused kernel takes
+    static kernels::HsvSegmentationParams getSegmentationParams(
+            const RoombaEstimatorSettings& settings);
 
     const RoombaEstimatorSettings& settings_;
 
     const cv::Size image_size_;
 
-    ros::Publisher debug_hsv_slice_pub_;
-    ros::Publisher debug_contours_pub_;
-    ros::Publisher debug_rects_pub_;
+    std::unique_ptr<DebugImagePublisher> debug_hsv_slice_pub_;
+    std::unique_ptr<DebugImagePublisher> debug_contours_pub_;
 
     mutable cv::cuda::GpuMat hsv_image_;
     mutable std::array<cv::cuda::GpuMat, 3> hsv_channels_;
     mutable cv::cuda::GpuMat range_mask_;
+    mutable cv_utils::InRangeBuf in_range_buf_;
+    mutable cv_utils::MeanStdDevBuf mean_std_dev_buf_;
 
     const cv::Mat structuring_element_;
     const cv::Ptr<cv::cuda::Filter> morphology_open_;
@@ -75,6 +137,28 @@ class RoombaBlobDetector {
     mutable cv::cuda::GpuMat normalized_sat_;
     mutable cv::cuda::GpuMat normalized_sat2_;
     mutable cv::cuda::GpuMat normalized_sat2_8bit_;
+
+    const kernels::HsvSegmentationParams segmentation_params_;
+    mutable cv::cuda::GpuMat saturation_sums_;
+    mutable cv::cuda::HostMem saturation_sums_cpu_;
+
+    /// Area of the last full frame the saturation sums are over, 0 if there
+    /// hasn't been one with fused segmentation
+    mutable int frame_sums_area_;
+    /// Saturation statistics of the last full frame without fused
+    /// segmentation
+    mutable cv::Scalar frame_mean_;
+    mutable cv::Scalar frame_stddev_;
+    mutable cv::cuda::GpuMat region_mask_;
+
+    mutable kernels::BlobLabelingBuf blob_labeling_buf_;
+    mutable cv::cuda::GpuMat blob_list_;
+    mutable cv::cuda::HostMem blob_list_cpu_;
+
+    mutable cv::cuda::HostMem patches_cpu_;
+    mutable cv::cuda::GpuMat patches_;
+    mutable cv::cuda::GpuMat patch_sums_;
+    mutable cv::cuda::HostMem patch_sums_cpu_;
 };
 
 }
@@ -1,6 +1,10 @@
 #ifndef _IARC_VISION_ROOMBA_ESTIMATOR_HPP_
 #define _IARC_VISION_ROOMBA_ESTIMATOR_HPP_
 
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/core.hpp>
 
@@ -8,16 +12,21 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <ros/ros.h>
-#include <ros_utils/SafeTransformWrapper.hpp>
 #include <tf2_ros/transform_listener.h>
 
+#include "iarc7_vision/DebugImagePublisher.hpp"
+#include "iarc7_vision/ImagePyramid.hpp"
 #include "iarc7_vision/RoombaBlobDetector.hpp"
 #include "iarc7_vision/RoombaEstimatorConfig.h"
 #include "iarc7_vision/RoombaEstimatorSettings.hpp"
 #include "iarc7_vision/RoombaImageLocation.hpp"
+#include "iarc7_vision/SettingsMailbox.hpp"
+#include "iarc7_vision/TransformSource.hpp"
 
 #include <sensor_msgs/CameraInfo.h>
+#include <iarc7_msgs/OdometryArray.h>
 #include <iarc7_msgs/RoombaDetection.h>
+#include <iarc7_msgs/RoombaDetectionFrame.h>
 #include <geometry_msgs/Point.h>
 #include <geometry_msgs/Polygon.h>
 #include <geometry_msgs/Vector3.h>
@@ -26,21 +35,55 @@
 namespace iarc7_vision
 {
 
-/// Gets roomba positions from bottom camera images, converts to global
-/// positions using tf, and publishes to /detected_roombas
+/// Gets roomba positions from downward facing camera images, converts to
+/// global positions using tf, and publishes to /detected_roombas
 class RoombaEstimator {
     public:
-        RoombaEstimator(const cv::Size& image_size);
+        /// @param[in]  image_size        Size of the undistorted images
+        /// @param[in]  transform_source  Source of the camera pose, must
+        ///                               outlive the estimator
+        /// @param[in]  camera_id         Camera id on published detections
+        /// @param[in]  camera_frame      Optical frame of the camera
+        /// @param[in]  private_nh        Namespace of the settings, also
+        ///                               used for dynamic reconfigure and
+        ///                               the debug topics
+        RoombaEstimator(const cv::Size& image_size,
+                        const TransformSource& transform_source,
+                        const std::string& camera_id,
+                        const std::string& camera_frame,
+                        const ros::NodeHandle& private_nh);
 
         /// Processes current frame and publishes detections
         ///
-        /// @param[in]  image  Current frame to process (in rgb8)
-        /// @param[in]  time   Timestamp of current frame
+        /// Settings changed with dynamic reconfigure since the last frame
+        /// are swapped in first.
+        ///
+        /// Without pyramid levels the frame is resized to the detection size
+        /// first, unless it is already at that size (see getDetectionSize).
+        /// With levels detection runs on the coarsest level no larger than
+        /// the detection size which still has min_plate_width_px pixels
+        /// across a roomba plate at the current height.
+        ///
+        /// @param[in]  pyramid  Current frame to process (in rgb8)
+        /// @param[in]  time     Timestamp of current frame
         /// @param[out]  roomba_image_locations Vector of roomba locations
-        void update(const cv::cuda::GpuMat& image,
+        /// @param[in]  stream  Stream to queue gpu work on
+        void update(ImagePyramid& pyramid,
                     const ros::Time& time,
                     std::vector<RoombaImageLocation>&
-                                roomba_image_locations);
+                                roomba_image_locations,
+                    cv::cuda::Stream& stream = cv::cuda::Stream::Null());
+
+        /// Size images are resized to before detection
+        ///
+        /// Changes if detection_image_width is changed with dynamic
+        /// reconfigure.  Only call from the thread calling update.
+        cv::Size getDetectionSize() const;
+
+        /// Load settings from rosparam
+        static RoombaEstimatorSettings getSettings(
+                const ros::NodeHandle& private_nh);
+
     private:
 
         /// Converts a pixel in an image to a ray from the camera center
@@ -56,12 +99,66 @@ class RoombaEstimator {
                         double ph,
                         geometry_msgs::Vector3Stamped& ray) const;
 
+        struct LevelDetector {
+            cv::Size size;
+            /// Referenced by detector
+            RoombaEstimatorSettings settings;
+            std::unique_ptr<const RoombaBlobDetector> detector;
+        };
+        /// Indexed by pyramid level, null for levels never searched
+        using LevelDetectors
+            = std::vector<std::shared_ptr<const LevelDetector>>;
+
+        /// Settings from dynamic reconfigure, with anything built for them
+        struct StagedSettings {
+            RoombaEstimatorSettings settings;
+            cv::Size detection_size;
+            /// Detector for settings and detection_size, the same one as
+            /// the last snapshot's if none of its settings changed
+            std::shared_ptr<const RoombaBlobDetector> blob_detector;
+            /// Detectors for the levels of the pyramid the next frames are
+            /// expected to come in, null if no frame has come in yet
+            std::shared_ptr<const LevelDetectors> level_detectors;
+        };
+
+        /// Build a blob detector which owns a copy of the settings it
+        /// references
+        std::shared_ptr<const RoombaBlobDetector> makeBlobDetector(
+                const RoombaEstimatorSettings& settings,
+                const cv::Size& size);
+
+        /// Build a blob detector for a pyramid level, with the blob size
+        /// limits scaled from the detection size to the level size
+        std::unique_ptr<LevelDetector> makeLevelDetector(
+                const RoombaEstimatorSettings& settings,
+                const cv::Size& detection_size,
+                const cv::Size& size);
+
+        /// Build detectors for every level of a pyramid detection could
+        /// run on
+        std::shared_ptr<const LevelDetectors> makeLevelDetectors(
+                const RoombaEstimatorSettings& settings,
+                const cv::Size& detection_size,
+                const cv::Size& base_size,
+                int max_level);
+
         /// Callback for dynamic_reconfigure
+        ///
+        /// Builds a snapshot of the new settings, and new blob detectors if
+        /// they need them, for update to swap in
         void getDynamicSettings(iarc7_vision::RoombaEstimatorConfig& config);
 
-        /// Load settings from rosparam
-        static RoombaEstimatorSettings getSettings(
-                const ros::NodeHandle& private_nh);
+        /// Swap in the last settings from dynamic reconfigure, if there are
+        /// new ones
+        void applyStagedSettings();
+
+        /// Fetch the transform from the camera optical frame to the map
+        /// into camera_to_map_tf_
+        ///
+        /// @returns  False if it isn't available within timeout, in which
+        ///           case camera_to_map_tf_ is unchanged
+        bool fetchCameraTransform(const ros::Time& time,
+                                  const ros::Duration& timeout);
 
         /// Fetch altitude of camera optical frame from tf
         ///
@@ -96,6 +193,56 @@ class RoombaEstimator {
                       iarc7_msgs::RoombaDetection& roomba,
                       RoombaImageLocation& roomba_image_location);
 
+        /// Project a point in the map frame into the current image
+        ///
+        /// Inverse of pixelToRay and camera_to_map_tf_
+        ///
+        /// @returns  False if the point is behind the camera
+        bool mapPointToPixel(double x,
+                             double y,
+                             double z,
+                             double pw,
+                             double ph,
+                             cv::Point2f& pixel) const;
+
+        /// Regions of the image predicted to contain the roombas found on
+        /// the last frame, including how far they could have moved since
+        ///
+        /// @param[in]   image_size  Size of the image detection runs on
+        /// @param[in]   view_width  Width of the floor spanned by the image
+        ///                          (m)
+        /// @param[in]   time        Timestamp of the current frame
+        /// @param[in]   detector    Detector that will search the regions
+        /// @param[out]  regions     Regions to search, not overlapping
+        ///
+        /// @returns  False if the whole frame should be searched instead
+        bool getTrackingRegions(const cv::Size& image_size,
+                                double view_width,
+                                const ros::Time& time,
+                                const RoombaBlobDetector& detector,
+                                std::vector<cv::Rect>& regions) const;
+
+        /// Blob detector for a pyramid level, with the blob size limits
+        /// scaled to the level size
+        ///
+        /// Comes from the settings snapshot, and is only built here if the
+        /// pyramid doesn't have the size the snapshot was built for (before
+        /// the first reconfigure, or after the input changes size)
+        const RoombaBlobDetector& getLevelDetector(int level,
+                                                   const cv::Size& size);
+
+        /// Publish the outputs roomba_blob_vision_node.py used to provide,
+        /// if enabled: the /roombas list of every roomba seen so far, and
+        /// rviz lines from the camera to each detection
+        ///
+        /// @param[in]  frame  Detections of the current frame
+        void publishLegacyOutputs(const iarc7_msgs::RoombaDetectionFrame& frame);
+
+        /// Adopt the /roombas list published by any estimator or python
+        /// node, so every camera adds to the same list
+        void roombaOdometryCallback(
+                const iarc7_msgs::OdometryArray::ConstPtr& message);
+
         ros::NodeHandle nh_;
         ros::NodeHandle private_nh_;
 
@@ -105,17 +252,65 @@ class RoombaEstimator {
             dynamic_reconfigure_settings_callback_;
         bool dynamic_reconfigure_called_;
 
-        ros_utils::SafeTransformWrapper transform_wrapper_;
+        const TransformSource& transform_source_;
+        const std::string camera_id_;
+        const std::string camera_frame_;
         geometry_msgs::TransformStamped camera_to_map_tf_;
         ros::Publisher roomba_pub_;
 
+        /// Only changed by applyStagedSettings, between frames
         RoombaEstimatorSettings settings_;
 
+        /// Dynamic reconfigure callbacks can come from a different thread
+        /// than update, so they only ever post here
+        SettingsMailbox<StagedSettings> staged_settings_;
+        /// Last settings from dynamic reconfigure, only used by its callback
+        RoombaEstimatorSettings last_staged_settings_;
+
         const cv::Size input_size_;
         cv::Size detection_size_;
-        std::unique_ptr<const RoombaBlobDetector> blob_detector_;
+        std::shared_ptr<const RoombaBlobDetector> blob_detector_;
+        /// Detector in the last snapshot from dynamic reconfigure, only used
+        /// by its callback
+        std::shared_ptr<const RoombaBlobDetector> staged_blob_detector_;
+
+        std::shared_ptr<const LevelDetectors> level_detectors_;
+        /// Built by getLevelDetector for levels level_detectors_ doesn't
+        /// have at the right size, cleared when the settings change
+        std::vector<std::unique_ptr<LevelDetector>> extra_level_detectors_;
+        /// Level detectors in the last snapshot, and the pyramid they were
+        /// built for, only used by the dynamic reconfigure callback
+        std::shared_ptr<const LevelDetectors> staged_level_detectors_;
+        cv::Size staged_level_base_size_;
+        int staged_level_max_level_;
+
+        /// Base size and max level of the last pyramid update ran on, so
+        /// the callback can build level detectors for it
+        std::mutex pyramid_shape_mutex_;
+        cv::Size pyramid_base_size_;
+        int pyramid_max_level_;
+
+        std::unique_ptr<DebugImagePublisher> debug_detected_rects_pub_;
+
+        ros::Publisher roomba_odometry_pub_;
+        ros::Subscriber roomba_odometry_sub_;
+        ros::Publisher debug_roomba_rays_pub_;
+        /// Every roomba seen so far, for roomba_odometry_pub_
+        ///
+        /// Replaced by roombaOdometryCallback, which can run on another
+        /// thread than update
+        iarc7_msgs::OdometryArray roomba_odometry_;
+        std::mutex roomba_odometry_mutex_;
+
+        /// Map positions of the roombas detected on the last frame
+        std::vector<cv::Point2d> tracked_positions_;
+        ros::Time tracked_time_;
+        int frames_since_full_search_;
+        /// True if the last region search found fewer roombas than it
+        /// was looking for
+        bool track_lost_;
 
-        ros::Publisher debug_detected_rects_pub_;
+        cv::cuda::GpuMat image_scaled_;
 };
 
 } // namespace iarc7_vision
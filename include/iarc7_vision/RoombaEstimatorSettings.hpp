@@ -30,17 +30,42 @@ struct RoombaEstimatorSettings {
     int hsv_slice_h_red2_min;
     int hsv_slice_h_red2_max;
 
+    bool use_fused_segmentation;
+
     int morphology_size;
     int morphology_iterations;
 
+    int min_plate_width_px;
+
+    bool tracking_enabled;
+    int tracking_full_search_interval;
+    double tracking_max_roomba_speed;
+    double tracking_roi_padding;
+
+    double speculative_pose_max_age;
+
+    bool use_gpu_blob_labeling;
+
+    bool use_gpu_corner_sampling;
+
     double max_relative_error;
 
     double uncertainty_scale;
 
     double bottom_camera_aov;
+
+    /// Also publish the roombas seen so far on /roombas, the way
+    /// roomba_blob_vision_node.py did
+    bool publish_roomba_odometry;
+
     bool debug_hsv_slice;
     bool debug_contours;
     bool debug_detected_rects;
+    /// Lines from the camera to each detected roomba, for rviz
+    bool debug_roomba_rays;
+    /// Most images to publish per second on each debug image topic, 0 for
+    /// no limit
+    double debug_image_max_rate;
 };
 
 } // namespace iarc7_vision
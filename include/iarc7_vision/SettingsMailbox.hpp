@@ -0,0 +1,43 @@
+#ifndef IARC7_VISION_SETTINGS_MAILBOX_HPP_
+#define IARC7_VISION_SETTINGS_MAILBOX_HPP_
+
+#include <memory>
+
+namespace iarc7_vision {
+
+/// Handoff of immutable settings snapshots to the thread that uses them
+///
+/// Whoever changes the settings (usually a dynamic reconfigure callback)
+/// builds a complete snapshot, including anything expensive the new
+/// settings need, and posts it.  The thread using the settings takes the
+/// latest snapshot between frames and swaps it in, so it never waits on the
+/// callback and never sees half applied settings.  A snapshot posted before
+/// the last one was taken replaces it.
+template<class T>
+class SettingsMailbox {
+  public:
+    SettingsMailbox() : pending_() {}
+
+    SettingsMailbox(const SettingsMailbox&) = delete;
+    SettingsMailbox& operator=(const SettingsMailbox&) = delete;
+
+    /// Make a snapshot available to take(), safe from any thread
+    void post(std::shared_ptr<const T> snapshot)
+    {
+        std::atomic_store(&pending_, std::move(snapshot));
+    }
+
+    /// Snapshot posted since the last call, or null if there isn't one
+    std::shared_ptr<const T> take()
+    {
+        return std::atomic_exchange(&pending_, std::shared_ptr<const T>());
+    }
+
+  private:
+    /// Only accessed through the shared_ptr atomic functions
+    std::shared_ptr<const T> pending_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
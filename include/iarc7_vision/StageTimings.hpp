@@ -0,0 +1,177 @@
+#ifndef IARC7_VISION_STAGE_TIMINGS_HPP_
+#define IARC7_VISION_STAGE_TIMINGS_HPP_
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <diagnostic_msgs/DiagnosticStatus.h>
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+/// Latency statistics for one stage of the pipeline
+///
+/// Samples go into a fixed histogram with eight log spaced bins per octave
+/// from 1us to 16s, so recording one is a few instructions under an
+/// uncontended lock and never allocates.  Percentiles are accurate to about
+/// 5%, the max is exact.
+class StageStats {
+  public:
+    struct Summary {
+        uint64_t count;
+        /// Samples per second over the window
+        double rate;
+        /// All times in seconds
+        double p50;
+        double p95;
+        double p99;
+        double max;
+    };
+
+    explicit StageStats(const std::string& name);
+
+    StageStats(const StageStats&) = delete;
+    StageStats& operator=(const StageStats&) = delete;
+
+    /// Add a sample, safe to call from any thread
+    void record(double seconds);
+
+    /// Summarize the samples since the last call and start a new window
+    Summary takeSummary();
+
+    const std::string& name() const { return name_; }
+
+  private:
+    static constexpr int kBinsPerOctave = 8;
+    static constexpr int kOctaves = 24;
+    static constexpr int kBins = kBinsPerOctave * kOctaves;
+    static constexpr double kMinSeconds = 1e-6;
+
+    /// Geometric center of a bin, in seconds
+    static double binValue(int bin);
+
+    const std::string name_;
+
+    std::mutex mutex_;
+    std::array<uint32_t, kBins> bins_;
+    uint64_t count_;
+    double max_;
+    std::chrono::steady_clock::time_point window_start_;
+};
+
+/// Measures how long work queued on a stream takes to run on the gpu
+///
+/// start and stop record events on the stream, the elapsed time between
+/// them goes into the stats once both have completed.  Completion is
+/// checked without blocking whenever the timer is started again, so
+/// samples show up a frame or so late.  If more than max_pending
+/// measurements are waiting the new one is skipped.
+///
+/// Not thread safe, each timer should only be used by one thread.
+class GpuStageTimer {
+  public:
+    /// @param[in]  stats        Where samples go
+    /// @param[in]  enabled      If false start and stop do nothing
+    /// @param[in]  max_pending  Max measurements waiting on the gpu
+    GpuStageTimer(StageStats& stats, bool enabled, size_t max_pending = 8);
+
+    void start(cv::cuda::Stream& stream);
+    void stop(cv::cuda::Stream& stream);
+
+  private:
+    struct EventPair {
+        cv::cuda::Event start;
+        cv::cuda::Event stop;
+    };
+
+    /// Record every completed measurement, oldest first
+    void collect();
+
+    StageStats& stats_;
+    const bool enabled_;
+
+    /// Ring of event pairs, pending ones are [oldest_, oldest_ + pending_)
+    std::vector<EventPair> events_;
+    size_t oldest_;
+    size_t pending_;
+
+    /// True between start and stop, if start found a free pair
+    bool started_;
+};
+
+/// Records the cpu time from construction to destruction
+class ScopedStageTimer {
+  public:
+    explicit ScopedStageTimer(StageStats& stats)
+        : stats_(stats),
+          start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~ScopedStageTimer()
+    {
+        stats_.record(std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start_).count());
+    }
+
+    ScopedStageTimer(const ScopedStageTimer&) = delete;
+    ScopedStageTimer& operator=(const ScopedStageTimer&) = delete;
+
+  private:
+    StageStats& stats_;
+    const std::chrono::steady_clock::time_point start_;
+};
+
+/// Times the gpu work queued on a stream from construction to destruction
+class ScopedGpuStageTimer {
+  public:
+    ScopedGpuStageTimer(GpuStageTimer& timer, cv::cuda::Stream& stream)
+        : timer_(timer),
+          stream_(stream)
+    {
+        timer_.start(stream_);
+    }
+
+    ~ScopedGpuStageTimer()
+    {
+        timer_.stop(stream_);
+    }
+
+    ScopedGpuStageTimer(const ScopedGpuStageTimer&) = delete;
+    ScopedGpuStageTimer& operator=(const ScopedGpuStageTimer&) = delete;
+
+  private:
+    GpuStageTimer& timer_;
+    cv::cuda::Stream& stream_;
+};
+
+/// Every stage timed in a node, for reporting them together
+class StageTimings {
+  public:
+    /// Add a stage, the reference stays valid for the life of this object
+    ///
+    /// Stages should all be added before any are used from other threads
+    StageStats& addStage(const std::string& name);
+
+    /// Name and summary of every stage since the last call, in the order
+    /// they were added
+    std::vector<std::pair<std::string, StageStats::Summary>> takeSummaries();
+
+    /// Fill out a status with the summary of every stage since the last
+    /// call
+    void fillStatus(const std::string& name,
+                    diagnostic_msgs::DiagnosticStatus& status);
+
+  private:
+    std::deque<StageStats> stages_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
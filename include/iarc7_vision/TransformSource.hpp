@@ -0,0 +1,54 @@
+#ifndef IARC7_VISION_TRANSFORM_SOURCE_HPP_
+#define IARC7_VISION_TRANSFORM_SOURCE_HPP_
+
+#include <string>
+
+#include <geometry_msgs/TransformStamped.h>
+#include <ros/ros.h>
+#include <ros_utils/SafeTransformWrapper.hpp>
+
+namespace iarc7_vision {
+
+/// Where the estimators get their transforms from
+///
+/// The node uses tf, the benchmark looks transforms up in tf recorded in a
+/// bag instead.  Implementations must be safe to use from several threads.
+class TransformSource {
+  public:
+    virtual ~TransformSource() = default;
+
+    /// Same semantics as SafeTransformWrapper::getTransformAtTime
+    ///
+    /// @returns  False if the transform isn't available within timeout
+    virtual bool getTransformAtTime(
+            geometry_msgs::TransformStamped& transform,
+            const std::string& target_frame,
+            const std::string& source_frame,
+            const ros::Time& time,
+            const ros::Duration& timeout) const = 0;
+};
+
+/// Transforms from tf
+class TfTransformSource : public TransformSource {
+  public:
+    bool getTransformAtTime(
+            geometry_msgs::TransformStamped& transform,
+            const std::string& target_frame,
+            const std::string& source_frame,
+            const ros::Time& time,
+            const ros::Duration& timeout) const override
+    {
+        return transform_wrapper_.getTransformAtTime(transform,
+                                                     target_frame,
+                                                     source_frame,
+                                                     time,
+                                                     timeout);
+    }
+
+  private:
+    const ros_utils::SafeTransformWrapper transform_wrapper_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -0,0 +1,76 @@
+#ifndef IARC7_VISION_TRIPLE_BUFFER_HPP_
+#define IARC7_VISION_TRIPLE_BUFFER_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace iarc7_vision {
+
+/// Lock-free handoff of the latest value from one writer thread to one
+/// reader thread
+///
+/// The writer fills writeBuffer() and calls publish(), the reader calls
+/// update() and then looks at readBuffer().  Neither side ever blocks, and
+/// the reader always sees the most recently published value.  Buffers are
+/// reused, so a container that has already grown to size will not allocate.
+template<class T>
+class TripleBuffer {
+  public:
+    TripleBuffer()
+        : buffers_(),
+          middle_(1),
+          write_index_(0),
+          read_index_(2)
+    {
+    }
+
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    /// Buffer owned by the writer, only call from the writer thread
+    T& writeBuffer() { return buffers_[write_index_]; }
+
+    /// Make the contents of writeBuffer() available to the reader
+    void publish()
+    {
+        write_index_ = middle_.exchange(write_index_ | kNewData,
+                                        std::memory_order_acq_rel)
+                     & kIndexMask;
+    }
+
+    /// Pick up the latest published value if there is one
+    ///
+    /// Only call from the reader thread
+    ///
+    /// @returns  True if readBuffer() changed
+    bool update()
+    {
+        if (!(middle_.load(std::memory_order_relaxed) & kNewData)) {
+            return false;
+        }
+
+        read_index_ = middle_.exchange(read_index_, std::memory_order_acq_rel)
+                    & kIndexMask;
+        return true;
+    }
+
+    /// Buffer owned by the reader, only call from the reader thread
+    const T& readBuffer() const { return buffers_[read_index_]; }
+
+  private:
+    static constexpr uint8_t kIndexMask = 0x3;
+    static constexpr uint8_t kNewData = 0x4;
+
+    std::array<T, 3> buffers_;
+
+    /// Index of the buffer not owned by either side, with kNewData set if
+    /// it was published since the reader last looked
+    std::atomic<uint8_t> middle_;
+    uint8_t write_index_;
+    uint8_t read_index_;
+};
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -1,6 +1,9 @@
 #ifndef IARC7_VISION_UNDISTORTION_MODEL_HPP_
 #define IARC7_VISION_UNDISTORTION_MODEL_HPP_
 
+#include <list>
+#include <mutex>
+
 #include <opencv2/opencv.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/cudaimgproc.hpp>
@@ -16,14 +19,46 @@ class UndistortionModel {
 
     void undistort(const cv::cuda::GpuMat& in, cv::cuda::GpuMat& out, cv::cuda::Stream& stream) const;
 
+    /// Undistort directly to a different output size
+    ///
+    /// Equivalent to undistort followed by a resize to out_size, but in one
+    /// remap with maps built for out_size.  Maps are computed the first
+    /// time each size is requested and cached after that.
+    void undistort(const cv::cuda::GpuMat& in,
+                   cv::cuda::GpuMat& out,
+                   const cv::Size& out_size,
+                   cv::cuda::Stream& stream) const;
+
     cv::Size getUndistortedSize() const { return new_image_size_; }
 
   private:
+    struct Maps {
+        cv::Size size;
+        cv::cuda::GpuMat map1;
+        cv::cuda::GpuMat map2;
+    };
+
+    /// Build remap maps producing an image of the given size
+    Maps makeMaps(const cv::Size& size) const;
+
+    /// Get maps for the given size, building them if needed
+    const Maps& getMaps(const cv::Size& size) const;
+
     const cv::Size image_size_;
     const cv::Size new_image_size_;
 
+    cv::Mat camera_matrix_;
+    cv::Mat dist_;
+    cv::Mat new_camera_matrix_;
+
     cv::cuda::GpuMat map1_;
     cv::cuda::GpuMat map2_;
+
+    /// Maps for sizes other than new_image_size_
+    ///
+    /// Only a handful of sizes are ever used, so this is a list
+    mutable std::list<Maps> scaled_maps_;
+    mutable std::mutex scaled_maps_mutex_;
 };
 
 } // namespace iarc7_vision
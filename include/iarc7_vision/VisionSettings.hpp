@@ -0,0 +1,54 @@
+#ifndef IARC7_VISION_VISION_SETTINGS_HPP_
+#define IARC7_VISION_VISION_SETTINGS_HPP_
+
+#include <string>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "iarc7_vision/CameraSettings.hpp"
+#include "iarc7_vision/FloorDetector.hpp"
+#include "iarc7_vision/GridLineEstimator.hpp"
+#include "iarc7_vision/OpticalFlowEstimator.hpp"
+
+namespace iarc7_vision {
+
+// Load estimator settings from rosparam, relative to the vision node's
+// private namespace.  Shared by the node and the benchmark.
+
+void getLineExtractorSettings(const ros::NodeHandle& private_nh,
+                              LineExtractorSettings& line_settings);
+
+void getOpticalFlowEstimatorSettings(const ros::NodeHandle& private_nh,
+                                     OpticalFlowEstimatorSettings& settings);
+
+void getGridEstimatorSettings(const ros::NodeHandle& private_nh,
+                              GridEstimatorSettings& settings);
+
+void getGridDebugSettings(const ros::NodeHandle& private_nh,
+                          GridLineDebugSettings& settings);
+
+void getFlowDebugSettings(const ros::NodeHandle& private_nh,
+                          OpticalFlowDebugSettings& settings);
+
+void getFloorDetectorSettings(const ros::NodeHandle& private_nh,
+                              FloorDetectorSettings& settings);
+
+/// Load the cameras listed in camera_names, each from cameras/<name>
+///
+/// Asserts that every pipeline is one the node can run: undistort and color
+/// together, roomba, grid and floor only on cameras which undistort, flow
+/// on its own, and at most one camera each with grid, floor and flow
+void getCameraSettings(const ros::NodeHandle& private_nh,
+                       std::vector<CameraSettings>& cameras);
+
+/// Convert the image_format param to a cvtColor code to get to rgb, 0 if no
+/// conversion is needed
+///
+/// @returns  False if the format isn't supported
+bool getColorConversionCode(const std::string& image_format,
+                            int& color_conversion_code);
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -10,13 +10,30 @@ namespace iarc7_vision {
 
 namespace cv_utils {
 
-/// Download a vector from the GPU
+/// Download a vector from the GPU, after the work queued on stream
 void downloadVector(const cv::cuda::GpuMat& mat,
-                    std::vector<cv::Point2f>& vector);
+                    std::vector<cv::Point2f>& vector,
+                    cv::cuda::Stream& stream = cv::cuda::Stream::Null());
 
-/// Download a vector from the GPU
+/// Download a vector from the GPU, after the work queued on stream
 void downloadVector(const cv::cuda::GpuMat& mat,
-                    std::vector<uchar>& vector);
+                    std::vector<uchar>& vector,
+                    cv::cuda::Stream& stream = cv::cuda::Stream::Null());
+
+/// True if the current device shares memory with the host (e.g. a Jetson),
+/// so HostMem::SHARED buffers can be used by kernels without copies
+bool deviceSharesHostMemory();
+
+/// Copy a host image into staging and give a gpu image with its contents
+///
+/// If staging was created as HostMem::SHARED, out becomes a view of staging
+/// and nothing is uploaded.  Otherwise staging is uploaded to out on
+/// stream.  Either way staging must not be touched until the work queued
+/// on out is done.
+void ingestImage(const cv::Mat& image,
+                 cv::cuda::HostMem& staging,
+                 cv::cuda::GpuMat& out,
+                 cv::cuda::Stream& stream);
 
 /// Draw arrows on top of an image
 ///
@@ -63,7 +80,8 @@ void inRange(const cv::cuda::GpuMat& src,
              cv::Scalar lowerb,
              cv::Scalar upperb,
              cv::cuda::GpuMat& dst,
-             InRangeBuf& buf);
+             InRangeBuf& buf,
+             cv::cuda::Stream& stream = cv::cuda::Stream::Null());
 
 /// See documentation for other inRange
 inline void inRange(const cv::cuda::GpuMat& src,
@@ -75,12 +93,40 @@ inline void inRange(const cv::cuda::GpuMat& src,
     inRange(src, lowerb, upperb, dst, buf);
 }
 
-/// Add together all pixels in image that are inside rect
+struct MeanStdDevBuf {
+    cv::cuda::GpuMat sum;
+    cv::cuda::GpuMat sqr_sum;
+    cv::Mat sum_cpu;
+    cv::Mat sqr_sum_cpu;
+};
+
+/// Mean and standard deviation of a single channel image
+///
+/// Unlike cv::cuda::meanStdDev this runs on the given stream, so it only
+/// waits on work queued to that stream instead of the whole device
+void meanStdDev(const cv::cuda::GpuMat& src,
+                double& mean,
+                double& stddev,
+                MeanStdDevBuf& buf,
+                cv::cuda::Stream& stream);
+
+/// Average all pixels in image that are inside rect
 ///
 /// @param[in]  image  An rgb image
-/// @returns           Sum of pixels inside rect
+/// @returns           Mean of pixels inside rect
 cv::Vec3d sumPatch(const cv::Mat& image, const cv::RotatedRect& rect);
 
+/// Convert a single pixel from rgb to hsv
+///
+/// Gives the same results as cv::cvtColor with cv::COLOR_RGB2HSV
+cv::Vec3b rgbToHsv(const cv::Vec3b& rgb);
+
+/// Single pixel version of cv::inRange, true if every channel is inside
+/// the inclusive bounds
+bool inRange(const cv::Vec3b& pixel,
+             const cv::Scalar& lowerb,
+             const cv::Scalar& upperb);
+
 } // end namespace cv_utils
 
 } // end namespace iarc7_vision
@@ -0,0 +1,69 @@
+#ifndef IARC7_VISION_KERNELS_BLOB_LABELING_HPP_
+#define IARC7_VISION_KERNELS_BLOB_LABELING_HPP_
+
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+/// Max number of connected components considered per image, any beyond
+/// this are ignored
+constexpr int kMaxBlobLabels = 4096;
+
+/// Max number of blobs within the size limits returned per image
+constexpr int kMaxBlobs = 64;
+
+struct BlobRecord {
+    /// Area inside the blob's outer contour, see findBlobs
+    float area;
+    /// Eigenvectors of the blob's covariance, smallest eigenvalue first
+    float axes[2][2];
+    /// Range of the blob's pixel coordinates projected onto each axis
+    float extent_min[2];
+    float extent_max[2];
+};
+
+struct BlobList {
+    /// Number of connected components found, may be more than
+    /// kMaxBlobLabels
+    int label_count;
+    /// Number of blobs within the size limits, may be more than kMaxBlobs
+    int blob_count;
+    BlobRecord blobs[kMaxBlobs];
+};
+
+/// Device buffers for findBlobs
+struct BlobLabelingBuf {
+    cv::cuda::GpuMat filled;
+    cv::cuda::GpuMat labels;
+    cv::cuda::GpuMat ids;
+    cv::cuda::GpuMat label_stats;
+};
+
+/// Find 8-connected blobs of nonzero pixels and their oriented extents
+///
+/// Blobs are measured the way RoombaBlobDetector measures the external
+/// contours from findContours.  Holes are filled first.  The area is that
+/// of the polygon through the centers of the outer boundary pixels, which
+/// is cv::moments(contour).m00 for any blob without one pixel wide parts.
+/// The orientation comes from the filled blob's pixel moments.  Only blobs
+/// with an area in [min_area, max_area] get a record.
+///
+/// @param[in]   mask       mono8 mask
+/// @param[in]   min_area   Smallest blob to return
+/// @param[in]   max_area   Largest blob to return
+/// @param[out]  blob_list  1xsizeof(BlobList) CV_8UC1 holding a BlobList
+/// @param[in]   buf        Intermediate buffers
+void findBlobs(const cv::cuda::GpuMat& mask,
+               int min_area,
+               int max_area,
+               cv::cuda::GpuMat& blob_list,
+               BlobLabelingBuf& buf,
+               cv::cuda::Stream& stream);
+
+} // namespace kernels
+
+} // namespace iarc7_vision
+
+#endif // include guard
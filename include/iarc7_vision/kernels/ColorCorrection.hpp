@@ -0,0 +1,36 @@
+#ifndef IARC7_VISION_KERNELS_COLOR_CORRECTION_HPP_
+#define IARC7_VISION_KERNELS_COLOR_CORRECTION_HPP_
+
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+struct ColorCorrectionParams {
+    /// Row major, out_i = sum_j matrix[3*i + j] * in_j + offset[i]
+    float matrix[9];
+    float offset[3];
+};
+
+/// Apply gamma, matrix + offset, and final gamma to an rgb8 image in a
+/// single pass
+///
+/// Channels which are saturated after the first gamma stay saturated.
+///
+/// @param[in]   in         rgb8 input image
+/// @param[out]  out        rgb8 output image, must not alias in
+/// @param[in]   gamma_lut  1x256 CV_8UC1 table applied before the matrix
+/// @param[in]   final_lut  1x256 CV_8UC1 table applied after the matrix
+void colorCorrect(const cv::cuda::GpuMat& in,
+                  cv::cuda::GpuMat& out,
+                  const cv::cuda::GpuMat& gamma_lut,
+                  const cv::cuda::GpuMat& final_lut,
+                  const ColorCorrectionParams& params,
+                  cv::cuda::Stream& stream);
+
+} // namespace kernels
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -0,0 +1,77 @@
+#ifndef IARC7_VISION_KERNELS_FLOOR_FEATURES_HPP_
+#define IARC7_VISION_KERNELS_FLOOR_FEATURES_HPP_
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+/// Most filters floorFeatures can apply, there's one thread per filter
+/// plus one per color channel
+constexpr int kMaxFloorFilters = 61;
+
+/// Largest patch, in pixels, floorFeatures can load for a single patch
+constexpr int kMaxFloorPatchSize = 32;
+
+/// Layout of the filterbank features, see floorFeatures
+struct FloorFeatureParams {
+    int kernel_size;
+    int stride;
+    /// Side length of each patch, in strided filter responses
+    int average_size;
+    int num_filters;
+};
+
+/// Size of the grid of patches floorFeatures makes for an image
+cv::Size floorPatchGrid(const cv::Size& image_size,
+                        const FloorFeatureParams& params);
+
+/// Texture and color features of each patch of an image
+///
+/// Same as the original tensorflow version of the floor detector: the
+/// grayscale image in [0, 1] is correlated with each filter (valid region
+/// only, every stride pixels), squared, and averaged over average_size x
+/// average_size blocks.  Each patch also gets the mean of each rgb channel
+/// over the matching stride * average_size pixel square.
+///
+/// @param[in]   image    rgb8 image
+/// @param[in]   filters  num_filters x (kernel_size * kernel_size) CV_32FC1,
+///                       each row a row major kernel
+/// @param[in]   params   Feature layout
+/// @param[out]  features (grid rows * grid cols) x (num_filters + 3)
+///                       CV_32FC1, one row per patch in row major grid
+///                       order, filter responses then rgb
+void floorFeatures(const cv::cuda::GpuMat& image,
+                   const cv::cuda::GpuMat& filters,
+                   const FloorFeatureParams& params,
+                   cv::cuda::GpuMat& features,
+                   cv::cuda::Stream& stream);
+
+/// Evaluate a binary svm's decision function for each row of features
+///
+/// The decision is sum_i(dual_coefs_i * K(support_vector_i, x)) + intercept,
+/// with K(a, b) = exp(-gamma * |a - b|^2) for rbf, or a . b for linear.
+///
+/// @param[in]   features         n x d CV_32FC1
+/// @param[in]   support_vectors  m x d CV_32FC1
+/// @param[in]   dual_coefs       1 x m CV_32FC1
+/// @param[in]   gamma            Rbf kernel width, unused if linear
+/// @param[in]   intercept        Added to every decision
+/// @param[in]   rbf              Rbf kernel if true, linear otherwise
+/// @param[out]  decisions        1 x n CV_32FC1
+void svmDecisions(const cv::cuda::GpuMat& features,
+                  const cv::cuda::GpuMat& support_vectors,
+                  const cv::cuda::GpuMat& dual_coefs,
+                  float gamma,
+                  float intercept,
+                  bool rbf,
+                  cv::cuda::GpuMat& decisions,
+                  cv::cuda::Stream& stream);
+
+} // namespace kernels
+
+} // namespace iarc7_vision
+
+#endif // include guard
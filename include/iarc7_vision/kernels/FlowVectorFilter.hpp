@@ -0,0 +1,66 @@
+#ifndef IARC7_VISION_KERNELS_FLOW_VECTOR_FILTER_HPP_
+#define IARC7_VISION_KERNELS_FLOW_VECTOR_FILTER_HPP_
+
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+/// Max number of roombas filterFlowVectors can reject vectors around
+constexpr int kMaxFilterRoombas = 16;
+
+struct FlowFilterParams {
+    /// Exclusive bounds both ends of a vector have to be inside
+    float min_x;
+    float max_x;
+    float min_y;
+    float max_y;
+
+    /// A point p is at p * roomba_scale + roomba_offset in the units of the
+    /// roomba locations
+    float roomba_scale;
+    float roomba_offset_x;
+    float roomba_offset_y;
+
+    int roomba_count;
+    float roomba_x[kMaxFilterRoombas];
+    float roomba_y[kMaxFilterRoombas];
+    float roomba_radius_sq[kMaxFilterRoombas];
+};
+
+struct FlowFilterCounts {
+    /// Vectors written to the outputs
+    unsigned int accepted;
+    /// Valid vectors with an end outside the bounds
+    unsigned int rejection_region;
+    /// Valid vectors with an end on a roomba, can overlap rejection_region
+    unsigned int roomba_region;
+};
+
+/// Throw out flow vectors which aren't valid, have an end outside the
+/// bounds, or have an end on a roomba, and pack the rest together
+///
+/// The accepted vectors stay in the same order as the input.
+///
+/// @param[in]   tails           1xn CV_32FC2 tails
+/// @param[in]   heads           1xn CV_32FC2 heads
+/// @param[in]   status          1xn CV_8UC1 status, nonzero for valid
+/// @param[out]  filtered_tails  1xn CV_32FC2, the first counts.accepted
+///                              entries are the accepted tails
+/// @param[out]  filtered_heads  1xn CV_32FC2, same for the heads
+/// @param[out]  counts          1xsizeof(FlowFilterCounts) CV_8UC1
+void filterFlowVectors(const cv::cuda::GpuMat& tails,
+                       const cv::cuda::GpuMat& heads,
+                       const cv::cuda::GpuMat& status,
+                       const FlowFilterParams& params,
+                       cv::cuda::GpuMat& filtered_tails,
+                       cv::cuda::GpuMat& filtered_heads,
+                       cv::cuda::GpuMat& counts,
+                       cv::cuda::Stream& stream);
+
+} // namespace kernels
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -0,0 +1,64 @@
+#ifndef IARC7_VISION_KERNELS_HSV_SEGMENTATION_HPP_
+#define IARC7_VISION_KERNELS_HSV_SEGMENTATION_HPP_
+
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+/// Inclusive bounds on hue, normalized saturation, and value
+struct HsvSlice {
+    int min[3];
+    int max[3];
+};
+
+struct HsvSegmentationParams {
+    /// A pixel is in the mask if it is inside any of the slices
+    HsvSlice slices[3];
+};
+
+/// Sum and sum of squares of the HSV saturation of every pixel
+///
+/// Stored on the device in a 1x16 CV_8UC1 GpuMat, since there is no
+/// matching 64 bit unsigned GpuMat type
+struct SaturationSums {
+    unsigned long long sum;
+    unsigned long long sqr_sum;
+};
+
+/// Compute SaturationSums for an rgb8 image
+///
+/// @param[in]   rgb   rgb8 input image
+/// @param[out]  sums  Reduction results, see SaturationSums
+void saturationSums(const cv::cuda::GpuMat& rgb,
+                    cv::cuda::GpuMat& sums,
+                    cv::cuda::Stream& stream);
+
+/// Threshold an rgb8 image against HSV slices in a single pass
+///
+/// Saturation is normalized to a mean of 128 and a standard deviation of
+/// 42.5 before thresholding, using the statistics in sums.  Results match
+/// cvtColor to HSV followed by the same normalization and inRange on each
+/// slice.
+///
+/// The sums don't have to come from rgb itself, e.g. rgb can be a region of
+/// the image the sums were computed for.
+///
+/// @param[in]   rgb        rgb8 input image
+/// @param[in]   sums       Output of saturationSums
+/// @param[in]   sums_area  Number of pixels in the image sums is for
+/// @param[in]   params     Slices to threshold against
+/// @param[out]  mask       mono8 output, 255 inside any slice and 0 otherwise
+void hsvSegmentation(const cv::cuda::GpuMat& rgb,
+                     const cv::cuda::GpuMat& sums,
+                     int sums_area,
+                     const HsvSegmentationParams& params,
+                     cv::cuda::GpuMat& mask,
+                     cv::cuda::Stream& stream);
+
+} // namespace kernels
+
+} // namespace iarc7_vision
+
+#endif // include guard
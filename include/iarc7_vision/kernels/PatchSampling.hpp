@@ -0,0 +1,50 @@
+#ifndef IARC7_VISION_KERNELS_PATCH_SAMPLING_HPP_
+#define IARC7_VISION_KERNELS_PATCH_SAMPLING_HPP_
+
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+/// A rotated rect to sum over, see cv_utils::sumPatch
+struct PatchParams {
+    float center_x;
+    float center_y;
+    float cos_angle;
+    float sin_angle;
+    float half_width;
+    float half_height;
+    /// Inclusive pixel bounds to search, already clipped to the image
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+};
+
+struct PatchSum {
+    unsigned int sum[3];
+    /// Number of pixels inside the patch
+    unsigned int count;
+};
+
+/// Sum the pixels inside each of a batch of rotated patches
+///
+/// A pixel is inside a patch under the same test as
+/// cv_utils::insideRotatedRect, evaluated with the same float operations.
+///
+/// @param[in]   image    rgb8 image
+/// @param[in]   patches  1x(n*sizeof(PatchParams)) CV_8UC1 of PatchParams
+/// @param[in]   count    Number of patches
+/// @param[out]  sums     1x(n*sizeof(PatchSum)) CV_8UC1 of PatchSum
+void patchSums(const cv::cuda::GpuMat& image,
+               const cv::cuda::GpuMat& patches,
+               int count,
+               cv::cuda::GpuMat& sums,
+               cv::cuda::Stream& stream);
+
+} // namespace kernels
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -0,0 +1,68 @@
+#ifndef IARC7_VISION_KERNELS_PYR_LK_HPP_
+#define IARC7_VISION_KERNELS_PYR_LK_HPP_
+
+#include <vector>
+
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+/// Max number of pyramid levels above the base image
+constexpr int kMaxPyrLKLevel = 7;
+
+/// Max window size for pyrLK
+constexpr int kMaxPyrLKWinSize = 31;
+
+struct PyrLKParams {
+    /// Side length of the square window, even windows are centered
+    /// between pixels
+    int win_size;
+    /// Highest pyramid level to track at, 0 is the base image
+    int max_level;
+    /// Max iterations at each level
+    int iters;
+    /// Points whose window's smallest gradient matrix eigenvalue is below
+    /// this are lost, in the units of cv::calcOpticalFlowPyrLK's
+    /// minEigThreshold
+    float min_eig_threshold;
+};
+
+/// cv::calcOpticalFlowPyrLK's default min_eig_threshold
+constexpr float kDefaultPyrLKMinEigThreshold = 1e-4f;
+
+/// True if pyrLK has a kernel compiled for this window size and image type
+///
+/// Those are the window sizes of the flight configs (5 on 2.0, 20 on 1.1
+/// and 1.9).  Every kernel caches the previous window and its gradients in
+/// shared memory; these ones also have that cache and their loops sized at
+/// compile time, and a block only as wide as the window needs.  Everything
+/// else runs a generic kernel which reads the window size at runtime.
+bool pyrLKHasFastPath(int win_size, int type);
+
+/// Pyramidal Lucas-Kanade tracking between two prebuilt pyramids
+///
+/// Both pyramids must have at least max_level + 1 levels, as built by
+/// cv::cuda::pyrDown starting from the base image, and be CV_8UC1 or
+/// CV_8UC3.  Each point is tracked by a block of threads splitting its
+/// window, so even the few hundred points optical flow uses fill the gpu.
+///
+/// @param[in]   prev_pyramid  Pyramid of the image the points are in
+/// @param[in]   next_pyramid  Pyramid of the image to track the points into
+/// @param[in]   prev_pts      1xN CV_32FC2 points in the previous image
+/// @param[out]  next_pts      1xN CV_32FC2 tracked points
+/// @param[out]  status        1xN CV_8UC1, nonzero if the point was tracked
+void pyrLK(const std::vector<cv::cuda::GpuMat>& prev_pyramid,
+           const std::vector<cv::cuda::GpuMat>& next_pyramid,
+           const cv::cuda::GpuMat& prev_pts,
+           cv::cuda::GpuMat& next_pts,
+           cv::cuda::GpuMat& status,
+           const PyrLKParams& params,
+           cv::cuda::Stream& stream);
+
+} // namespace kernels
+
+} // namespace iarc7_vision
+
+#endif // include guard
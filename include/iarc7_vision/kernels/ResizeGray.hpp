@@ -0,0 +1,31 @@
+#ifndef IARC7_VISION_KERNELS_RESIZE_GRAY_HPP_
+#define IARC7_VISION_KERNELS_RESIZE_GRAY_HPP_
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/cuda.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+/// Crop, resize, and convert to grayscale in a single pass
+///
+/// Gives the same results as cropping, cv::cuda::resize with INTER_LINEAR,
+/// and cv::cuda::cvtColor to gray, but only ever writes the single channel
+/// output.
+///
+/// @param[in]   in    rgb8 or rgba8 image
+/// @param[in]   roi   Region of in to use
+/// @param[in]   size  Output size
+/// @param[out]  gray  mono8 output
+void cropResizeGray(const cv::cuda::GpuMat& in,
+                    const cv::Rect& roi,
+                    const cv::Size& size,
+                    cv::cuda::GpuMat& gray,
+                    cv::cuda::Stream& stream);
+
+} // namespace kernels
+
+} // namespace iarc7_vision
+
+#endif // include guard
@@ -0,0 +1,105 @@
+#!/usr/bin/env python
+# Converts a pickled floor classifier into rosparam yaml for the vision
+# node's floor detector
+#
+# Usage: export_floor_classifier.py <classifier.clf> <output.yaml>
+import pickle
+import sys
+
+import numpy as np
+
+from iarc7_vision.filterbank import get_RFS_filters_in_tensorflow_format
+
+
+class SettingsObject(object):
+    def __init__(self):
+        pass
+
+
+class SettingsUnpickler(pickle.Unpickler):
+    # The classifiers were pickled from the floor detector, which pulls in
+    # tensorflow when imported, so its settings class is swapped for this one
+    def find_class(self, module, name):
+        if name == 'SettingsObject':
+            return SettingsObject
+        return pickle.Unpickler.find_class(self, module, name)
+
+
+def format_float(value):
+    # Always with a point, so yaml doesn't load any of them as ints
+    s = '%.9g' % value
+    if '.' not in s and 'e' not in s:
+        s += '.0'
+    return s
+
+
+def format_list(values):
+    return '[' + ', '.join(format_float(v) for v in values) + ']'
+
+
+def export(clf_filename, yaml_filename):
+    with open(clf_filename, 'rb') as f:
+        settings = SettingsUnpickler(f).load()
+    clf = settings.clf
+
+    if clf.kernel not in ('rbf', 'linear'):
+        raise ValueError('Unsupported kernel {}'.format(clf.kernel))
+    if len(clf.classes_) != 2 or list(clf.classes_) != [0, 1]:
+        raise ValueError('Expected a floor (0) / anti floor (1) classifier')
+
+    # (kernel_size, kernel_size, 1, n) to n row major kernels
+    filters = get_RFS_filters_in_tensorflow_format(settings.kernel_size,
+                                                   settings.sigmas,
+                                                   settings.n_orientations)
+    filters = np.transpose(filters[:, :, 0, :], (2, 0, 1))
+
+    support_vectors = np.asarray(clf.support_vectors_, dtype=np.float64)
+    if support_vectors.shape[1] != filters.shape[0] + 3:
+        raise ValueError('Classifier features don\'t match the filterbank')
+
+    revision = clf_filename.split('/')[-1]
+    revision = revision.replace('floor_classifier_params_', '')
+    revision = revision.replace('.clf', '')
+
+    with open(yaml_filename, 'w') as f:
+        f.write('# Generated by scripts/export_floor_classifier.py from\n')
+        f.write('# classifiers/{}\n'.format(clf_filename.split('/')[-1]))
+        f.write('floor_classifier:\n')
+        f.write('    revision: {}\n'.format(revision))
+        f.write('\n')
+        f.write('    # Size the cropped frame is resized to\n')
+        f.write('    target_width: {}\n'.format(settings.target_size[0]))
+        f.write('    target_height: {}\n'.format(settings.target_size[1]))
+        f.write('    # Height whose view fills the target size, frames from '
+                'higher up are\n')
+        f.write('    # cropped to the same ground area\n')
+        f.write('    min_height: {}\n'.format(settings.min_height))
+        f.write('\n')
+        f.write('    # Filterbank, num_filters kernel_size x kernel_size '
+                'kernels, row major\n')
+        f.write('    kernel_size: {}\n'.format(settings.kernel_size))
+        f.write('    stride: {}\n'.format(settings.stride))
+        f.write('    average_size: {}\n'.format(settings.average_size))
+        f.write('    num_filters: {}\n'.format(filters.shape[0]))
+        f.write('    filters: {}\n'.format(format_list(filters.ravel())))
+        f.write('\n')
+        f.write('    # Svm over the filter responses and mean rgb of each '
+                'patch, positive\n')
+        f.write('    # decisions are anti floor\n')
+        f.write('    kernel: {}\n'.format(clf.kernel))
+        f.write('    gamma: {}\n'.format(format_float(clf._gamma)))
+        f.write('    intercept: {}\n'.format(format_float(clf.intercept_[0])))
+        f.write('    num_support_vectors: {}\n'.format(
+            support_vectors.shape[0]))
+        f.write('    dual_coefs: {}\n'.format(
+            format_list(np.ravel(clf.dual_coef_))))
+        f.write('    support_vectors: {}\n'.format(
+            format_list(support_vectors.ravel())))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print('Usage: export_floor_classifier.py <classifier.clf> '
+              '<output.yaml>')
+        sys.exit(1)
+    export(sys.argv[1], sys.argv[2])
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Replays a bag through iarc7_vision_benchmark once for each platform's
+# params and saves the results next to each other
+#
+# Usage: run_benchmarks.sh BAG [OUTPUT_DIR]
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 BAG [OUTPUT_DIR]" >&2
+    exit 1
+fi
+
+bag=$(readlink -f "$1")
+output_dir=${2:-benchmark_results}
+mkdir -p "$output_dir"
+
+for platform in 1.1 1.9 2.0 sim; do
+    # Only 2.0 and sim have their own distortion and color correction models
+    case $platform in
+        1.1|1.9) model_platform=2.0 ;;
+        *) model_platform=$platform ;;
+    esac
+
+    echo "=== $platform ==="
+    roslaunch iarc7_vision benchmark.launch \
+        platform:=$platform \
+        model_platform:=$model_platform \
+        bag:="$bag" \
+        | tee "$output_dir/$platform.txt"
+done
@@ -1,6 +1,7 @@
 #include "iarc7_vision/ColorCorrectionModel.hpp"
 
 #include <chrono>
+#include <vector>
 
 #include "ros_utils/ParamUtils.hpp"
 
@@ -20,100 +21,136 @@ ColorCorrectionModel::ColorCorrectionModel(const ros::NodeHandle& nh)
       offset1_(ros_utils::ParamUtils::getParam<double>(nh, "offset1")),
       offset2_(ros_utils::ParamUtils::getParam<double>(nh, "offset2")),
       gamma_(ros_utils::ParamUtils::getParam<double>(nh, "gamma")),
-      final_gamma_(ros_utils::ParamUtils::getParam<double>(nh, "final_gamma"))
+      final_gamma_(ros_utils::ParamUtils::getParam<double>(nh, "final_gamma")),
+      use_fused_kernel_(ros_utils::ParamUtils::getParam<bool>(
+                  nh, "use_fused_kernel"))
 {
-    {
-        cv::Mat lut(cv::Size(256, 1), CV_8UC3);
+    const auto make_lut = [](double gamma) {
+        cv::Mat lut(cv::Size(256, 1), CV_8UC1);
         for (int i = 0; i < 256; i++) {
             const double result = 255. * std::pow(static_cast<double>(i) / 255.,
-                                           1/gamma_);
-            const uchar result_b = std::max(0., std::min(255., result));
-            lut.at<cv::Vec3b>(0, i) = cv::Vec3b(result_b, result_b, result_b);
+                                           1/gamma);
+            lut.at<uchar>(0, i) = std::max(0., std::min(255., result));
         }
-        gamma_lut_ = cv::cuda::createLookUpTable(lut);
+        return lut;
+    };
+
+    {
+        const cv::Mat lut = make_lut(gamma_);
+        gamma_lut_gpu_.upload(lut);
+
+        cv::Mat lut3;
+        cv::merge(std::vector<cv::Mat>{lut, lut, lut}, lut3);
+        gamma_lut_ = cv::cuda::createLookUpTable(lut3);
     }
 
     {
-        cv::Mat lut(cv::Size(256, 1), CV_8UC3);
-        for (int i = 0; i < 256; i++) {
-            const double result = 255. * std::pow(static_cast<double>(i) / 255.,
-                                           1/final_gamma_);
-            const uchar result_b = std::max(0., std::min(255., result));
-            lut.at<cv::Vec3b>(0, i) = cv::Vec3b(result_b, result_b, result_b);
-        }
-        final_lut_ = cv::cuda::createLookUpTable(lut);
+        const cv::Mat lut = make_lut(final_gamma_);
+        final_lut_gpu_.upload(lut);
+
+        cv::Mat lut3;
+        cv::merge(std::vector<cv::Mat>{lut, lut, lut}, lut3);
+        final_lut_ = cv::cuda::createLookUpTable(lut3);
     }
+
+    const double matrix[9] = {a00_, a01_, a02_,
+                              a10_, a11_, a12_,
+                              a20_, a21_, a22_};
+    for (int i = 0; i < 9; i++) {
+        kernel_params_.matrix[i] = matrix[i];
+    }
+    kernel_params_.offset[0] = offset0_;
+    kernel_params_.offset[1] = offset1_;
+    kernel_params_.offset[2] = offset2_;
 }
 
 void ColorCorrectionModel::correct(const cv::cuda::GpuMat& in,
                                    cv::cuda::GpuMat& out,
                                    cv::cuda::Stream& stream) const
 {
+    correct(in, out, buf_, stream);
+}
+
+void ColorCorrectionModel::correct(const cv::cuda::GpuMat& in,
+                                   cv::cuda::GpuMat& out,
+                                   ColorCorrectionBuf& buf,
+                                   cv::cuda::Stream& stream) const
+{
+    if (use_fused_kernel_) {
+        kernels::colorCorrect(in,
+                              out,
+                              gamma_lut_gpu_,
+                              final_lut_gpu_,
+                              kernel_params_,
+                              stream);
+        return;
+    }
+
     const auto start = std::chrono::high_resolution_clock::now();
 
-    gamma_lut_->transform(in, in_post_gamma_, stream);
+    gamma_lut_->transform(in, buf.in_post_gamma, stream);
 
     const auto after_gamma = std::chrono::high_resolution_clock::now();
 
-    cv::cuda::split(in_post_gamma_, in_channels_.data(), stream);
+    cv::cuda::split(buf.in_post_gamma, buf.in_channels.data(), stream);
 
     for (int i = 0; i < 3; i++) {
-        cv::cuda::compare(in_channels_[i], 255, saturated_masks_[i], cv::CMP_GE, stream);
+        cv::cuda::compare(buf.in_channels[i], 255, buf.saturated_masks[i], cv::CMP_GE, stream);
     }
 
-    std::array<cv::cuda::GpuMat, 3> gbr_channels = {{in_channels_[1],
-                                                     in_channels_[2],
-                                                     in_channels_[0]}};
-    cv::cuda::merge(gbr_channels.data(), 3, gbr_order_, stream);
+    std::array<cv::cuda::GpuMat, 3> gbr_channels = {{buf.in_channels[1],
+                                                     buf.in_channels[2],
+                                                     buf.in_channels[0]}};
+    cv::cuda::merge(gbr_channels.data(), 3, buf.gbr_order, stream);
 
-    std::array<cv::cuda::GpuMat, 3> brg_channels = {{in_channels_[2],
-                                                     in_channels_[0],
-                                                     in_channels_[1]}};
-    cv::cuda::merge(brg_channels.data(), 3, brg_order_, stream);
+    std::array<cv::cuda::GpuMat, 3> brg_channels = {{buf.in_channels[2],
+                                                     buf.in_channels[0],
+                                                     buf.in_channels[1]}};
+    cv::cuda::merge(brg_channels.data(), 3, buf.brg_order, stream);
 
     const auto after_splits = std::chrono::high_resolution_clock::now();
 
-    cv::cuda::multiply(in_post_gamma_,
+    cv::cuda::multiply(buf.in_post_gamma,
                        cv::Scalar(a00_, a11_, a22_),
-                       out1_,
+                       buf.out1,
                        1.,
                        CV_32FC3,
                        stream);
-    cv::cuda::multiply(gbr_order_,
+    cv::cuda::multiply(buf.gbr_order,
                        cv::Scalar(a01_, a12_, a20_),
-                       out2_,
+                       buf.out2,
                        1.,
                        CV_32FC3,
                        stream);
-    cv::cuda::multiply(brg_order_,
+    cv::cuda::multiply(buf.brg_order,
                        cv::Scalar(a02_, a10_, a21_),
-                       out3_,
+                       buf.out3,
                        1.,
                        CV_32FC3,
                        stream);
 
-    cv::cuda::add(out1_, out2_, out_float1_, cv::noArray(), CV_32FC3, stream);
-    cv::cuda::add(out3_,
+    cv::cuda::add(buf.out1, buf.out2, buf.out_float1, cv::noArray(), CV_32FC3, stream);
+    cv::cuda::add(buf.out3,
                   cv::Scalar(offset0_, offset1_, offset2_),
-                  out_float2_,
+                  buf.out_float2,
                   cv::noArray(),
                   CV_32FC3,
                   stream);
 
-    cv::cuda::add(out_float1_, out_float2_, out_float_, cv::noArray(), CV_32FC3, stream);
+    cv::cuda::add(buf.out_float1, buf.out_float2, buf.out_float, cv::noArray(), CV_32FC3, stream);
 
     const auto after_arithm = std::chrono::high_resolution_clock::now();
 
-    out_float_.convertTo(out_before_gamma_, CV_8UC3);
-    final_lut_->transform(out_before_gamma_, out_after_gamma_, stream);
+    buf.out_float.convertTo(buf.out_before_gamma, CV_8UC3, stream);
+    final_lut_->transform(buf.out_before_gamma, buf.out_after_gamma, stream);
 
     const auto after_gamma2 = std::chrono::high_resolution_clock::now();
 
-    cv::cuda::split(out_after_gamma_, out_channels_.data(), stream);
+    cv::cuda::split(buf.out_after_gamma, buf.out_channels.data(), stream);
     for (int i = 0; i < 3; i++) {
-        out_channels_[i].setTo(255, saturated_masks_[i], stream);
+        buf.out_channels[i].setTo(255, buf.saturated_masks[i], stream);
     }
-    cv::cuda::merge(out_channels_.data(), 3, out, stream);
+    cv::cuda::merge(buf.out_channels.data(), 3, out, stream);
 
     const auto after_out = std::chrono::high_resolution_clock::now();
 
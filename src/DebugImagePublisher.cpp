@@ -0,0 +1,121 @@
+#include "iarc7_vision/DebugImagePublisher.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <utility>
+
+#include <sensor_msgs/Image.h>
+
+namespace iarc7_vision {
+
+DebugImagePublisher::DebugImagePublisher(ros::NodeHandle& nh,
+                                         const std::string& topic,
+                                         double max_rate)
+    : publisher_(nh.advertise<sensor_msgs::Image>(topic, 1)),
+      min_interval_(max_rate > 0
+                  ? std::chrono::duration_cast<
+                        std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>(1.0 / max_rate))
+                  : std::chrono::steady_clock::duration::zero()),
+      message_pool_(2),
+      mutex_(),
+      job_cv_(),
+      busy_(false),
+      shutdown_(false),
+      last_publish_(),
+      header_(),
+      encoding_(),
+      render_(),
+      thread_()
+{
+    ROS_ASSERT(max_rate >= 0);
+}
+
+DebugImagePublisher::~DebugImagePublisher()
+{
+    if (thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            shutdown_ = true;
+        }
+        job_cv_.notify_one();
+        thread_.join();
+    }
+}
+
+bool DebugImagePublisher::wanted() const
+{
+    // Checked first since it doesn't need the lock
+    if (publisher_.getNumSubscribers() == 0) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    return wantedLocked();
+}
+
+bool DebugImagePublisher::wantedLocked() const
+{
+    return !busy_
+        && std::chrono::steady_clock::now() - last_publish_ >= min_interval_;
+}
+
+void DebugImagePublisher::publish(const std_msgs::Header& header,
+                                  const std::string& encoding,
+                                  Render render)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!wantedLocked()) {
+            return;
+        }
+
+        busy_ = true;
+        last_publish_ = std::chrono::steady_clock::now();
+        header_ = header;
+        encoding_ = encoding;
+        render_ = std::move(render);
+
+        if (!thread_.joinable()) {
+            thread_ = std::thread(&DebugImagePublisher::run, this);
+        }
+    }
+    job_cv_.notify_one();
+}
+
+void DebugImagePublisher::run()
+{
+    // Debug images only get cpu time nothing else wants
+    sched_param param {};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        ROS_WARN("Failed to lower priority of debug publisher for %s",
+                 publisher_.getTopic().c_str());
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        job_cv_.wait(lock, [this]() { return shutdown_ || render_; });
+        if (shutdown_) {
+            return;
+        }
+
+        const std_msgs::Header header = header_;
+        const std::string encoding = encoding_;
+        Render render = std::move(render_);
+        render_ = nullptr;
+
+        lock.unlock();
+        const cv::Mat image = render();
+        if (!image.empty()) {
+            publisher_.publish(message_pool_.fill(image, header, encoding));
+        }
+        // Drop whatever the job captured before taking new ones
+        render = nullptr;
+        lock.lock();
+
+        busy_ = false;
+    }
+}
+
+} // namespace iarc7_vision
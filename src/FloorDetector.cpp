@@ -0,0 +1,747 @@
+#include "iarc7_vision/FloorDetector.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <utility>
+
+#include <geometry_msgs/Point.h>
+#include <geometry_msgs/Vector3Stamped.h>
+#include <iarc7_msgs/Boundary.h>
+#include <opencv2/cudawarping.hpp>
+#include <opencv2/imgproc.hpp>
+#include <ros_utils/ParamUtils.hpp>
+#include <sensor_msgs/image_encodings.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <visualization_msgs/Marker.h>
+
+namespace iarc7_vision {
+
+namespace {
+
+/// Load a matrix stored row major as a flat list
+cv::cuda::GpuMat loadMatrix(const ros::NodeHandle& nh,
+                            const std::string& name,
+                            int rows,
+                            int cols)
+{
+    const std::vector<double> values
+        = ros_utils::ParamUtils::getParam<std::vector<double>>(nh, name);
+    ROS_ASSERT_MSG(values.size() == static_cast<size_t>(rows * cols),
+                   "Floor classifier %s has %lu values, expected %d",
+                   name.c_str(),
+                   values.size(),
+                   rows * cols);
+
+    cv::Mat mat(rows, cols, CV_32FC1);
+    std::copy(values.begin(), values.end(), mat.begin<float>());
+    return cv::cuda::GpuMat(mat);
+}
+
+/// Fit a soft margin linear svm to labelled points
+///
+/// Solves the same problem as libsvm with a linear kernel, using smo with
+/// the maximal violating pair.  That converges slower than libsvm's second
+/// order selection, which doesn't matter for the few dozen points here.
+///
+/// @param[in]   points  Points to separate
+/// @param[in]   labels  +1 or -1 for each point, with both present
+/// @param[in]   c       Penalty on points inside the margin
+/// @param[out]  w       Normal of the boundary
+/// @param[out]  b       Offset of the boundary, w . p + b is positive on the
+///                      +1 side
+void fitLinearSvm(const std::vector<cv::Point2f>& points,
+                  const std::vector<int>& labels,
+                  double c,
+                  cv::Vec2d& w,
+                  double& b)
+{
+    // Same stopping tolerance as libsvm
+    constexpr double kTolerance = 1e-3;
+    constexpr double kTau = 1e-12;
+    constexpr int kMaxIterations = 100000;
+
+    ROS_ASSERT(points.size() == labels.size());
+    const size_t n = points.size();
+
+    std::vector<double> kernel(n * n);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            kernel[i * n + j] = static_cast<double>(points[i].x) * points[j].x
+                              + static_cast<double>(points[i].y) * points[j].y;
+        }
+    }
+
+    // Gradient of the dual, 1/2 a^T Q a - sum(a)
+    std::vector<double> alpha(n, 0.0);
+    std::vector<double> gradient(n, -1.0);
+
+    const auto in_up = [&](size_t t) {
+        return labels[t] > 0 ? alpha[t] < c : alpha[t] > 0;
+    };
+    const auto in_low = [&](size_t t) {
+        return labels[t] > 0 ? alpha[t] > 0 : alpha[t] < c;
+    };
+    // Rounding shouldn't leave a point just off a bound
+    const auto snap = [&](double a) {
+        if (a < c * kTau) {
+            return 0.0;
+        }
+        if (a > c * (1 - kTau)) {
+            return c;
+        }
+        return a;
+    };
+
+    int iteration = 0;
+    for (; iteration < kMaxIterations; iteration++) {
+        size_t i = n;
+        size_t j = n;
+        double max_up = -std::numeric_limits<double>::infinity();
+        double min_low = std::numeric_limits<double>::infinity();
+        for (size_t t = 0; t < n; t++) {
+            const double yg = -labels[t] * gradient[t];
+            if (in_up(t) && yg > max_up) {
+                max_up = yg;
+                i = t;
+            }
+            if (in_low(t) && yg < min_low) {
+                min_low = yg;
+                j = t;
+            }
+        }
+
+        if (i == n || j == n || max_up - min_low < kTolerance) {
+            break;
+        }
+
+        // Move alpha_i by labels_i * step and alpha_j by -labels_j * step,
+        // which keeps sum(labels * alpha) at 0
+        const double eta = std::max(kernel[i * n + i]
+                                  + kernel[j * n + j]
+                                  - 2 * kernel[i * n + j],
+                                    kTau);
+        double step = (max_up - min_low) / eta;
+        step = std::min(step, labels[i] > 0 ? c - alpha[i] : alpha[i]);
+        step = std::min(step, labels[j] > 0 ? alpha[j] : c - alpha[j]);
+
+        alpha[i] = snap(alpha[i] + labels[i] * step);
+        alpha[j] = snap(alpha[j] - labels[j] * step);
+        for (size_t k = 0; k < n; k++) {
+            gradient[k] += labels[k] * step
+                         * (kernel[k * n + i] - kernel[k * n + j]);
+        }
+    }
+
+    if (iteration == kMaxIterations) {
+        ROS_WARN_THROTTLE(1.0, "Floor detector boundary fit didn't converge");
+    }
+
+    // Offset from the points strictly inside the bounds, or the middle of
+    // the feasible range if there aren't any, like libsvm
+    double upper = std::numeric_limits<double>::infinity();
+    double lower = -std::numeric_limits<double>::infinity();
+    double free_sum = 0;
+    int free_count = 0;
+    for (size_t t = 0; t < n; t++) {
+        const double yg = labels[t] * gradient[t];
+        if (alpha[t] >= c) {
+            if (labels[t] < 0) {
+                upper = std::min(upper, yg);
+            } else {
+                lower = std::max(lower, yg);
+            }
+        } else if (alpha[t] <= 0) {
+            if (labels[t] > 0) {
+                upper = std::min(upper, yg);
+            } else {
+                lower = std::max(lower, yg);
+            }
+        } else {
+            free_sum += yg;
+            free_count++;
+        }
+    }
+    const double rho = free_count > 0 ? free_sum / free_count
+                                      : (upper + lower) / 2;
+
+    w = cv::Vec2d(0, 0);
+    for (size_t t = 0; t < n; t++) {
+        w[0] += alpha[t] * labels[t] * points[t].x;
+        w[1] += alpha[t] * labels[t] * points[t].y;
+    }
+    b = -rho;
+}
+
+} // namespace
+
+FloorDetector::FloorDetector(const FloorDetectorSettings& settings,
+                             const ros::NodeHandle& classifier_nh,
+                             const TransformSource& transform_source,
+                             const std::string& camera_frame)
+    : settings_(settings),
+      transform_source_(transform_source),
+      camera_frame_(camera_frame),
+      target_size_(
+            ros_utils::ParamUtils::getParam<int>(classifier_nh,
+                                                 "target_width"),
+            ros_utils::ParamUtils::getParam<int>(classifier_nh,
+                                                 "target_height")),
+      min_height_(ros_utils::ParamUtils::getParam<double>(classifier_nh,
+                                                          "min_height")),
+      feature_params_(),
+      rbf_(),
+      gamma_(),
+      intercept_(),
+      filters_(),
+      support_vectors_(),
+      dual_coefs_(),
+      resized_(),
+      features_(),
+      decisions_(),
+      decisions_cpu_(),
+      detections_(),
+      nh_("floor_detector"),
+      boundary_pub_(nh_.advertise<iarc7_msgs::Boundary>("boundaries", 10)),
+      line_marker_pub_(nh_.advertise<visualization_msgs::Marker>(
+                  "line_position", 1)),
+      boundary_marker_pub_(nh_.advertise<visualization_msgs::Marker>(
+                  "boundaries_marker", 1)),
+      debug_image_pub_(nh_,
+                       "detections_image",
+                       settings.debug_image_max_rate)
+{
+    ROS_ASSERT(min_height_ > 0);
+    ROS_ASSERT(settings_.min_boundary_detections >= 1);
+    ROS_ASSERT(settings_.max_detections_queued >= 1);
+
+    feature_params_.kernel_size = ros_utils::ParamUtils::getParam<int>(
+            classifier_nh, "kernel_size");
+    feature_params_.stride = ros_utils::ParamUtils::getParam<int>(
+            classifier_nh, "stride");
+    feature_params_.average_size = ros_utils::ParamUtils::getParam<int>(
+            classifier_nh, "average_size");
+    feature_params_.num_filters = ros_utils::ParamUtils::getParam<int>(
+            classifier_nh, "num_filters");
+    ROS_ASSERT(feature_params_.num_filters <= kernels::kMaxFloorFilters);
+
+    const cv::Size grid = kernels::floorPatchGrid(target_size_,
+                                                  feature_params_);
+    ROS_ASSERT_MSG(grid.width >= 3 && grid.height >= 3,
+                   "Floor classifier target size is too small");
+
+    const std::string kernel = ros_utils::ParamUtils::getParam<std::string>(
+            classifier_nh, "kernel");
+    ROS_ASSERT_MSG(kernel == "rbf" || kernel == "linear",
+                   "Unsupported floor classifier kernel %s",
+                   kernel.c_str());
+    rbf_ = kernel == "rbf";
+    gamma_ = ros_utils::ParamUtils::getParam<double>(classifier_nh, "gamma");
+    intercept_ = ros_utils::ParamUtils::getParam<double>(classifier_nh,
+                                                         "intercept");
+
+    const int kernel_area = feature_params_.kernel_size
+                          * feature_params_.kernel_size;
+    const int num_features = feature_params_.num_filters + 3;
+    const int num_support_vectors = ros_utils::ParamUtils::getParam<int>(
+            classifier_nh, "num_support_vectors");
+    filters_ = loadMatrix(classifier_nh,
+                          "filters",
+                          feature_params_.num_filters,
+                          kernel_area);
+    support_vectors_ = loadMatrix(classifier_nh,
+                                  "support_vectors",
+                                  num_support_vectors,
+                                  num_features);
+    dual_coefs_ = loadMatrix(classifier_nh,
+                             "dual_coefs",
+                             1,
+                             num_support_vectors);
+
+    ROS_INFO("Floor detector using classifier %s",
+             ros_utils::ParamUtils::getParam<std::string>(
+                 classifier_nh, "revision").c_str());
+}
+
+void FloorDetector::update(ImagePyramid& pyramid,
+                           const ros::Time& time,
+                           cv::cuda::Stream& stream)
+{
+    Detection detection {false, 0, 0, time};
+
+    geometry_msgs::TransformStamped camera_to_map;
+    if (!transform_source_.getTransformAtTime(
+                camera_to_map,
+                "map",
+                camera_frame_,
+                time,
+                ros::Duration(settings_.transform_timeout))) {
+        ROS_ERROR("Floor detector failed to fetch camera transform");
+        filterDetections(detection);
+        return;
+    }
+
+    // The classifier was trained on the view from min_height
+    const double height = camera_to_map.transform.translation.z;
+    if (height < min_height_) {
+        filterDetections(detection);
+        return;
+    }
+
+    // Crop to the ground area seen from min_height, on the smallest level
+    // that still has the target resolution there
+    const double crop_fraction = min_height_ / height;
+    const int level = pyramid.levelForWidth(static_cast<int>(
+                std::ceil(target_size_.width / crop_fraction)));
+    const cv::Size level_size = pyramid.levelSize(level);
+    const cv::Size crop_size(
+            std::max(1, static_cast<int>(level_size.width * crop_fraction)),
+            std::max(1, static_cast<int>(level_size.height * crop_fraction)));
+    const cv::Rect crop((level_size.width - crop_size.width) / 2,
+                        (level_size.height - crop_size.height) / 2,
+                        crop_size.width,
+                        crop_size.height);
+
+    cv::cuda::resize(pyramid.level(level, stream)(crop),
+                     resized_,
+                     target_size_,
+                     0,
+                     0,
+                     cv::INTER_LINEAR,
+                     stream);
+
+    FrameResult result;
+    classifyPatches(stream, result);
+    if (fitBoundary(result)) {
+        detection.found = locateBoundary(result,
+                                         crop,
+                                         level_size,
+                                         camera_to_map,
+                                         detection);
+    }
+
+    filterDetections(detection);
+    publishDebugImage(result, time, stream);
+}
+
+void FloorDetector::classifyPatches(cv::cuda::Stream& stream,
+                                    FrameResult& result)
+{
+    kernels::floorFeatures(resized_,
+                           filters_,
+                           feature_params_,
+                           features_,
+                           stream);
+    kernels::svmDecisions(features_,
+                          support_vectors_,
+                          dual_coefs_,
+                          gamma_,
+                          intercept_,
+                          rbf_,
+                          decisions_,
+                          stream);
+    decisions_.download(decisions_cpu_, stream);
+    stream.waitForCompletion();
+
+    result.grid = kernels::floorPatchGrid(target_size_, feature_params_);
+    result.have_line = false;
+    result.line = cv::Vec2d(0, 0);
+    result.line_offset = 0;
+    result.failed_checks = false;
+
+    const cv::Mat decisions = decisions_cpu_.createMatHeader();
+    const int patch_pixels = feature_params_.average_size
+                           * feature_params_.stride;
+    const int center = ((feature_params_.average_size - 1)
+                            * feature_params_.stride
+                      + feature_params_.kernel_size) / 2;
+    for (int row = 0; row < result.grid.height; row++) {
+        for (int col = 0; col < result.grid.width; col++) {
+            result.points.emplace_back(col * patch_pixels + center,
+                                       row * patch_pixels + center);
+            result.anti_floor.push_back(
+                    decisions.at<float>(0, row * result.grid.width + col)
+                  > 0);
+        }
+    }
+}
+
+bool FloorDetector::fitBoundary(FrameResult& result) const
+{
+    const size_t anti_floor_count = std::count(result.anti_floor.begin(),
+                                               result.anti_floor.end(),
+                                               true);
+    if (anti_floor_count == 0
+     || anti_floor_count == result.anti_floor.size()) {
+        return false;
+    }
+
+    std::vector<int> labels;
+    for (bool anti_floor : result.anti_floor) {
+        labels.push_back(anti_floor ? 1 : -1);
+    }
+    fitLinearSvm(result.points,
+                 labels,
+                 settings_.boundary_svm_c,
+                 result.line,
+                 result.line_offset);
+    result.have_line = true;
+
+    int floor_side = 0;
+    int floor_side_floor = 0;
+    int anti_side = 0;
+    int anti_side_anti = 0;
+    int anti_side_anti_on_edge = 0;
+    for (size_t i = 0; i < result.points.size(); i++) {
+        const cv::Point2f& p = result.points[i];
+        if (result.line[0] * p.x + result.line[1] * p.y + result.line_offset
+                <= 0) {
+            floor_side++;
+            floor_side_floor += !result.anti_floor[i];
+            continue;
+        }
+
+        anti_side++;
+        if (result.anti_floor[i]) {
+            anti_side_anti++;
+
+            const int row = static_cast<int>(i) / result.grid.width;
+            const int col = static_cast<int>(i) % result.grid.width;
+            anti_side_anti_on_edge += row == 0
+                                   || col == 0
+                                   || row == result.grid.height - 1
+                                   || col == result.grid.width - 1;
+        }
+    }
+
+    const bool passed
+        = floor_side >= settings_.min_floor_patches
+       && floor_side_floor
+              >= settings_.min_floor_appearance_ratio * floor_side
+       && anti_side >= settings_.min_anti_floor_patches
+       && anti_side_anti
+              >= settings_.min_anti_floor_appearance_ratio * anti_side
+       && anti_side_anti_on_edge >= settings_.min_anti_floor_on_edge;
+    result.failed_checks = !passed;
+    return passed;
+}
+
+bool FloorDetector::locateBoundary(
+        const FrameResult& result,
+        const cv::Rect& crop,
+        const cv::Size& level_size,
+        const geometry_msgs::TransformStamped& camera_to_map,
+        Detection& detection) const
+{
+    // Where the boundary crosses the edges of the image
+    const double width = target_size_.width;
+    const double height = target_size_.height;
+    const cv::Vec2d& n = result.line;
+    const double offset = result.line_offset;
+
+    std::vector<cv::Point2d> crossings;
+    if (std::abs(n[1]) > std::numeric_limits<double>::epsilon()) {
+        for (double x : {0.0, width}) {
+            const double y = -(offset + n[0] * x) / n[1];
+            if (y >= 0 && y <= height) {
+                crossings.emplace_back(x, y);
+            }
+        }
+    }
+    if (std::abs(n[0]) > std::numeric_limits<double>::epsilon()) {
+        for (double y : {0.0, height}) {
+            const double x = -(offset + n[1] * y) / n[0];
+            if (x >= 0 && x <= width) {
+                crossings.emplace_back(x, y);
+            }
+        }
+    }
+
+    // A crossing through a corner shows up twice
+    cv::Point2d start;
+    cv::Point2d end;
+    double max_distance = 0;
+    for (size_t i = 0; i < crossings.size(); i++) {
+        for (size_t j = i + 1; j < crossings.size(); j++) {
+            const double distance = cv::norm(crossings[i] - crossings[j]);
+            if (distance > max_distance) {
+                max_distance = distance;
+                start = crossings[i];
+                end = crossings[j];
+            }
+        }
+    }
+    if (max_distance == 0) {
+        return false;
+    }
+
+    // Middle of the floor side, to tell which way the boundary faces
+    cv::Point2d floor_middle(0, 0);
+    int floor_count = 0;
+    for (size_t i = 0; i < result.points.size(); i++) {
+        const cv::Point2f& p = result.points[i];
+        if (n[0] * p.x + n[1] * p.y + offset <= 0) {
+            floor_middle += cv::Point2d(p.x, p.y);
+            floor_count++;
+        }
+    }
+    if (floor_count == 0) {
+        return false;
+    }
+    floor_middle *= 1.0 / floor_count;
+
+    // Pixels of the target size image onto the floor, through the pinhole
+    // model of the level it was cropped from
+    const double focal_length
+        = std::hypot(level_size.width, level_size.height)
+        / (2 * std::tan(settings_.afov / 2));
+    const double scale_x = crop.width / width;
+    const double scale_y = crop.height / height;
+    const geometry_msgs::Vector3& camera_position
+        = camera_to_map.transform.translation;
+    const auto project = [&](const cv::Point2d& pixel,
+                             geometry_msgs::Point& point) {
+        geometry_msgs::Vector3Stamped camera_ray;
+        camera_ray.vector.x = crop.x + pixel.x * scale_x
+                            - level_size.width / 2.0;
+        camera_ray.vector.y = crop.y + pixel.y * scale_y
+                            - level_size.height / 2.0;
+        camera_ray.vector.z = focal_length;
+
+        geometry_msgs::Vector3Stamped map_ray;
+        tf2::doTransform(camera_ray, map_ray, camera_to_map);
+        if (map_ray.vector.z >= 0) {
+            return false;
+        }
+
+        const double ray_scale = camera_position.z / -map_ray.vector.z;
+        point.x = camera_position.x + map_ray.vector.x * ray_scale;
+        point.y = camera_position.y + map_ray.vector.y * ray_scale;
+        point.z = 0;
+        return true;
+    };
+
+    geometry_msgs::Point map_start;
+    geometry_msgs::Point map_end;
+    geometry_msgs::Point map_center;
+    geometry_msgs::Point map_floor;
+    if (!project(start, map_start)
+     || !project(end, map_end)
+     || !project((start + end) * 0.5, map_center)
+     || !project(floor_middle, map_floor)) {
+        return false;
+    }
+
+    // Walls run along one of the map axes, so a boundary within 45 degrees
+    // of x is on the left or right
+    if (std::abs(map_end.x - map_start.x)
+            >= std::abs(map_end.y - map_start.y)) {
+        detection.type = map_floor.y < map_center.y
+                       ? iarc7_msgs::Boundary::left
+                       : iarc7_msgs::Boundary::right;
+        detection.position = map_center.y;
+    } else {
+        detection.type = map_floor.x < map_center.x
+                       ? iarc7_msgs::Boundary::top
+                       : iarc7_msgs::Boundary::bottom;
+        detection.position = map_center.x;
+    }
+
+    if (line_marker_pub_.getNumSubscribers() > 0) {
+        visualization_msgs::Marker marker;
+        marker.header.frame_id = "map";
+        marker.header.stamp = detection.stamp;
+        marker.type = visualization_msgs::Marker::LINE_STRIP;
+        marker.action = visualization_msgs::Marker::ADD;
+        marker.pose.orientation.w = 1;
+        marker.scale.x = 0.1;
+        marker.color.a = 1;
+        marker.color.r = 1;
+        marker.points.push_back(map_start);
+        marker.points.push_back(map_end);
+        line_marker_pub_.publish(marker);
+    }
+
+    return true;
+}
+
+void FloorDetector::filterDetections(const Detection& detection)
+{
+    // Time jumped back, e.g. a bag started over
+    if (!detections_.empty() && detections_.back().stamp > detection.stamp) {
+        detections_.clear();
+    }
+
+    detections_.push_back(detection);
+    while ((detection.stamp - detections_.front().stamp).toSec()
+               >= settings_.max_detection_lag
+        || detections_.size()
+               > static_cast<size_t>(settings_.max_detections_queued)) {
+        detections_.pop_front();
+    }
+
+    if (detections_.size()
+            < static_cast<size_t>(settings_.min_boundary_detections)) {
+        return;
+    }
+
+    for (uint8_t type : {iarc7_msgs::Boundary::left,
+                         iarc7_msgs::Boundary::right,
+                         iarc7_msgs::Boundary::top,
+                         iarc7_msgs::Boundary::bottom}) {
+        int count = 0;
+        double sum = 0;
+        double sum_squares = 0;
+        for (const Detection& d : detections_) {
+            if (d.found && d.type == type) {
+                count++;
+                sum += d.position;
+                sum_squares += d.position * d.position;
+            }
+        }
+
+        if (count < settings_.min_boundary_detections) {
+            continue;
+        }
+
+        const double mean = sum / count;
+        const double variance = sum_squares / count - mean * mean;
+        if (variance > settings_.max_boundary_std_dev
+                     * settings_.max_boundary_std_dev) {
+            continue;
+        }
+
+        iarc7_msgs::Boundary boundary;
+        boundary.header.stamp = detection.stamp;
+        boundary.boundary_type = type;
+        boundary.position = mean;
+        boundary_pub_.publish(boundary);
+
+        publishBoundaryMarker(type, mean);
+    }
+}
+
+void FloorDetector::publishBoundaryMarker(uint8_t type, double position)
+{
+    if (boundary_marker_pub_.getNumSubscribers() == 0) {
+        return;
+    }
+
+    constexpr double kLineLength = 100;
+
+    visualization_msgs::Marker marker;
+    marker.header.frame_id = "map";
+    marker.header.stamp = ros::Time::now();
+    marker.type = visualization_msgs::Marker::LINE_STRIP;
+    marker.action = visualization_msgs::Marker::ADD;
+    marker.pose.orientation.w = 1;
+    marker.scale.x = 0.05;
+    marker.color.a = 1;
+    marker.color.g = 1;
+
+    geometry_msgs::Point start;
+    geometry_msgs::Point end;
+    if (type == iarc7_msgs::Boundary::left
+     || type == iarc7_msgs::Boundary::right) {
+        start.x = -kLineLength;
+        end.x = kLineLength;
+        start.y = end.y = position;
+    } else {
+        start.x = end.x = position;
+        start.y = -kLineLength;
+        end.y = kLineLength;
+    }
+    marker.points.push_back(start);
+    marker.points.push_back(end);
+    boundary_marker_pub_.publish(marker);
+}
+
+void FloorDetector::publishDebugImage(const FrameResult& result,
+                                      const ros::Time& time,
+                                      cv::cuda::Stream& stream)
+{
+    if (!debug_image_pub_.wanted()) {
+        return;
+    }
+
+    cv::Mat resized;
+    resized_.download(resized, stream);
+    stream.waitForCompletion();
+
+    std_msgs::Header header;
+    header.stamp = time;
+
+    const int patch_pixels = feature_params_.average_size
+                           * feature_params_.stride;
+    const int block_size = (feature_params_.average_size - 1)
+                             * feature_params_.stride
+                         + 1;
+    const int block_offset = feature_params_.kernel_size / 2;
+
+    debug_image_pub_.publish(
+            header,
+            sensor_msgs::image_encodings::RGB8,
+            [resized, result, patch_pixels, block_size, block_offset]() {
+                cv::Mat image = resized / 2;
+
+                // Floor patches tinted green, the rest red
+                for (int row = 0; row < result.grid.height; row++) {
+                    for (int col = 0; col < result.grid.width; col++) {
+                        const bool anti_floor
+                            = result.anti_floor[row * result.grid.width + col];
+                        const cv::Rect block
+                            = cv::Rect(col * patch_pixels + block_offset,
+                                       row * patch_pixels + block_offset,
+                                       block_size,
+                                       block_size)
+                            & cv::Rect(cv::Point(0, 0), image.size());
+                        for (int y = block.y; y < block.y + block.height; y++) {
+                            for (int x = block.x;
+                                 x < block.x + block.width;
+                                 x++) {
+                                image.at<cv::Vec3b>(y, x)[anti_floor ? 0 : 1]
+                                    = 200;
+                            }
+                        }
+                    }
+                }
+
+                for (const cv::Point2f& p : result.points) {
+                    image.at<cv::Vec3b>(p) = cv::Vec3b(0, 0, 0);
+                }
+
+                if (result.have_line) {
+                    // Two points far enough apart the line crosses the
+                    // whole image
+                    const cv::Vec2d& n = result.line;
+                    const double norm_squared = n.dot(n);
+                    if (norm_squared > 0) {
+                        const cv::Point2d on_line
+                            = cv::Point2d(n[0], n[1])
+                            * (-result.line_offset / norm_squared);
+                        const cv::Point2d direction
+                            = cv::Point2d(-n[1], n[0])
+                            * (2.0 * (image.cols + image.rows)
+                               / std::sqrt(norm_squared));
+                        cv::line(image,
+                                 on_line - direction,
+                                 on_line + direction,
+                                 cv::Scalar(0, 0, 255));
+                    }
+                }
+
+                if (result.failed_checks) {
+                    cv::putText(image,
+                                "No edge",
+                                cv::Point(2, 15),
+                                cv::FONT_HERSHEY_PLAIN,
+                                1,
+                                cv::Scalar(255, 255, 255));
+                }
+
+                return image;
+            });
+}
+
+} // namespace iarc7_vision
@@ -0,0 +1,258 @@
+#include "iarc7_vision/GpuBufferPool.hpp"
+
+#include <algorithm>
+
+#include <opencv2/core/cuda_stream_accessor.hpp>
+#include <ros/ros.h>
+
+namespace iarc7_vision {
+
+namespace {
+
+size_t alignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+} // namespace
+
+GpuBufferPool::GpuBufferPool(size_t max_cached_bytes)
+    : max_cached_bytes_(max_cached_bytes),
+      pitch_alignment_(512),
+      mutex_(),
+      streams_{cudaStream_t(0)},
+      spare_events_(),
+      free_buffers_(),
+      used_buffers_(),
+      stats_()
+{
+    int device;
+    int alignment;
+    if (cudaGetDevice(&device) == cudaSuccess
+     && cudaDeviceGetAttribute(&alignment,
+                               cudaDevAttrTexturePitchAlignment,
+                               device) == cudaSuccess) {
+        // Same alignment cudaMallocPitch gives, so rows stay usable as
+        // textures
+        pitch_alignment_ = alignment;
+    }
+}
+
+GpuBufferPool::~GpuBufferPool()
+{
+    if (cv::cuda::GpuMat::defaultAllocator() == this) {
+        cv::cuda::GpuMat::setDefaultAllocator(
+                cv::cuda::GpuMat::getStdAllocator());
+    }
+
+    clearCache();
+    for (cudaEvent_t event : spare_events_) {
+        cudaEventDestroy(event);
+    }
+
+    if (!used_buffers_.empty()) {
+        ROS_ERROR("GpuBufferPool destroyed with %lu buffers still in use",
+                  used_buffers_.size());
+    }
+}
+
+void GpuBufferPool::install()
+{
+    cv::cuda::GpuMat::setDefaultAllocator(this);
+}
+
+void GpuBufferPool::addStream(const cv::cuda::Stream& stream)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const cudaStream_t cuda_stream
+        = cv::cuda::StreamAccessor::getStream(stream);
+    if (std::find(streams_.begin(), streams_.end(), cuda_stream)
+            == streams_.end()) {
+        streams_.push_back(cuda_stream);
+    }
+}
+
+void GpuBufferPool::reserve(int rows,
+                            int cols,
+                            size_t elem_size,
+                            size_t count)
+{
+    size_t step;
+    const size_t size = getSize(rows, cols, elem_size, step);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < count; i++) {
+        if (stats_.cached_bytes + size > max_cached_bytes_) {
+            ROS_WARN("GpuBufferPool: only reserved %lu of %lu %dx%d buffers",
+                     i, count, cols, rows);
+            return;
+        }
+
+        void* data = nullptr;
+        if (cudaMalloc(&data, size) != cudaSuccess) {
+            cudaGetLastError();
+            ROS_WARN("GpuBufferPool: only reserved %lu of %lu %dx%d buffers",
+                     i, count, cols, rows);
+            return;
+        }
+
+        // Nothing has used it yet, so no events to wait on
+        free_buffers_.emplace(size, FreeBuffer{data, {}});
+        stats_.cached_bytes += size;
+    }
+}
+
+size_t GpuBufferPool::getSize(int rows,
+                              int cols,
+                              size_t elem_size,
+                              size_t& step) const
+{
+    // Same layout as the default allocator, pitched unless it's a vector
+    step = rows > 1 && cols > 1
+         ? alignUp(elem_size * cols, pitch_alignment_)
+         : elem_size * cols;
+    return step * rows;
+}
+
+bool GpuBufferPool::allocate(cv::cuda::GpuMat* mat,
+                             int rows,
+                             int cols,
+                             size_t elem_size)
+{
+    size_t step;
+    const size_t size = getSize(rows, cols, elem_size, step);
+
+    size_t actual_size;
+    void* data = take(size, actual_size);
+    if (data == nullptr) {
+        return false;
+    }
+
+    mat->data = static_cast<uchar*>(data);
+    mat->step = step;
+    mat->refcount = static_cast<int*>(cv::fastMalloc(sizeof(int)));
+    return true;
+}
+
+void GpuBufferPool::free(cv::cuda::GpuMat* mat)
+{
+    void* data = mat->datastart;
+    cv::fastFree(mat->refcount);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto used = used_buffers_.find(data);
+    ROS_ASSERT(used != used_buffers_.end());
+    const size_t size = used->second;
+    used_buffers_.erase(used);
+    stats_.in_use_bytes -= size;
+
+    if (stats_.cached_bytes + size > max_cached_bytes_) {
+        cudaFree(data);
+        return;
+    }
+
+    FreeBuffer buffer {data, {}};
+    recordRelease(buffer.released);
+    free_buffers_.emplace(size, std::move(buffer));
+    stats_.cached_bytes += size;
+}
+
+GpuBufferPoolStats GpuBufferPool::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void* GpuBufferPool::take(size_t size, size_t& actual_size)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Don't hand out buffers much bigger than requested, or a big buffer
+    // would get stuck serving small requests.  Buffers still in use by
+    // work queued before they were released are skipped.
+    for (auto cached = free_buffers_.lower_bound(size);
+         cached != free_buffers_.end() && cached->first <= 2 * size;
+         ++cached) {
+        if (!releaseDone(cached->second)) {
+            continue;
+        }
+
+        void* data = cached->second.data;
+        actual_size = cached->first;
+        recycleEvents(cached->second);
+        free_buffers_.erase(cached);
+        stats_.cached_bytes -= actual_size;
+
+        used_buffers_.emplace(data, actual_size);
+        stats_.in_use_bytes += actual_size;
+        stats_.hits++;
+        return data;
+    }
+
+    void* data = nullptr;
+    if (cudaMalloc(&data, size) != cudaSuccess) {
+        // Give the cached buffers back to the device and try again
+        cudaGetLastError();
+        clearCache();
+
+        if (cudaMalloc(&data, size) != cudaSuccess) {
+            cudaGetLastError();
+            return nullptr;
+        }
+    }
+
+    actual_size = size;
+    used_buffers_.emplace(data, actual_size);
+    stats_.in_use_bytes += actual_size;
+    stats_.misses++;
+    return data;
+}
+
+void GpuBufferPool::recordRelease(std::vector<cudaEvent_t>& events)
+{
+    events.reserve(streams_.size());
+    for (cudaStream_t stream : streams_) {
+        cudaEvent_t event;
+        if (!spare_events_.empty()) {
+            event = spare_events_.back();
+            spare_events_.pop_back();
+        } else {
+            ROS_ASSERT(cudaEventCreateWithFlags(&event, cudaEventDisableTiming)
+                    == cudaSuccess);
+        }
+
+        ROS_ASSERT(cudaEventRecord(event, stream) == cudaSuccess);
+        events.push_back(event);
+    }
+}
+
+bool GpuBufferPool::releaseDone(const FreeBuffer& buffer) const
+{
+    for (cudaEvent_t event : buffer.released) {
+        if (cudaEventQuery(event) == cudaErrorNotReady) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void GpuBufferPool::recycleEvents(FreeBuffer& buffer)
+{
+    spare_events_.insert(spare_events_.end(),
+                         buffer.released.begin(),
+                         buffer.released.end());
+    buffer.released.clear();
+}
+
+void GpuBufferPool::clearCache()
+{
+    // cudaFree waits for the device, so the events don't need checking
+    for (auto& buffer : free_buffers_) {
+        cudaFree(buffer.second.data);
+        recycleEvents(buffer.second);
+    }
+    free_buffers_.clear();
+    stats_.cached_bytes = 0;
+}
+
+} // namespace iarc7_vision
@@ -0,0 +1,162 @@
+#include "iarc7_vision/GpuScheduler.hpp"
+
+#include <cuda_runtime.h>
+#include <opencv2/core/cuda_stream_accessor.hpp>
+#include <ros/ros.h>
+
+namespace iarc7_vision {
+
+GpuScheduler::Lease::Lease()
+    : scheduler_(nullptr),
+      index_(0)
+{
+}
+
+GpuScheduler::Lease::Lease(GpuScheduler& scheduler, size_t index)
+    : scheduler_(&scheduler),
+      index_(index)
+{
+}
+
+GpuScheduler::Lease::Lease(Lease&& other)
+    : scheduler_(other.scheduler_),
+      index_(other.index_)
+{
+    other.scheduler_ = nullptr;
+}
+
+GpuScheduler::Lease& GpuScheduler::Lease::operator=(Lease&& other)
+{
+    if (this != &other) {
+        release();
+        scheduler_ = other.scheduler_;
+        index_ = other.index_;
+        other.scheduler_ = nullptr;
+    }
+    return *this;
+}
+
+GpuScheduler::Lease::~Lease()
+{
+    release();
+}
+
+cv::cuda::Stream& GpuScheduler::Lease::stream() const
+{
+    ROS_ASSERT(scheduler_ != nullptr);
+    return scheduler_->streams_[index_];
+}
+
+void GpuScheduler::Lease::release()
+{
+    if (scheduler_ != nullptr) {
+        scheduler_->release(index_);
+        scheduler_ = nullptr;
+    }
+}
+
+GpuScheduler::GpuScheduler(size_t num_streams)
+    : streams_(),
+      mutex_(),
+      released_cv_(),
+      leased_(num_streams, false),
+      latency_waiting_(0)
+{
+    ROS_ASSERT_MSG(num_streams >= 1, "GpuScheduler needs at least one stream");
+
+    // Lower numbers are higher priorities
+    int least_priority = 0;
+    int greatest_priority = 0;
+    if (num_streams > 1) {
+        ROS_ASSERT(cudaDeviceGetStreamPriorityRange(&least_priority,
+                                                    &greatest_priority)
+                == cudaSuccess);
+    }
+
+    streams_.reserve(num_streams);
+    for (size_t i = 0; i < num_streams; i++) {
+        const int priority = i == 0 ? greatest_priority : least_priority;
+
+        cudaStream_t stream;
+        const cudaError_t result = cudaStreamCreateWithPriority(
+                &stream,
+                cudaStreamNonBlocking,
+                priority);
+        ROS_ASSERT_MSG(result == cudaSuccess,
+                       "GpuScheduler failed to create a stream: %s",
+                       cudaGetErrorString(result));
+
+        // The wrapper doesn't own the stream, it's destroyed with the
+        // scheduler
+        streams_.push_back(cv::cuda::StreamAccessor::wrapStream(stream));
+    }
+}
+
+GpuScheduler::~GpuScheduler()
+{
+    for (size_t i = 0; i < streams_.size(); i++) {
+        if (leased_[i]) {
+            ROS_ERROR("GpuScheduler destroyed with stream %lu still leased",
+                      i);
+        }
+
+        cudaStream_t stream = cv::cuda::StreamAccessor::getStream(streams_[i]);
+        cudaStreamSynchronize(stream);
+        cudaStreamDestroy(stream);
+    }
+}
+
+GpuScheduler::Lease GpuScheduler::acquire(GpuPriority priority)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    size_t index = findFree(priority);
+    if (index == streams_.size()) {
+        if (priority == GpuPriority::Latency) {
+            latency_waiting_++;
+            released_cv_.wait(lock, [&]() {
+                index = findFree(priority);
+                return index != streams_.size();
+            });
+            latency_waiting_--;
+        } else {
+            released_cv_.wait(lock, [&]() {
+                if (latency_waiting_ > 0) {
+                    return false;
+                }
+                index = findFree(priority);
+                return index != streams_.size();
+            });
+        }
+    }
+
+    leased_[index] = true;
+    return Lease(*this, index);
+}
+
+size_t GpuScheduler::findFree(GpuPriority priority) const
+{
+    // The first stream is kept for latency stages, unless it's the only one
+    const size_t first = priority == GpuPriority::Latency
+                      || streams_.size() == 1
+                       ? 0
+                       : 1;
+    for (size_t i = first; i < streams_.size(); i++) {
+        if (!leased_[i]) {
+            return i;
+        }
+    }
+    return streams_.size();
+}
+
+void GpuScheduler::release(size_t index)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ROS_ASSERT(leased_[index]);
+        leased_[index] = false;
+    }
+    released_cv_.notify_all();
+}
+
+} // namespace iarc7_vision
@@ -1,11 +1,6 @@
 #include "iarc7_vision/GridLineEstimator.hpp"
 
 // BAD HEADERS
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#include <cv_bridge/cv_bridge.h>
-#pragma GCC diagnostic pop
-
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 #pragma GCC diagnostic ignored "-Wignored-attributes"
@@ -21,12 +16,12 @@
 #include <iterator>
 #include <limits>
 #include <ros/ros.h>
-#include <ros_utils/SafeTransformWrapper.hpp>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
 #include <geometry_msgs/Vector3Stamped.h>
 #include <iarc7_msgs/Float64Stamped.h>
+#include <sensor_msgs/image_encodings.h>
 #include <visualization_msgs/Marker.h>
 
 static void drawLines(const std::vector<cv::Vec2f>& lines, cv::Mat image)
@@ -72,13 +67,19 @@ GridLineEstimator::GridLineEstimator(
         const LineExtractorSettings& line_extractor_settings,
         const GridEstimatorSettings& grid_estimator_settings,
         const GridLineDebugSettings& debug_settings,
-        const std::string& expected_image_format)
+        const std::string& expected_image_format,
+        const TransformSource& transform_source,
+        const std::string& camera_frame)
     : line_extractor_settings_(line_extractor_settings),
+      staged_settings_(),
       grid_estimator_settings_(grid_estimator_settings),
       debug_settings_(debug_settings),
       gpu_canny_edge_detector_(),
       gpu_hough_lines_detector_(),
-      transform_wrapper_()
+      line_image_width_(0),
+      line_image_width_per_height_(0),
+      transform_source_(transform_source),
+      camera_frame_(camera_frame)
 {
     ros::NodeHandle local_nh ("grid_line_estimator");
 
@@ -88,11 +89,13 @@ GridLineEstimator::GridLineEstimator(
     }
 
     if (debug_settings_.debug_edges) {
-        debug_edges_pub_ = local_nh.advertise<sensor_msgs::Image>("edges", 10);
+        debug_edges_pub_.reset(new DebugImagePublisher(
+                local_nh, "edges", debug_settings_.debug_image_max_rate));
     }
 
     if (debug_settings_.debug_lines) {
-        debug_lines_pub_ = local_nh.advertise<sensor_msgs::Image>("lines", 10);
+        debug_lines_pub_.reset(new DebugImagePublisher(
+                local_nh, "lines", debug_settings_.debug_image_max_rate));
     }
 
     if (debug_settings_.debug_line_markers) {
@@ -134,31 +137,59 @@ GridLineEstimator::GridLineEstimator(
     }
 }
 
-bool __attribute__((warn_unused_result))
-        GridLineEstimator::onSettingsChanged()
+void GridLineEstimator::stageSettings(const LineExtractorSettings& settings)
+{
+    staged_settings_.post(std::make_shared<LineExtractorSettings>(
+                settings));
+}
+
+void GridLineEstimator::applyStagedSettings()
 {
-    // Update the settings in the canny edgy detector
-    gpu_canny_edge_detector_->setLowThreshold(
-        line_extractor_settings_.canny_low_threshold);
-    gpu_canny_edge_detector_->setHighThreshold(
-        line_extractor_settings_.canny_high_threshold);
-    gpu_canny_edge_detector_->setAppertureSize(
-        line_extractor_settings_.canny_sobel_size);
-
-    // Update the settings in the hough lines detector
+    const std::shared_ptr<const LineExtractorSettings> staged
+        = staged_settings_.take();
+    if (staged == nullptr) {
+        return;
+    }
+
+    const LineExtractorSettings old_settings = line_extractor_settings_;
+    line_extractor_settings_ = *staged;
+
+    // The detectors are updated in place, nothing is reallocated.
     // Threshold does not need to be set here because it is recalculated
     // for every image based on the current height
-    gpu_hough_lines_detector_->setRho(
-        line_extractor_settings_.hough_rho_resolution);
-    gpu_hough_lines_detector_->setTheta(
-        line_extractor_settings_.hough_theta_resolution);
-
-    return true;
+    if (line_extractor_settings_.canny_low_threshold
+            != old_settings.canny_low_threshold) {
+        gpu_canny_edge_detector_->setLowThreshold(
+            line_extractor_settings_.canny_low_threshold);
+    }
+    if (line_extractor_settings_.canny_high_threshold
+            != old_settings.canny_high_threshold) {
+        gpu_canny_edge_detector_->setHighThreshold(
+            line_extractor_settings_.canny_high_threshold);
+    }
+    if (line_extractor_settings_.canny_sobel_size
+            != old_settings.canny_sobel_size) {
+        gpu_canny_edge_detector_->setAppertureSize(
+            line_extractor_settings_.canny_sobel_size);
+    }
+    if (line_extractor_settings_.hough_rho_resolution
+            != old_settings.hough_rho_resolution) {
+        gpu_hough_lines_detector_->setRho(
+            line_extractor_settings_.hough_rho_resolution);
+    }
+    if (line_extractor_settings_.hough_theta_resolution
+            != old_settings.hough_theta_resolution) {
+        gpu_hough_lines_detector_->setTheta(
+            line_extractor_settings_.hough_theta_resolution);
+    }
 }
 
 void GridLineEstimator::update(const cv::cuda::GpuMat& image,
-                               const ros::Time& time)
+                               const ros::Time& time,
+                               cv::cuda::Stream& stream)
 {
+    applyStagedSettings();
+
     if (time <= last_update_time_) {
         ROS_ERROR("Tried to process message with stamp before previous update");
     }
@@ -185,7 +216,7 @@ void GridLineEstimator::update(const cv::cuda::GpuMat& image,
     if (last_filtered_position_(2)
             >= grid_estimator_settings_.min_extraction_altitude) {
         try {
-            processImage(image, time);
+            processImage(image, time, stream);
         } catch (const std::exception& ex) {
             ROS_ERROR_STREAM("Caught exception processing image: "
                           << ex.what());
@@ -205,7 +236,7 @@ void GridLineEstimator::update(const cv::cuda::GpuMat& image,
 double GridLineEstimator::getCurrentTheta(const ros::Time& time) const
 {
     geometry_msgs::TransformStamped q_lq_tf;
-    if (!transform_wrapper_.getTransformAtTime(q_lq_tf,
+    if (!transform_source_.getTransformAtTime(q_lq_tf,
                                                "level_quad",
                                                "quad",
                                                time,
@@ -239,7 +270,8 @@ double GridLineEstimator::getFocalLength(const cv::Size& img_size, double fov)
 
 void GridLineEstimator::getLines(std::vector<cv::Vec2f>& lines,
                                  const cv::cuda::GpuMat& image,
-                                 double height) const
+                                 double height,
+                                 cv::cuda::Stream& stream) const
 {
     // m/px = camera_height / focal_length;
     double current_meters_per_px = height
@@ -264,21 +296,37 @@ void GridLineEstimator::getLines(std::vector<cv::Vec2f>& lines,
                      gpu_image_sized,
                      cv::Size(),
                      scale_factor,
-                     scale_factor);
-    cv::cuda::cvtColor(gpu_image_sized, gpu_image_hsv, hsv_conversion_constant_);
+                     scale_factor,
+                     cv::INTER_LINEAR,
+                     stream);
+    line_image_width_ = gpu_image_sized.cols;
+    if (height > 0) {
+        line_image_width_per_height_ = gpu_image_sized.cols / height;
+    }
+    cv::cuda::cvtColor(gpu_image_sized,
+                       gpu_image_hsv,
+                       hsv_conversion_constant_,
+                       0,
+                       stream);
 
-    cv::cuda::split(gpu_image_hsv, gpu_image_hsv_channels);
+    cv::cuda::split(gpu_image_hsv, gpu_image_hsv_channels, stream);
 
-    gpu_canny_edge_detector_->detect(gpu_image_hsv_channels[2], gpu_image_edges);
+    gpu_canny_edge_detector_->detect(gpu_image_hsv_channels[2],
+                                     gpu_image_edges,
+                                     stream);
 
     double hough_threshold = gpu_image_edges.size().height
                            * line_extractor_settings_.hough_thresh_fraction;
 
     gpu_hough_lines_detector_->setThreshold(hough_threshold);
 
-    gpu_hough_lines_detector_->detect(gpu_image_edges, gpu_lines);
+    gpu_hough_lines_detector_->detect(gpu_image_edges, gpu_lines, stream);
 
-    gpu_hough_lines_detector_->downloadResults(gpu_lines, lines);
+    gpu_hough_lines_detector_->downloadResults(gpu_lines,
+                                               lines,
+                                               cv::noArray(),
+                                               stream);
+    stream.waitForCompletion();
 
     // rescale lines back to original image size
     for (cv::Vec2f& line : lines) {
@@ -294,30 +342,27 @@ void GridLineEstimator::getLines(std::vector<cv::Vec2f>& lines,
         line[0] -= corner_to_center.dot(normal_dir);
     }
 
-    if (debug_settings_.debug_edges) {
+    if (debug_edges_pub_ && debug_edges_pub_->wanted()) {
         cv::Mat image_edges;
-        gpu_image_edges.download(image_edges);
-
-        cv_bridge::CvImage cv_image {
-            std_msgs::Header(),
-            sensor_msgs::image_encodings::MONO8,
-            image_edges
-        };
+        gpu_image_edges.download(image_edges, stream);
+        stream.waitForCompletion();
 
-        debug_edges_pub_.publish(cv_image.toImageMsg());
+        debug_edges_pub_->publish(std_msgs::Header(),
+                                  sensor_msgs::image_encodings::MONO8,
+                                  [image_edges]() { return image_edges; });
     }
 
-    if (debug_settings_.debug_lines) {
+    if (debug_lines_pub_ && debug_lines_pub_->wanted()) {
         cv::Mat image_lines;
-        image.download(image_lines);
+        image.download(image_lines, stream);
+        stream.waitForCompletion();
 
-        drawLines(lines, image_lines);
-        cv_bridge::CvImage cv_image {
-            std_msgs::Header(),
-            image_encoding_,
-            image_lines
-        };
-        debug_lines_pub_.publish(cv_image.toImageMsg());
+        debug_lines_pub_->publish(std_msgs::Header(),
+                                  image_encoding_,
+                                  [lines, image_lines]() {
+                                      drawLines(lines, image_lines);
+                                      return image_lines;
+                                  });
     }
 }
 
@@ -328,9 +373,9 @@ void GridLineEstimator::getPlanesForImageLines(
         std::vector<Eigen::Vector3d>& pl_normals) const
 {
     geometry_msgs::TransformStamped camera_to_lq_transform;
-    if (!transform_wrapper_.getTransformAtTime(camera_to_lq_transform,
+    if (!transform_source_.getTransformAtTime(camera_to_lq_transform,
                                                "level_quad",
-                                               "bottom_camera_rgb_optical_frame",
+                                               camera_frame_,
                                                time,
                                                ros::Duration(1.0))) {
         throw ros::Exception("Failed to fetch transform");
@@ -381,6 +426,70 @@ void GridLineEstimator::getPlanesForImageLines(
     }
 }
 
+double GridLineEstimator::circularLeastSquaresMin(
+        const std::vector<double>& candidates,
+        size_t per_point,
+        double period)
+{
+    struct Switch {
+        double s;
+        double from;
+        double to;
+    };
+
+    const double n = candidates.size() / per_point;
+    double sum = 0;
+    double sum_sq = 0;
+    std::vector<Switch> switches;
+    std::vector<double> extended(per_point + 2);
+    for (size_t i = 0; i < candidates.size(); i += per_point) {
+        std::copy(candidates.begin() + i,
+                  candidates.begin() + i + per_point,
+                  extended.begin() + 1);
+        std::sort(extended.begin() + 1, extended.end() - 1);
+        extended.front() = extended[per_point] - period;
+        extended.back() = extended[1] + period;
+
+        double nearest = extended[0];
+        for (size_t k = 0; k + 1 < extended.size(); k++) {
+            const double midpoint = (extended[k] + extended[k + 1]) / 2;
+            if (midpoint <= 0) {
+                nearest = extended[k + 1];
+            } else if (midpoint < period) {
+                switches.push_back({midpoint, extended[k], extended[k + 1]});
+            }
+        }
+
+        sum += nearest;
+        sum_sq += nearest * nearest;
+    }
+
+    std::sort(switches.begin(), switches.end(),
+              [](const Switch& a, const Switch& b) { return a.s < b.s; });
+
+    double best = 0;
+    double best_loss = std::numeric_limits<double>::max();
+    const auto check_piece = [&](double lower, double upper) {
+        const double s = std::min(std::max(sum / n, lower), upper);
+        const double loss = n * s * s - 2 * s * sum + sum_sq;
+        if (loss < best_loss) {
+            best_loss = loss;
+            best = s;
+        }
+    };
+
+    double lower = 0;
+    for (const Switch& change : switches) {
+        check_piece(lower, change.s);
+        sum += change.to - change.from;
+        sum_sq += change.to * change.to - change.from * change.from;
+        lower = change.s;
+    }
+    check_piece(lower, period);
+
+    return best >= period ? best - period : best;
+}
+
 double GridLineEstimator::getThetaForPlanes(
         const std::vector<Eigen::Vector3d>& pl_normals) const
 {
@@ -398,16 +507,21 @@ double GridLineEstimator::getThetaForPlanes(
         thetas.push_back(next_theta);
     }
 
-    // do a coarse sweep over angles from 0 to pi/2
     double best_coarse_theta = 0;
-    double best_coarse_theta_score = theta_loss(thetas, 0);
-    for (double theta = grid_estimator_settings_.theta_step;
-         theta < M_PI / 2;
-         theta += grid_estimator_settings_.theta_step) {
-        double theta_score = theta_loss(thetas, theta);
-        if (theta_score < best_coarse_theta_score) {
-            best_coarse_theta = theta;
-            best_coarse_theta_score = theta_score;
+    if (grid_estimator_settings_.exact_search) {
+        // theta_loss is the squared circular distance with period pi/2
+        best_coarse_theta = circularLeastSquaresMin(thetas, 1, M_PI / 2);
+    } else {
+        // do a coarse sweep over angles from 0 to pi/2
+        double best_coarse_theta_score = theta_loss(thetas, 0);
+        for (double theta = grid_estimator_settings_.theta_step;
+             theta < M_PI / 2;
+             theta += grid_estimator_settings_.theta_step) {
+            double theta_score = theta_loss(thetas, theta);
+            if (theta_score < best_coarse_theta_score) {
+                best_coarse_theta = theta;
+                best_coarse_theta_score = theta_score;
+            }
         }
     }
 
@@ -486,16 +600,37 @@ void GridLineEstimator::get1dGridShift(
     double grid_spacing = grid_estimator_settings_.grid_spacing;
     double line_thickness = grid_estimator_settings_.grid_line_thickness;
 
-    // Take coarse samples and use min cost one
-    double min_cost = std::numeric_limits<double>::max();
     double best_guess = -1;
-    for (double sample = 0;
-         sample < grid_spacing;
-         sample += grid_estimator_settings_.grid_step) {
-        double cost = gridLoss(wrapped_dists, sample);
-        if (cost < min_cost) {
-            min_cost = cost;
-            best_guess = sample;
+    if (grid_estimator_settings_.exact_search) {
+        // gridLoss is the squared circular distance from each line to the
+        // closer of the two edges of the gridline, or equivalently from the
+        // gridline center to the closer of dist -/+ line_thickness/2
+        std::vector<double> candidates;
+        candidates.reserve(2 * wrapped_dists.size());
+        for (double sample_dist : wrapped_dists) {
+            double smaller_dist = sample_dist - line_thickness/2;
+            if (smaller_dist < 0) {
+                smaller_dist += grid_spacing;
+            }
+            double larger_dist = sample_dist + line_thickness/2;
+            if (larger_dist >= grid_spacing) {
+                larger_dist -= grid_spacing;
+            }
+            candidates.push_back(smaller_dist);
+            candidates.push_back(larger_dist);
+        }
+        best_guess = circularLeastSquaresMin(candidates, 2, grid_spacing);
+    } else {
+        // Take coarse samples and use min cost one
+        double min_cost = std::numeric_limits<double>::max();
+        for (double sample = 0;
+             sample < grid_spacing;
+             sample += grid_estimator_settings_.grid_step) {
+            double cost = gridLoss(wrapped_dists, sample);
+            if (cost < min_cost) {
+                min_cost = cost;
+                best_guess = sample;
+            }
         }
     }
     if (best_guess < 0 || best_guess >= grid_spacing) {
@@ -720,13 +855,14 @@ double GridLineEstimator::gridLoss(const std::vector<double>& wrapped_dists,
 }
 
 void GridLineEstimator::processImage(const cv::cuda::GpuMat& image,
-                                     const ros::Time& time) const
+                                     const ros::Time& time,
+                                     cv::cuda::Stream& stream) const
 {
     const double height = last_filtered_position_(2);
 
     // Extract lines from image
     std::vector<cv::Vec2f> lines;
-    getLines(lines, image, height);
+    getLines(lines, image, height, stream);
     ROS_DEBUG("Number of lines extracted: %lu", lines.size());
 
     // Don't process further if we don't have any lines
@@ -740,7 +876,8 @@ void GridLineEstimator::processImage(const cv::cuda::GpuMat& image,
                                           line_extractor_settings_.fov),
                            pl_normals);
 
-    if (debug_settings_.debug_line_markers) {
+    if (debug_settings_.debug_line_markers
+            && debug_line_markers_pub_.getNumSubscribers() > 0) {
         publishLineMarkers(pl_normals, height, time);
     }
 
@@ -785,7 +922,8 @@ void GridLineEstimator::processLines(
                         std::abs(yaw - current_theta - 2*M_PI),
                         std::abs(yaw - current_theta + 2*M_PI)}));
 
-    if (debug_settings_.debug_direction) {
+    if (debug_settings_.debug_direction
+            && debug_direction_marker_pub_.getNumSubscribers() > 0) {
         publishDirectionMarker(yaw, time);
     }
 
@@ -833,16 +971,16 @@ void GridLineEstimator::processLines(
 
     // Publish updated position
     geometry_msgs::TransformStamped camera_to_lq_transform;
-    if (!transform_wrapper_.getTransformAtTime(camera_to_lq_transform,
+    if (!transform_source_.getTransformAtTime(camera_to_lq_transform,
                                                      "level_quad",
-                                                     "bottom_camera_rgb_optical_frame",
+                                                     camera_frame_,
                                                      time,
                                                      ros::Duration(1.0))) {
         throw ros::Exception(
-            "Failed to get transform from level_quad to bottom_camera_rgb_optical_frame");
+            "Failed to get transform from level_quad to " + camera_frame_);
     }
     geometry_msgs::PointStamped camera_position;
-    camera_position.header.frame_id = "bottom_camera_rgb_optical_frame";
+    camera_position.header.frame_id = camera_frame_;
     camera_position.point.x = 0;
     camera_position.point.y = 0;
     camera_position.point.z = 0;
@@ -1000,13 +1138,13 @@ void GridLineEstimator::splitLinesByOrientation(
 void GridLineEstimator::updateFilteredPosition(const ros::Time& time)
 {
     geometry_msgs::TransformStamped filtered_position_transform_stamped;
-    if (!transform_wrapper_.getTransformAtTime(
+    if (!transform_source_.getTransformAtTime(
             filtered_position_transform_stamped,
             "map",
-            "bottom_camera_rgb_optical_frame",
+            camera_frame_,
             time,
             ros::Duration(1.0))) {
-        ROS_ERROR("Failed to fetch transform to bottom_camera_rgb_optical_frame");
+        ROS_ERROR("Failed to fetch transform to %s", camera_frame_.c_str());
     } else {
         geometry_msgs::PointStamped camera_position;
         tf2::doTransform(camera_position,
@@ -1025,9 +1163,9 @@ void GridLineEstimator::updateFilteredPosition(const ros::Time& time)
 bool GridLineEstimator::waitUntilReady(const ros::Duration& timeout)
 {
     geometry_msgs::TransformStamped transform;
-    bool success = transform_wrapper_.getTransformAtTime(transform,
+    bool success = transform_source_.getTransformAtTime(transform,
                                                     "map",
-                                                    "bottom_camera_rgb_optical_frame",
+                                                    camera_frame_,
                                                     ros::Time(0),
                                                     timeout);
     if (!success)
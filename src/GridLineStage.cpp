@@ -0,0 +1,142 @@
+#include "iarc7_vision/GridLineStage.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace iarc7_vision {
+
+GridLineStage::GridLineStage(GridLineEstimator& estimator,
+                             int frame_interval,
+                             double max_position_stddev,
+                             GpuScheduler& scheduler)
+    : estimator_(estimator),
+      frame_interval_(frame_interval),
+      max_position_variance_(max_position_stddev * max_position_stddev),
+      scheduler_(scheduler),
+      frames_since_taken_(frame_interval),
+      position_variance_(0.0),
+      height_(0.0),
+      odometry_sub_(),
+      line_image_width_per_height_(0.0),
+      image_(),
+      image_time_(),
+      mutex_(),
+      image_cv_(),
+      busy_(false),
+      pending_(false),
+      shutdown_(false),
+      thread_()
+{
+    ROS_ASSERT(frame_interval_ >= 1);
+
+    ros::NodeHandle nh;
+    odometry_sub_ = nh.subscribe("/odometry/filtered",
+                                 1,
+                                 &GridLineStage::odometryCallback,
+                                 this);
+
+    thread_ = std::thread(&GridLineStage::run, this);
+}
+
+GridLineStage::~GridLineStage()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        shutdown_ = true;
+    }
+    image_cv_.notify_one();
+    thread_.join();
+}
+
+int GridLineStage::getTargetWidth() const
+{
+    const double width_per_height = line_image_width_per_height_.load();
+    const double height = height_.load();
+    if (width_per_height <= 0 || height <= 0) {
+        return 0;
+    }
+    return static_cast<int>(std::ceil(width_per_height * height));
+}
+
+bool GridLineStage::offer(ImagePyramid& pyramid,
+                          const cv::cuda::GpuMat& full_size,
+                          const ros::Time& time,
+                          cv::cuda::Stream& stream)
+{
+    frames_since_taken_++;
+
+    const bool uncertain = position_variance_.load() > max_position_variance_;
+    if (!uncertain && frames_since_taken_ < frame_interval_) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (busy_) {
+            return false;
+        }
+        busy_ = true;
+    }
+
+    // The base until the estimator has told us what it's going to use.  If
+    // even the base is too small the full size image is resized down
+    // instead, and only if there isn't one does the estimator upsample.
+    const int target_width = getTargetWidth();
+    if (target_width > pyramid.levelSize(0).width && !full_size.empty()) {
+        full_size.copyTo(image_, stream);
+    } else {
+        const int level = target_width > 0
+                        ? pyramid.levelForWidth(target_width)
+                        : 0;
+        pyramid.level(level, stream).copyTo(image_, stream);
+    }
+
+    // The stage is idle, so this only waits for the copy (and building the
+    // level if nobody else has yet)
+    stream.waitForCompletion();
+    image_time_ = time;
+    frames_since_taken_ = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_ = true;
+    }
+    image_cv_.notify_one();
+    return true;
+}
+
+void GridLineStage::odometryCallback(
+        const nav_msgs::Odometry::ConstPtr& message)
+{
+    // Row major 6x6, x and y variances are the first two diagonal entries
+    position_variance_.store(std::max(message->pose.covariance[0],
+                                      message->pose.covariance[7]));
+    height_.store(message->pose.pose.position.z);
+}
+
+void GridLineStage::run()
+{
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            image_cv_.wait(lock, [this]() { return pending_ || shutdown_; });
+            if (shutdown_) {
+                return;
+            }
+            pending_ = false;
+        }
+
+        {
+            const GpuScheduler::Lease lease
+                = scheduler_.acquire(GpuPriority::Throughput);
+            estimator_.update(image_, image_time_, lease.stream());
+        }
+        line_image_width_per_height_.store(
+                estimator_.getLineImageWidthPerHeight());
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        busy_ = false;
+    }
+}
+
+} // namespace iarc7_vision
@@ -0,0 +1,57 @@
+#include "iarc7_vision/ImageMessagePool.hpp"
+
+#include <cstring>
+
+#include <boost/make_shared.hpp>
+
+#include <ros/assert.h>
+
+namespace iarc7_vision {
+
+ImageMessagePool::ImageMessagePool(size_t size)
+    : messages_(size),
+      next_(0)
+{
+    ROS_ASSERT(size >= 1);
+
+    for (sensor_msgs::ImagePtr& message : messages_) {
+        message = boost::make_shared<sensor_msgs::Image>();
+    }
+}
+
+sensor_msgs::ImageConstPtr ImageMessagePool::fill(
+        const cv::Mat& image,
+        const std_msgs::Header& header,
+        const std::string& encoding)
+{
+    ROS_ASSERT(image.depth() == CV_8U);
+
+    // Messages are published in order, so the next one is the most likely
+    // to have been released
+    sensor_msgs::ImagePtr& message = messages_[next_];
+    next_ = (next_ + 1) % messages_.size();
+    if (!message.unique()) {
+        message = boost::make_shared<sensor_msgs::Image>();
+    }
+
+    const size_t row_size = image.cols * image.elemSize();
+    message->header = header;
+    message->height = image.rows;
+    message->width = image.cols;
+    message->encoding = encoding;
+    message->is_bigendian = false;
+    message->step = row_size;
+    message->data.resize(row_size * image.rows);
+
+    if (image.isContinuous()) {
+        std::memcpy(message->data.data(), image.data, message->data.size());
+    } else {
+        for (int i = 0; i < image.rows; i++) {
+            std::memcpy(&message->data[i * row_size], image.ptr(i), row_size);
+        }
+    }
+
+    return message;
+}
+
+} // namespace iarc7_vision
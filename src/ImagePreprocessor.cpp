@@ -0,0 +1,230 @@
+#include "iarc7_vision/ImagePreprocessor.hpp"
+
+#include <opencv2/cudaimgproc.hpp>
+#include <opencv2/imgproc.hpp>
+#include <sensor_msgs/image_encodings.h>
+
+#include "iarc7_vision/cv_utils.hpp"
+
+namespace iarc7_vision {
+
+ImagePreprocessor::ImagePreprocessor(
+        const UndistortionModel& undistortion_model,
+        const ColorCorrectionModel& color_correction_model,
+        int color_conversion_code,
+        size_t depth,
+        bool use_composite_maps,
+        bool use_mapped_memory,
+        GpuStageTimer* gpu_timer)
+    : undistortion_model_(undistortion_model),
+      color_correction_model_(color_correction_model),
+      color_conversion_code_(color_conversion_code),
+      use_composite_maps_(use_composite_maps),
+      use_mapped_memory_(use_mapped_memory),
+      gpu_timer_(gpu_timer),
+      slots_(depth),
+      oldest_(0),
+      in_flight_(0)
+{
+    ROS_ASSERT(depth >= 1);
+
+    if (use_mapped_memory_) {
+        ROS_ASSERT(cv_utils::deviceSharesHostMemory());
+        for (Slot& slot : slots_) {
+            slot.upload_staging = cv::cuda::HostMem(cv::cuda::HostMem::SHARED);
+            slot.download_staging
+                = cv::cuda::HostMem(cv::cuda::HostMem::SHARED);
+        }
+    }
+}
+
+bool ImagePreprocessor::getConversion(const std::string& encoding,
+                                      Conversion& conversion) const
+{
+    namespace enc = sensor_msgs::image_encodings;
+
+    // OpenCV names bayer patterns by the second row, hence the mismatches
+    if (encoding == enc::RGB8) {
+        conversion = {CV_8UC3, 0, false};
+    } else if (encoding == enc::BGR8) {
+        conversion = {CV_8UC3, CV_BGR2RGB, false};
+    } else if (encoding == enc::RGBA8) {
+        conversion = {CV_8UC4, CV_RGBA2RGB, false};
+    } else if (encoding == enc::BGRA8) {
+        conversion = {CV_8UC4, CV_BGRA2RGB, false};
+    } else if (encoding == enc::MONO8) {
+        conversion = {CV_8UC1, CV_GRAY2RGB, false};
+    } else if (encoding == enc::BAYER_RGGB8) {
+        conversion = {CV_8UC1, CV_BayerBG2RGB, true};
+    } else if (encoding == enc::BAYER_BGGR8) {
+        conversion = {CV_8UC1, CV_BayerRG2RGB, true};
+    } else if (encoding == enc::BAYER_GBRG8) {
+        conversion = {CV_8UC1, CV_BayerGR2RGB, true};
+    } else if (encoding == enc::BAYER_GRBG8) {
+        conversion = {CV_8UC1, CV_BayerGB2RGB, true};
+    } else if (encoding == enc::TYPE_8UC3 || encoding == enc::TYPE_8UC4) {
+        // No channel order, so trust the configured one
+        conversion = {encoding == enc::TYPE_8UC4 ? CV_8UC4 : CV_8UC3,
+                      color_conversion_code_,
+                      false};
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool ImagePreprocessor::supportsEncoding(const std::string& encoding) const
+{
+    Conversion conversion;
+    return getConversion(encoding, conversion);
+}
+
+void ImagePreprocessor::push(const sensor_msgs::Image::ConstPtr& message,
+                             const cv::Size& detection_size,
+                             bool produce_corrected,
+                             bool download_corrected,
+                             cv::cuda::Stream& stream)
+{
+    ROS_ASSERT(!full());
+
+    Slot& slot = slots_[(oldest_ + in_flight_) % slots_.size()];
+    slot.frame.message = message;
+
+    // Copy into pinned memory so the upload is actually asynchronous, or
+    // into mapped memory so there's no upload at all
+    if (gpu_timer_ != nullptr) {
+        gpu_timer_->start(stream);
+    }
+
+    Conversion conversion;
+    ROS_ASSERT_MSG(getConversion(message->encoding, conversion),
+                   "Unsupported image encoding %s",
+                   message->encoding.c_str());
+
+    // A header over the message's own buffer, so the copy into staging is
+    // the only one
+    const cv::Mat image(message->height,
+                        message->width,
+                        conversion.type,
+                        const_cast<uint8_t*>(message->data.data()),
+                        message->step);
+    cv_utils::ingestImage(image,
+                          slot.upload_staging,
+                          slot.distorted,
+                          stream);
+
+    // Interpolating between pixels of a mosaic mixes colors, so bayer images
+    // are demosaiced before they're undistorted
+    const cv::cuda::GpuMat* distorted = &slot.distorted;
+    int color_conversion_code = conversion.code;
+    if (conversion.demosaic) {
+        cv::cuda::demosaicing(slot.distorted,
+                              slot.demosaiced,
+                              conversion.code,
+                              3,
+                              stream);
+        distorted = &slot.demosaiced;
+        color_conversion_code = 0;
+    }
+
+    if (use_composite_maps_) {
+        undistortion_model_.undistort(*distorted,
+                                      slot.undistorted_detection,
+                                      detection_size,
+                                      stream);
+        convertAndCorrect(color_conversion_code,
+                          slot.undistorted_detection,
+                          slot.undistorted_detection_rgb,
+                          slot.detection_color_correction_buf,
+                          slot.frame.detection,
+                          stream);
+    }
+
+    // With mapped memory the corrected image is written straight into the
+    // download staging buffer, otherwise it shouldn't stay in mapped memory
+    if (use_mapped_memory_ && download_corrected) {
+        slot.download_staging.create(
+                undistortion_model_.getUndistortedSize(), CV_8UC3);
+        slot.frame.corrected = slot.download_staging.createGpuMatHeader();
+        slot.corrected_is_mapped = true;
+    } else if (slot.corrected_is_mapped) {
+        slot.frame.corrected.release();
+        slot.corrected_is_mapped = false;
+    }
+
+    slot.frame.has_corrected = !use_composite_maps_
+                            || produce_corrected
+                            || download_corrected;
+    if (slot.frame.has_corrected) {
+        undistortion_model_.undistort(*distorted,
+                                      slot.undistorted,
+                                      stream);
+        convertAndCorrect(color_conversion_code,
+                          slot.undistorted,
+                          slot.undistorted_rgb,
+                          slot.color_correction_buf,
+                          slot.frame.corrected,
+                          stream);
+    }
+
+    if (!use_composite_maps_) {
+        slot.frame.detection = slot.frame.corrected;
+    }
+
+    if (download_corrected) {
+        if (!use_mapped_memory_) {
+            slot.frame.corrected.download(slot.download_staging, stream);
+        }
+        slot.frame.corrected_cpu = slot.download_staging.createMatHeader();
+    } else {
+        slot.frame.corrected_cpu.release();
+    }
+
+    if (gpu_timer_ != nullptr) {
+        gpu_timer_->stop(stream);
+    }
+    slot.frame.ready.record(stream);
+
+    in_flight_++;
+}
+
+void ImagePreprocessor::convertAndCorrect(
+        int color_conversion_code,
+        const cv::cuda::GpuMat& undistorted,
+        cv::cuda::GpuMat& undistorted_rgb,
+        ColorCorrectionBuf& color_correction_buf,
+        cv::cuda::GpuMat& out,
+        cv::cuda::Stream& stream) const
+{
+    const cv::cuda::GpuMat* rgb = &undistorted;
+    if (color_conversion_code != 0) {
+        cv::cuda::cvtColor(undistorted,
+                           undistorted_rgb,
+                           color_conversion_code,
+                           0,
+                           stream);
+        rgb = &undistorted_rgb;
+    }
+
+    color_correction_model_.correct(*rgb, out, color_correction_buf, stream);
+}
+
+const ImagePreprocessor::Frame& ImagePreprocessor::front()
+{
+    ROS_ASSERT(!empty());
+
+    Slot& slot = slots_[oldest_];
+    slot.frame.ready.waitForCompletion();
+    return slot.frame;
+}
+
+void ImagePreprocessor::pop()
+{
+    ROS_ASSERT(!empty());
+
+    slots_[oldest_].frame.message.reset();
+    oldest_ = (oldest_ + 1) % slots_.size();
+    in_flight_--;
+}
+
+} // namespace iarc7_vision
@@ -0,0 +1,71 @@
+#include "iarc7_vision/ImagePyramid.hpp"
+
+#include <opencv2/cudawarping.hpp>
+#include <ros/assert.h>
+
+namespace iarc7_vision {
+
+ImagePyramid::ImagePyramid(int max_level)
+    : max_level_(max_level),
+      levels_(max_level + 1),
+      built_(0)
+{
+    ROS_ASSERT(max_level_ >= 0);
+}
+
+void ImagePyramid::reset(const cv::cuda::GpuMat& base)
+{
+    levels_[0] = base;
+    built_ = base.empty() ? 0 : 1;
+}
+
+cv::Size ImagePyramid::levelSize(int level) const
+{
+    ROS_ASSERT(level >= 0 && level <= max_level_);
+    return levelSize(levels_[0].size(), level);
+}
+
+cv::Size ImagePyramid::levelSize(const cv::Size& base, int level)
+{
+    // Same rounding as pyrDown
+    cv::Size size = base;
+    for (int i = 0; i < level; i++) {
+        size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+    }
+    return size;
+}
+
+int ImagePyramid::levelForWidth(int width) const
+{
+    int level = 0;
+    while (level < max_level_ && levelSize(level + 1).width >= width) {
+        level++;
+    }
+    return level;
+}
+
+const cv::cuda::GpuMat& ImagePyramid::level(int level,
+                                            cv::cuda::Stream& stream)
+{
+    ROS_ASSERT(level >= 0 && level <= max_level_);
+    ROS_ASSERT(built_ > 0);
+
+    // Levels below the base may have been built on a different stream,
+    // whether we return one of them or build the next level from one
+    if (built_ > 1) {
+        stream.waitEvent(built_event_);
+    }
+
+    if (level < built_) {
+        return levels_[level];
+    }
+
+    for (; built_ <= level; built_++) {
+        cv::cuda::pyrDown(levels_[built_ - 1], levels_[built_], stream);
+    }
+    built_event_.record(stream);
+
+    return levels_[level];
+}
+
+} // namespace iarc7_vision
@@ -1,13 +1,12 @@
+#include <algorithm>
 #include <numeric>
+#include <utility>
+
+#include <opencv2/cudawarping.hpp>
 
 #include "iarc7_vision/OpticalFlowEstimator.hpp"
 
 // BAD HEADER
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#include <cv_bridge/cv_bridge.h>
-#pragma GCC diagnostic pop
-
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 #pragma GCC diagnostic ignored "-Wignored-attributes"
@@ -23,7 +22,8 @@
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 
 #include "iarc7_vision/cv_utils.hpp"
-#include <ros_utils/SafeTransformWrapper.hpp>
+#include "iarc7_vision/kernels/PyrLK.hpp"
+#include "iarc7_vision/kernels/ResizeGray.hpp"
 
 #include <geometry_msgs/PointStamped.h>
 #include <geometry_msgs/Vector3Stamped.h>
@@ -35,16 +35,31 @@ namespace iarc7_vision {
 OpticalFlowEstimator::OpticalFlowEstimator(
         const OpticalFlowEstimatorSettings& flow_estimator_settings,
         const OpticalFlowDebugSettings& debug_settings,
-        const std::string& expected_image_format)
+        const std::string& expected_image_format,
+        const TransformSource& transform_source,
+        const std::string& camera_frame)
     : flow_estimator_settings_(flow_estimator_settings),
       debug_settings_(debug_settings),
+      staged_settings_(),
+      stage_mutex_(),
+      last_staged_settings_(flow_estimator_settings),
+      staged_features_detector_(),
       gpu_features_detector_(),
       gpu_d_pyrLK_(),
       have_valid_last_image_(false),
       images_skipped_(0),
+      tracked_points_(),
+      frames_since_detection_(0),
+      detection_mask_(),
+      gpu_detection_mask_(),
+      last_pyramid_(),
+      curr_pyramid_(),
+      last_pyramid_valid_(false),
+      vector_scratch_(),
       last_scaled_image_(),
       last_scaled_grayscale_image_(),
-      transform_wrapper_(),
+      transform_source_(transform_source),
+      camera_frame_(camera_frame),
       current_altitude_(0.0),
       current_orientation_(),
       last_orientation_(),
@@ -59,8 +74,9 @@ OpticalFlowEstimator::OpticalFlowEstimator(
               local_nh_.advertise<geometry_msgs::Vector3Stamped>(
                   "orientation_rate", 1)),
       debug_average_velocity_vector_image_pub_(
-              local_nh_.advertise<sensor_msgs::Image>("average_vector_image",
-                                                     1)),
+              local_nh_,
+              "average_vector_image",
+              debug_settings.debug_image_max_rate),
       debug_level_quad_raw_pub_(
               local_nh_.advertise<geometry_msgs::TwistWithCovarianceStamped>(
                   "twist_level_quad_uncorrected", 10)),
@@ -71,8 +87,9 @@ OpticalFlowEstimator::OpticalFlowEstimator(
               local_nh_.advertise<geometry_msgs::TwistWithCovarianceStamped>(
                   "twist_correction", 10)),
       debug_hist_pub_(
-              local_nh_.advertise<sensor_msgs::Image>("hist",
-                                                     1)),
+              local_nh_,
+              "hist",
+              debug_settings.debug_image_max_rate),
       debug_raw_pub_(
               local_nh_.advertise<geometry_msgs::TwistWithCovarianceStamped>(
                   "twist_raw", 10)),
@@ -80,9 +97,13 @@ OpticalFlowEstimator::OpticalFlowEstimator(
               local_nh_.advertise<geometry_msgs::TwistWithCovarianceStamped>(
                   "twist_unrotated", 10)),
       debug_velocity_vector_image_pub_(
-              local_nh_.advertise<sensor_msgs::Image>("vector_image", 1)),
+              local_nh_,
+              "vector_image",
+              debug_settings.debug_image_max_rate),
       debug_filtered_velocity_vector_image_pub_(
-              local_nh_.advertise<sensor_msgs::Image>("filtered_vector_image", 1)),
+              local_nh_,
+              "filtered_vector_image",
+              debug_settings.debug_image_max_rate),
       debug_flow_quality_pub_(
               local_nh_.advertise<iarc7_msgs::FlowQuality>(
                   "flow_quality", 10)),
@@ -93,21 +114,23 @@ OpticalFlowEstimator::OpticalFlowEstimator(
               local_nh_.advertise<geometry_msgs::TwistWithCovarianceStamped>(
                   "twist", 10))
 {
-    // Create the feature detector with default settings that will be replaced
-    // on the first called to onSettingsChanged
+    // Create the feature detector, replaced by applyStagedSettings when its
+    // settings change
     gpu_features_detector_ = cv::cuda::createGoodFeaturesToTrackDetector(
                                         CV_8UC1,
                                         flow_estimator_settings_.points,
                                         flow_estimator_settings_.quality_level,
                                         flow_estimator_settings_.min_dist);
+    staged_features_detector_ = gpu_features_detector_;
 
-    // Create optical flow object with default settings that will be replaced
-    // on the first called to onSettingsChanged
+    // Create optical flow object, its settings are updated in place by
+    // applyStagedSettings
     gpu_d_pyrLK_ = cv::cuda::SparsePyrLKOpticalFlow::create(
                                   cv::Size(flow_estimator_settings_.win_size,
                                            flow_estimator_settings_.win_size),
                                   flow_estimator_settings_.max_level,
                                   flow_estimator_settings_.iters);
+    logPyrLKKernel();
 
     if (expected_image_format == "RGB") {
         grayscale_conversion_constant_ = CV_RGB2GRAY;
@@ -122,8 +145,82 @@ OpticalFlowEstimator::OpticalFlowEstimator(
     }
 }
 
+void OpticalFlowEstimator::stageSettings(
+        const OpticalFlowEstimatorSettings& settings)
+{
+    std::lock_guard<std::mutex> lock(stage_mutex_);
+
+    auto staged = std::make_shared<StagedSettings>();
+    staged->settings = settings;
+
+    // The corner detector can't be changed in place, but building it here
+    // keeps that off the thread running update
+    if (settings.points != last_staged_settings_.points
+     || settings.quality_level != last_staged_settings_.quality_level
+     || settings.min_dist != last_staged_settings_.min_dist) {
+        staged_features_detector_ = cv::cuda::createGoodFeaturesToTrackDetector(
+                CV_8UC1,
+                settings.points,
+                settings.quality_level,
+                settings.min_dist);
+    }
+    staged->features_detector = staged_features_detector_;
+
+    last_staged_settings_ = settings;
+    staged_settings_.post(std::move(staged));
+}
+
+void OpticalFlowEstimator::applyStagedSettings(cv::cuda::Stream& stream)
+{
+    const std::shared_ptr<const StagedSettings> staged
+        = staged_settings_.take();
+    if (staged == nullptr) {
+        return;
+    }
+
+    const OpticalFlowEstimatorSettings old_settings = flow_estimator_settings_;
+    const cv::Size old_target_size = target_size_;
+    flow_estimator_settings_ = staged->settings;
+
+    gpu_features_detector_ = staged->features_detector;
+
+    // These just store the values
+    gpu_d_pyrLK_->setWinSize(cv::Size(flow_estimator_settings_.win_size,
+                                      flow_estimator_settings_.win_size));
+    gpu_d_pyrLK_->setMaxLevel(flow_estimator_settings_.max_level);
+    gpu_d_pyrLK_->setNumIters(flow_estimator_settings_.iters);
+
+    ROS_ASSERT(updateTargetSize());
+
+    // Everything else only affects the next frame, there's no need to start
+    // over for it
+    if (target_size_ != old_target_size
+     || flow_estimator_settings_.grayscale_flow != old_settings.grayscale_flow
+     || flow_estimator_settings_.max_level != old_settings.max_level) {
+        resetFlowHistory(stream);
+    }
+
+    if (flow_estimator_settings_.win_size != old_settings.win_size
+     || flow_estimator_settings_.grayscale_flow
+            != old_settings.grayscale_flow) {
+        logPyrLKKernel();
+    }
+}
+
+void OpticalFlowEstimator::logPyrLKKernel() const
+{
+    if (flow_estimator_settings_.use_cached_pyramids
+     && !kernels::pyrLKHasFastPath(
+             flow_estimator_settings_.win_size,
+             flow_estimator_settings_.grayscale_flow ? CV_8UC1 : CV_8UC3)) {
+        ROS_INFO_STREAM("No specialized optical flow kernel for win_size "
+                     << flow_estimator_settings_.win_size
+                     << ", using the generic one");
+    }
+}
+
 bool __attribute__((warn_unused_result))
-        OpticalFlowEstimator::onSettingsChanged()
+        OpticalFlowEstimator::updateTargetSize()
 {
     cv::Size new_target_size;
     if(flow_estimator_settings_.crop) {
@@ -155,44 +252,64 @@ bool __attribute__((warn_unused_result))
     }
 
     target_size_ = new_target_size;
+    return true;
+}
+
+void OpticalFlowEstimator::resetFlowHistory(cv::cuda::Stream& stream)
+{
+    // Tracks and pyramids don't carry over to a different target size
+    tracked_points_.clear();
+    last_pyramid_valid_ = false;
 
     if (expected_input_size_ != cv::Size(0, 0)) {
-        // Note: neither of the outputs can be the input image, so we need to
-        // do this copying thing
-        cv::cuda::GpuMat scaled_image;
-        resizeAndConvertImages(last_scaled_image_,
-                               scaled_image,
-                               last_scaled_grayscale_image_);
-        last_scaled_image_ = scaled_image;
+        if (last_scaled_image_.empty()) {
+            // In grayscale mode the color image isn't always kept, so start
+            // over from the next frame
+            have_valid_last_image_ = false;
+        } else {
+            // Note: neither of the outputs can be the input image, so we need
+            // to do this copying thing
+            cv::cuda::GpuMat scaled_image;
+            resizeAndConvertImages(last_scaled_image_,
+                                   scaled_image,
+                                   last_scaled_grayscale_image_,
+                                   !flow_estimator_settings_.grayscale_flow,
+                                   stream);
+            last_scaled_image_ = scaled_image;
+        }
     }
-
-
-    // Update the settings in the feature detector
-    // Currently this requres recreating the entire object, individual
-    // parameters can't be set.
-    gpu_features_detector_ = cv::cuda::createGoodFeaturesToTrackDetector(
-                                        CV_8UC1,
-                                        flow_estimator_settings_.points,
-                                        flow_estimator_settings_.quality_level,
-                                        flow_estimator_settings_.min_dist);
-
-    // Set the optical flow detector settings
-    gpu_d_pyrLK_->setWinSize(cv::Size(flow_estimator_settings_.win_size,
-                                        flow_estimator_settings_.win_size));
-    gpu_d_pyrLK_->setMaxLevel(flow_estimator_settings_.max_level);
-    gpu_d_pyrLK_->setNumIters(flow_estimator_settings_.iters);
-
-    return true;
 }
 
 void OpticalFlowEstimator::update(const cv::cuda::GpuMat& curr_image,
                                   const ros::Time& time,
                                   const std::vector<RoombaImageLocation>&
                                           roomba_image_locations,
-                                  const bool images_skipped)
+                                  const bool images_skipped,
+                                  cv::cuda::Stream& stream)
 {
+    applyStagedSettings(stream);
+
     have_valid_last_image_ = have_valid_last_image_ && !images_skipped;
 
+    // Scale and convert the image before waiting for this frame's pose, so
+    // the image work overlaps with tf catching up instead of adding to it
+    cv::cuda::GpuMat scaled_image;
+    cv::cuda::GpuMat scaled_gray_image;
+    bool resized = false;
+    if (have_valid_last_image_ && curr_image.size() == expected_input_size_) {
+        try {
+            resizeAndConvertImages(curr_image,
+                                   scaled_image,
+                                   scaled_gray_image,
+                                   needColorImages(images_skipped_ == 0),
+                                   stream);
+            resized = true;
+        } catch (const std::exception& ex) {
+            // Tried again below, where failures are handled
+            ROS_DEBUG_STREAM("Failed to resize image for flow: " << ex.what());
+        }
+    }
+
     // start time for debugging time spent in updateFilteredPosition
     const ros::WallTime start = ros::WallTime::now();
 
@@ -228,20 +345,22 @@ void OpticalFlowEstimator::update(const cv::cuda::GpuMat& curr_image,
         }
 
         try {
-            // Scale and convert input image
-            cv::cuda::GpuMat scaled_image;
-            cv::cuda::GpuMat scaled_gray_image;
-
-            resizeAndConvertImages(curr_image,
-                                   scaled_image,
-                                   scaled_gray_image);
+            // Scale and convert input image, if that wasn't already done
+            if (!resized) {
+                resizeAndConvertImages(curr_image,
+                                       scaled_image,
+                                       scaled_gray_image,
+                                       needColorImages(images_skipped_ == 0),
+                                       stream);
+            }
 
             // Get velocity estimate from average vector
             processImage(scaled_image,
                          scaled_gray_image,
                          time,
                          roomba_image_locations,
-                         images_skipped_ == 0);
+                         images_skipped_ == 0,
+                         stream);
             images_skipped_ = (images_skipped_ + 1)
                            % (flow_estimator_settings_.debug_frameskip + 1);
 
@@ -256,11 +375,13 @@ void OpticalFlowEstimator::update(const cv::cuda::GpuMat& curr_image,
         if (expected_input_size_ == cv::Size(0, 0)) {
             expected_input_size_ = curr_image.size();
             last_scaled_image_ = curr_image;
-            ROS_ASSERT(onSettingsChanged());
+            ROS_ASSERT(updateTargetSize());
+            resetFlowHistory(stream);
             have_valid_last_image_ = true;
         } else if (expected_input_size_ == curr_image.size()) {
             last_scaled_image_ = curr_image;
-            ROS_ASSERT(onSettingsChanged());
+            ROS_ASSERT(updateTargetSize());
+            resetFlowHistory(stream);
             have_valid_last_image_ = true;
         } else {
             ROS_ERROR("Unable to accept new valid last image. Ignoring image of size (%dx%d), expected (%dx%d)",
@@ -536,88 +657,105 @@ bool OpticalFlowEstimator::findAverageVector(
         const cv::cuda::GpuMat& curr_frame,
         const ros::Time& time,
         const bool debug,
-        cv::Point2f& average) const
+        const kernels::FlowFilterCounts* gpu_filter_counts,
+        cv::Point2f& average,
+        cv::cuda::Stream& stream) const
 {
-    auto in_roomba_perimeter = [&](const cv::Point2f& point) {
-        if(flow_estimator_settings_.crop) {
-            // Transform the point in the cropped and scaled region to
-            // a unitless point in the original image frame
-            double expected_width  = static_cast<double>(expected_input_size_.width);
-            double expected_height = static_cast<double>(expected_input_size_.height);
-            double crop_width      = static_cast<double>(flow_estimator_settings_.crop_width);
-            double crop_height     = static_cast<double>(flow_estimator_settings_.crop_height);
-            double image_width     = static_cast<double>(image_size.width);
-
-            cv::Point2f new_point;
-            new_point.x =
-              (point.x / image_width) * (crop_width / expected_width)
-              + ((expected_width - crop_width) / 2.0 / expected_width);
-
-            new_point.y =
-              (point.y / image_width) * (crop_width / expected_width)
-              + ((expected_height - crop_height) / 2.0 / expected_width);
+    double roomba_scale;
+    double roomba_offset_x;
+    double roomba_offset_y;
+    getRoombaTransform(image_size,
+                       roomba_scale,
+                       roomba_offset_x,
+                       roomba_offset_y);
 
-            for(const auto& roomba : roomba_image_locations) {
-                if(roomba.point_on_roomba(new_point.x, new_point.y)) {
-                    return true;
-                }
-            }
-        }
-        else {
-            for(const auto& roomba : roomba_image_locations) {
-                if(roomba.point_on_roomba(point.x, point.y, image_size.width)) {
-                    return true;
-                }
+    auto in_roomba_perimeter = [&](const cv::Point2f& point) {
+        const double s_x = point.x * roomba_scale + roomba_offset_x;
+        const double s_y = point.y * roomba_scale + roomba_offset_y;
+        for(const auto& roomba : roomba_image_locations) {
+            const double d_x = s_x - roomba.x;
+            const double d_y = s_y - roomba.y;
+            if(d_x * d_x + d_y * d_y <= roomba.radius * roomba.radius) {
+                return true;
             }
         }
         return false;
     };
 
+    const float min_x = image_size.width * x_cutoff;
+    const float max_x = image_size.width * (1.0 - x_cutoff);
+    const float min_y = image_size.height * y_cutoff;
+    const float max_y = image_size.height * (1.0 - y_cutoff);
     auto in_acceptance_region = [&](const cv::Point2f& point) {
-        return point.x > image_size.width * x_cutoff
-               && point.x < image_size.width  * (1.0 - x_cutoff)
-               && point.y > image_size.height * y_cutoff
-               && point.y < image_size.height * (1.0 - y_cutoff);
+        return (point.x > min_x) & (point.x < max_x)
+             & (point.y > min_y) & (point.y < max_y);
     };
 
-    std::vector<double> dx;
-    dx.reserve(tails.size());
-    std::vector<double> dy;
-    dy.reserve(tails.size());
-    std::vector<cv::Point2f> filtered_heads;
-    filtered_heads.reserve(tails.size());
-    std::vector<cv::Point2f> filtered_tails;
-    filtered_tails.reserve(tails.size());
-    std::vector<uchar> filtered_status;
-    filtered_status.reserve(tails.size());
-    std::vector<double> rejection_region_dx;
-    rejection_region_dx.reserve(tails.size());
-    std::vector<double> rejection_region_dy;
-    rejection_region_dy.reserve(tails.size());
-    std::vector<double> roomba_region_dx;
-    roomba_region_dx.reserve(tails.size());
-    std::vector<double> roomba_region_dy;
-    roomba_region_dy.reserve(tails.size());
+    // Scratch vectors keep their capacity between frames, so none of this
+    // allocates once the number of points settles
+    VectorScratch& scratch = vector_scratch_;
+    scratch.clear();
+
+    std::vector<float>& dx = scratch.dx;
+    std::vector<float>& dy = scratch.dy;
+    std::vector<float>& rejection_region_dx = scratch.rejection_region_dx;
+    std::vector<float>& rejection_region_dy = scratch.rejection_region_dy;
+    std::vector<float>& roomba_region_dx = scratch.roomba_region_dx;
+    std::vector<float>& roomba_region_dy = scratch.roomba_region_dy;
+    std::vector<cv::Point2f>& filtered_heads = scratch.filtered_heads;
+    std::vector<cv::Point2f>& filtered_tails = scratch.filtered_tails;
+    std::vector<uchar>& filtered_status = scratch.filtered_status;
+
+    // The filtered vectors are only needed to draw the debug image (the
+    // color frame is only there in grayscale mode if someone is listening)
+    const bool keep_filtered_vectors
+        = !curr_frame.empty()
+       && debug_filtered_velocity_vector_image_pub_.wanted();
+    const bool prefiltered = gpu_filter_counts != nullptr;
+    const bool have_roombas = !prefiltered && !roomba_image_locations.empty();
+
+    // Classify every vector and accumulate the sample statistics of the
+    // accepted ones in a single pass
+    double sum_x = 0.0;
+    double sum_y = 0.0;
+    double sum_xx = 0.0;
+    double sum_yy = 0.0;
+    double sum_xy = 0.0;
     for (size_t i = 0; i < tails.size(); ++i) {
-        if (status[i]) {
-            bool in_acceptable_area = in_acceptance_region(tails[i])
-                                      && in_acceptance_region(heads[i]);
-            bool not_in_roomba_perimeter = !in_roomba_perimeter(tails[i])
-                                           && !in_roomba_perimeter(heads[i]);
-
-            if (!in_acceptable_area) {
-                rejection_region_dx.push_back(heads[i].x - tails[i].x);
-                rejection_region_dy.push_back(heads[i].y - tails[i].y);
-            }
+        if (!status[i]) {
+            continue;
+        }
 
-            if (!not_in_roomba_perimeter) {
-                roomba_region_dx.push_back(heads[i].x - tails[i].x);
-                roomba_region_dy.push_back(heads[i].y - tails[i].y);
-            }
+        const float delta_x = heads[i].x - tails[i].x;
+        const float delta_y = heads[i].y - tails[i].y;
+
+        const bool in_acceptable_area = prefiltered
+                                     || (in_acceptance_region(tails[i])
+                                       & in_acceptance_region(heads[i]));
+        const bool in_roomba = have_roombas
+                            && (in_roomba_perimeter(tails[i])
+                             || in_roomba_perimeter(heads[i]));
+
+        if (!in_acceptable_area) {
+            rejection_region_dx.push_back(delta_x);
+            rejection_region_dy.push_back(delta_y);
+        }
+
+        if (in_roomba) {
+            roomba_region_dx.push_back(delta_x);
+            roomba_region_dy.push_back(delta_y);
+        }
 
-            if(in_acceptable_area && not_in_roomba_perimeter) {
-                dx.push_back(heads[i].x - tails[i].x);
-                dy.push_back(heads[i].y - tails[i].y);
+        if (in_acceptable_area && !in_roomba) {
+            dx.push_back(delta_x);
+            dy.push_back(delta_y);
+            sum_x += delta_x;
+            sum_y += delta_y;
+            sum_xx += delta_x * static_cast<double>(delta_x);
+            sum_yy += delta_y * static_cast<double>(delta_y);
+            sum_xy += delta_x * static_cast<double>(delta_y);
+
+            if (keep_filtered_vectors) {
                 filtered_heads.push_back(heads[i]);
                 filtered_tails.push_back(tails[i]);
                 filtered_status.push_back(static_cast<uchar>(true));
@@ -625,111 +763,118 @@ bool OpticalFlowEstimator::findAverageVector(
         }
     }
 
-    if(filtered_tails.size() == 0) {
+    // Vectors the gpu filter threw out aren't in the lists, only counted
+    const size_t num_rejection_region
+        = prefiltered ? gpu_filter_counts->rejection_region
+                      : rejection_region_dx.size();
+    const size_t num_roomba_region
+        = prefiltered ? gpu_filter_counts->roomba_region
+                      : roomba_region_dx.size();
+
+    if(dx.size() == 0) {
         ROS_WARN("iarc7_vision: No flow vectors were within the acceptable image region");
         return false;
     }
 
     // Publish debugging image with only the vectors used drawn
-    cv::Mat arrow_image;
-    curr_frame.download(arrow_image);
-
-    for(const auto& roomba : roomba_image_locations) {
-        cv::Point2f p;
-
-        if(flow_estimator_settings_.crop) {
-            // Transform the point in the cropped and scaled region to
-            // a unitless point in the original image frame
-            double expected_width  = static_cast<double>(expected_input_size_.width);
-            double expected_height = static_cast<double>(expected_input_size_.height);
-            double crop_width      = static_cast<double>(flow_estimator_settings_.crop_width);
-            double crop_height     = static_cast<double>(flow_estimator_settings_.crop_height);
-
-            p.x = (roomba.x - ((expected_width - crop_width) / 2.0 / expected_width))
-                  * (expected_width / crop_width);
-            p.y = (roomba.y - ((expected_height - crop_height) / 2.0 / expected_width))
-                  * (expected_width / crop_width);
-            p.x *= image_size.width;
-            p.y *= image_size.width;
-
-            if(p.x >= 0 && p.x <= image_size.width
-              && p.y >=0 && p.y <= image_size.height) {
-                cv::circle(arrow_image,
-                           p,
-                           roomba.radius * (expected_width / crop_width) * image_size.width,
-                           cv::Scalar(0, 255, 0));
-            }
-        }
-        else {
-            p.x = roomba.x * image_size.width;
-            p.y = roomba.y * image_size.width;
-
-            if(p.x >= 0 && p.x <= image_size.width
-               && p.y >=0 && p.y <= image_size.height) {
-                cv::circle(arrow_image,
-                           p,
-                           roomba.radius * image_size.width,
-                           cv::Scalar(0, 255, 0));
+    if (keep_filtered_vectors) {
+        cv::Mat arrow_image;
+        curr_frame.download(arrow_image, stream);
+        stream.waitForCompletion();
+
+        const bool crop = flow_estimator_settings_.crop;
+        const double expected_width  = static_cast<double>(expected_input_size_.width);
+        const double expected_height = static_cast<double>(expected_input_size_.height);
+        const double crop_width      = static_cast<double>(flow_estimator_settings_.crop_width);
+        const double crop_height     = static_cast<double>(flow_estimator_settings_.crop_height);
+
+        // Drawn in the background, so it works on copies of everything
+        auto render = [=]() mutable {
+            for(const auto& roomba : roomba_image_locations) {
+                cv::Point2f p;
+
+                if(crop) {
+                    // Transform the point in the cropped and scaled region to
+                    // a unitless point in the original image frame
+                    p.x = (roomba.x - ((expected_width - crop_width) / 2.0 / expected_width))
+                          * (expected_width / crop_width);
+                    p.y = (roomba.y - ((expected_height - crop_height) / 2.0 / expected_width))
+                          * (expected_width / crop_width);
+                    p.x *= image_size.width;
+                    p.y *= image_size.width;
+
+                    if(p.x >= 0 && p.x <= image_size.width
+                      && p.y >=0 && p.y <= image_size.height) {
+                        cv::circle(arrow_image,
+                                   p,
+                                   roomba.radius * (expected_width / crop_width) * image_size.width,
+                                   cv::Scalar(0, 255, 0));
+                    }
+                }
+                else {
+                    p.x = roomba.x * image_size.width;
+                    p.y = roomba.y * image_size.width;
+
+                    if(p.x >= 0 && p.x <= image_size.width
+                       && p.y >=0 && p.y <= image_size.height) {
+                        cv::circle(arrow_image,
+                                   p,
+                                   roomba.radius * image_size.width,
+                                   cv::Scalar(0, 255, 0));
+                    }
+                }
             }
-        }
-    }
 
-    cv::Rect usable_image_rect(image_size.width  * x_cutoff,
-                               image_size.height * y_cutoff,
-                               image_size.width  * (1.0 - 2.0 * x_cutoff),
-                               image_size.height * (1.0 - 2.0 * y_cutoff));
-
-    cv::rectangle(arrow_image,
-                  usable_image_rect,
-                  cv::Scalar(0, 255, 255));
-
-    cv_utils::drawArrows(arrow_image,
-                         filtered_tails,
-                         filtered_heads,
-                         filtered_status,
-                         cv::Scalar(255, 0, 0));
-
-    cv_bridge::CvImage cv_image {
-        std_msgs::Header(),
-        image_encoding_,
-        arrow_image
-    };
+            cv::Rect usable_image_rect(image_size.width  * x_cutoff,
+                                       image_size.height * y_cutoff,
+                                       image_size.width  * (1.0 - 2.0 * x_cutoff),
+                                       image_size.height * (1.0 - 2.0 * y_cutoff));
+
+            cv::rectangle(arrow_image,
+                          usable_image_rect,
+                          cv::Scalar(0, 255, 255));
+
+            cv_utils::drawArrows(arrow_image,
+                                 filtered_tails,
+                                 filtered_heads,
+                                 filtered_status,
+                                 cv::Scalar(255, 0, 0));
+
+            return arrow_image;
+        };
+
+        debug_filtered_velocity_vector_image_pub_.publish(std_msgs::Header(),
+                                                          image_encoding_,
+                                                          std::move(render));
+    }
 
-    debug_filtered_velocity_vector_image_pub_.publish(cv_image.toImageMsg());
-
-    auto mean_and_var = [&](const std::vector<double>& x,
-                            double& u,
-                            double& var) {
-        u = std::accumulate(x.begin(), x.end(), 0.0) / x.size();
-        var =
-            std::accumulate(x.begin(), x.end(), 0.0,
-                [&](double& sum, double x_i) {
-                    return sum + std::pow(x_i - u, 2.0);
-                })
-            / x.size();
+    // Mean and covariance from the sums of a set of vectors
+    auto moments = [](double n,
+                      double s_x,
+                      double s_y,
+                      double s_xx,
+                      double s_yy,
+                      double s_xy,
+                      double& u_x,
+                      double& u_y,
+                      double& var_x,
+                      double& var_y,
+                      double& cov) {
+        u_x = s_x / n;
+        u_y = s_y / n;
+        var_x = std::max(0.0, s_xx / n - u_x * u_x);
+        var_y = std::max(0.0, s_yy / n - u_y * u_y);
+        cov = s_xy / n - u_x * u_y;
     };
 
     double sample_u_x = 0.0;
-    double sample_var_x = 0.0;
-    mean_and_var(dx, sample_u_x, sample_var_x);
     double sample_u_y = 0.0;
+    double sample_var_x = 0.0;
     double sample_var_y = 0.0;
-    mean_and_var(dy, sample_u_y, sample_var_y);
-
-    auto covariance = [&](const std::vector<double>& x,
-                          const std::vector<double>& y,
-                          const double& u_x,
-                          const double& u_y,
-                          double& cov) {
-        double sum_xy = 0.0;
-        for(size_t i = 0; i < x.size(); i++) {
-            sum_xy += x[i]*y[i];
-        }
-        cov = (sum_xy/static_cast<double>(x.size())) - (u_x * u_y);
-    };
-
     double sample_covariance = 0.0;
-    covariance(dx, dy, sample_u_x, sample_u_y, sample_covariance);
+    moments(dx.size(), sum_x, sum_y, sum_xx, sum_yy, sum_xy,
+            sample_u_x, sample_u_y,
+            sample_var_x, sample_var_y, sample_covariance);
 
     Eigen::Matrix2d sample_covariance_matrix = Eigen::Matrix2d::Zero();
     sample_covariance_matrix(0, 0) = sample_var_x;
@@ -739,50 +884,64 @@ bool OpticalFlowEstimator::findAverageVector(
 
     Eigen::SelfAdjointEigenSolver<Eigen::Matrix2d> sample_covariance_eigen(sample_covariance_matrix);
 
-    std::vector<double> no_outlier_deltas_x;
-    no_outlier_deltas_x.reserve(dx.size());
-    std::vector<double> no_outlier_deltas_y;
-    no_outlier_deltas_y.reserve(dx.size());
-    // Perform outlier removal
+    // Perform outlier removal, delta^T * cov^-1 * delta written out for the
+    // 2x2 case so the loop is plain float math
+    const Eigen::Matrix2d inverse_covariance = sample_covariance_matrix.inverse();
+    const float inv_xx = inverse_covariance(0, 0);
+    const float inv_xy = inverse_covariance(0, 1) + inverse_covariance(1, 0);
+    const float inv_yy = inverse_covariance(1, 1);
+    const float u_x = sample_u_x;
+    const float u_y = sample_u_y;
+    const float max_normalized_variance
+        = flow_estimator_settings_.max_normalized_element_variance;
+
+    size_t no_outlier_count = 0;
+    double filtered_sum_x = 0.0;
+    double filtered_sum_y = 0.0;
+    double filtered_sum_xx = 0.0;
+    double filtered_sum_yy = 0.0;
+    double filtered_sum_xy = 0.0;
     for(size_t i = 0; i < dx.size(); i++) {
-        Eigen::Vector2d delta(dx[i] - sample_u_x, dy[i] - sample_u_y);
-        double normalized_variance
-            = delta.transpose() * sample_covariance_matrix.inverse() * delta;
-        if(normalized_variance
-              <= flow_estimator_settings_.max_normalized_element_variance) {
-            no_outlier_deltas_x.push_back(dx[i]);
-            no_outlier_deltas_y.push_back(dy[i]);
+        const float delta_x = dx[i] - u_x;
+        const float delta_y = dy[i] - u_y;
+        const float normalized_variance = inv_xx * delta_x * delta_x
+                                        + inv_xy * delta_x * delta_y
+                                        + inv_yy * delta_y * delta_y;
+        if(normalized_variance <= max_normalized_variance) {
+            no_outlier_count++;
+            filtered_sum_x += dx[i];
+            filtered_sum_y += dy[i];
+            filtered_sum_xx += dx[i] * static_cast<double>(dx[i]);
+            filtered_sum_yy += dy[i] * static_cast<double>(dy[i]);
+            filtered_sum_xy += dx[i] * static_cast<double>(dy[i]);
         }
     }
 
-    if(no_outlier_deltas_x.size() == 0) {
+    if(no_outlier_count == 0) {
         ROS_WARN_STREAM("iarc7_vision: No vectors were within the outlier boundaries, "
                         << "cannot compute average vector");
         return false;
     }
 
-    bool enough_no_outlier_deltas = static_cast<int>(no_outlier_deltas_x.size())
+    bool enough_no_outlier_deltas = static_cast<int>(no_outlier_count)
                                       >= flow_estimator_settings_.min_vectors;
     if(!enough_no_outlier_deltas) {
         ROS_WARN_STREAM("iarc7_vision: Not enough flow vectors after outlier rejection, Min: "
                         << flow_estimator_settings_.min_vectors
                         << " Actual: "
-                        << no_outlier_deltas_x.size());
+                        << no_outlier_count);
     }
 
     double filtered_u_x = 0.0;
-    double filtered_var_x = 0.0;
-    mean_and_var(no_outlier_deltas_x, filtered_u_x, filtered_var_x);
     double filtered_u_y = 0.0;
+    double filtered_var_x = 0.0;
     double filtered_var_y = 0.0;
-    mean_and_var(no_outlier_deltas_y, filtered_u_y, filtered_var_y);
-
     double filtered_covariance = 0.0;
-    covariance(no_outlier_deltas_x,
-               no_outlier_deltas_y,
-               filtered_u_x,
-               filtered_u_y,
-               filtered_covariance);
+    moments(no_outlier_count,
+            filtered_sum_x, filtered_sum_y,
+            filtered_sum_xx, filtered_sum_yy, filtered_sum_xy,
+            filtered_u_x, filtered_u_y,
+            filtered_var_x, filtered_var_y, filtered_covariance);
 
     Eigen::Matrix2d filtered_covariance_matrix = Eigen::Matrix2d::Zero();
     filtered_covariance_matrix(0, 0) = filtered_var_x;
@@ -808,8 +967,9 @@ bool OpticalFlowEstimator::findAverageVector(
     bool flow_average_accepted = false;
     if (flow_estimator_settings_.vector_filter == VectorFilterType::Median) {
         if (dx.size() > 0) {
-            std::sort(dx.begin(), dx.end());
-            std::sort(dy.begin(), dy.end());
+            // Only the middle element is needed, not a full sort
+            std::nth_element(dx.begin(), dx.begin() + dx.size() / 2, dx.end());
+            std::nth_element(dy.begin(), dy.begin() + dy.size() / 2, dy.end());
 
             average.x = dx[dx.size() / 2];
             average.y = dy[dy.size() / 2];
@@ -839,13 +999,13 @@ bool OpticalFlowEstimator::findAverageVector(
     flow_quality_msg.header.stamp = time;
 
     flow_quality_msg.num_starting_vectors = dx.size()
-                                            + rejection_region_dx.size()
-                                            + roomba_region_dx.size();
-    flow_quality_msg.num_rejection_region_vectors = rejection_region_dx.size();
-    flow_quality_msg.num_roomba_region_vectors = roomba_region_dx.size();
+                                            + num_rejection_region
+                                            + num_roomba_region;
+    flow_quality_msg.num_rejection_region_vectors = num_rejection_region;
+    flow_quality_msg.num_roomba_region_vectors = num_roomba_region;
     flow_quality_msg.num_exceeded_element_var_vectors
-        = dx.size() - no_outlier_deltas_x.size();
-    flow_quality_msg.num_accepted_vectors = no_outlier_deltas_x.size();
+        = dx.size() - no_outlier_count;
+    flow_quality_msg.num_accepted_vectors = no_outlier_count;
 
     flow_quality_msg.sample_std_dev_eigen_values.x
         = std::sqrt(sample_covariance_eigen.eigenvalues()[0]);
@@ -868,242 +1028,264 @@ bool OpticalFlowEstimator::findAverageVector(
 
     debug_flow_quality_pub_.publish(flow_quality_msg);
 
-    if (debug && debug_settings_.debug_hist) {
+    if (debug
+     && debug_settings_.debug_hist
+     && debug_hist_pub_.wanted()) {
         // Histogram scale factor scales image so that a more readable plot is made
         const double hist_scale_factor = flow_estimator_settings_.hist_scale_factor;
-        cv::Mat hist_image = cv::Mat::zeros(curr_frame.size().height
-                                                * flow_estimator_settings_.hist_image_size_scale,
-                                            curr_frame.size().width
-                                                * flow_estimator_settings_.hist_image_size_scale,
-                                            CV_8UC3);
-
-        auto plot_hist_points = [&](const std::vector<double>& points_x,
-                                    const std::vector<double>& points_y,
-                                    const cv::Scalar& color) {
-            for (size_t i = 0; i < points_x.size(); i++) {
-                int x = ((points_x[i] - sample_u_x) * hist_scale_factor) + hist_image.size().width / 2;
-                int y = ((points_y[i] - sample_u_y) * hist_scale_factor) + hist_image.size().height / 2;
-                if (x >= 0 && x < hist_image.size().width
-                 && y >= 0 && y < hist_image.size().height) {
-                    hist_image.at<cv::Vec3b>(cv::Point(x, y))[0] = color[0];
-                    hist_image.at<cv::Vec3b>(cv::Point(x, y))[1] = color[1];
-                    hist_image.at<cv::Vec3b>(cv::Point(x, y))[2] = color[2];
-
-                } else {
-                    ROS_DEBUG("VECTOR OUTSIDE HIST IMAGE");
+        const cv::Size hist_size(image_size.width
+                                     * flow_estimator_settings_.hist_image_size_scale,
+                                 image_size.height
+                                     * flow_estimator_settings_.hist_image_size_scale);
+        const double max_normalized_element_variance
+            = flow_estimator_settings_.max_normalized_element_variance;
+        const double max_filtered_variance
+            = flow_estimator_settings_.max_filtered_variance;
+
+        const double sample_eigenvalue_0 = sample_covariance_eigen.eigenvalues()[0];
+        const double sample_eigenvalue_1 = sample_covariance_eigen.eigenvalues()[1];
+        const double sample_angle
+            = std::atan2(-sample_covariance_eigen.eigenvectors().col(0)[1],
+                         sample_covariance_eigen.eigenvectors().col(0)[0])
+            * 180.0 / CV_PI;
+        const double filtered_eigenvalue_0 = filtered_covariance_eigen.eigenvalues()[0];
+        const double filtered_eigenvalue_1 = filtered_covariance_eigen.eigenvalues()[1];
+        const double filtered_angle
+            = std::atan2(-filtered_covariance_eigen.eigenvectors().col(0)[1],
+                         filtered_covariance_eigen.eigenvectors().col(0)[0])
+            * 180.0 / CV_PI;
+
+        // Drawn in the background, so it works on copies of everything
+        auto render = [=]() {
+            cv::Mat hist_image = cv::Mat::zeros(hist_size, CV_8UC3);
+
+            auto plot_hist_points = [&](const std::vector<float>& points_x,
+                                        const std::vector<float>& points_y,
+                                        const cv::Scalar& color) {
+                for (size_t i = 0; i < points_x.size(); i++) {
+                    int x = ((points_x[i] - sample_u_x) * hist_scale_factor) + hist_image.size().width / 2;
+                    int y = ((points_y[i] - sample_u_y) * hist_scale_factor) + hist_image.size().height / 2;
+                    if (x >= 0 && x < hist_image.size().width
+                     && y >= 0 && y < hist_image.size().height) {
+                        hist_image.at<cv::Vec3b>(cv::Point(x, y))[0] = color[0];
+                        hist_image.at<cv::Vec3b>(cv::Point(x, y))[1] = color[1];
+                        hist_image.at<cv::Vec3b>(cv::Point(x, y))[2] = color[2];
+
+                    } else {
+                        ROS_DEBUG("VECTOR OUTSIDE HIST IMAGE");
+                    }
                 }
-            }
+            };
+
+            // Plot all the vectors in the rejection region
+            //plot_hist_points(rejection_region_dx, rejection_region_dy, cv::Scalar(255, 0, 0));
+            // Plot all the vectors on the roomba
+            plot_hist_points(roomba_region_dx, roomba_region_dy, cv::Scalar(0, 0, 255));
+            // Plot all the vectors not in the rejection regions
+            plot_hist_points(dx, dy, cv::Scalar(0, 255, 0));
+
+            const double sampled_filtered_diff_x
+              = (filtered_u_x - sample_u_x) * hist_scale_factor;
+
+            const double sampled_filtered_diff_y
+              = (filtered_u_y - sample_u_y) * hist_scale_factor;
+
+            // Plot the element acceptance boundary
+            cv::ellipse(hist_image,
+                        cv::Point(hist_image.size().width / 2,
+                                  hist_image.size().height / 2),
+                        cv::Size(std::sqrt(max_normalized_element_variance
+                                               * sample_eigenvalue_0)
+                                     * hist_scale_factor,
+                                 std::sqrt(max_normalized_element_variance
+                                               * sample_eigenvalue_1)
+                                     * hist_scale_factor),
+                        sample_angle,
+                        0.0, // Draw the whole ellipse
+                        360.0, // Draw the whole ellipse,
+                        cv::Scalar(255, 0, 0));
+
+            // Plot the filtered sample max variance limit
+            cv::circle(hist_image,
+                        cv::Point(sampled_filtered_diff_x + hist_image.size().width / 2,
+                                  sampled_filtered_diff_y + hist_image.size().height / 2),
+                       std::sqrt(max_filtered_variance)
+                           * hist_scale_factor,
+                       cv::Scalar(255, 255, 255));
+
+            // Plot the filtered sample variance
+            cv::ellipse(hist_image,
+                        cv::Point(sampled_filtered_diff_x + hist_image.size().width / 2,
+                                  sampled_filtered_diff_y + hist_image.size().height / 2),
+                        cv::Size(std::sqrt(filtered_eigenvalue_0)
+                                     * hist_scale_factor,
+                                 std::sqrt(filtered_eigenvalue_1)
+                                     * hist_scale_factor),
+                        filtered_angle,
+                        0.0, // Draw the whole ellipse
+                        360.0, // Draw the whole ellipse,
+                        cv::Scalar(255, 255, 0));
+
+            // Plot two lines that intersect at the sample average
+            cv::line(hist_image,
+                     cv::Point(hist_image.size().width/2,0),
+                     cv::Point(hist_image.size().width/2,
+                               hist_image.size().height),
+                     cv::Scalar(255, 0, 0));
+            cv::line(hist_image,
+                     cv::Point(0, hist_image.size().height/2),
+                     cv::Point(hist_image.size().width,
+                               hist_image.size().height/2),
+                     cv::Scalar(255, 0, 0));
+
+            // Plot two lines that intersect at the filtered average
+            cv::line(hist_image,
+                     cv::Point(sampled_filtered_diff_x
+                                   + hist_image.size().width/2,
+                               0),
+                     cv::Point(sampled_filtered_diff_x
+                                   + hist_image.size().width/2,
+                               hist_image.size().height),
+                     cv::Scalar(255, 255, 0));
+            cv::line(hist_image,
+                     cv::Point(0,
+                               sampled_filtered_diff_y
+                                   + hist_image.size().height/2),
+                     cv::Point(hist_image.size().width,
+                               sampled_filtered_diff_y
+                                   + hist_image.size().height/2),
+                     cv::Scalar(255, 255, 0));
+
+            // Put text on image about vector stats
+            // How many vectors were found by flow
+            cv::putText(hist_image,
+                        std::string("Starting vectors: ")
+                            + std::to_string(dx.size()
+                                             + num_rejection_region
+                                             + num_roomba_region),
+                        cv::Point(0, 15),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+            // How many vectors were rejected by image region
+            cv::putText(hist_image,
+                        std::string("In rejection region: ")
+                            + std::to_string(num_rejection_region),
+                        cv::Point(0, 30),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+            // How many vectors were rejected by roomba region
+            cv::putText(hist_image,
+                        std::string("In roomba region: ")
+                            + std::to_string(num_roomba_region),
+                        cv::Point(0, 45),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+            // How many vectors were rejected by stat filter
+            cv::putText(hist_image,
+                        std::string("Exceed element var: ")
+                            + std::to_string(dx.size() - no_outlier_count),
+                        cv::Point(0, 60),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+            // How many vectors were accepted after statistical filtering
+            cv::putText(hist_image,
+                        std::string("Left post stat filter: ")
+                            + std::to_string(no_outlier_count),
+                        cv::Point(0, 75),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+            // Eigen values corresponding to the max element variance
+            cv::putText(hist_image,
+                        std::string("Sample std dev acceptance: ")
+                            + std::to_string(std::sqrt(max_normalized_element_variance
+                                               * sample_eigenvalue_0))
+                            + std::string(", ")
+                            + std::to_string(std::sqrt(max_normalized_element_variance
+                                               * sample_eigenvalue_1)),
+                        cv::Point(0, 90),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+            // Sample average
+            cv::putText(hist_image,
+                        std::string("Sample avg: ")
+                            + std::to_string(sample_u_x)
+                            + std::string(", ")
+                            + std::to_string(sample_u_y),
+                        cv::Point(0, 105),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+            // Filtered sample std dev
+            cv::putText(hist_image,
+                        std::string("Filtered sample std dev: ")
+                            + std::to_string(std::sqrt(filtered_eigenvalue_0))
+                            + std::string(", ")
+                            + std::to_string(std::sqrt(filtered_eigenvalue_1)),
+                        cv::Point(0, 120),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+            // Filtered sample average
+            cv::putText(hist_image,
+                        std::string("Filtered sample avg: ")
+                            + std::to_string(filtered_u_x)
+                            + std::string(", ")
+                            + std::to_string(filtered_u_y),
+                        cv::Point(0, 135),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+            // Sample vs filtered difference
+            cv::putText(hist_image,
+                        std::string("Diff filtered and sample avg: ")
+                            + std::to_string(filtered_u_x - sample_u_x)
+                            + std::string(", ")
+                            + std::to_string(filtered_u_y - sample_u_y),
+                        cv::Point(0, 150),
+                        cv::FONT_HERSHEY_SIMPLEX,
+                        0.5,
+                        cv::Scalar(255, 255, 255));
+
+            return hist_image;
         };
 
-        // Plot all the vectors in the rejection region
-        //plot_hist_points(rejection_region_dx, rejection_region_dy, cv::Scalar(255, 0, 0));
-        // Plot all the vectors on the roomba
-        plot_hist_points(roomba_region_dx, roomba_region_dy, cv::Scalar(0, 0, 255));
-        // Plot all the vectors not in the rejection regions
-        plot_hist_points(dx, dy, cv::Scalar(0, 255, 0));
-
-        const double sampled_filtered_diff_x
-          = (filtered_u_x - sample_u_x) * hist_scale_factor;
-
-        const double sampled_filtered_diff_y
-          = (filtered_u_y - sample_u_y) * hist_scale_factor;
-
-        // Plot the element acceptance boundary
-        cv::ellipse(hist_image,
-                    cv::Point(hist_image.size().width / 2,
-                              hist_image.size().height / 2),
-                    cv::Size(std::sqrt(flow_estimator_settings_.max_normalized_element_variance
-                                           * sample_covariance_eigen.eigenvalues()[0])
-                                 * hist_scale_factor,
-                             std::sqrt(flow_estimator_settings_.max_normalized_element_variance
-                                           * sample_covariance_eigen.eigenvalues()[1])
-                                 * hist_scale_factor),
-                    std::atan2(-sample_covariance_eigen.eigenvectors().col(0)[1],
-                               sample_covariance_eigen.eigenvectors().col(0)[0])
-                        * 180.0 / CV_PI,
-                    0.0, // Draw the whole ellipse
-                    360.0, // Draw the whole ellipse,
-                    cv::Scalar(255, 0, 0));
-
-        // Plot the filtered sample max variance limit
-        cv::circle(hist_image,
-                    cv::Point(sampled_filtered_diff_x + hist_image.size().width / 2,
-                              sampled_filtered_diff_y + hist_image.size().height / 2),
-                   std::sqrt(flow_estimator_settings_.max_filtered_variance)
-                       * hist_scale_factor,
-                   cv::Scalar(255, 255, 255));
-
-        // Plot the filtered sample variance
-        cv::ellipse(hist_image,
-                    cv::Point(sampled_filtered_diff_x + hist_image.size().width / 2,
-                              sampled_filtered_diff_y + hist_image.size().height / 2),
-                    cv::Size(std::sqrt(filtered_covariance_eigen.eigenvalues()[0])
-                                 * hist_scale_factor,
-                             std::sqrt(filtered_covariance_eigen.eigenvalues()[1])
-                                 * hist_scale_factor),
-                    std::atan2(-filtered_covariance_eigen.eigenvectors().col(0)[1],
-                               filtered_covariance_eigen.eigenvectors().col(0)[0])
-                        * 180.0 / CV_PI,
-                    0.0, // Draw the whole ellipse
-                    360.0, // Draw the whole ellipse,
-                    cv::Scalar(255, 255, 0));
-
-        // Plot two lines that intersect at the sample average
-        cv::line(hist_image,
-                 cv::Point(hist_image.size().width/2,0),
-                 cv::Point(hist_image.size().width/2,
-                           hist_image.size().height),
-                 cv::Scalar(255, 0, 0));
-        cv::line(hist_image,
-                 cv::Point(0, hist_image.size().height/2),
-                 cv::Point(hist_image.size().width,
-                           hist_image.size().height/2),
-                 cv::Scalar(255, 0, 0));
-
-        // Plot two lines that intersect at the filtered average
-        cv::line(hist_image,
-                 cv::Point(sampled_filtered_diff_x
-                               + hist_image.size().width/2,
-                           0),
-                 cv::Point(sampled_filtered_diff_x
-                               + hist_image.size().width/2,
-                           hist_image.size().height),
-                 cv::Scalar(255, 255, 0));
-        cv::line(hist_image,
-                 cv::Point(0,
-                           sampled_filtered_diff_y
-                               + hist_image.size().height/2),
-                 cv::Point(hist_image.size().width,
-                           sampled_filtered_diff_y
-                               + hist_image.size().height/2),
-                 cv::Scalar(255, 255, 0));
-
-        // Put text on image about vector stats
-        // How many vectors were found by flow
-        cv::putText(hist_image,
-                    std::string("Starting vectors: ")
-                        + std::to_string(dx.size()
-                                         + rejection_region_dx.size()
-                                         + roomba_region_dx.size()),
-                    cv::Point(0, 15),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-        // How many vectors were rejected by image region
-        cv::putText(hist_image,
-                    std::string("In rejection region: ")
-                        + std::to_string(rejection_region_dx.size()),
-                    cv::Point(0, 30),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-        // How many vectors were rejected by roomba region
-        cv::putText(hist_image,
-                    std::string("In roomba region: ")
-                        + std::to_string(roomba_region_dx.size()),
-                    cv::Point(0, 45),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-        // How many vectors were rejected by stat filter
-        cv::putText(hist_image,
-                    std::string("Exceed element var: ")
-                        + std::to_string(dx.size() - no_outlier_deltas_x.size()),
-                    cv::Point(0, 60),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-        // How many vectors were accepted after statistical filtering
-        cv::putText(hist_image,
-                    std::string("Left post stat filter: ")
-                        + std::to_string(no_outlier_deltas_x.size()),
-                    cv::Point(0, 75),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-        // Eigen values corresponding to the max element variance
-        cv::putText(hist_image,
-                    std::string("Sample std dev acceptance: ")
-                        + std::to_string(std::sqrt(flow_estimator_settings_.max_normalized_element_variance
-                                           * sample_covariance_eigen.eigenvalues()[0]))
-                        + std::string(", ")
-                        + std::to_string(std::sqrt(flow_estimator_settings_.max_normalized_element_variance
-                                           * sample_covariance_eigen.eigenvalues()[1])),
-                    cv::Point(0, 90),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-        // Sample average
-        cv::putText(hist_image,
-                    std::string("Sample avg: ")
-                        + std::to_string(sample_u_x)
-                        + std::string(", ")
-                        + std::to_string(sample_u_y),
-                    cv::Point(0, 105),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-        // Filtered sample std dev
-        cv::putText(hist_image,
-                    std::string("Filtered sample std dev: ")
-                        + std::to_string(std::sqrt(filtered_covariance_eigen.eigenvalues()[0]))
-                        + std::string(", ")
-                        + std::to_string(std::sqrt(filtered_covariance_eigen.eigenvalues()[1])),
-                    cv::Point(0, 120),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-        // Filtered sample average
-        cv::putText(hist_image,
-                    std::string("Filtered sample avg: ")
-                        + std::to_string(filtered_u_x)
-                        + std::string(", ")
-                        + std::to_string(filtered_u_y),
-                    cv::Point(0, 135),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-        // Sample vs filtered difference
-        cv::putText(hist_image,
-                    std::string("Diff filtered and sample avg: ")
-                        + std::to_string(filtered_u_x - sample_u_x)
-                        + std::string(", ")
-                        + std::to_string(filtered_u_y - sample_u_y),
-                    cv::Point(0, 150),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
-
-
-        cv_bridge::CvImage cv_hist_image {
-            std_msgs::Header(),
-            sensor_msgs::image_encodings::RGB8,
-            hist_image
-        };
-
-        cv_hist_image.header.stamp = time;
-
-        debug_hist_pub_.publish(cv_hist_image);
+        std_msgs::Header header;
+        header.stamp = time;
+        debug_hist_pub_.publish(header,
+                                sensor_msgs::image_encodings::RGB8,
+                                std::move(render));
     }
 
     return flow_average_accepted;
 }
 
-void OpticalFlowEstimator::findFeatureVectors(
+bool OpticalFlowEstimator::findFeatureVectors(
         const cv::cuda::GpuMat& curr_frame,
-        const cv::cuda::GpuMat& /*curr_gray_frame*/,
+        const cv::cuda::GpuMat& curr_gray_frame,
         const cv::cuda::GpuMat& /*last_frame*/,
         const cv::cuda::GpuMat& last_gray_frame,
+        const std::vector<RoombaImageLocation>& roomba_image_locations,
         std::vector<cv::Point2f>& tails,
         std::vector<cv::Point2f>& heads,
         std::vector<uchar>& status,
-        bool debug) const
+        kernels::FlowFilterCounts& filter_counts,
+        bool debug,
+        cv::cuda::Stream& stream) const
 {
     const ros::WallTime start = ros::WallTime::now();
 
     // Perform feature detection
     cv::cuda::GpuMat d_prev_pts;
-    gpu_features_detector_->detect(last_gray_frame, d_prev_pts);
+    getPointsToTrack(last_gray_frame,
+                     roomba_image_locations,
+                     d_prev_pts,
+                     stream);
 
     if (debug_settings_.debug_times) {
         ROS_WARN_STREAM("post detector: " << ros::WallTime::now() - start);
@@ -1112,39 +1294,348 @@ void OpticalFlowEstimator::findFeatureVectors(
     cv::cuda::GpuMat d_next_pts;
     cv::cuda::GpuMat d_status;
 
+    // Images to track between
+    const cv::cuda::GpuMat& last_flow_frame
+        = flow_estimator_settings_.grayscale_flow ? last_gray_frame
+                                                  : last_scaled_image_;
+    const cv::cuda::GpuMat& curr_flow_frame
+        = flow_estimator_settings_.grayscale_flow ? curr_gray_frame
+                                                  : curr_frame;
+
     // Perform optical flow
-    gpu_d_pyrLK_->calc(last_scaled_image_,
-                  curr_frame,
-                  d_prev_pts,
-                  d_next_pts,
-                  d_status);
+    if (flow_estimator_settings_.use_cached_pyramids) {
+        if (!last_pyramid_valid_) {
+            buildPyramid(last_flow_frame, last_pyramid_, stream);
+        }
+        buildPyramid(curr_flow_frame, curr_pyramid_, stream);
+
+        kernels::PyrLKParams params;
+        params.win_size = flow_estimator_settings_.win_size;
+        params.max_level = flow_estimator_settings_.max_level;
+        params.iters = flow_estimator_settings_.iters;
+        params.min_eig_threshold
+            = kernels::kDefaultPyrLKMinEigThreshold;
+        kernels::pyrLK(last_pyramid_,
+                       curr_pyramid_,
+                       d_prev_pts,
+                       d_next_pts,
+                       d_status,
+                       params,
+                       stream);
+
+        // This frame is the last frame next time
+        std::swap(last_pyramid_, curr_pyramid_);
+        last_pyramid_valid_ = true;
+    } else {
+        gpu_d_pyrLK_->calc(last_flow_frame,
+                      curr_flow_frame,
+                      d_prev_pts,
+                      d_next_pts,
+                      d_status,
+                      cv::noArray(),
+                      stream);
+    }
 
     if (debug_settings_.debug_times) {
         ROS_WARN_STREAM("PYRLK sparse: " << ros::WallTime::now() - start);
     }
 
-    cv_utils::downloadVector(d_prev_pts, tails);
-    cv_utils::downloadVector(d_next_pts, heads);
-    cv_utils::downloadVector(d_status, status);
+    // The debug outputs want every vector, not just the accepted ones
+    const bool draw_vectors_image = debug
+                                 && debug_settings_.debug_vectors_image
+                                 && !curr_frame.empty()
+                                 && debug_velocity_vector_image_pub_.wanted();
+    const bool debug_all_vectors = draw_vectors_image
+                                || (debug
+                                 && debug_settings_.debug_hist
+                                 && debug_hist_pub_.wanted());
+    const bool filtered_on_gpu = flow_estimator_settings_.gpu_vector_filter
+                              && !debug_all_vectors
+                              && filterFeatureVectorsGpu(d_prev_pts,
+                                                         d_next_pts,
+                                                         d_status,
+                                                         roomba_image_locations,
+                                                         tails,
+                                                         heads,
+                                                         status,
+                                                         filter_counts,
+                                                         stream);
+    if (!filtered_on_gpu) {
+        cv_utils::downloadVector(d_prev_pts, tails, stream);
+        cv_utils::downloadVector(d_next_pts, heads, stream);
+        cv_utils::downloadVector(d_status, status, stream);
+    }
+
+    // Tracks carry on from every point pyrLK tracked, not only the ones
+    // kept for the velocity estimate, so with the gpu filter they need the
+    // unfiltered vectors
+    if (flow_estimator_settings_.tracking_mode) {
+        if (filtered_on_gpu) {
+            std::vector<cv::Point2f> tracked_heads;
+            std::vector<uchar> tracked_status;
+            cv_utils::downloadVector(d_next_pts, tracked_heads, stream);
+            cv_utils::downloadVector(d_status, tracked_status, stream);
+            updateTrackedPoints(tracked_heads,
+                                tracked_status,
+                                curr_flow_frame.size());
+        } else {
+            updateTrackedPoints(heads, status, curr_flow_frame.size());
+        }
+    }
 
     // Publish debugging image with all vectors drawn
-    if (debug && debug_settings_.debug_vectors_image) {
-        // Draw arrows
+    if (draw_vectors_image) {
         cv::Mat arrow_image;
-        curr_frame.download(arrow_image);
-        cv_utils::drawArrows(arrow_image,
-                             tails,
-                             heads,
-                             status,
-                             cv::Scalar(255, 0, 0));
-
-        cv_bridge::CvImage cv_image {
-            std_msgs::Header(),
-            image_encoding_,
-            arrow_image
+        curr_frame.download(arrow_image, stream);
+        stream.waitForCompletion();
+
+        // Drawn in the background, so it works on copies of everything
+        auto render = [arrow_image, tails, heads, status]() mutable {
+            cv_utils::drawArrows(arrow_image,
+                                 tails,
+                                 heads,
+                                 status,
+                                 cv::Scalar(255, 0, 0));
+            return arrow_image;
         };
 
-        debug_velocity_vector_image_pub_.publish(cv_image.toImageMsg());
+        debug_velocity_vector_image_pub_.publish(std_msgs::Header(),
+                                                 image_encoding_,
+                                                 std::move(render));
+    }
+
+    return filtered_on_gpu;
+}
+
+bool OpticalFlowEstimator::filterFeatureVectorsGpu(
+        const cv::cuda::GpuMat& d_prev_pts,
+        const cv::cuda::GpuMat& d_next_pts,
+        const cv::cuda::GpuMat& d_status,
+        const std::vector<RoombaImageLocation>& roomba_image_locations,
+        std::vector<cv::Point2f>& tails,
+        std::vector<cv::Point2f>& heads,
+        std::vector<uchar>& status,
+        kernels::FlowFilterCounts& filter_counts,
+        cv::cuda::Stream& stream) const
+{
+    if (d_prev_pts.empty()
+     || roomba_image_locations.size()
+            > static_cast<size_t>(kernels::kMaxFilterRoombas)) {
+        return false;
+    }
+
+    const double x_cutoff
+        = flow_estimator_settings_.x_cutoff_region_velocity_measurement;
+    const double y_cutoff
+        = flow_estimator_settings_.y_cutoff_region_velocity_measurement;
+
+    // Same bounds as findAverageVector
+    kernels::FlowFilterParams params;
+    params.min_x = target_size_.width * x_cutoff;
+    params.max_x = target_size_.width * (1.0 - x_cutoff);
+    params.min_y = target_size_.height * y_cutoff;
+    params.max_y = target_size_.height * (1.0 - y_cutoff);
+
+    double roomba_scale;
+    double roomba_offset_x;
+    double roomba_offset_y;
+    getRoombaTransform(target_size_,
+                       roomba_scale,
+                       roomba_offset_x,
+                       roomba_offset_y);
+    params.roomba_scale = roomba_scale;
+    params.roomba_offset_x = roomba_offset_x;
+    params.roomba_offset_y = roomba_offset_y;
+
+    params.roomba_count = roomba_image_locations.size();
+    for (size_t i = 0; i < roomba_image_locations.size(); i++) {
+        const RoombaImageLocation& roomba = roomba_image_locations[i];
+        params.roomba_x[i] = roomba.x;
+        params.roomba_y[i] = roomba.y;
+        params.roomba_radius_sq[i] = roomba.radius * roomba.radius;
+    }
+
+    kernels::filterFlowVectors(d_prev_pts,
+                               d_next_pts,
+                               d_status,
+                               params,
+                               d_filtered_tails_,
+                               d_filtered_heads_,
+                               d_filter_counts_,
+                               stream);
+
+    cv::Mat counts_cpu(1,
+                       sizeof(kernels::FlowFilterCounts),
+                       CV_8UC1,
+                       &filter_counts);
+    d_filter_counts_.download(counts_cpu, stream);
+    stream.waitForCompletion();
+
+    // Only bring back the accepted vectors
+    if (filter_counts.accepted > 0) {
+        const cv::Range accepted(0, filter_counts.accepted);
+        cv_utils::downloadVector(d_filtered_tails_.colRange(accepted),
+                                 tails,
+                                 stream);
+        cv_utils::downloadVector(d_filtered_heads_.colRange(accepted),
+                                 heads,
+                                 stream);
+    } else {
+        tails.clear();
+        heads.clear();
+    }
+    status.assign(filter_counts.accepted, 1);
+
+    return true;
+}
+
+void OpticalFlowEstimator::getRoombaTransform(const cv::Size& image_size,
+                                              double& scale,
+                                              double& offset_x,
+                                              double& offset_y) const
+{
+    // Roomba locations are in units of the image width (of the uncropped
+    // image when cropping)
+    scale = 1.0 / image_size.width;
+    offset_x = 0.0;
+    offset_y = 0.0;
+    if(flow_estimator_settings_.crop) {
+        double expected_width  = static_cast<double>(expected_input_size_.width);
+        double expected_height = static_cast<double>(expected_input_size_.height);
+        double crop_width      = static_cast<double>(flow_estimator_settings_.crop_width);
+        double crop_height     = static_cast<double>(flow_estimator_settings_.crop_height);
+
+        scale = (1.0 / image_size.width) * (crop_width / expected_width);
+        offset_x = (expected_width - crop_width) / 2.0 / expected_width;
+        offset_y = (expected_height - crop_height) / 2.0 / expected_width;
+    }
+}
+
+void OpticalFlowEstimator::getPointsToTrack(
+        const cv::cuda::GpuMat& last_gray_frame,
+        const std::vector<RoombaImageLocation>& roomba_image_locations,
+        cv::cuda::GpuMat& d_prev_pts,
+        cv::cuda::Stream& stream) const
+{
+    const bool mask_roombas = flow_estimator_settings_.mask_roomba_features
+                           && !roomba_image_locations.empty();
+
+    // Keeps the detector away from the roombas, and in tracking mode from
+    // the existing tracks
+    const auto upload_detection_mask = [&](bool mask_tracks) {
+        detection_mask_.create(last_gray_frame.size(), CV_8UC1);
+        detection_mask_.setTo(cv::Scalar(255));
+
+        if (mask_roombas) {
+            double scale;
+            double offset_x;
+            double offset_y;
+            getRoombaTransform(target_size_, scale, offset_x, offset_y);
+            for (const RoombaImageLocation& roomba : roomba_image_locations) {
+                cv::circle(detection_mask_,
+                           cv::Point2f((roomba.x - offset_x) / scale,
+                                       (roomba.y - offset_y) / scale),
+                           std::ceil(roomba.radius / scale),
+                           cv::Scalar(0),
+                           -1);
+            }
+        }
+
+        if (mask_tracks) {
+            for (const cv::Point2f& point : tracked_points_) {
+                cv::circle(detection_mask_,
+                           point,
+                           flow_estimator_settings_.min_dist,
+                           cv::Scalar(0),
+                           -1);
+            }
+        }
+
+        // Waits for the mask to be copied out, so it can be redrawn next
+        // frame
+        gpu_detection_mask_.upload(detection_mask_, stream);
+        stream.waitForCompletion();
+    };
+
+    if (!flow_estimator_settings_.tracking_mode
+     || tracked_points_.empty()
+     || frames_since_detection_ >= flow_estimator_settings_.redetect_interval) {
+        if (mask_roombas) {
+            upload_detection_mask(false);
+            gpu_features_detector_->detect(last_gray_frame,
+                                           d_prev_pts,
+                                           gpu_detection_mask_,
+                                           stream);
+        } else {
+            gpu_features_detector_->detect(last_gray_frame,
+                                           d_prev_pts,
+                                           cv::noArray(),
+                                           stream);
+        }
+        frames_since_detection_ = 0;
+        return;
+    }
+
+    frames_since_detection_++;
+
+    if (static_cast<int>(tracked_points_.size())
+            < flow_estimator_settings_.min_vectors) {
+        // Only look for new corners away from the existing tracks
+        upload_detection_mask(true);
+
+        cv::cuda::GpuMat d_new_pts;
+        gpu_features_detector_->detect(last_gray_frame,
+                                       d_new_pts,
+                                       gpu_detection_mask_,
+                                       stream);
+
+        if (!d_new_pts.empty()) {
+            std::vector<cv::Point2f> new_points;
+            cv_utils::downloadVector(d_new_pts, new_points, stream);
+            for (const cv::Point2f& point : new_points) {
+                if (static_cast<int>(tracked_points_.size())
+                        >= flow_estimator_settings_.points) {
+                    break;
+                }
+                tracked_points_.push_back(point);
+            }
+        }
+    }
+
+    // tracked_points_ isn't changed again until the tracked points are
+    // downloaded, after this has run
+    d_prev_pts.upload(cv::Mat(1,
+                              tracked_points_.size(),
+                              CV_32FC2,
+                              tracked_points_.data()),
+                      stream);
+}
+
+void OpticalFlowEstimator::updateTrackedPoints(
+        const std::vector<cv::Point2f>& heads,
+        const std::vector<uchar>& status,
+        const cv::Size& image_size) const
+{
+    const cv::Rect2f image_rect (0, 0, image_size.width, image_size.height);
+
+    tracked_points_.clear();
+    for (size_t i = 0; i < heads.size(); i++) {
+        if (status[i] && image_rect.contains(heads[i])) {
+            tracked_points_.push_back(heads[i]);
+        }
+    }
+}
+
+void OpticalFlowEstimator::buildPyramid(
+        const cv::cuda::GpuMat& image,
+        std::vector<cv::cuda::GpuMat>& pyramid,
+        cv::cuda::Stream& stream) const
+{
+    pyramid.resize(flow_estimator_settings_.max_level + 1);
+    // Copy the base, so the pyramid stays valid if the caller reuses `image`
+    image.copyTo(pyramid[0], stream);
+    for (int i = 1; i <= flow_estimator_settings_.max_level; i++) {
+        cv::cuda::pyrDown(pyramid[i - 1], pyramid[i], stream);
     }
 }
 
@@ -1172,20 +1663,26 @@ void OpticalFlowEstimator::processImage(const cv::cuda::GpuMat& image,
                                         const ros::Time& time,
                                         const std::vector<RoombaImageLocation>&
                                             roomba_image_locations,
-                                        bool debug) const
+                                        bool debug,
+                                        cv::cuda::Stream& stream) const
 {
     // Find vectors from image
     std::vector<cv::Point2f> tails;
     std::vector<cv::Point2f> heads;
     std::vector<uchar> status;
-    findFeatureVectors(image,
-                       gray_image,
-                       last_scaled_image_,
-                       last_scaled_grayscale_image_,
-                       tails,
-                       heads,
-                       status,
-                       debug);
+    kernels::FlowFilterCounts filter_counts;
+    const bool filtered_on_gpu = findFeatureVectors(
+            image,
+            gray_image,
+            last_scaled_image_,
+            last_scaled_grayscale_image_,
+            roomba_image_locations,
+            tails,
+            heads,
+            status,
+            filter_counts,
+            debug,
+            stream);
 
     // Calculate the average movement of the features in the camera frame
     cv::Point2f average_vec;
@@ -1200,7 +1697,9 @@ void OpticalFlowEstimator::processImage(const cv::cuda::GpuMat& image,
             image,
             time,
             debug,
-            average_vec);
+            filtered_on_gpu ? &filter_counts : nullptr,
+            average_vec,
+            stream);
 
     if (!found_average) {
         ROS_WARN("iarc7_vision: OpticalFlow image with no valid features, returning");
@@ -1208,9 +1707,13 @@ void OpticalFlowEstimator::processImage(const cv::cuda::GpuMat& image,
     }
 
     // Publish debugging image with average vector drawn
-    if (debug && debug_settings_.debug_average_vector_image) {
+    if (debug
+     && debug_settings_.debug_average_vector_image
+     && !last_scaled_image_.empty()
+     && debug_average_velocity_vector_image_pub_.wanted()) {
         cv::Mat arrow_image;
-        last_scaled_image_.download(arrow_image);
+        last_scaled_image_.download(arrow_image, stream);
+        stream.waitForCompletion();
 
         const cv::Point2f start_point(target_size_.width / 2.0,
                                       target_size_.height / 2.0);
@@ -1218,20 +1721,19 @@ void OpticalFlowEstimator::processImage(const cv::cuda::GpuMat& image,
         const cv::Point2f end_point(average_vec.x + start_point.x,
                                     average_vec.y + start_point.y);
 
-        cv_utils::drawArrows(arrow_image,
-                             { start_point },
-                             { end_point },
-                             { 1 },
-                             cv::Scalar(255, 0, 0));
-
-        const cv_bridge::CvImage cv_image {
-            std_msgs::Header(),
-            image_encoding_,
-            arrow_image
+        // Drawn in the background, so it works on copies of everything
+        auto render = [arrow_image, start_point, end_point]() mutable {
+            cv_utils::drawArrows(arrow_image,
+                                 { start_point },
+                                 { end_point },
+                                 { 1 },
+                                 cv::Scalar(255, 0, 0));
+            return arrow_image;
         };
 
-        debug_average_velocity_vector_image_pub_.publish(
-                cv_image.toImageMsg());
+        debug_average_velocity_vector_image_pub_.publish(std_msgs::Header(),
+                                                         image_encoding_,
+                                                         std::move(render));
     }
 
     const geometry_msgs::TwistWithCovarianceStamped velocity
@@ -1252,12 +1754,63 @@ void OpticalFlowEstimator::processImage(const cv::cuda::GpuMat& image,
     }
 }
 
+bool OpticalFlowEstimator::needColorImages(bool debug) const
+{
+    if (!flow_estimator_settings_.grayscale_flow) {
+        return true;
+    }
+
+    // In grayscale mode only the debug images use the color frames
+    return debug_filtered_velocity_vector_image_pub_.wanted()
+        || (debug
+         && debug_settings_.debug_vectors_image
+         && debug_velocity_vector_image_pub_.wanted())
+        || (debug
+         && debug_settings_.debug_average_vector_image
+         && debug_average_velocity_vector_image_pub_.wanted());
+}
+
 void OpticalFlowEstimator::resizeAndConvertImages(const cv::cuda::GpuMat& image,
                                                   cv::cuda::GpuMat& scaled,
-                                                  cv::cuda::GpuMat& gray) const
+                                                  cv::cuda::GpuMat& gray,
+                                                  bool need_scaled,
+                                                  cv::cuda::Stream& stream) const
 {
     const ros::WallTime start = ros::WallTime::now();
 
+    if (flow_estimator_settings_.grayscale_flow) {
+        const cv::Rect roi = flow_estimator_settings_.crop
+            ? cv::Rect((expected_input_size_.width - flow_estimator_settings_.crop_width)/2,
+                       (expected_input_size_.height - flow_estimator_settings_.crop_height)/2,
+                       flow_estimator_settings_.crop_width,
+                       flow_estimator_settings_.crop_height)
+            : cv::Rect(0, 0, image.cols, image.rows);
+
+        kernels::cropResizeGray(image,
+                                roi,
+                                target_size_,
+                                gray,
+                                stream);
+
+        if (need_scaled) {
+            cv::cuda::resize(cv::cuda::GpuMat(image, roi),
+                             scaled,
+                             target_size_,
+                             0,
+                             0,
+                             cv::INTER_LINEAR,
+                             stream);
+        } else {
+            scaled.release();
+        }
+
+        if (debug_settings_.debug_times) {
+            ROS_WARN_STREAM("post resize and convert: "
+                         << ros::WallTime::now() - start);
+        }
+        return;
+    }
+
     if(flow_estimator_settings_.crop) {
         cv::cuda::GpuMat cropped
           = cv::cuda::GpuMat(
@@ -1269,12 +1822,20 @@ void OpticalFlowEstimator::resizeAndConvertImages(const cv::cuda::GpuMat& image,
 
         cv::cuda::resize(cropped,
                         scaled,
-                        target_size_);
+                        target_size_,
+                        0,
+                        0,
+                        cv::INTER_LINEAR,
+                        stream);
     }
     else {
         cv::cuda::resize(image,
                         scaled,
-                        target_size_);
+                        target_size_,
+                        0,
+                        0,
+                        cv::INTER_LINEAR,
+                        stream);
     }
 
     if (debug_settings_.debug_times) {
@@ -1283,7 +1844,9 @@ void OpticalFlowEstimator::resizeAndConvertImages(const cv::cuda::GpuMat& image,
 
     cv::cuda::cvtColor(scaled,
                       gray,
-                      grayscale_conversion_constant_);
+                      grayscale_conversion_constant_,
+                      0,
+                      stream);
 
     if (debug_settings_.debug_times) {
         ROS_WARN_STREAM("post cvtColor: " << ros::WallTime::now() - start);
@@ -1296,10 +1859,10 @@ bool OpticalFlowEstimator::updateFilteredPosition(const ros::Time& time,
     geometry_msgs::TransformStamped filtered_position_transform_stamped;
     geometry_msgs::TransformStamped camera_to_level_quad_tf_stamped;
 
-    bool success = transform_wrapper_.getTransformAtTime(
+    bool success = transform_source_.getTransformAtTime(
             filtered_position_transform_stamped,
             "map",
-            "bottom_camera_r200_rgb_optical_frame",
+            camera_frame_,
             time,
             timeout);
 
@@ -1307,10 +1870,10 @@ bool OpticalFlowEstimator::updateFilteredPosition(const ros::Time& time,
         return false;
     }
 
-    success = transform_wrapper_.getTransformAtTime(
+    success = transform_source_.getTransformAtTime(
             camera_to_level_quad_tf_stamped,
             "level_quad",
-            "bottom_camera_r200_rgb_optical_frame",
+            camera_frame_,
             time,
             timeout);
 
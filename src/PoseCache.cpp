@@ -0,0 +1,215 @@
+#include "iarc7_vision/PoseCache.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include <tf2/exceptions.h>
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+
+namespace iarc7_vision {
+
+PoseCache::PoseCache(const TransformSource& fallback,
+                     const std::vector<FramePair>& pairs,
+                     const ros::Duration& length)
+    : fallback_(fallback),
+      length_(length),
+      buffer_(length + ros::Duration(1.0)),
+      mutex_(),
+      updated_cv_(),
+      histories_(),
+      callback_queue_(),
+      tf_sub_(),
+      tf_static_sub_(),
+      spinner_(1, &callback_queue_)
+{
+    ROS_ASSERT(length_ > ros::Duration(0));
+
+    for (const FramePair& pair : pairs) {
+        histories_.push_back(History{pair, {}});
+    }
+
+    ros::NodeHandle nh;
+    nh.setCallbackQueue(&callback_queue_);
+    tf_sub_ = nh.subscribe("/tf",
+                           100,
+                           &PoseCache::tfCallback,
+                           this,
+                           ros::TransportHints().tcpNoDelay());
+    tf_static_sub_ = nh.subscribe("/tf_static",
+                                  100,
+                                  &PoseCache::tfStaticCallback,
+                                  this,
+                                  ros::TransportHints().tcpNoDelay());
+    spinner_.start();
+}
+
+PoseCache::~PoseCache()
+{
+    spinner_.stop();
+}
+
+void PoseCache::tfCallback(const tf2_msgs::TFMessage::ConstPtr& message)
+{
+    addTransforms(*message, false);
+}
+
+void PoseCache::tfStaticCallback(const tf2_msgs::TFMessage::ConstPtr& message)
+{
+    addTransforms(*message, true);
+}
+
+void PoseCache::addTransforms(const tf2_msgs::TFMessage& message,
+                              bool is_static)
+{
+    for (const geometry_msgs::TransformStamped& transform
+            : message.transforms) {
+        buffer_.setTransform(transform, "pose_cache", is_static);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (History& history : histories_) {
+            geometry_msgs::TransformStamped transform;
+            try {
+                transform = buffer_.lookupTransform(history.pair.first,
+                                                    history.pair.second,
+                                                    ros::Time(0));
+            } catch (const tf2::TransformException&) {
+                // Not every part of the chain has been seen yet
+                continue;
+            }
+
+            if (!history.transforms.empty()) {
+                const ros::Time& newest
+                    = history.transforms.back().header.stamp;
+                if (transform.header.stamp + length_ < newest) {
+                    // Time jumped back, e.g. a bag started over
+                    history.transforms.clear();
+                } else if (transform.header.stamp <= newest) {
+                    continue;
+                }
+            }
+
+            history.transforms.push_back(transform);
+            while (transform.header.stamp
+                 - history.transforms.front().header.stamp > length_) {
+                history.transforms.pop_front();
+            }
+        }
+    }
+    updated_cv_.notify_all();
+}
+
+PoseCache::LookupResult PoseCache::lookup(
+        const FramePair& pair,
+        const ros::Time& time,
+        geometry_msgs::TransformStamped& transform) const
+{
+    const auto history = std::find_if(
+            histories_.begin(),
+            histories_.end(),
+            [&](const History& h) { return h.pair == pair; });
+    if (history == histories_.end()) {
+        return LookupResult::Unavailable;
+    }
+
+    const std::deque<geometry_msgs::TransformStamped>& transforms
+        = history->transforms;
+    if (transforms.empty()) {
+        return LookupResult::TooNew;
+    }
+
+    // Same as tf, time 0 means the latest.  A chain of static transforms
+    // has stamp 0 and is valid at any time.
+    if (time.isZero() || transforms.back().header.stamp.isZero()) {
+        transform = transforms.back();
+        return LookupResult::Found;
+    }
+
+    if (time > transforms.back().header.stamp) {
+        return LookupResult::TooNew;
+    }
+
+    if (time < transforms.front().header.stamp) {
+        return LookupResult::Unavailable;
+    }
+
+    // First transform after time, there's one before it since time is in
+    // the history
+    const auto after = std::upper_bound(
+            transforms.begin(),
+            transforms.end(),
+            time,
+            [](const ros::Time& t, const geometry_msgs::TransformStamped& tf) {
+                return t < tf.header.stamp;
+            });
+    const geometry_msgs::TransformStamped& before = *(after - 1);
+    if (after == transforms.end() || before.header.stamp == time) {
+        transform = before;
+        return LookupResult::Found;
+    }
+
+    // Linear in translation and slerp in rotation, like tf
+    const double ratio = (time - before.header.stamp).toSec()
+                       / (after->header.stamp - before.header.stamp).toSec();
+
+    const geometry_msgs::Vector3& t0 = before.transform.translation;
+    const geometry_msgs::Vector3& t1 = after->transform.translation;
+
+    tf2::Quaternion q0;
+    tf2::Quaternion q1;
+    tf2::fromMsg(before.transform.rotation, q0);
+    tf2::fromMsg(after->transform.rotation, q1);
+
+    transform.header.stamp = time;
+    transform.header.frame_id = before.header.frame_id;
+    transform.child_frame_id = before.child_frame_id;
+    transform.transform.translation.x = t0.x + (t1.x - t0.x) * ratio;
+    transform.transform.translation.y = t0.y + (t1.y - t0.y) * ratio;
+    transform.transform.translation.z = t0.z + (t1.z - t0.z) * ratio;
+    transform.transform.rotation = tf2::toMsg(q0.slerp(q1, ratio));
+    return LookupResult::Found;
+}
+
+bool PoseCache::getTransformAtTime(
+        geometry_msgs::TransformStamped& transform,
+        const std::string& target_frame,
+        const std::string& source_frame,
+        const ros::Time& time,
+        const ros::Duration& timeout) const
+{
+    const FramePair pair(target_frame, source_frame);
+    const auto deadline = std::chrono::steady_clock::now()
+                        + std::chrono::duration_cast<
+                              std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double>(
+                                      timeout.toSec()));
+
+    LookupResult result;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        result = lookup(pair, time, transform);
+        while (result == LookupResult::TooNew
+            && updated_cv_.wait_until(lock, deadline)
+                   != std::cv_status::timeout) {
+            result = lookup(pair, time, transform);
+        }
+    }
+
+    if (result == LookupResult::Found) {
+        return true;
+    }
+
+    // If the cache timed out the timeout is used up, so tf only gets a
+    // quick check
+    return fallback_.getTransformAtTime(transform,
+                                        target_frame,
+                                        source_frame,
+                                        time,
+                                        result == LookupResult::Unavailable
+                                            ? timeout
+                                            : ros::Duration(0));
+}
+
+} // namespace iarc7_vision
@@ -1,7 +1,7 @@
 #include <chrono>
-#include <cv_bridge/cv_bridge.h>
 
 #include <sensor_msgs/Image.h>
+#include <sensor_msgs/image_encodings.h>
 #include <std_msgs/Header.h>
 
 #include "iarc7_vision/cv_utils.hpp"
@@ -36,41 +36,89 @@ RoombaBlobDetector::RoombaBlobDetector(const RoombaEstimatorSettings& settings,
               CV_8UC1,
               structuring_element_,
               cv::Point(-1, -1),
-              settings_.morphology_iterations))
+              settings_.morphology_iterations)),
+      segmentation_params_(getSegmentationParams(settings_)),
+      frame_sums_area_(0)
 {
     if (settings_.debug_hsv_slice) {
-        debug_hsv_slice_pub_ = ph.advertise<sensor_msgs::Image>("hsv_slice",
-                                                                10);
+        debug_hsv_slice_pub_.reset(new DebugImagePublisher(
+                ph, "hsv_slice", settings_.debug_image_max_rate));
     }
 
     if (settings_.debug_contours) {
-        debug_contours_pub_ = ph.advertise<sensor_msgs::Image>("contours",
-                                                               10);
+        debug_contours_pub_.reset(new DebugImagePublisher(
+                ph, "contours", settings_.debug_image_max_rate));
     }
 }
 
 void RoombaBlobDetector::thresholdFrame(const cv::cuda::GpuMat& image,
                                         cv::cuda::GpuMat& dst,
-                                        cv::Scalar& mean,
-                                        cv::Scalar& stddev) const
+                                        cv::cuda::Stream& stream) const
 {
     const auto start_time = std::chrono::high_resolution_clock::now();
 
-    cv::cuda::cvtColor(image, hsv_image_, cv::COLOR_RGB2HSV);
-    cv::cuda::split(hsv_image_, hsv_channels_.data());
+    if (settings_.use_fused_segmentation) {
+        kernels::saturationSums(image, saturation_sums_, stream);
+        saturation_sums_.download(saturation_sums_cpu_, stream);
+        kernels::hsvSegmentation(image,
+                                 saturation_sums_,
+                                 image.size().area(),
+                                 segmentation_params_,
+                                 dst,
+                                 stream);
+
+        morphology_open_->apply(dst, dst, stream);
+        morphology_close_->apply(dst, dst, stream);
+
+        // The sums are read once boundMask has waited for the stream, see
+        // getSaturationStatistics.  They're kept around for
+        // detectInRegions.
+        frame_sums_area_ = image.size().area();
+
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        ROS_DEBUG_STREAM("Fused slice and morph: "
+                      << std::chrono::duration_cast<std::chrono::microseconds>(
+                             end_time - start_time).count());
+        return;
+    }
 
-    // Normalize saturation
-    cv::cuda::meanStdDev(hsv_channels_[1], mean, stddev);
-    hsv_channels_[1].convertTo(float_sat_, CV_32FC1);
-    cv::cuda::add(float_sat_, -mean, normalized_sat_, cv::noArray(), CV_32FC1);
-    cv::cuda::multiply(normalized_sat_, 42.5 / stddev, normalized_sat2_);
-    cv::cuda::add(normalized_sat2_, 128, normalized_sat2_8bit_);
-    normalized_sat2_8bit_.convertTo(hsv_channels_[1], CV_8UC1);
+    cv::cuda::cvtColor(image, hsv_image_, cv::COLOR_RGB2HSV, 0, stream);
+    cv::cuda::split(hsv_image_, hsv_channels_.data(), stream);
 
-    cv::cuda::merge(hsv_channels_.data(), 3, hsv_image_);
+    // Normalize saturation
+    double sat_mean, sat_stddev;
+    cv_utils::meanStdDev(hsv_channels_[1],
+                         sat_mean,
+                         sat_stddev,
+                         mean_std_dev_buf_,
+                         stream);
+    frame_mean_ = cv::Scalar(sat_mean);
+    frame_stddev_ = cv::Scalar(sat_stddev);
+    hsv_channels_[1].convertTo(float_sat_, CV_32FC1, stream);
+    cv::cuda::add(float_sat_,
+                  -frame_mean_,
+                  normalized_sat_,
+                  cv::noArray(),
+                  CV_32FC1,
+                  stream);
+    cv::cuda::multiply(normalized_sat_,
+                       42.5 / sat_stddev,
+                       normalized_sat2_,
+                       1,
+                       -1,
+                       stream);
+    cv::cuda::add(normalized_sat2_,
+                  128,
+                  normalized_sat2_8bit_,
+                  cv::noArray(),
+                  -1,
+                  stream);
+    normalized_sat2_8bit_.convertTo(hsv_channels_[1], CV_8UC1, stream);
+
+    cv::cuda::merge(hsv_channels_.data(), 3, hsv_image_, stream);
 
     dst.create(image.rows, image.cols, CV_8U);
-    dst.setTo(cv::Scalar(0, 0, 0, 0));
+    dst.setTo(cv::Scalar(0, 0, 0, 0), stream);
 
     // Green slice
     cv_utils::inRange(hsv_image_,
@@ -80,8 +128,10 @@ void RoombaBlobDetector::thresholdFrame(const cv::cuda::GpuMat& image,
                       cv::Scalar(settings_.hsv_slice_h_green_max,
                                  settings_.hsv_slice_s_green_max,
                                  settings_.hsv_slice_v_green_max),
-                      range_mask_);
-    cv::cuda::bitwise_or(dst, range_mask_, dst);
+                      range_mask_,
+                      in_range_buf_,
+                      stream);
+    cv::cuda::bitwise_or(dst, range_mask_, dst, cv::noArray(), stream);
     // Upper red slice
     cv_utils::inRange(hsv_image_,
                       cv::Scalar(settings_.hsv_slice_h_red1_min,
@@ -90,8 +140,10 @@ void RoombaBlobDetector::thresholdFrame(const cv::cuda::GpuMat& image,
                       cv::Scalar(settings_.hsv_slice_h_red1_max,
                                  settings_.hsv_slice_s_red_max,
                                  settings_.hsv_slice_v_red_max),
-                      range_mask_);
-    cv::cuda::bitwise_or(dst, range_mask_, dst);
+                      range_mask_,
+                      in_range_buf_,
+                      stream);
+    cv::cuda::bitwise_or(dst, range_mask_, dst, cv::noArray(), stream);
     // Lower red slice
     cv_utils::inRange(hsv_image_,
                       cv::Scalar(settings_.hsv_slice_h_red2_min,
@@ -100,13 +152,15 @@ void RoombaBlobDetector::thresholdFrame(const cv::cuda::GpuMat& image,
                       cv::Scalar(settings_.hsv_slice_h_red2_max,
                                  settings_.hsv_slice_s_red_max,
                                  settings_.hsv_slice_v_red_max),
-                      range_mask_);
-    cv::cuda::bitwise_or(dst, range_mask_, dst);
+                      range_mask_,
+                      in_range_buf_,
+                      stream);
+    cv::cuda::bitwise_or(dst, range_mask_, dst, cv::noArray(), stream);
 
     const auto slice_time = std::chrono::high_resolution_clock::now();
 
-    morphology_open_->apply(dst, dst);
-    morphology_close_->apply(dst, dst);
+    morphology_open_->apply(dst, dst, stream);
+    morphology_close_->apply(dst, dst, stream);
 
     const auto morph_time = std::chrono::high_resolution_clock::now();
 
@@ -121,12 +175,165 @@ void RoombaBlobDetector::thresholdFrame(const cv::cuda::GpuMat& image,
     ROS_ASSERT(dst.channels() == 1);
 }
 
+kernels::HsvSegmentationParams RoombaBlobDetector::getSegmentationParams(
+        const RoombaEstimatorSettings& settings)
+{
+    const auto make_slice = [](int h_min, int s_min, int v_min,
+                               int h_max, int s_max, int v_max) {
+        kernels::HsvSlice slice;
+        slice.min[0] = h_min;
+        slice.min[1] = s_min;
+        slice.min[2] = v_min;
+        slice.max[0] = h_max;
+        slice.max[1] = s_max;
+        slice.max[2] = v_max;
+        return slice;
+    };
+
+    kernels::HsvSegmentationParams params;
+    params.slices[0] = make_slice(settings.hsv_slice_h_green_min,
+                                  settings.hsv_slice_s_green_min,
+                                  settings.hsv_slice_v_green_min,
+                                  settings.hsv_slice_h_green_max,
+                                  settings.hsv_slice_s_green_max,
+                                  settings.hsv_slice_v_green_max);
+    params.slices[1] = make_slice(settings.hsv_slice_h_red1_min,
+                                  settings.hsv_slice_s_red_min,
+                                  settings.hsv_slice_v_red_min,
+                                  settings.hsv_slice_h_red1_max,
+                                  settings.hsv_slice_s_red_max,
+                                  settings.hsv_slice_v_red_max);
+    params.slices[2] = make_slice(settings.hsv_slice_h_red2_min,
+                                  settings.hsv_slice_s_red_min,
+                                  settings.hsv_slice_v_red_min,
+                                  settings.hsv_slice_h_red2_max,
+                                  settings.hsv_slice_s_red_max,
+                                  settings.hsv_slice_v_red_max);
+    return params;
+}
+
+cv::Mat RoombaBlobDetector::drawContourImage(
+        const std::vector<std::vector<cv::Point>>& contours,
+        const cv::Size& size)
+{
+    cv::Mat contour_image = cv::Mat::zeros(size, CV_8UC3);
+
+    for (const auto& contour : contours) {
+        cv_utils::drawContour(contour_image,
+                              contour,
+                              cv::Scalar(255, 255, 255));
+    }
+
+    return contour_image;
+}
+
+void RoombaBlobDetector::getSaturationStatistics(cv::Scalar& mean,
+                                                 cv::Scalar& stddev) const
+{
+    if (!settings_.use_fused_segmentation) {
+        mean = frame_mean_;
+        stddev = frame_stddev_;
+        return;
+    }
+
+    const kernels::SaturationSums& sums
+        = *reinterpret_cast<const kernels::SaturationSums*>(
+                saturation_sums_cpu_.data);
+    const double n = static_cast<double>(frame_sums_area_);
+    const double sat_mean = sums.sum / n;
+    const double variance = sums.sqr_sum / n - sat_mean * sat_mean;
+    mean = cv::Scalar(sat_mean);
+    stddev = cv::Scalar(std::sqrt(std::max(0., variance)));
+}
+
+void RoombaBlobDetector::boundMaskGpu(
+        const cv::cuda::GpuMat& mask,
+        std::vector<cv::RotatedRect>& boundRect,
+        cv::cuda::Stream& stream) const
+{
+    kernels::findBlobs(mask,
+                       settings_.min_roomba_blob_size,
+                       settings_.max_roomba_blob_size,
+                       blob_list_,
+                       blob_labeling_buf_,
+                       stream);
+    blob_list_.download(blob_list_cpu_, stream);
+
+    const bool draw_contours = debug_contours_pub_
+                            && debug_contours_pub_->wanted();
+    cv::Mat mask_cpu;
+    if (draw_contours) {
+        mask.download(mask_cpu, stream);
+    }
+
+    stream.waitForCompletion();
+
+    if (draw_contours) {
+        // Contours are only needed for the debug image here, so they're
+        // found in the background too
+        debug_contours_pub_->publish(
+                std_msgs::Header(),
+                sensor_msgs::image_encodings::RGB8,
+                [mask_cpu]() mutable {
+                    std::vector<std::vector<cv::Point>> contours;
+                    cv::findContours(mask_cpu,
+                                     contours,
+                                     CV_RETR_EXTERNAL,
+                                     CV_CHAIN_APPROX_SIMPLE);
+                    return drawContourImage(contours, mask_cpu.size());
+                });
+    }
+
+    const kernels::BlobList& blob_list
+        = *reinterpret_cast<const kernels::BlobList*>(blob_list_cpu_.data);
+
+    if (blob_list.label_count > kernels::kMaxBlobLabels) {
+        ROS_WARN_THROTTLE(1.0,
+                          "Found %d blobs, only the first %d were used",
+                          blob_list.label_count,
+                          kernels::kMaxBlobLabels);
+    }
+    if (blob_list.blob_count > kernels::kMaxBlobs) {
+        ROS_WARN_THROTTLE(1.0,
+                          "Found %d roomba sized blobs, only the first %d "
+                          "were used",
+                          blob_list.blob_count,
+                          kernels::kMaxBlobs);
+    }
+
+    const int blob_count = std::min(blob_list.blob_count, kernels::kMaxBlobs);
+    boundRect.resize(0); // Clear the vector
+    for (int i = 0; i < blob_count; i++) {
+        const kernels::BlobRecord& blob = blob_list.blobs[i];
+
+        const cv::Point2f evector0 (blob.axes[0][0], blob.axes[0][1]);
+        const cv::Point2f evector1 (blob.axes[1][0], blob.axes[1][1]);
+
+        const cv::Point2f center
+            = evector0 * ((blob.extent_max[0] + blob.extent_min[0]) / 2)
+            + evector1 * ((blob.extent_max[1] + blob.extent_min[1]) / 2);
+
+        boundRect.emplace_back(
+                center,
+                cv::Size2f(blob.extent_max[0] - blob.extent_min[0],
+                           blob.extent_max[1] - blob.extent_min[1]),
+                -std::atan2(evector1.x, evector1.y) * 180 / M_PI);
+    }
+}
+
 void RoombaBlobDetector::boundMask(
         const cv::cuda::GpuMat& mask,
-        std::vector<cv::RotatedRect>& boundRect) const
+        std::vector<cv::RotatedRect>& boundRect,
+        cv::cuda::Stream& stream) const
 {
+    if (settings_.use_gpu_blob_labeling) {
+        boundMaskGpu(mask, boundRect, stream);
+        return;
+    }
+
     cv::Mat mask_cpu;
-    mask.download(mask_cpu);
+    mask.download(mask_cpu, stream);
+    stream.waitForCompletion();
 
     std::vector<std::vector<cv::Point>> contours;
 
@@ -140,22 +347,14 @@ void RoombaBlobDetector::boundMask(
                      CV_RETR_EXTERNAL,
                      CV_CHAIN_APPROX_SIMPLE);
 
-    if (settings_.debug_contours) {
-        cv::Mat contour_image = cv::Mat::zeros(mask.rows, mask.cols, CV_8UC3);
-
-        for (const auto& contour : contours) {
-            cv_utils::drawContour(contour_image,
-                                  contour,
-                                  cv::Scalar(255, 255, 255));
-        }
-
-        const cv_bridge::CvImage cv_image {
-            std_msgs::Header(),
-            sensor_msgs::image_encodings::RGB8,
-            contour_image
-        };
-
-        debug_contours_pub_.publish(cv_image.toImageMsg());
+    if (debug_contours_pub_ && debug_contours_pub_->wanted()) {
+        const cv::Size size = mask.size();
+        debug_contours_pub_->publish(
+                std_msgs::Header(),
+                sensor_msgs::image_encodings::RGB8,
+                [contours, size]() {
+                    return drawContourImage(contours, size);
+                });
     }
 
     //////////////////////////////////////////////////////////////////////////
@@ -235,22 +434,77 @@ void RoombaBlobDetector::boundMask(
     }
 }
 
+void RoombaBlobDetector::samplePatchesGpu(
+        const cv::cuda::GpuMat& image,
+        const std::vector<cv::RotatedRect>& windows,
+        std::vector<cv::Vec3b>& patch_means,
+        cv::cuda::Stream& stream) const
+{
+    const int count = windows.size();
+    patches_cpu_.create(1, count * sizeof(kernels::PatchParams), CV_8UC1);
+    kernels::PatchParams* patches
+        = reinterpret_cast<kernels::PatchParams*>(patches_cpu_.data);
+
+    for (int i = 0; i < count; i++) {
+        const cv::RotatedRect& window = windows[i];
+
+        // Same bounds and angle math as cv_utils::sumPatch
+        const cv::Rect bounding_rect = window.boundingRect2f();
+        const float rads = window.angle * M_PI / 180;
+
+        kernels::PatchParams& patch = patches[i];
+        patch.center_x = window.center.x;
+        patch.center_y = window.center.y;
+        patch.cos_angle = std::cos(rads);
+        patch.sin_angle = std::sin(rads);
+        patch.half_width = window.size.width / 2;
+        patch.half_height = window.size.height / 2;
+        patch.min_x = std::max(bounding_rect.x, 0);
+        patch.min_y = std::max(bounding_rect.y, 0);
+        patch.max_x = std::min(bounding_rect.x + bounding_rect.width,
+                               image.cols - 1);
+        patch.max_y = std::min(bounding_rect.y + bounding_rect.height,
+                               image.rows - 1);
+    }
+
+    patches_.upload(patches_cpu_, stream);
+    kernels::patchSums(image, patches_, count, patch_sums_, stream);
+    patch_sums_.download(patch_sums_cpu_, stream);
+    stream.waitForCompletion();
+
+    const kernels::PatchSum* sums
+        = reinterpret_cast<const kernels::PatchSum*>(patch_sums_cpu_.data);
+    patch_means.clear();
+    patch_means.reserve(count);
+    for (int i = 0; i < count; i++) {
+        if (sums[i].count == 0) {
+            // sumPatch divides by zero here, which ends up black
+            patch_means.emplace_back(0, 0, 0);
+            continue;
+        }
+
+        const cv::Vec3d total (sums[i].sum[0], sums[i].sum[1], sums[i].sum[2]);
+        patch_means.push_back(total / double(sums[i].count));
+    }
+}
+
 void RoombaBlobDetector::checkCorners(
         const cv::cuda::GpuMat& image,
         const cv::Scalar& mean,
         const cv::Scalar& stddev,
         std::vector<cv::RotatedRect>& rects,
-        std::vector<double>& flip_certainties) const
+        std::vector<double>& flip_certainties,
+        cv::cuda::Stream& stream) const
 {
     ROS_ASSERT(flip_certainties.empty());
     flip_certainties.reserve(rects.size());
 
-    cv::Mat cpu_image;
-    image.download(cpu_image);
-
     float scale = 0.2;
 
-    for (cv::RotatedRect& rect : rects) {
+    // Four corner windows for each rect, in row major order of corners
+    std::vector<cv::RotatedRect> windows;
+    windows.reserve(4 * rects.size());
+    for (const cv::RotatedRect& rect : rects) {
         cv::RotatedRect window (cv::Point2f(), rect.size * scale, rect.angle);
 
         float rads = rect.angle * M_PI / 180;
@@ -261,81 +515,76 @@ void RoombaBlobDetector::checkCorners(
                              * (1 - scale) / 2
                              * cv::Point2f(-std::sin(rads), std::cos(rads));
 
-        // True if the patch is red/green, false otherwise
-        cv::Mat corners = cv::Mat::zeros(2, 2, CV_8UC1);
-
         for (int i = -1; i != 3; i += 2) {
             for (int j = -1; j != 3; j += 2) {
                 window.center = rect.center + i*offset_x + j*offset_y;
-                cv::Vec3d patch_sum = cv_utils::sumPatch(cpu_image, window);
-
-                cv::Mat patch_sum_mat = cv::Mat::zeros(1, 1, CV_8UC3);
-                patch_sum_mat.at<cv::Vec3b>(0, 0) = patch_sum;
-                cv::cvtColor(patch_sum_mat, patch_sum_mat, cv::COLOR_RGB2HSV);
-
-                // True if the patch is red/green, false otherwise
-                cv::Mat patch_good_mat = cv::Mat::zeros(1, 1, CV_8U);
-                patch_good_mat.at<uchar>(0, 0) = 0;
-
-                cv::Mat range_mask;
-
-
-                // Note:  extra linear transformations on saturation limits
-                // threshold against the normalized saturation instead of original
-
-                // Green slice
-                cv::inRange(patch_sum_mat,
-                            cv::Scalar(settings_.hsv_slice_h_green_min,
-                                       (settings_.hsv_slice_s_green_min - 128)
-                                      * stddev.val[0]/42.5 + mean.val[0],
-                                       settings_.hsv_slice_v_green_min),
-                            cv::Scalar(settings_.hsv_slice_h_green_max,
-                                       (settings_.hsv_slice_s_green_max - 128)
-                                      * stddev.val[0]/42.5 + mean.val[0],
-                                       settings_.hsv_slice_v_green_max),
-                            range_mask);
-                cv::bitwise_or(patch_good_mat, range_mask, patch_good_mat);
-                // Upper red slice
-                cv::inRange(patch_sum_mat,
-                            cv::Scalar(settings_.hsv_slice_h_red1_min,
-                                       (settings_.hsv_slice_s_red_min - 128)
-                                      * stddev.val[0]/42.5 + mean.val[0],
-                                       settings_.hsv_slice_v_red_min),
-                            cv::Scalar(settings_.hsv_slice_h_red1_max,
-                                       (settings_.hsv_slice_s_red_max - 128)
-                                      * stddev.val[0]/42.5 + mean.val[0],
-                                       settings_.hsv_slice_v_red_max),
-                            range_mask);
-                cv::bitwise_or(patch_good_mat, range_mask, patch_good_mat);
-                // Lower red slice
-                cv::inRange(patch_sum_mat,
-                            cv::Scalar(settings_.hsv_slice_h_red2_min,
-                                       (settings_.hsv_slice_s_red_min - 128)
-                                      * stddev.val[0]/42.5 + mean.val[0],
-                                       settings_.hsv_slice_v_red_min),
-                            cv::Scalar(settings_.hsv_slice_h_red2_max,
-                                       (settings_.hsv_slice_s_red_max - 128)
-                                      * stddev.val[0]/42.5 + mean.val[0],
-                                       settings_.hsv_slice_v_red_max),
-                            range_mask);
-                cv::bitwise_or(patch_good_mat, range_mask, patch_good_mat);
-
-                corners.at<uchar>((i+1)/2, (j+1)/2)
-                        = patch_good_mat.at<uchar>(0, 0);
+                windows.push_back(window);
             }
         }
+    }
 
-        if (!corners.at<uchar>(0, 0)
-         && !corners.at<uchar>(0, 1)
-         && corners.at<uchar>(1, 0)
-         && corners.at<uchar>(1, 1)) {
+    std::vector<cv::Vec3b> patch_means;
+    if (settings_.use_gpu_corner_sampling) {
+        samplePatchesGpu(image, windows, patch_means, stream);
+    } else {
+        cv::Mat cpu_image;
+        image.download(cpu_image, stream);
+        stream.waitForCompletion();
+
+        patch_means.reserve(windows.size());
+        for (const cv::RotatedRect& window : windows) {
+            patch_means.push_back(cv_utils::sumPatch(cpu_image, window));
+        }
+    }
+
+    // Note:  extra linear transformations on saturation limits
+    // threshold against the normalized saturation instead of original
+    const auto unnormalize = [&](int s) {
+        return (s - 128) * stddev.val[0]/42.5 + mean.val[0];
+    };
+    const cv::Scalar green_min (settings_.hsv_slice_h_green_min,
+                                unnormalize(settings_.hsv_slice_s_green_min),
+                                settings_.hsv_slice_v_green_min);
+    const cv::Scalar green_max (settings_.hsv_slice_h_green_max,
+                                unnormalize(settings_.hsv_slice_s_green_max),
+                                settings_.hsv_slice_v_green_max);
+    const cv::Scalar red1_min (settings_.hsv_slice_h_red1_min,
+                               unnormalize(settings_.hsv_slice_s_red_min),
+                               settings_.hsv_slice_v_red_min);
+    const cv::Scalar red1_max (settings_.hsv_slice_h_red1_max,
+                               unnormalize(settings_.hsv_slice_s_red_max),
+                               settings_.hsv_slice_v_red_max);
+    const cv::Scalar red2_min (settings_.hsv_slice_h_red2_min,
+                               unnormalize(settings_.hsv_slice_s_red_min),
+                               settings_.hsv_slice_v_red_min);
+    const cv::Scalar red2_max (settings_.hsv_slice_h_red2_max,
+                               unnormalize(settings_.hsv_slice_s_red_max),
+                               settings_.hsv_slice_v_red_max);
+
+    for (size_t k = 0; k < rects.size(); k++) {
+        cv::RotatedRect& rect = rects[k];
+
+        // True if the patch is red/green, false otherwise
+        bool corners[2][2];
+        for (int c = 0; c < 4; c++) {
+            const cv::Vec3b hsv = cv_utils::rgbToHsv(patch_means[4*k + c]);
+            corners[c / 2][c % 2] =
+                    cv_utils::inRange(hsv, green_min, green_max)
+                 || cv_utils::inRange(hsv, red1_min, red1_max)
+                 || cv_utils::inRange(hsv, red2_min, red2_max);
+        }
+
+        if (!corners[0][0]
+         && !corners[0][1]
+         && corners[1][0]
+         && corners[1][1]) {
             rect.angle += 180;
             rect.angle = std::fmod(rect.angle, 360);
             flip_certainties.push_back(1.0);
-        } else if (corners.at<uchar>(0, 0)
-                && corners.at<uchar>(0, 1)
-                && !corners.at<uchar>(1, 0)
-                && !corners.at<uchar>(1, 1)) {
+        } else if (corners[0][0]
+                && corners[0][1]
+                && !corners[1][0]
+                && !corners[1][1]) {
             flip_certainties.push_back(1.0);
         } else {
             flip_certainties.push_back(0.0);
@@ -345,33 +594,39 @@ void RoombaBlobDetector::checkCorners(
 
 void RoombaBlobDetector::detect(const cv::cuda::GpuMat& image,
                                 std::vector<cv::RotatedRect>& bounding_rects,
-                                std::vector<double>& flip_certainties) const
+                                std::vector<double>& flip_certainties,
+                                cv::cuda::Stream& stream) const
 {
     ROS_ASSERT(image.size() == image_size_);
 
     const auto start_time = std::chrono::high_resolution_clock::now();
 
     cv::cuda::GpuMat mask;
-    cv::Scalar mean, stddev;
-    thresholdFrame(image, mask, mean, stddev);
+    thresholdFrame(image, mask, stream);
 
     const auto threshold_time = std::chrono::high_resolution_clock::now();
 
-    if (settings_.debug_hsv_slice) {
+    if (debug_hsv_slice_pub_ && debug_hsv_slice_pub_->wanted()) {
         cv::Mat mask_cpu;
-        mask.download(mask_cpu);
-
-        const cv_bridge::CvImage cv_image {
-            std_msgs::Header(),
-            sensor_msgs::image_encodings::MONO8,
-            mask_cpu
-        };
+        mask.download(mask_cpu, stream);
+        stream.waitForCompletion();
 
-        debug_hsv_slice_pub_.publish(cv_image.toImageMsg());
+        debug_hsv_slice_pub_->publish(std_msgs::Header(),
+                                      sensor_msgs::image_encodings::MONO8,
+                                      [mask_cpu]() { return mask_cpu; });
     }
 
-    boundMask(mask, bounding_rects);
-    checkCorners(image, mean, stddev, bounding_rects, flip_certainties);
+    boundMask(mask, bounding_rects, stream);
+
+    // boundMask waited for the stream, so the statistics are downloaded
+    cv::Scalar mean, stddev;
+    getSaturationStatistics(mean, stddev);
+    checkCorners(image,
+                 mean,
+                 stddev,
+                 bounding_rects,
+                 flip_certainties,
+                 stream);
 
     const auto final_time = std::chrono::high_resolution_clock::now();
 
@@ -384,4 +639,52 @@ void RoombaBlobDetector::detect(const cv::cuda::GpuMat& image,
          << "Final: " << count(threshold_time, final_time) << std::endl);
 }
 
+void RoombaBlobDetector::detectInRegions(
+        const cv::cuda::GpuMat& image,
+        const std::vector<cv::Rect>& regions,
+        std::vector<cv::RotatedRect>& bounding_rects,
+        std::vector<double>& flip_certainties,
+        cv::cuda::Stream& stream) const
+{
+    ROS_ASSERT(image.size() == image_size_);
+    ROS_ASSERT(hasFrameStatistics());
+
+    const auto start_time = std::chrono::high_resolution_clock::now();
+
+    bounding_rects.clear();
+    std::vector<cv::RotatedRect> region_rects;
+    for (const cv::Rect& region : regions) {
+        // Normalized against the whole frame from the last full search, so
+        // the thresholds mean the same thing as they do there
+        kernels::hsvSegmentation(image(region),
+                                 saturation_sums_,
+                                 frame_sums_area_,
+                                 segmentation_params_,
+                                 region_mask_,
+                                 stream);
+        morphology_open_->apply(region_mask_, region_mask_, stream);
+        morphology_close_->apply(region_mask_, region_mask_, stream);
+
+        boundMask(region_mask_, region_rects, stream);
+        for (cv::RotatedRect& rect : region_rects) {
+            rect.center += cv::Point2f(region.tl());
+            bounding_rects.push_back(rect);
+        }
+    }
+
+    cv::Scalar mean, stddev;
+    getSaturationStatistics(mean, stddev);
+    checkCorners(image,
+                 mean,
+                 stddev,
+                 bounding_rects,
+                 flip_certainties,
+                 stream);
+
+    const auto final_time = std::chrono::high_resolution_clock::now();
+    ROS_DEBUG_STREAM("Regions: "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(
+                         final_time - start_time).count());
+}
+
 } // namespace iarc7_vision
@@ -3,9 +3,9 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath>
-#include <cv_bridge/cv_bridge.h>
 #include <dynamic_reconfigure/server.h>
 #include <string>
+#include <utility>
 #include <tf/transform_datatypes.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 
@@ -13,8 +13,11 @@
 #include <geometry_msgs/PointStamped.h>
 #include <iarc7_msgs/RoombaDetection.h>
 #include <iarc7_msgs/RoombaDetectionFrame.h>
+#include <nav_msgs/Odometry.h>
 #include <sensor_msgs/Image.h>
+#include <sensor_msgs/image_encodings.h>
 #include <std_msgs/Header.h>
+#include <visualization_msgs/Marker.h>
 
 #include "iarc7_vision/cv_utils.hpp"
 #include "iarc7_vision/RoombaEstimatorConfig.h"
@@ -29,33 +32,75 @@
 namespace iarc7_vision
 {
 
-RoombaEstimator::RoombaEstimator(const cv::Size& image_size)
+RoombaEstimator::RoombaEstimator(const cv::Size& image_size,
+                                 const TransformSource& transform_source,
+                                 const std::string& camera_id,
+                                 const std::string& camera_frame,
+                                 const ros::NodeHandle& private_nh)
     : nh_(),
-      private_nh_("~/roomba_estimator"),
+      private_nh_(private_nh),
       dynamic_reconfigure_server_(private_nh_),
       dynamic_reconfigure_settings_callback_(
               [this](iarc7_vision::RoombaEstimatorConfig& config, uint32_t) {
                   getDynamicSettings(config);
               }),
       dynamic_reconfigure_called_(false),
-      transform_wrapper_(),
+      transform_source_(transform_source),
+      camera_id_(camera_id),
+      camera_frame_(camera_frame),
       camera_to_map_tf_(),
       roomba_pub_(nh_.advertise<iarc7_msgs::RoombaDetectionFrame>(
                   "detected_roombas", 100)),
       settings_(getSettings(private_nh_)),
+      staged_settings_(),
+      last_staged_settings_(settings_),
       input_size_(image_size),
       detection_size_(settings_.detection_image_width,
                       input_size_.height
                     * settings_.detection_image_width / input_size_.width),
-      blob_detector_(std::make_unique<const RoombaBlobDetector>(
-                  settings_, private_nh_, detection_size_))
+      blob_detector_(makeBlobDetector(settings_, detection_size_)),
+      staged_blob_detector_(blob_detector_),
+      level_detectors_(),
+      extra_level_detectors_(),
+      staged_level_detectors_(),
+      staged_level_base_size_(),
+      staged_level_max_level_(0),
+      pyramid_shape_mutex_(),
+      pyramid_base_size_(),
+      pyramid_max_level_(0),
+      tracked_positions_(),
+      tracked_time_(),
+      frames_since_full_search_(0),
+      track_lost_(true)
 {
     dynamic_reconfigure_server_.setCallback(
             dynamic_reconfigure_settings_callback_);
 
+    if (settings_.tracking_enabled && !settings_.use_fused_segmentation) {
+        ROS_WARN("Roomba tracking needs use_fused_segmentation, searching "
+                 "every frame instead");
+    }
+
     if (settings_.debug_detected_rects) {
-        debug_detected_rects_pub_ = private_nh_.advertise<sensor_msgs::Image>(
-                "detected_rects", 10);
+        debug_detected_rects_pub_.reset(new DebugImagePublisher(
+                private_nh_,
+                "detected_rects",
+                settings_.debug_image_max_rate));
+    }
+
+    if (settings_.publish_roomba_odometry) {
+        roomba_odometry_pub_ = nh_.advertise<iarc7_msgs::OdometryArray>(
+                "roombas", 10);
+        roomba_odometry_sub_ = nh_.subscribe(
+                "roombas",
+                10,
+                &RoombaEstimator::roombaOdometryCallback,
+                this);
+    }
+
+    if (settings_.debug_roomba_rays) {
+        debug_roomba_rays_pub_ = private_nh_.advertise<
+            visualization_msgs::Marker>("roomba_rays", 1);
     }
 }
 
@@ -90,6 +135,100 @@ void RoombaEstimator::pixelToRay(double px,
     ray.vector.z /= norm;
 }
 
+bool RoombaEstimator::mapPointToPixel(double x,
+                                      double y,
+                                      double z,
+                                      double pw,
+                                      double ph,
+                                      cv::Point2f& pixel) const
+{
+    tf2::Transform camera_to_map;
+    tf2::fromMsg(camera_to_map_tf_.transform, camera_to_map);
+    const tf2::Vector3 p = camera_to_map.inverse() * tf2::Vector3(x, y, z);
+
+    if (p.z() <= 0) {
+        return false;
+    }
+
+    double pix_R = std::hypot(ph, pw) * 0.5;
+    double max_phi = settings_.bottom_camera_aov * M_PI / 360;
+    double pix_focal = pix_R / std::tan(max_phi);
+
+    pixel.x = pw * 0.5 + pix_focal * p.x() / p.z();
+    pixel.y = ph * 0.5 + pix_focal * p.y() / p.z();
+    return true;
+}
+
+bool RoombaEstimator::getTrackingRegions(
+        const cv::Size& image_size,
+        double view_width,
+        const ros::Time& time,
+        const RoombaBlobDetector& detector,
+        std::vector<cv::Rect>& regions) const
+{
+    if (!settings_.tracking_enabled
+     || !settings_.use_fused_segmentation
+     || !detector.hasFrameStatistics()
+     || track_lost_
+     || tracked_positions_.empty()
+     || frames_since_full_search_ + 1
+            >= settings_.tracking_full_search_interval) {
+        return false;
+    }
+
+    // Half the plate diagonal, plus as far as the roomba could have driven
+    // since it was seen
+    const double radius = std::hypot(settings_.roomba_plate_width,
+                                     settings_.roomba_plate_height) / 2
+                        + settings_.tracking_max_roomba_speed
+                        * (time - tracked_time_).toSec()
+                        + settings_.tracking_roi_padding;
+    const double radius_px = radius * image_size.width / view_width;
+    const cv::Rect image_rect (cv::Point(), image_size);
+
+    regions.clear();
+    for (const cv::Point2d& position : tracked_positions_) {
+        cv::Point2f center;
+        if (!mapPointToPixel(position.x,
+                             position.y,
+                             settings_.roomba_height,
+                             image_size.width,
+                             image_size.height,
+                             center)) {
+            return false;
+        }
+
+        const cv::Rect region = image_rect & cv::Rect(
+                cvFloor(center.x - radius_px),
+                cvFloor(center.y - radius_px),
+                cvCeil(2 * radius_px),
+                cvCeil(2 * radius_px));
+        if (region.area() == 0) {
+            // It left the view, do a full search in case anything else came
+            // in
+            return false;
+        }
+        regions.push_back(region);
+    }
+
+    // Merge overlapping regions, so nothing is detected twice
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i = 0; i < regions.size() && !merged; i++) {
+            for (size_t j = i + 1; j < regions.size() && !merged; j++) {
+                if ((regions[i] & regions[j]).area() > 0) {
+                    regions[i] |= regions[j];
+                    regions.erase(regions.begin() + j);
+                    merged = true;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
 void RoombaEstimator::getDynamicSettings(
         iarc7_vision::RoombaEstimatorConfig& config)
 {
@@ -121,39 +260,247 @@ void RoombaEstimator::getDynamicSettings(
 
         dynamic_reconfigure_called_ = true;
     } else {
-        settings_.detection_image_width = config.detection_image_width;
-
-        settings_.hsv_slice_h_green_min = config.hsv_slice_h_green_min;
-        settings_.hsv_slice_h_green_max = config.hsv_slice_h_green_max;
-        settings_.hsv_slice_s_green_min = config.hsv_slice_s_green_min;
-        settings_.hsv_slice_s_green_max = config.hsv_slice_s_green_max;
-        settings_.hsv_slice_v_green_min = config.hsv_slice_v_green_min;
-        settings_.hsv_slice_v_green_max = config.hsv_slice_v_green_max;
-        settings_.hsv_slice_h_red1_min = config.hsv_slice_h_red1_min;
-        settings_.hsv_slice_h_red1_max = config.hsv_slice_h_red1_max;
-        settings_.hsv_slice_s_red_min = config.hsv_slice_s_red_min;
-        settings_.hsv_slice_s_red_max = config.hsv_slice_s_red_max;
-        settings_.hsv_slice_v_red_min = config.hsv_slice_v_red_min;
-        settings_.hsv_slice_v_red_max = config.hsv_slice_v_red_max;
-        settings_.hsv_slice_h_red2_min = config.hsv_slice_h_red2_min;
-        settings_.hsv_slice_h_red2_max = config.hsv_slice_h_red2_max;
-
-        settings_.min_roomba_blob_size = config.min_roomba_blob_size;
-        settings_.max_roomba_blob_size = config.max_roomba_blob_size;
-
-        settings_.morphology_size = config.morphology_size;
-        settings_.morphology_iterations = config.morphology_iterations;
-
-        settings_.max_relative_error = config.max_relative_error;
-
-        detection_size_ = cv::Size(settings_.detection_image_width,
+        auto staged = std::make_shared<StagedSettings>();
+        RoombaEstimatorSettings& settings = staged->settings;
+        settings = last_staged_settings_;
+
+        settings.detection_image_width = config.detection_image_width;
+
+        settings.hsv_slice_h_green_min = config.hsv_slice_h_green_min;
+        settings.hsv_slice_h_green_max = config.hsv_slice_h_green_max;
+        settings.hsv_slice_s_green_min = config.hsv_slice_s_green_min;
+        settings.hsv_slice_s_green_max = config.hsv_slice_s_green_max;
+        settings.hsv_slice_v_green_min = config.hsv_slice_v_green_min;
+        settings.hsv_slice_v_green_max = config.hsv_slice_v_green_max;
+        settings.hsv_slice_h_red1_min = config.hsv_slice_h_red1_min;
+        settings.hsv_slice_h_red1_max = config.hsv_slice_h_red1_max;
+        settings.hsv_slice_s_red_min = config.hsv_slice_s_red_min;
+        settings.hsv_slice_s_red_max = config.hsv_slice_s_red_max;
+        settings.hsv_slice_v_red_min = config.hsv_slice_v_red_min;
+        settings.hsv_slice_v_red_max = config.hsv_slice_v_red_max;
+        settings.hsv_slice_h_red2_min = config.hsv_slice_h_red2_min;
+        settings.hsv_slice_h_red2_max = config.hsv_slice_h_red2_max;
+
+        settings.min_roomba_blob_size = config.min_roomba_blob_size;
+        settings.max_roomba_blob_size = config.max_roomba_blob_size;
+
+        settings.morphology_size = config.morphology_size;
+        settings.morphology_iterations = config.morphology_iterations;
+
+        settings.max_relative_error = config.max_relative_error;
+
+        staged->detection_size = cv::Size(settings.detection_image_width,
                         input_size_.height
-                      * settings_.detection_image_width / input_size_.width);
-        blob_detector_ = std::make_unique<const RoombaBlobDetector>(
-                    settings_, private_nh_, detection_size_);
+                      * settings.detection_image_width / input_size_.width);
+
+        // max_relative_error is only used by the estimator, everything else
+        // goes into the detector's segmentation params and filters.  A new
+        // detector is built here so update doesn't have to.
+        const RoombaEstimatorSettings& old = last_staged_settings_;
+        const bool detector_changed
+            = settings.detection_image_width != old.detection_image_width
+           || settings.hsv_slice_h_green_min != old.hsv_slice_h_green_min
+           || settings.hsv_slice_h_green_max != old.hsv_slice_h_green_max
+           || settings.hsv_slice_s_green_min != old.hsv_slice_s_green_min
+           || settings.hsv_slice_s_green_max != old.hsv_slice_s_green_max
+           || settings.hsv_slice_v_green_min != old.hsv_slice_v_green_min
+           || settings.hsv_slice_v_green_max != old.hsv_slice_v_green_max
+           || settings.hsv_slice_h_red1_min != old.hsv_slice_h_red1_min
+           || settings.hsv_slice_h_red1_max != old.hsv_slice_h_red1_max
+           || settings.hsv_slice_s_red_min != old.hsv_slice_s_red_min
+           || settings.hsv_slice_s_red_max != old.hsv_slice_s_red_max
+           || settings.hsv_slice_v_red_min != old.hsv_slice_v_red_min
+           || settings.hsv_slice_v_red_max != old.hsv_slice_v_red_max
+           || settings.hsv_slice_h_red2_min != old.hsv_slice_h_red2_min
+           || settings.hsv_slice_h_red2_max != old.hsv_slice_h_red2_max
+           || settings.min_roomba_blob_size != old.min_roomba_blob_size
+           || settings.max_roomba_blob_size != old.max_roomba_blob_size
+           || settings.morphology_size != old.morphology_size
+           || settings.morphology_iterations != old.morphology_iterations;
+        if (detector_changed) {
+            staged_blob_detector_ = makeBlobDetector(settings,
+                                                     staged->detection_size);
+        }
+        staged->blob_detector = staged_blob_detector_;
+
+        // Level detectors are built for the pyramid of the last frame.  With
+        // composite maps that is built at the detection size, so it changes
+        // size along with it.
+        cv::Size base_size;
+        int max_level;
+        {
+            std::lock_guard<std::mutex> lock(pyramid_shape_mutex_);
+            base_size = pyramid_base_size_;
+            max_level = pyramid_max_level_;
+        }
+        const cv::Size old_detection_size(
+                old.detection_image_width,
+                input_size_.height * old.detection_image_width
+              / input_size_.width);
+        if (base_size == old_detection_size) {
+            base_size = staged->detection_size;
+        }
+
+        if (detector_changed
+         || base_size != staged_level_base_size_
+         || max_level != staged_level_max_level_) {
+            staged_level_detectors_
+                = base_size.area() > 0 && max_level > 0
+                ? makeLevelDetectors(settings,
+                                     staged->detection_size,
+                                     base_size,
+                                     max_level)
+                : nullptr;
+            staged_level_base_size_ = base_size;
+            staged_level_max_level_ = max_level;
+        }
+        staged->level_detectors = staged_level_detectors_;
+
+        last_staged_settings_ = settings;
+        staged_settings_.post(std::move(staged));
+    }
+}
+
+void RoombaEstimator::applyStagedSettings()
+{
+    const std::shared_ptr<const StagedSettings> staged
+        = staged_settings_.take();
+    if (staged == nullptr) {
+        return;
+    }
+
+    settings_ = staged->settings;
+    detection_size_ = staged->detection_size;
+
+    // Only pointers change hands here, the callback built the detectors
+    if (staged->blob_detector != blob_detector_
+     || staged->level_detectors != level_detectors_) {
+        blob_detector_ = staged->blob_detector;
+        level_detectors_ = staged->level_detectors;
+        extra_level_detectors_.clear();
+    }
+}
+
+std::shared_ptr<const RoombaBlobDetector> RoombaEstimator::makeBlobDetector(
+        const RoombaEstimatorSettings& settings,
+        const cv::Size& size)
+{
+    struct OwningDetector {
+        RoombaEstimatorSettings settings;
+        std::unique_ptr<const RoombaBlobDetector> detector;
+    };
+
+    auto owner = std::make_shared<OwningDetector>();
+    owner->settings = settings;
+    owner->detector = std::make_unique<const RoombaBlobDetector>(
+            owner->settings, private_nh_, size);
+
+    // Shares ownership of the settings along with the detector
+    return std::shared_ptr<const RoombaBlobDetector>(owner,
+                                                     owner->detector.get());
+}
+
+void RoombaEstimator::publishLegacyOutputs(
+        const iarc7_msgs::RoombaDetectionFrame& frame)
+{
+    const geometry_msgs::Vector3& camera_position
+        = camera_to_map_tf_.transform.translation;
+
+    visualization_msgs::Marker rays;
+    const bool draw_rays = settings_.debug_roomba_rays
+                        && debug_roomba_rays_pub_.getNumSubscribers() > 0;
+
+    // Held across the whole frame, so a list from the callback can't land
+    // between this frame's updates and the publish
+    std::unique_lock<std::mutex> lock(roomba_odometry_mutex_,
+                                      std::defer_lock);
+    if (settings_.publish_roomba_odometry) {
+        lock.lock();
+    }
+
+    for (const iarc7_msgs::RoombaDetection& roomba : frame.roombas) {
+        geometry_msgs::Point position;
+        position.x = roomba.pose.x;
+        position.y = roomba.pose.y;
+        position.z = 0;
+
+        if (draw_rays) {
+            geometry_msgs::Point camera_point;
+            camera_point.x = camera_position.x;
+            camera_point.y = camera_position.y;
+            camera_point.z = camera_position.z;
+            rays.points.push_back(camera_point);
+            rays.points.push_back(position);
+        }
+
+        if (!settings_.publish_roomba_odometry) {
+            continue;
+        }
+
+        // Move the nearest known roomba within 0.1 m^2 of the detection, or
+        // add a new one.  Once all 10 are known every detection updates the
+        // nearest one.
+        const double sq_tolerance = roomba_odometry_.data.size() < 10
+                                  ? 0.1
+                                  : 1000;
+        auto match = roomba_odometry_.data.end();
+        double match_sq_dist = sq_tolerance;
+        for (auto known = roomba_odometry_.data.begin();
+             known != roomba_odometry_.data.end();
+             ++known) {
+            const geometry_msgs::Point& p = known->pose.pose.position;
+            const double sq_dist = std::pow(position.x - p.x, 2)
+                                 + std::pow(position.y - p.y, 2);
+            if (sq_dist < match_sq_dist) {
+                match = known;
+                match_sq_dist = sq_dist;
+            }
+        }
+        if (match != roomba_odometry_.data.end()) {
+            match->header.stamp = frame.header.stamp;
+            match->pose.pose.position = position;
+        } else {
+            nav_msgs::Odometry known;
+            known.child_frame_id = "roomba"
+                    + std::to_string(roomba_odometry_.data.size());
+            known.header.frame_id = "map";
+            known.header.stamp = frame.header.stamp;
+            known.pose.pose.position = position;
+            known.pose.pose.orientation.z = 1;
+            roomba_odometry_.data.push_back(known);
+        }
+    }
+
+    if (settings_.publish_roomba_odometry && !frame.roombas.empty()) {
+        roomba_odometry_pub_.publish(roomba_odometry_);
+    }
+    if (lock.owns_lock()) {
+        lock.unlock();
+    }
+
+    if (draw_rays) {
+        rays.header.frame_id = "map";
+        rays.header.stamp = frame.header.stamp;
+        rays.ns = "roomba_rays";
+        rays.id = 0;
+        rays.type = visualization_msgs::Marker::LINE_LIST;
+        rays.action = visualization_msgs::Marker::ADD;
+        rays.pose.orientation.w = 1.0;
+        rays.scale.x = 0.03;
+        rays.color.r = 1.0;
+        rays.color.a = 1.0;
+        debug_roomba_rays_pub_.publish(rays);
     }
 }
 
+void RoombaEstimator::roombaOdometryCallback(
+        const iarc7_msgs::OdometryArray::ConstPtr& message)
+{
+    // Same as the python node, the latest list wins, including our own
+    std::lock_guard<std::mutex> lock(roomba_odometry_mutex_);
+    roomba_odometry_ = *message;
+}
+
 RoombaEstimatorSettings RoombaEstimator::getSettings(
         const ros::NodeHandle& private_nh)
 {
@@ -182,31 +529,59 @@ RoombaEstimatorSettings RoombaEstimator::getSettings(
     IARC7_VISION_RES_LOAD(hsv_slice_v_red_max);
     IARC7_VISION_RES_LOAD(hsv_slice_h_red2_min);
     IARC7_VISION_RES_LOAD(hsv_slice_h_red2_max);
+    IARC7_VISION_RES_LOAD(use_fused_segmentation);
     IARC7_VISION_RES_LOAD(min_roomba_blob_size);
     IARC7_VISION_RES_LOAD(max_roomba_blob_size);
     IARC7_VISION_RES_LOAD(morphology_size);
     IARC7_VISION_RES_LOAD(morphology_iterations);
+    IARC7_VISION_RES_LOAD(min_plate_width_px);
+    IARC7_VISION_RES_LOAD(tracking_enabled);
+    IARC7_VISION_RES_LOAD(tracking_full_search_interval);
+    IARC7_VISION_RES_LOAD(tracking_max_roomba_speed);
+    IARC7_VISION_RES_LOAD(tracking_roi_padding);
+    IARC7_VISION_RES_LOAD(speculative_pose_max_age);
     IARC7_VISION_RES_LOAD(morphology_size);
+    IARC7_VISION_RES_LOAD(use_gpu_blob_labeling);
+    IARC7_VISION_RES_LOAD(use_gpu_corner_sampling);
     IARC7_VISION_RES_LOAD(max_relative_error);
     IARC7_VISION_RES_LOAD(uncertainty_scale);
     IARC7_VISION_RES_LOAD(bottom_camera_aov);
+    IARC7_VISION_RES_LOAD(publish_roomba_odometry);
     IARC7_VISION_RES_LOAD(debug_hsv_slice);
     IARC7_VISION_RES_LOAD(debug_contours);
     IARC7_VISION_RES_LOAD(debug_detected_rects);
+    IARC7_VISION_RES_LOAD(debug_roomba_rays);
+    IARC7_VISION_RES_LOAD(debug_image_max_rate);
 
 #undef IARC7_VISION_RES_LOAD
 
     return settings;
 }
 
-double RoombaEstimator::getHeight(const ros::Time& time)
+cv::Size RoombaEstimator::getDetectionSize() const
 {
-    if (!transform_wrapper_.getTransformAtTime(
-                camera_to_map_tf_,
+    return detection_size_;
+}
+
+bool RoombaEstimator::fetchCameraTransform(const ros::Time& time,
+                                           const ros::Duration& timeout)
+{
+    geometry_msgs::TransformStamped camera_to_map_tf;
+    if (!transform_source_.getTransformAtTime(
+                camera_to_map_tf,
                 "map",
-                "bottom_camera_rgb_optical_frame",
+                camera_frame_,
                 time,
-                ros::Duration(1.0))) {
+                timeout)) {
+        return false;
+    }
+    camera_to_map_tf_ = camera_to_map_tf;
+    return true;
+}
+
+double RoombaEstimator::getHeight(const ros::Time& time)
+{
+    if (!fetchCameraTransform(time, ros::Duration(1.0))) {
         throw ros::Exception("Failed to fetch transform");
     }
     return camera_to_map_tf_.transform.translation.z;
@@ -387,36 +762,133 @@ void RoombaEstimator::calcPose(const cv::Point2f& pos,
                      << " cos(theta): " << std::cos(theta));
 }
 
+std::unique_ptr<RoombaEstimator::LevelDetector>
+RoombaEstimator::makeLevelDetector(const RoombaEstimatorSettings& settings,
+                                   const cv::Size& detection_size,
+                                   const cv::Size& size)
+{
+    auto level_detector = std::make_unique<LevelDetector>();
+    level_detector->size = size;
+    level_detector->settings = settings;
+
+    // Blob sizes are configured as areas at the detection size
+    const double scale = static_cast<double>(size.width)
+                       / detection_size.width;
+    level_detector->settings.min_roomba_blob_size = std::lround(
+            settings.min_roomba_blob_size * scale * scale);
+    level_detector->settings.max_roomba_blob_size = std::lround(
+            settings.max_roomba_blob_size * scale * scale);
+
+    level_detector->detector = std::make_unique<const RoombaBlobDetector>(
+            level_detector->settings, private_nh_, size);
+    return level_detector;
+}
+
+std::shared_ptr<const RoombaEstimator::LevelDetectors>
+RoombaEstimator::makeLevelDetectors(const RoombaEstimatorSettings& settings,
+                                    const cv::Size& detection_size,
+                                    const cv::Size& base_size,
+                                    int max_level)
+{
+    auto level_detectors = std::make_shared<LevelDetectors>(max_level + 1);
+    for (int level = 0; level <= max_level; level++) {
+        // update never searches a level if the next one is still at least
+        // the detection width
+        if (level < max_level
+         && ImagePyramid::levelSize(base_size, level + 1).width
+                >= detection_size.width) {
+            continue;
+        }
+
+        (*level_detectors)[level] = makeLevelDetector(
+                settings,
+                detection_size,
+                ImagePyramid::levelSize(base_size, level));
+    }
+    return level_detectors;
+}
+
+const RoombaBlobDetector& RoombaEstimator::getLevelDetector(
+        int level,
+        const cv::Size& size)
+{
+    if (level_detectors_ != nullptr
+     && static_cast<size_t>(level) < level_detectors_->size()) {
+        const std::shared_ptr<const LevelDetector>& level_detector
+            = (*level_detectors_)[level];
+        if (level_detector != nullptr && level_detector->size == size) {
+            return *level_detector->detector;
+        }
+    }
+
+    // Kept between frames, so this only builds once per size
+    if (extra_level_detectors_.size() <= static_cast<size_t>(level)) {
+        extra_level_detectors_.resize(level + 1);
+    }
+
+    std::unique_ptr<LevelDetector>& level_detector
+        = extra_level_detectors_[level];
+    if (level_detector == nullptr || level_detector->size != size) {
+        level_detector = makeLevelDetector(settings_, detection_size_, size);
+    }
+
+    return *level_detector->detector;
+}
+
 void RoombaEstimator::update(
-        const cv::cuda::GpuMat& image,
+        ImagePyramid& pyramid,
         const ros::Time& time,
-        std::vector<RoombaImageLocation>& roomba_image_locations)
+        std::vector<RoombaImageLocation>& roomba_image_locations,
+        cv::cuda::Stream& stream)
 {
-    ROS_ASSERT(image.size() == input_size_);
+    applyStagedSettings();
 
     const auto start_time = std::chrono::high_resolution_clock::now();
 
+    const cv::Size image_size = pyramid.levelSize(0);
+
     // Validation
-    if(image.empty()) {
+    if(image_size.area() == 0) {
         iarc7_msgs::RoombaDetectionFrame result;
         result.header.stamp = time;
         result.header.frame_id = "map";
-        result.camera_id = "bottom_camera";
+        result.camera_id = camera_id_;
         roomba_pub_.publish(result);
+        track_lost_ = true;
         return;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(pyramid_shape_mutex_);
+        pyramid_base_size_ = image_size;
+        pyramid_max_level_ = pyramid.maxLevel();
+    }
+
     //////////////////////////////////////////////////////////////////////////
     /// Fetch height
     //////////////////////////////////////////////////////////////////////////
-    double height = getHeight(time);
+    // If this frame's pose hasn't arrived yet, a recent enough pose from the
+    // last frame is good enough to pick the resolution and tracking regions,
+    // so detection starts right away and the wait for the real pose overlaps
+    // with it.  Detections are always projected with the frame's own pose.
+    const bool have_frame_pose
+        = fetchCameraTransform(time, ros::Duration(0));
+    const bool speculate = !have_frame_pose
+                        && !camera_to_map_tf_.header.stamp.isZero()
+                        && time - camera_to_map_tf_.header.stamp
+                               < ros::Duration(
+                                     settings_.speculative_pose_max_age);
+    double height = speculate
+                  ? camera_to_map_tf_.transform.translation.z
+                  : getHeight(time);
 
     if (height < settings_.roomba_height + 0.01) {
         iarc7_msgs::RoombaDetectionFrame result;
         result.header.stamp = time;
         result.header.frame_id = "map";
-        result.camera_id = "bottom_camera";
+        result.camera_id = camera_id_;
         roomba_pub_.publish(result);
+        track_lost_ = true;
         return;
     }
 
@@ -432,8 +904,10 @@ void RoombaEstimator::update(
     //////////////////////////////////////////////////////////////////////////
     geometry_msgs::Vector3Stamped a;
     geometry_msgs::Vector3Stamped b;
-    pixelToRay(0, 0,          image.cols, image.rows, a);
-    pixelToRay(0, image.cols, image.cols, image.rows, b);
+    pixelToRay(0, 0,
+               image_size.width, image_size.height, a);
+    pixelToRay(0, image_size.width,
+               image_size.width, image_size.height, b);
 
     Eigen::Vector3d a_v (a.vector.x, a.vector.y, a.vector.z);
     Eigen::Vector3d b_v (b.vector.x, b.vector.y, b.vector.z);
@@ -451,20 +925,84 @@ void RoombaEstimator::update(
 
     const auto boilerplate_time = std::chrono::high_resolution_clock::now();
 
-    cv::cuda::GpuMat image_scaled;
-    cv::cuda::resize(image, image_scaled, detection_size_);
+    const cv::cuda::GpuMat* image_scaled_ptr;
+    const RoombaBlobDetector* blob_detector;
+    if (pyramid.maxLevel() > 0) {
+        // Never go above the detection size, and go as far below it as the
+        // plate size allows.  Lower levels mean less work when flying low,
+        // with the morphology kernels staying the same size in pixels.
+        const int max_size_level = pyramid.levelForWidth(
+                detection_size_.width);
+        const int min_width = static_cast<int>(std::ceil(
+                settings_.min_plate_width_px
+              * distance
+              / settings_.roomba_plate_width));
+        const int level = std::max(max_size_level,
+                                   pyramid.levelForWidth(min_width));
+
+        image_scaled_ptr = &pyramid.level(level, stream);
+        blob_detector = &getLevelDetector(level, image_scaled_ptr->size());
+    } else {
+        // The caller may have produced the image at the detection size
+        // already, any other size (e.g. input_size_, or a stale detection
+        // size right after a reconfigure) just gets resized
+        const cv::cuda::GpuMat& image = pyramid.level(0, stream);
+        const bool needs_resize = image.size() != detection_size_;
+        if (needs_resize) {
+            cv::cuda::resize(image,
+                             image_scaled_,
+                             detection_size_,
+                             0,
+                             0,
+                             cv::INTER_LINEAR,
+                             stream);
+        }
+        image_scaled_ptr = needs_resize ? &image_scaled_ : &image;
+        blob_detector = blob_detector_.get();
+    }
+    const cv::cuda::GpuMat& image_scaled = *image_scaled_ptr;
 
     const auto resize_time = std::chrono::high_resolution_clock::now();
 
     //////////////////////////////////////////////////////////////////////////
     /// Run blob detection
     //////////////////////////////////////////////////////////////////////////
-    blob_detector_->detect(image_scaled,
-                           bounding_rects,
-                           flip_certainties);
+    std::vector<cv::Rect> regions;
+    const bool region_search = getTrackingRegions(image_scaled.size(),
+                                                  distance,
+                                                  time,
+                                                  *blob_detector,
+                                                  regions);
+    if (region_search) {
+        blob_detector->detectInRegions(image_scaled,
+                                       regions,
+                                       bounding_rects,
+                                       flip_certainties,
+                                       stream);
+        frames_since_full_search_++;
+    } else {
+        blob_detector->detect(image_scaled,
+                              bounding_rects,
+                              flip_certainties,
+                              stream);
+        frames_since_full_search_ = 0;
+    }
 
     const auto blob_time = std::chrono::high_resolution_clock::now();
 
+    if (speculate) {
+        height = getHeight(time);
+        if (height < settings_.roomba_height + 0.01) {
+            iarc7_msgs::RoombaDetectionFrame result;
+            result.header.stamp = time;
+            result.header.frame_id = "map";
+            result.camera_id = camera_id_;
+            roomba_pub_.publish(result);
+            track_lost_ = true;
+            return;
+        }
+    }
+
     std::vector<std::array<double, 4>> position_covariances;
     calcBoxUncertainties(image_scaled.size(),
                          bounding_rects,
@@ -474,9 +1012,15 @@ void RoombaEstimator::update(
     ROS_ASSERT(box_uncertainties.size() == bounding_rects.size());
     ROS_ASSERT(flip_certainties.size() == bounding_rects.size());
 
+    // Rects to draw on the debug image, drawn once the detections are done
+    const bool draw_rects = debug_detected_rects_pub_
+                         && debug_detected_rects_pub_->wanted();
     cv::Mat detected_rect_image;
-    if (settings_.debug_detected_rects) {
-        image_scaled.download(detected_rect_image);
+    std::vector<cv::RotatedRect> rejected_rects;
+    std::vector<cv::RotatedRect> accepted_rects;
+    if (draw_rects) {
+        image_scaled.download(detected_rect_image, stream);
+        stream.waitForCompletion();
     }
 
     //////////////////////////////////////////////////////////////////////////
@@ -486,15 +1030,12 @@ void RoombaEstimator::update(
     iarc7_msgs::RoombaDetectionFrame roomba_frame;
     roomba_frame.header.stamp = time;
     roomba_frame.header.frame_id = "map";
-    roomba_frame.camera_id = "bottom_camera";
+    roomba_frame.camera_id = camera_id_;
 
     for (unsigned int i = 0; i < bounding_rects.size(); i++) {
         if (box_uncertainties[i] < 0) {
-            if (settings_.debug_detected_rects) {
-                // Draw yellow rect for bad detection
-                cv_utils::drawRotatedRect(detected_rect_image,
-                                          bounding_rects[i],
-                                          cv::Scalar(255, 255, 0));
+            if (draw_rects) {
+                rejected_rects.push_back(bounding_rects[i]);
             }
             continue;
         }
@@ -502,14 +1043,8 @@ void RoombaEstimator::update(
         cv::Point2f pos = bounding_rects[i].center;
         double angle = bounding_rects[i].angle * M_PI / 180;
 
-        if (settings_.debug_detected_rects) {
-            cv::Point2f p;
-            p.x = pos.x + 100 * std::cos(angle);
-            p.y = pos.y + 100 * std::sin(angle);
-            cv::line(detected_rect_image, pos, p, cv::Scalar(255, 0, 0), 3);
-            cv_utils::drawRotatedRect(detected_rect_image,
-                                      bounding_rects[i],
-                                      cv::Scalar(0, 0, 255));
+        if (draw_rects) {
+            accepted_rects.push_back(bounding_rects[i]);
         }
 
         iarc7_msgs::RoombaDetection roomba;
@@ -528,32 +1063,63 @@ void RoombaEstimator::update(
         roomba.flip_certainty = flip_certainties[i];
         roomba_frame.roombas.push_back(roomba);
         roomba_image_locations.push_back(roomba_image_location);
+    }
 
-        if (settings_.debug_detected_rects) {
-            cv::Point2f p;
-            p.x = roomba_image_location.x * image_scaled.cols;
-            p.y = roomba_image_location.y * image_scaled.cols;
-            //cv::circle(detected_rect_image,
-            //           p,
-            //           roomba_image_location.radius * image_scaled.cols,
-            //           cv::Scalar(0, 255, 0));
+    if (settings_.tracking_enabled) {
+        // With nothing to track, a region search would search nothing, so
+        // keep doing full searches until something is found
+        track_lost_ = roomba_frame.roombas.empty()
+                   || (region_search
+                    && roomba_frame.roombas.size() < tracked_positions_.size());
+        tracked_positions_.clear();
+        for (const iarc7_msgs::RoombaDetection& roomba : roomba_frame.roombas) {
+            tracked_positions_.emplace_back(roomba.pose.x, roomba.pose.y);
         }
+        tracked_time_ = time;
     }
 
     calcFloorPoly(roomba_frame.detection_region);
 
-    if (settings_.debug_detected_rects) {
-        const cv_bridge::CvImage cv_image {
-            std_msgs::Header(),
-            sensor_msgs::image_encodings::RGB8,
-            detected_rect_image
+    if (draw_rects) {
+        // Drawn in the background, so it works on copies of everything
+        auto render = [detected_rect_image,
+                       rejected_rects,
+                       accepted_rects]() mutable {
+            // Yellow rect for bad detections
+            for (const cv::RotatedRect& rect : rejected_rects) {
+                cv_utils::drawRotatedRect(detected_rect_image,
+                                          rect,
+                                          cv::Scalar(255, 255, 0));
+            }
+
+            // Red rect with a line in the direction of the roomba for good
+            // ones
+            for (const cv::RotatedRect& rect : accepted_rects) {
+                const double angle = rect.angle * M_PI / 180;
+                cv::Point2f p;
+                p.x = rect.center.x + 100 * std::cos(angle);
+                p.y = rect.center.y + 100 * std::sin(angle);
+                cv::line(detected_rect_image,
+                         rect.center,
+                         p,
+                         cv::Scalar(255, 0, 0),
+                         3);
+                cv_utils::drawRotatedRect(detected_rect_image,
+                                          rect,
+                                          cv::Scalar(0, 0, 255));
+            }
+
+            return detected_rect_image;
         };
 
-        debug_detected_rects_pub_.publish(cv_image.toImageMsg());
+        debug_detected_rects_pub_->publish(std_msgs::Header(),
+                                           sensor_msgs::image_encodings::RGB8,
+                                           std::move(render));
     }
 
     // publish
     roomba_pub_.publish(roomba_frame);
+    publishLegacyOutputs(roomba_frame);
 
     const auto final_time = std::chrono::high_resolution_clock::now();
 
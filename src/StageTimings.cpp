@@ -0,0 +1,191 @@
+#include "iarc7_vision/StageTimings.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include <ros/assert.h>
+
+namespace iarc7_vision {
+
+constexpr int StageStats::kBinsPerOctave;
+constexpr int StageStats::kOctaves;
+constexpr int StageStats::kBins;
+constexpr double StageStats::kMinSeconds;
+
+StageStats::StageStats(const std::string& name)
+    : name_(name),
+      mutex_(),
+      bins_(),
+      count_(0),
+      max_(0),
+      window_start_(std::chrono::steady_clock::now())
+{
+}
+
+void StageStats::record(double seconds)
+{
+    // Anything outside the range goes in the first or last bin
+    const int bin = seconds > kMinSeconds
+                  ? static_cast<int>(std::min<double>(
+                          kBins - 1,
+                          std::log2(seconds / kMinSeconds) * kBinsPerOctave))
+                  : 0;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    bins_[bin]++;
+    count_++;
+    max_ = std::max(max_, seconds);
+}
+
+double StageStats::binValue(int bin)
+{
+    return kMinSeconds * std::exp2((bin + 0.5) / kBinsPerOctave);
+}
+
+StageStats::Summary StageStats::takeSummary()
+{
+    std::array<uint32_t, kBins> bins;
+    Summary summary;
+    std::chrono::steady_clock::time_point window_start;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bins = bins_;
+        summary.count = count_;
+        summary.max = max_;
+        window_start = window_start_;
+
+        bins_.fill(0);
+        count_ = 0;
+        max_ = 0;
+        window_start_ = std::chrono::steady_clock::now();
+    }
+
+    const double window = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - window_start).count();
+    summary.rate = window > 0 ? summary.count / window : 0;
+
+    // Value of the bin containing the sample with the given rank, but never
+    // more than the real max
+    const auto percentile = [&](double fraction) {
+        if (summary.count == 0) {
+            return 0.0;
+        }
+        const uint64_t rank = static_cast<uint64_t>(
+                std::ceil(fraction * summary.count));
+        uint64_t seen = 0;
+        for (int i = 0; i < kBins; i++) {
+            seen += bins[i];
+            if (seen >= rank) {
+                return std::min(binValue(i), summary.max);
+            }
+        }
+        return summary.max;
+    };
+    summary.p50 = percentile(0.50);
+    summary.p95 = percentile(0.95);
+    summary.p99 = percentile(0.99);
+
+    return summary;
+}
+
+GpuStageTimer::GpuStageTimer(StageStats& stats,
+                             bool enabled,
+                             size_t max_pending)
+    : stats_(stats),
+      enabled_(enabled),
+      events_(enabled ? max_pending : 0),
+      oldest_(0),
+      pending_(0),
+      started_(false)
+{
+    ROS_ASSERT(!enabled_ || max_pending >= 1);
+}
+
+void GpuStageTimer::collect()
+{
+    while (pending_ > 0) {
+        EventPair& events = events_[oldest_];
+        if (!events.stop.queryIfComplete()) {
+            return;
+        }
+
+        // elapsedTime is in milliseconds
+        stats_.record(cv::cuda::Event::elapsedTime(events.start, events.stop)
+                    / 1000.0);
+        oldest_ = (oldest_ + 1) % events_.size();
+        pending_--;
+    }
+}
+
+void GpuStageTimer::start(cv::cuda::Stream& stream)
+{
+    if (!enabled_) {
+        return;
+    }
+
+    collect();
+
+    started_ = pending_ < events_.size();
+    if (started_) {
+        events_[(oldest_ + pending_) % events_.size()].start.record(stream);
+    }
+}
+
+void GpuStageTimer::stop(cv::cuda::Stream& stream)
+{
+    if (!started_) {
+        return;
+    }
+
+    events_[(oldest_ + pending_) % events_.size()].stop.record(stream);
+    pending_++;
+    started_ = false;
+}
+
+StageStats& StageTimings::addStage(const std::string& name)
+{
+    stages_.emplace_back(name);
+    return stages_.back();
+}
+
+std::vector<std::pair<std::string, StageStats::Summary>>
+StageTimings::takeSummaries()
+{
+    std::vector<std::pair<std::string, StageStats::Summary>> summaries;
+    for (StageStats& stage : stages_) {
+        summaries.emplace_back(stage.name(), stage.takeSummary());
+    }
+    return summaries;
+}
+
+void StageTimings::fillStatus(const std::string& name,
+                              diagnostic_msgs::DiagnosticStatus& status)
+{
+    status.name = name;
+    status.hardware_id = "vision_node";
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.message = "OK";
+
+    const auto add_value = [&](const std::string& key, double value) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.3f", value);
+
+        diagnostic_msgs::KeyValue key_value;
+        key_value.key = key;
+        key_value.value = buf;
+        status.values.push_back(key_value);
+    };
+
+    for (const auto& stage : takeSummaries()) {
+        const std::string& stage_name = stage.first;
+        const StageStats::Summary& summary = stage.second;
+        add_value(stage_name + "/rate_hz", summary.rate);
+        add_value(stage_name + "/p50_ms", summary.p50 * 1000);
+        add_value(stage_name + "/p95_ms", summary.p95 * 1000);
+        add_value(stage_name + "/p99_ms", summary.p99 * 1000);
+        add_value(stage_name + "/max_ms", summary.max * 1000);
+    }
+}
+
+} // namespace iarc7_vision
@@ -11,44 +11,85 @@ UndistortionModel::UndistortionModel(const ros::NodeHandle& nh,
             ros_utils::ParamUtils::getParam<int>(nh, "out_width"),
             ros_utils::ParamUtils::getParam<int>(nh, "out_height"))
 {
-    cv::Mat camera_matrix(3, 3, CV_32FC1);
-    camera_matrix.at<float>(0, 0) =
+    camera_matrix_.create(3, 3, CV_32FC1);
+    camera_matrix_.at<float>(0, 0) =
         ros_utils::ParamUtils::getParam<double>(nh, "f_x");
-    camera_matrix.at<float>(0, 1) = 0.;
-    camera_matrix.at<float>(0, 2) =
+    camera_matrix_.at<float>(0, 1) = 0.;
+    camera_matrix_.at<float>(0, 2) =
         ros_utils::ParamUtils::getParam<double>(nh, "c_x");
-    camera_matrix.at<float>(1, 0) = 0.;
-    camera_matrix.at<float>(1, 1) =
+    camera_matrix_.at<float>(1, 0) = 0.;
+    camera_matrix_.at<float>(1, 1) =
         ros_utils::ParamUtils::getParam<double>(nh, "f_y");
-    camera_matrix.at<float>(1, 2) =
+    camera_matrix_.at<float>(1, 2) =
         ros_utils::ParamUtils::getParam<double>(nh, "c_y");
-    camera_matrix.at<float>(2, 0) = 0.;
-    camera_matrix.at<float>(2, 1) = 0.;
-    camera_matrix.at<float>(2, 2) = 1.;
+    camera_matrix_.at<float>(2, 0) = 0.;
+    camera_matrix_.at<float>(2, 1) = 0.;
+    camera_matrix_.at<float>(2, 2) = 1.;
 
-    cv::Mat dist(5, 1, CV_32FC1);
-    dist.at<float>(0, 0) = ros_utils::ParamUtils::getParam<double>(nh, "k1");
-    dist.at<float>(1, 0) = ros_utils::ParamUtils::getParam<double>(nh, "k2");
-    dist.at<float>(2, 0) = ros_utils::ParamUtils::getParam<double>(nh, "p1");
-    dist.at<float>(3, 0) = ros_utils::ParamUtils::getParam<double>(nh, "p2");
-    dist.at<float>(4, 0) = ros_utils::ParamUtils::getParam<double>(nh, "k3");
+    dist_.create(5, 1, CV_32FC1);
+    dist_.at<float>(0, 0) = ros_utils::ParamUtils::getParam<double>(nh, "k1");
+    dist_.at<float>(1, 0) = ros_utils::ParamUtils::getParam<double>(nh, "k2");
+    dist_.at<float>(2, 0) = ros_utils::ParamUtils::getParam<double>(nh, "p1");
+    dist_.at<float>(3, 0) = ros_utils::ParamUtils::getParam<double>(nh, "p2");
+    dist_.at<float>(4, 0) = ros_utils::ParamUtils::getParam<double>(nh, "k3");
 
-    cv::Mat new_camera_matrix = cv::getOptimalNewCameraMatrix(
-            camera_matrix, dist, image_size_, 0, new_image_size_, 0, true);
+    new_camera_matrix_ = cv::getOptimalNewCameraMatrix(
+            camera_matrix_, dist_, image_size_, 0, new_image_size_, 0, true);
+
+    const Maps maps = makeMaps(new_image_size_);
+    map1_ = maps.map1;
+    map2_ = maps.map2;
+}
+
+UndistortionModel::Maps UndistortionModel::makeMaps(const cv::Size& size) const
+{
+    // Scale the new camera matrix so the output pixel grid lines up with
+    // what resizing the full size output would give
+    const double scale_x = static_cast<double>(size.width)
+                         / new_image_size_.width;
+    const double scale_y = static_cast<double>(size.height)
+                         / new_image_size_.height;
+
+    cv::Mat scaled_camera_matrix = new_camera_matrix_.clone();
+    scaled_camera_matrix.at<double>(0, 0) *= scale_x;
+    scaled_camera_matrix.at<double>(0, 2) =
+        (new_camera_matrix_.at<double>(0, 2) + 0.5) * scale_x - 0.5;
+    scaled_camera_matrix.at<double>(1, 1) *= scale_y;
+    scaled_camera_matrix.at<double>(1, 2) =
+        (new_camera_matrix_.at<double>(1, 2) + 0.5) * scale_y - 0.5;
 
     cv::Mat map1_cpu;
     cv::Mat map2_cpu;
-    cv::initUndistortRectifyMap(camera_matrix,
-                                dist,
+    cv::initUndistortRectifyMap(camera_matrix_,
+                                dist_,
                                 cv::Mat(),
-                                new_camera_matrix,
-                                new_image_size_,
+                                scaled_camera_matrix,
+                                size,
                                 CV_32FC1,
                                 map1_cpu,
                                 map2_cpu);
 
-    map1_ = cv::cuda::GpuMat(map1_cpu);
-    map2_ = cv::cuda::GpuMat(map2_cpu);
+    Maps maps;
+    maps.size = size;
+    maps.map1 = cv::cuda::GpuMat(map1_cpu);
+    maps.map2 = cv::cuda::GpuMat(map2_cpu);
+    return maps;
+}
+
+const UndistortionModel::Maps& UndistortionModel::getMaps(
+        const cv::Size& size) const
+{
+    std::lock_guard<std::mutex> lock(scaled_maps_mutex_);
+
+    for (const Maps& maps : scaled_maps_) {
+        if (maps.size == size) {
+            return maps;
+        }
+    }
+
+    ROS_DEBUG_STREAM("Building undistortion maps for size " << size);
+    scaled_maps_.push_back(makeMaps(size));
+    return scaled_maps_.back();
 }
 
 void UndistortionModel::undistort(const cv::cuda::GpuMat& in,
@@ -69,4 +110,29 @@ void UndistortionModel::undistort(const cv::cuda::GpuMat& in,
                     stream);
 }
 
+void UndistortionModel::undistort(const cv::cuda::GpuMat& in,
+                                  cv::cuda::GpuMat& out,
+                                  const cv::Size& out_size,
+                                  cv::cuda::Stream& stream) const
+{
+    if (out_size == new_image_size_) {
+        undistort(in, out, stream);
+        return;
+    }
+
+    if (in.size() != image_size_) {
+        throw std::runtime_error("Image size does not match");
+    }
+
+    const Maps& maps = getMaps(out_size);
+    cv::cuda::remap(in,
+                    out,
+                    maps.map1,
+                    maps.map2,
+                    cv::INTER_LINEAR,
+                    cv::BORDER_CONSTANT,
+                    cv::Scalar(),
+                    stream);
+}
+
 } // namespace iarc7_vision
@@ -0,0 +1,399 @@
+// BAD HEADER
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#include <cv_bridge/cv_bridge.h>
+#pragma GCC diagnostic pop
+// END BAD HEADER
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/cuda.hpp>
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <sensor_msgs/Image.h>
+#include <tf2/buffer_core.h>
+#include <tf2/exceptions.h>
+#include <tf2_msgs/TFMessage.h>
+
+#include <ros_utils/ParamUtils.hpp>
+
+#include "iarc7_vision/ColorCorrectionModel.hpp"
+#include "iarc7_vision/GridLineEstimator.hpp"
+#include "iarc7_vision/ImagePreprocessor.hpp"
+#include "iarc7_vision/ImagePyramid.hpp"
+#include "iarc7_vision/OpticalFlowEstimator.hpp"
+#include "iarc7_vision/RoombaEstimator.hpp"
+#include "iarc7_vision/RoombaImageLocation.hpp"
+#include "iarc7_vision/StageTimings.hpp"
+#include "iarc7_vision/TransformSource.hpp"
+#include "iarc7_vision/UndistortionModel.hpp"
+#include "iarc7_vision/VisionSettings.hpp"
+#include "iarc7_vision/cv_utils.hpp"
+
+// Replays the camera images in a bag through the same pipeline as the vision
+// node, as fast as it will go, and prints how long each stage took
+//
+// Transforms come from the tf recorded in the bag instead of a tf listener,
+// so results don't depend on playback speed or anything else running.  Run
+// it with the same params as the node, see launch/benchmark.launch.
+
+namespace {
+
+/// Transforms from the /tf and /tf_static messages in a bag, all loaded up
+/// front
+class BagTransformSource : public iarc7_vision::TransformSource {
+  public:
+    explicit BagTransformSource(const rosbag::Bag& bag)
+        : buffer_(getBagDuration(bag) + ros::Duration(1.0))
+    {
+        const std::vector<std::string> topics {"/tf", "/tf_static"};
+        rosbag::View view(bag, rosbag::TopicQuery(topics));
+        for (const rosbag::MessageInstance& instance : view) {
+            const tf2_msgs::TFMessage::ConstPtr message
+                = instance.instantiate<tf2_msgs::TFMessage>();
+            if (message == nullptr) {
+                continue;
+            }
+
+            const bool is_static = instance.getTopic() == "/tf_static";
+            for (const geometry_msgs::TransformStamped& transform
+                    : message->transforms) {
+                buffer_.setTransform(transform, "rosbag", is_static);
+            }
+        }
+    }
+
+    /// Everything is already loaded, so the timeout is ignored
+    bool getTransformAtTime(
+            geometry_msgs::TransformStamped& transform,
+            const std::string& target_frame,
+            const std::string& source_frame,
+            const ros::Time& time,
+            const ros::Duration&) const override
+    {
+        try {
+            transform = buffer_.lookupTransform(target_frame,
+                                                source_frame,
+                                                time);
+        } catch (const tf2::TransformException& ex) {
+            ROS_ERROR_STREAM("iarc7_vision_benchmark: "
+                          << "Failed to look up transform from "
+                          << source_frame << " to " << target_frame
+                          << ": " << ex.what());
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    static ros::Duration getBagDuration(const rosbag::Bag& bag)
+    {
+        rosbag::View view(bag);
+        return view.getEndTime() - view.getBeginTime();
+    }
+
+    tf2::BufferCore buffer_;
+};
+
+void printSummaries(
+        const std::vector<std::pair<std::string,
+                                    iarc7_vision::StageStats::Summary>>&
+            summaries)
+{
+    std::printf("%-20s %8s %10s %10s %10s %10s %10s\n",
+                "stage",
+                "count",
+                "rate_hz",
+                "p50_ms",
+                "p95_ms",
+                "p99_ms",
+                "max_ms");
+    for (const auto& stage : summaries) {
+        const iarc7_vision::StageStats::Summary& summary = stage.second;
+        std::printf("%-20s %8lu %10.2f %10.3f %10.3f %10.3f %10.3f\n",
+                    stage.first.c_str(),
+                    static_cast<unsigned long>(summary.count),
+                    summary.rate,
+                    summary.p50 * 1000,
+                    summary.p95 * 1000,
+                    summary.p99 * 1000,
+                    summary.max * 1000);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "vision_benchmark");
+
+    if (cv::cuda::getCudaEnabledDeviceCount() == 0) {
+        ROS_ERROR("No CUDA devices found, vision benchmark cannot run");
+        return 1;
+    }
+
+    ros::NodeHandle private_nh("~");
+
+    const std::string bag_path
+        = ros_utils::ParamUtils::getParam<std::string>(private_nh, "bag");
+    std::string bottom_topic;
+    private_nh.param<std::string>("bottom_topic",
+                                  bottom_topic,
+                                  "/bottom_camera/rgb/image_raw");
+    std::string r200_topic;
+    private_nh.param<std::string>("r200_topic",
+                                  r200_topic,
+                                  "/bottom_image_raw_r200/image_raw");
+
+    rosbag::Bag bag;
+    try {
+        bag.open(bag_path, rosbag::bagmode::Read);
+    } catch (const rosbag::BagException& ex) {
+        ROS_ERROR_STREAM("iarc7_vision_benchmark: Failed to open "
+                      << bag_path << ": " << ex.what());
+        return 1;
+    }
+
+    ROS_INFO("iarc7_vision_benchmark: Loading transforms");
+    const BagTransformSource transform_source(bag);
+
+    const std::vector<std::string> image_topics {bottom_topic, r200_topic};
+    rosbag::View image_view(bag, rosbag::TopicQuery(image_topics));
+
+    sensor_msgs::Image::ConstPtr first_message;
+    for (const rosbag::MessageInstance& instance : image_view) {
+        if (instance.getTopic() == bottom_topic) {
+            first_message = instance.instantiate<sensor_msgs::Image>();
+            break;
+        }
+    }
+    if (first_message == nullptr) {
+        ROS_ERROR_STREAM("iarc7_vision_benchmark: No images on "
+                      << bottom_topic);
+        return 1;
+    }
+    const cv::Size input_size(first_message->width, first_message->height);
+
+    int color_conversion_code;
+    if (!iarc7_vision::getColorConversionCode(
+                ros_utils::ParamUtils::getParam<std::string>(
+                    private_nh, "image_format"),
+                color_conversion_code)) {
+        ROS_ERROR("Invalid color conversion code");
+        return 1;
+    }
+
+    // Same settings as the node starts with, there's no dynamic reconfigure
+    // here
+    iarc7_vision::LineExtractorSettings line_extractor_settings;
+    iarc7_vision::getLineExtractorSettings(private_nh, line_extractor_settings);
+    iarc7_vision::GridEstimatorSettings grid_estimator_settings;
+    iarc7_vision::getGridEstimatorSettings(private_nh, grid_estimator_settings);
+    iarc7_vision::GridLineDebugSettings grid_line_debug_settings;
+    iarc7_vision::getGridDebugSettings(private_nh, grid_line_debug_settings);
+    iarc7_vision::OpticalFlowEstimatorSettings optical_flow_estimator_settings;
+    iarc7_vision::getOpticalFlowEstimatorSettings(
+            private_nh, optical_flow_estimator_settings);
+    iarc7_vision::OpticalFlowDebugSettings optical_flow_debug_settings;
+    iarc7_vision::getFlowDebugSettings(private_nh, optical_flow_debug_settings);
+
+    iarc7_vision::StageTimings stage_timings;
+    iarc7_vision::GpuStageTimer preprocess_gpu_timer(
+            stage_timings.addStage("preprocess_gpu"),
+            ros_utils::ParamUtils::getParam<bool>(
+                private_nh, "gpu_stage_timing"));
+    iarc7_vision::StageStats& preprocess_stage
+        = stage_timings.addStage("preprocess");
+    iarc7_vision::StageStats& grid_stage = stage_timings.addStage("grid");
+    iarc7_vision::StageStats& roomba_stage = stage_timings.addStage("roomba");
+    iarc7_vision::StageStats& bottom_frame_stage
+        = stage_timings.addStage("bottom_frame");
+    iarc7_vision::StageStats& flow_stage = stage_timings.addStage("flow");
+
+    const iarc7_vision::UndistortionModel undistortion_model(
+            ros::NodeHandle("~/distortion_model"),
+            input_size);
+    const iarc7_vision::ColorCorrectionModel color_correction_model(
+            ros::NodeHandle("~/color_correction_model"));
+    const bool use_mapped_image_memory
+        = ros_utils::ParamUtils::getParam<bool>(
+                private_nh, "use_mapped_image_memory")
+       && iarc7_vision::cv_utils::deviceSharesHostMemory();
+    const int bottom_camera_pipeline_depth
+        = ros_utils::ParamUtils::getParam<int>(
+            private_nh, "bottom_camera_pipeline_depth");
+    ROS_ASSERT(bottom_camera_pipeline_depth >= 1);
+    iarc7_vision::ImagePreprocessor image_preprocessor(
+            undistortion_model,
+            color_correction_model,
+            color_conversion_code,
+            bottom_camera_pipeline_depth,
+            ros_utils::ParamUtils::getParam<bool>(
+                private_nh, "use_composite_undistortion_maps"),
+            use_mapped_image_memory,
+            &preprocess_gpu_timer);
+
+    iarc7_vision::RoombaEstimator roomba_estimator(
+            undistortion_model.getUndistortedSize(),
+            transform_source,
+            "bottom_camera",
+            "bottom_camera_rgb_optical_frame",
+            ros::NodeHandle("~/roomba_estimator"));
+    iarc7_vision::ImagePyramid image_pyramid(
+            ros_utils::ParamUtils::getParam<int>(
+                private_nh, "image_pyramid_levels"));
+
+    iarc7_vision::GridLineEstimator gridline_estimator(
+            line_extractor_settings,
+            grid_estimator_settings,
+            grid_line_debug_settings,
+            "RGB",
+            transform_source,
+            "bottom_camera_rgb_optical_frame");
+    iarc7_vision::OpticalFlowEstimator optical_flow_estimator(
+            optical_flow_estimator_settings,
+            optical_flow_debug_settings,
+            "RGB",
+            transform_source,
+            "bottom_camera_r200_rgb_optical_frame");
+
+    const ros::Duration no_timeout(0);
+    ROS_ASSERT(gridline_estimator.waitUntilReady(no_timeout));
+    ROS_ASSERT(optical_flow_estimator.waitUntilReady(no_timeout));
+
+    // The node runs grid estimation on its own thread, here it runs inline
+    // on the same frames so its time isn't hidden behind the other stages
+    const bool grid_stage_enabled = ros_utils::ParamUtils::getParam<bool>(
+            private_nh, "grid_stage_enabled");
+    const int grid_frame_interval = ros_utils::ParamUtils::getParam<int>(
+            private_nh, "grid_frame_interval");
+    ROS_ASSERT(grid_frame_interval >= 1);
+    cv::cuda::Stream preprocess_stream;
+    cv::cuda::Stream grid_stream;
+    cv::cuda::Stream roomba_stream;
+
+    std::vector<iarc7_vision::RoombaImageLocation> roomba_image_locations;
+    uint64_t bottom_frames = 0;
+    uint64_t r200_frames = 0;
+
+    // Bottom camera frames are pushed as they come up in the bag and
+    // processed once the preprocessor is full, so with a pipeline depth
+    // above 1 the next frames are preprocessed while the oldest is searched
+    const auto process_bottom_frame = [&]() {
+        const iarc7_vision::ImagePreprocessor::Frame* frame_ptr;
+        {
+            iarc7_vision::ScopedStageTimer timer(preprocess_stage);
+            frame_ptr = &image_preprocessor.front();
+        }
+        const iarc7_vision::ImagePreprocessor::Frame& frame = *frame_ptr;
+        const ros::Time& stamp = frame.message->header.stamp;
+
+        image_pyramid.reset(frame.detection);
+
+        if (grid_stage_enabled && bottom_frames % grid_frame_interval == 0) {
+            iarc7_vision::ScopedStageTimer timer(grid_stage);
+
+            // Same choice as the node's grid stage, but from the last width
+            // since there's no odometry here
+            const int line_image_width = gridline_estimator.getLineImageWidth();
+            if (line_image_width > image_pyramid.levelSize(0).width
+             && frame.has_corrected) {
+                gridline_estimator.update(frame.corrected, stamp, grid_stream);
+            } else {
+                const int level = line_image_width > 0
+                                ? image_pyramid.levelForWidth(line_image_width)
+                                : 0;
+                const cv::cuda::GpuMat& image = image_pyramid.level(
+                        level, grid_stream);
+                gridline_estimator.update(image, stamp, grid_stream);
+            }
+        }
+
+        roomba_image_locations.clear();
+        {
+            iarc7_vision::ScopedStageTimer timer(roomba_stage);
+            roomba_estimator.update(image_pyramid,
+                                    stamp,
+                                    roomba_image_locations,
+                                    roomba_stream);
+        }
+
+        image_preprocessor.pop();
+        bottom_frames++;
+    };
+
+    // Don't count setup in the rates
+    stage_timings.takeSummaries();
+    ROS_INFO_STREAM("iarc7_vision_benchmark: Replaying " << bag_path);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (const rosbag::MessageInstance& instance : image_view) {
+        if (!ros::ok()) {
+            break;
+        }
+
+        const sensor_msgs::Image::ConstPtr message
+            = instance.instantiate<sensor_msgs::Image>();
+        if (message == nullptr) {
+            continue;
+        }
+
+        if (instance.getTopic() == bottom_topic) {
+            const auto frame_start = std::chrono::steady_clock::now();
+            {
+                iarc7_vision::ScopedStageTimer timer(preprocess_stage);
+                const cv::Size detection_size
+                    = roomba_estimator.getDetectionSize();
+                image_preprocessor.push(
+                        message,
+                        detection_size,
+                        grid_stage_enabled
+                     && gridline_estimator.getLineImageWidth()
+                            > detection_size.width,
+                        false,
+                        preprocess_stream);
+            }
+            if (image_preprocessor.full()) {
+                process_bottom_frame();
+            }
+            bottom_frame_stage.record(std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - frame_start)
+                    .count());
+        } else {
+            iarc7_vision::ScopedStageTimer timer(flow_stage);
+
+            auto cv_shared_ptr = cv_bridge::toCvShare(message);
+            cv::cuda::GpuMat image_r200;
+            image_r200.upload(cv_shared_ptr->image);
+            optical_flow_estimator.update(image_r200,
+                                          message->header.stamp,
+                                          roomba_image_locations,
+                                          false);
+            r200_frames++;
+        }
+    }
+
+    while (!image_preprocessor.empty()) {
+        process_bottom_frame();
+    }
+
+    const double elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    printSummaries(stage_timings.takeSummaries());
+    std::printf("\n%lu bottom frames, %lu r200 frames in %.3f s\n",
+                static_cast<unsigned long>(bottom_frames),
+                static_cast<unsigned long>(r200_frames),
+                elapsed);
+    if (elapsed > 0) {
+        std::printf("%.2f bottom fps, %.2f r200 fps end to end\n",
+                    bottom_frames / elapsed,
+                    r200_frames / elapsed);
+    }
+
+    return 0;
+}
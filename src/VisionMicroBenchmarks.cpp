@@ -0,0 +1,601 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <opencv2/core.hpp>
+#include <opencv2/core/cuda.hpp>
+#include <opencv2/cudawarping.hpp>
+#include <opencv2/imgproc.hpp>
+#include <ros/ros.h>
+
+#include "iarc7_vision/ColorCorrectionModel.hpp"
+#include "iarc7_vision/GridLineEstimator.hpp"
+#include "iarc7_vision/RoombaBlobDetector.hpp"
+#include "iarc7_vision/RoombaEstimator.hpp"
+#include "iarc7_vision/TransformSource.hpp"
+#include "iarc7_vision/UndistortionModel.hpp"
+#include "iarc7_vision/VisionSettings.hpp"
+#include "iarc7_vision/cv_utils.hpp"
+#include "iarc7_vision/kernels/PyrLK.hpp"
+
+// Micro benchmarks for the gpu primitives and the estimator stages built on
+// them
+//
+// Settings come from the same params as the node, see
+// launch/micro_benchmarks.launch.  Images are synthetic: noise with a given
+// number of roomba plate sized blobs on it.  Gpu benchmarks wait for their
+// stream every iteration and report wall time.  Standard google benchmark
+// flags apply, e.g. --benchmark_out=results.json
+// --benchmark_out_format=json to save results.
+
+namespace iarc7_vision {
+
+/// Gives the benchmarks access to the private stages of the estimators
+class MicroBenchmarkAccess {
+  public:
+    static void thresholdFrame(const RoombaBlobDetector& detector,
+                               const cv::cuda::GpuMat& image,
+                               cv::cuda::GpuMat& dst,
+                               cv::cuda::Stream& stream)
+    {
+        detector.thresholdFrame(image, dst, stream);
+    }
+
+    static void getSaturationStatistics(const RoombaBlobDetector& detector,
+                                        cv::Scalar& mean,
+                                        cv::Scalar& stddev)
+    {
+        detector.getSaturationStatistics(mean, stddev);
+    }
+
+    static void boundMask(const RoombaBlobDetector& detector,
+                          const cv::cuda::GpuMat& mask,
+                          std::vector<cv::RotatedRect>& rects,
+                          cv::cuda::Stream& stream)
+    {
+        detector.boundMask(mask, rects, stream);
+    }
+
+    static void checkCorners(const RoombaBlobDetector& detector,
+                             const cv::cuda::GpuMat& image,
+                             const cv::Scalar& mean,
+                             const cv::Scalar& stddev,
+                             std::vector<cv::RotatedRect>& rects,
+                             std::vector<double>& flip_certainties,
+                             cv::cuda::Stream& stream)
+    {
+        detector.checkCorners(image,
+                              mean,
+                              stddev,
+                              rects,
+                              flip_certainties,
+                              stream);
+    }
+
+    static void get1dGridShift(const GridLineEstimator& estimator,
+                               const std::vector<double>& wrapped_dists,
+                               double& value,
+                               double& variance)
+    {
+        estimator.get1dGridShift(wrapped_dists, value, variance);
+    }
+
+    static double circularLeastSquaresMin(
+            const std::vector<double>& candidates,
+            size_t per_point,
+            double period)
+    {
+        return GridLineEstimator::circularLeastSquaresMin(candidates,
+                                                          per_point,
+                                                          period);
+    }
+};
+
+} // namespace iarc7_vision
+
+namespace {
+
+using iarc7_vision::MicroBenchmarkAccess;
+
+/// Everything loaded from the param server, shared by all the benchmarks
+struct Fixture {
+    Fixture()
+        : private_nh("~"),
+          roomba_nh("~/roomba_estimator"),
+          roomba_settings(iarc7_vision::RoombaEstimator::getSettings(
+                      roomba_nh)),
+          color_correction_model(ros::NodeHandle("~/color_correction_model"))
+    {
+        iarc7_vision::getLineExtractorSettings(private_nh, line_settings);
+        iarc7_vision::getGridEstimatorSettings(private_nh, grid_settings);
+        iarc7_vision::getGridDebugSettings(private_nh, grid_debug_settings);
+
+        grid_estimator.reset(new iarc7_vision::GridLineEstimator(
+                    line_settings,
+                    grid_settings,
+                    grid_debug_settings,
+                    "RGB",
+                    transform_source,
+                    "bottom_camera_rgb_optical_frame"));
+    }
+
+    ros::NodeHandle private_nh;
+    ros::NodeHandle roomba_nh;
+
+    const iarc7_vision::RoombaEstimatorSettings roomba_settings;
+    const iarc7_vision::ColorCorrectionModel color_correction_model;
+
+    iarc7_vision::LineExtractorSettings line_settings;
+    iarc7_vision::GridEstimatorSettings grid_settings;
+    iarc7_vision::GridLineDebugSettings grid_debug_settings;
+
+    // Never queried, the grid estimator just needs one
+    const iarc7_vision::TfTransformSource transform_source;
+    std::unique_ptr<iarc7_vision::GridLineEstimator> grid_estimator;
+};
+
+Fixture& fixture()
+{
+    static Fixture fixture;
+    return fixture;
+}
+
+/// 4:3 image size for a width
+cv::Size sizeForWidth(int width)
+{
+    return cv::Size(width, width * 3 / 4);
+}
+
+/// Side of a square blob in the middle of the accepted blob sizes
+int blobSide(const iarc7_vision::RoombaEstimatorSettings& settings)
+{
+    return std::max(2, static_cast<int>(std::sqrt(
+                    (settings.min_roomba_blob_size
+                   + settings.max_roomba_blob_size) / 2.0)));
+}
+
+/// Squares in a grid over the image, clipped to fit
+std::vector<cv::Rect> blobRects(const cv::Size& size, int count, int side)
+{
+    const int cols = static_cast<int>(std::ceil(std::sqrt(count)));
+    const int rows = (count + cols - 1) / std::max(cols, 1);
+    const cv::Size cell(size.width / std::max(cols, 1),
+                        size.height / std::max(rows, 1));
+    const int clipped = std::min({side, cell.width - 2, cell.height - 2});
+
+    std::vector<cv::Rect> rects;
+    for (int i = 0; i < count; i++) {
+        const cv::Point cell_center((i % cols) * cell.width + cell.width / 2,
+                                    (i / cols) * cell.height + cell.height / 2);
+        rects.emplace_back(cell_center.x - clipped / 2,
+                           cell_center.y - clipped / 2,
+                           clipped,
+                           clipped);
+    }
+    return rects;
+}
+
+/// rgb8 noise with count green blobs
+cv::Mat makeImage(const cv::Size& size, int count, int side)
+{
+    cv::Mat image(size, CV_8UC3);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+    for (const cv::Rect& rect : blobRects(size, count, side)) {
+        image(rect).setTo(cv::Scalar(20, 160, 40));
+    }
+    return image;
+}
+
+/// mono8 mask with count blobs
+cv::Mat makeMask(const cv::Size& size, int count, int side)
+{
+    cv::Mat mask(size, CV_8UC1, cv::Scalar(0));
+    for (const cv::Rect& rect : blobRects(size, count, side)) {
+        mask(rect).setTo(cv::Scalar(255));
+    }
+    return mask;
+}
+
+void BM_InRange(benchmark::State& state)
+{
+    const cv::Size size = sizeForWidth(state.range(0));
+    cv::cuda::GpuMat image(makeImage(size, 0, 0));
+    cv::cuda::GpuMat dst;
+    iarc7_vision::cv_utils::InRangeBuf buf;
+    cv::cuda::Stream stream;
+
+    while (state.KeepRunning()) {
+        iarc7_vision::cv_utils::inRange(image,
+                                        cv::Scalar(40, 60, 60),
+                                        cv::Scalar(80, 255, 255),
+                                        dst,
+                                        buf,
+                                        stream);
+        stream.waitForCompletion();
+    }
+    state.SetItemsProcessed(state.iterations() * size.area());
+}
+BENCHMARK(BM_InRange)->Arg(320)->Arg(640)->Arg(1280)->UseRealTime();
+
+void BM_SumPatch(benchmark::State& state)
+{
+    const cv::Mat image = makeImage(sizeForWidth(640), 0, 0);
+    const int side = state.range(0);
+    const cv::RotatedRect rect(cv::Point2f(320, 240),
+                               cv::Size2f(side, side),
+                               30);
+
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(
+                iarc7_vision::cv_utils::sumPatch(image, rect));
+    }
+}
+BENCHMARK(BM_SumPatch)->Arg(4)->Arg(16)->Arg(64);
+
+void BM_DownloadVector(benchmark::State& state)
+{
+    const int count = state.range(0);
+    cv::Mat points_cpu(1, count, CV_32FC2);
+    cv::randu(points_cpu, cv::Scalar::all(0), cv::Scalar::all(640));
+    const cv::cuda::GpuMat points(points_cpu);
+    std::vector<cv::Point2f> vector;
+
+    while (state.KeepRunning()) {
+        iarc7_vision::cv_utils::downloadVector(points, vector);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_DownloadVector)->Arg(100)->Arg(1000)->Arg(10000)->UseRealTime();
+
+void BM_ColorCorrection(benchmark::State& state)
+{
+    const cv::Size size = sizeForWidth(state.range(0));
+    const cv::cuda::GpuMat image(makeImage(size, 0, 0));
+    cv::cuda::GpuMat out;
+    iarc7_vision::ColorCorrectionBuf buf;
+    cv::cuda::Stream stream;
+
+    while (state.KeepRunning()) {
+        fixture().color_correction_model.correct(image, out, buf, stream);
+        stream.waitForCompletion();
+    }
+    state.SetItemsProcessed(state.iterations() * size.area());
+}
+BENCHMARK(BM_ColorCorrection)->Arg(320)->Arg(640)->Arg(1280)->UseRealTime();
+
+/// Tracks 200 points between two grayscale pyramids with a range(0) window,
+/// 5 and 20 have specialized kernels and 7 and 21 run the generic one
+void BM_PyrLK(benchmark::State& state)
+{
+    const cv::Size size = sizeForWidth(640);
+    const int max_level = 3;
+    cv::cuda::Stream stream;
+
+    // The next image is the previous one moved a couple of pixels
+    cv::Mat gray;
+    cv::cvtColor(makeImage(size, 0, 0), gray, cv::COLOR_RGB2GRAY);
+    cv::Mat shifted;
+    cv::copyMakeBorder(gray(cv::Rect(0, 0, size.width - 2, size.height - 1)),
+                       shifted,
+                       1, 0, 2, 0,
+                       cv::BORDER_REPLICATE);
+
+    std::vector<cv::cuda::GpuMat> prev_pyramid(max_level + 1);
+    std::vector<cv::cuda::GpuMat> next_pyramid(max_level + 1);
+    prev_pyramid[0].upload(gray);
+    next_pyramid[0].upload(shifted);
+    for (int i = 1; i <= max_level; i++) {
+        cv::cuda::pyrDown(prev_pyramid[i - 1], prev_pyramid[i]);
+        cv::cuda::pyrDown(next_pyramid[i - 1], next_pyramid[i]);
+    }
+
+    cv::Mat points(1, 200, CV_32FC2);
+    for (int i = 0; i < points.cols; i++) {
+        points.at<cv::Point2f>(i) = cv::Point2f(
+                32 + (i % 20) * (size.width - 64) / 20.f,
+                32 + (i / 20) * (size.height - 64) / 10.f);
+    }
+    const cv::cuda::GpuMat prev_pts(points);
+    cv::cuda::GpuMat next_pts;
+    cv::cuda::GpuMat status;
+
+    iarc7_vision::kernels::PyrLKParams params;
+    params.win_size = state.range(0);
+    params.max_level = max_level;
+    params.iters = 20;
+    params.min_eig_threshold
+        = iarc7_vision::kernels::kDefaultPyrLKMinEigThreshold;
+
+    while (state.KeepRunning()) {
+        iarc7_vision::kernels::pyrLK(prev_pyramid,
+                                     next_pyramid,
+                                     prev_pts,
+                                     next_pts,
+                                     status,
+                                     params,
+                                     stream);
+        stream.waitForCompletion();
+    }
+    state.SetItemsProcessed(state.iterations() * points.cols);
+}
+BENCHMARK(BM_PyrLK)->Arg(5)->Arg(7)->Arg(20)->Arg(21)->UseRealTime();
+
+/// Undistorts a full size image, straight to the given width if range(1)
+/// is nonzero
+void BM_Undistort(benchmark::State& state)
+{
+    const cv::Size size = sizeForWidth(state.range(0));
+    const iarc7_vision::UndistortionModel undistortion_model(
+            ros::NodeHandle("~/distortion_model"),
+            size);
+    const cv::cuda::GpuMat image(makeImage(size, 0, 0));
+    cv::cuda::GpuMat out;
+    cv::cuda::Stream stream;
+
+    const cv::Size out_size = state.range(1) > 0
+                            ? sizeForWidth(state.range(1))
+                            : undistortion_model.getUndistortedSize();
+
+    while (state.KeepRunning()) {
+        if (state.range(1) > 0) {
+            undistortion_model.undistort(image, out, out_size, stream);
+        } else {
+            undistortion_model.undistort(image, out, stream);
+        }
+        stream.waitForCompletion();
+    }
+    state.SetItemsProcessed(state.iterations() * out_size.area());
+}
+BENCHMARK(BM_Undistort)
+    ->Args({640, 0})
+    ->Args({1280, 0})
+    ->Args({1280, 320})
+    ->Args({1280, 640})
+    ->UseRealTime();
+
+void BM_ThresholdFrame(benchmark::State& state)
+{
+    const iarc7_vision::RoombaEstimatorSettings& settings
+        = fixture().roomba_settings;
+    const cv::Size size = sizeForWidth(state.range(0));
+    const iarc7_vision::RoombaBlobDetector detector(settings,
+                                                    fixture().roomba_nh,
+                                                    size);
+    const cv::cuda::GpuMat image(makeImage(size,
+                                           state.range(1),
+                                           blobSide(settings)));
+    cv::cuda::GpuMat mask;
+    cv::cuda::Stream stream;
+
+    while (state.KeepRunning()) {
+        MicroBenchmarkAccess::thresholdFrame(detector, image, mask, stream);
+        stream.waitForCompletion();
+    }
+    state.SetItemsProcessed(state.iterations() * size.area());
+}
+BENCHMARK(BM_ThresholdFrame)
+    ->Args({320, 4})
+    ->Args({640, 4})
+    ->Args({1280, 4})
+    ->UseRealTime();
+
+void BM_BoundMask(benchmark::State& state)
+{
+    const iarc7_vision::RoombaEstimatorSettings& settings
+        = fixture().roomba_settings;
+    const cv::Size size = sizeForWidth(state.range(0));
+    const iarc7_vision::RoombaBlobDetector detector(settings,
+                                                    fixture().roomba_nh,
+                                                    size);
+    const cv::cuda::GpuMat mask(makeMask(size,
+                                         state.range(1),
+                                         blobSide(settings)));
+    std::vector<cv::RotatedRect> rects;
+    cv::cuda::Stream stream;
+
+    while (state.KeepRunning()) {
+        MicroBenchmarkAccess::boundMask(detector, mask, rects, stream);
+        stream.waitForCompletion();
+    }
+    state.counters["blobs_found"] = rects.size();
+}
+BENCHMARK(BM_BoundMask)
+    ->Args({320, 1})
+    ->Args({320, 10})
+    ->Args({640, 1})
+    ->Args({640, 10})
+    ->Args({640, 40})
+    ->UseRealTime();
+
+void BM_CheckCorners(benchmark::State& state)
+{
+    const iarc7_vision::RoombaEstimatorSettings& settings
+        = fixture().roomba_settings;
+    const cv::Size size = sizeForWidth(state.range(0));
+    const int side = blobSide(settings);
+    const iarc7_vision::RoombaBlobDetector detector(settings,
+                                                    fixture().roomba_nh,
+                                                    size);
+    const cv::cuda::GpuMat image(makeImage(size, state.range(1), side));
+    cv::cuda::Stream stream;
+
+    cv::cuda::GpuMat mask;
+    MicroBenchmarkAccess::thresholdFrame(detector, image, mask, stream);
+    stream.waitForCompletion();
+    cv::Scalar mean, stddev;
+    MicroBenchmarkAccess::getSaturationStatistics(detector, mean, stddev);
+
+    std::vector<cv::RotatedRect> blob_rects;
+    for (const cv::Rect& rect : blobRects(size, state.range(1), side)) {
+        blob_rects.emplace_back(
+                cv::Point2f(rect.x + rect.width / 2.0f,
+                            rect.y + rect.height / 2.0f),
+                cv::Size2f(rect.width, rect.height),
+                0);
+    }
+
+    std::vector<cv::RotatedRect> rects;
+    std::vector<double> flip_certainties;
+    while (state.KeepRunning()) {
+        // checkCorners rotates the rects in place
+        rects = blob_rects;
+        MicroBenchmarkAccess::checkCorners(detector,
+                                           image,
+                                           mean,
+                                           stddev,
+                                           rects,
+                                           flip_certainties,
+                                           stream);
+        stream.waitForCompletion();
+    }
+    state.SetItemsProcessed(state.iterations() * blob_rects.size());
+}
+BENCHMARK(BM_CheckCorners)
+    ->Args({640, 1})
+    ->Args({640, 10})
+    ->Args({640, 40})
+    ->UseRealTime();
+
+void BM_Get1dGridShift(benchmark::State& state)
+{
+    const double grid_spacing = fixture().grid_settings.grid_spacing;
+    const double line_thickness = fixture().grid_settings.grid_line_thickness;
+
+    // Lines near both edges of one grid line with some noise, like a real
+    // frame
+    cv::RNG rng(0);
+    std::vector<double> wrapped_dists;
+    for (int i = 0; i < state.range(0); i++) {
+        const double edge = i % 2 == 0 ? 0 : line_thickness;
+        const double d = edge + rng.gaussian(line_thickness / 4);
+        wrapped_dists.push_back(d - grid_spacing * std::floor(d / grid_spacing));
+    }
+
+    double value, variance;
+    while (state.KeepRunning()) {
+        MicroBenchmarkAccess::get1dGridShift(*fixture().grid_estimator,
+                                             wrapped_dists,
+                                             value,
+                                             variance);
+        benchmark::DoNotOptimize(value);
+        benchmark::DoNotOptimize(variance);
+    }
+    state.SetItemsProcessed(state.iterations() * wrapped_dists.size());
+}
+BENCHMARK(BM_Get1dGridShift)->Arg(4)->Arg(16)->Arg(64)->Arg(256);
+
+/// The loss circularLeastSquaresMin minimizes, at s
+double circularLeastSquaresLoss(const std::vector<double>& candidates,
+                                size_t per_point,
+                                double period,
+                                double s)
+{
+    double loss = 0;
+    for (size_t i = 0; i < candidates.size(); i += per_point) {
+        double dist = std::numeric_limits<double>::max();
+        for (size_t j = i; j < i + per_point; j++) {
+            const double d = std::abs(candidates[j] - s);
+            dist = std::min({dist, d, period - d});
+        }
+        loss += dist * dist;
+    }
+    return loss;
+}
+
+/// count points with per_point candidates each in [0, period), spread
+/// uniformly or clustered around one value, which can straddle the wrap
+std::vector<double> randomCandidates(cv::RNG& rng,
+                                     int count,
+                                     size_t per_point,
+                                     double period,
+                                     bool clustered)
+{
+    const double center = rng.uniform(0.0, period);
+    const double spread = rng.uniform(0.01, 0.25) * period;
+    const double offset = rng.uniform(0.0, period / 2);
+
+    std::vector<double> candidates;
+    for (int i = 0; i < count; i++) {
+        const double point = clustered ? center + rng.gaussian(spread)
+                                       : rng.uniform(0.0, period);
+        for (size_t j = 0; j < per_point; j++) {
+            const double c = point + j * offset;
+            candidates.push_back(c - period * std::floor(c / period));
+        }
+    }
+    return candidates;
+}
+
+/// Args are the number of points and the candidates per point, 1 for the
+/// orientation search and 2 for the grid shift search
+void BM_CircularLeastSquaresMin(benchmark::State& state)
+{
+    const int count = state.range(0);
+    const size_t per_point = state.range(1);
+    const double period = per_point == 1
+                        ? M_PI / 2
+                        : fixture().grid_settings.grid_spacing;
+
+    // Check the closed form against a fine sweep of the same loss before
+    // timing it.  The sweep can come close to the true minimum but never
+    // below it.
+    constexpr int kTrials = 100;
+    constexpr int kSweepSteps = 20000;
+    cv::RNG rng(0);
+    for (int trial = 0; trial < kTrials; trial++) {
+        const std::vector<double> candidates = randomCandidates(
+                rng, count, per_point, period, trial % 2 == 0);
+
+        const double exact = MicroBenchmarkAccess::circularLeastSquaresMin(
+                candidates, per_point, period);
+        if (!(exact >= 0 && exact < period)) {
+            state.SkipWithError("Closed form minimum is out of range");
+            return;
+        }
+
+        double sweep_loss = std::numeric_limits<double>::max();
+        for (int step = 0; step < kSweepSteps; step++) {
+            sweep_loss = std::min(sweep_loss, circularLeastSquaresLoss(
+                        candidates, per_point, period,
+                        period * step / kSweepSteps));
+        }
+        const double exact_loss = circularLeastSquaresLoss(
+                candidates, per_point, period, exact);
+        if (exact_loss > sweep_loss + 1e-9 * std::max(1.0, sweep_loss)) {
+            state.SkipWithError("Closed form minimum is worse than the sweep");
+            return;
+        }
+    }
+
+    const std::vector<double> candidates = randomCandidates(
+            rng, count, per_point, period, true);
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(MicroBenchmarkAccess::circularLeastSquaresMin(
+                    candidates, per_point, period));
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_CircularLeastSquaresMin)
+    ->Args({4, 1})
+    ->Args({64, 1})
+    ->Args({4, 2})
+    ->Args({64, 2});
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "vision_micro_benchmarks");
+
+    if (cv::cuda::getCudaEnabledDeviceCount() == 0) {
+        ROS_ERROR("No CUDA devices found, micro benchmarks cannot run");
+        return 1;
+    }
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
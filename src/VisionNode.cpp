@@ -5,268 +5,46 @@
 #pragma GCC diagnostic pop
 // END BAD HEADER
 
+#include <algorithm>
 #include <chrono>
-#include <deque>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <dynamic_reconfigure/server.h>
 #include <image_transport/image_transport.h>
-#include <limits>
+#include <memory>
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <ros/callback_queue.h>
 #include <ros/ros.h>
 #include <sensor_msgs/image_encodings.h>
 #include <sensor_msgs/Image.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "iarc7_safety/SafetyClient.hpp"
 #include <iarc7_vision/VisionNodeConfig.h>
 #include <ros_utils/ParamUtils.hpp>
 
+#include "iarc7_vision/BoundedRing.hpp"
 #include "iarc7_vision/ColorCorrectionModel.hpp"
+#include "iarc7_vision/FloorDetector.hpp"
+#include "iarc7_vision/GpuBufferPool.hpp"
+#include "iarc7_vision/GpuScheduler.hpp"
 #include "iarc7_vision/GridLineEstimator.hpp"
+#include "iarc7_vision/GridLineStage.hpp"
+#include "iarc7_vision/ImageMessagePool.hpp"
+#include "iarc7_vision/ImagePyramid.hpp"
+#include "iarc7_vision/ImagePreprocessor.hpp"
 #include "iarc7_vision/OpticalFlowEstimator.hpp"
+#include "iarc7_vision/PoseCache.hpp"
 #include "iarc7_vision/RoombaEstimator.hpp"
 #include "iarc7_vision/RoombaImageLocation.hpp"
+#include "iarc7_vision/StageTimings.hpp"
+#include "iarc7_vision/TransformSource.hpp"
+#include "iarc7_vision/TripleBuffer.hpp"
+#include "iarc7_vision/cv_utils.hpp"
 #include "iarc7_vision/UndistortionModel.hpp"
-
-void getLineExtractorSettings(const ros::NodeHandle& private_nh,
-                              iarc7_vision::LineExtractorSettings& line_settings)
-{
-    // Begin line extractor settings
-    ROS_ASSERT(private_nh.getParam(
-            "line_extractor/pixels_per_meter",
-            line_settings.pixels_per_meter));
-
-    ROS_ASSERT(private_nh.getParam(
-            "line_extractor/canny_high_threshold",
-            line_settings.canny_high_threshold));
-
-    double canny_threshold_ratio;
-    ROS_ASSERT(private_nh.getParam(
-            "line_extractor/canny_threshold_ratio",
-            canny_threshold_ratio));
-    line_settings.canny_low_threshold =
-        line_settings.canny_high_threshold / canny_threshold_ratio;
-
-    ROS_ASSERT(private_nh.getParam(
-            "line_extractor/canny_sobel_size",
-            line_settings.canny_sobel_size));
-
-    ROS_ASSERT(private_nh.getParam(
-            "line_extractor/hough_rho_resolution",
-            line_settings.hough_rho_resolution));
-
-    ROS_ASSERT(private_nh.getParam(
-            "line_extractor/hough_theta_resolution",
-            line_settings.hough_theta_resolution));
-
-    ROS_ASSERT(private_nh.getParam(
-            "line_extractor/hough_thresh_fraction",
-            line_settings.hough_thresh_fraction));
-
-    ROS_ASSERT(private_nh.getParam(
-            "line_extractor/fov",
-            line_settings.fov));
-}
-
-void getOpticalFlowEstimatorSettings(const ros::NodeHandle& private_nh,
-                    iarc7_vision::OpticalFlowEstimatorSettings& flow_settings)
-{
-    // Begin optical flow estimator settings
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/fov",
-            flow_settings.fov));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/min_estimation_altitude",
-            flow_settings.min_estimation_altitude));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/camera_vertical_threshold",
-            flow_settings.camera_vertical_threshold));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/points",
-            flow_settings.points));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/quality_level",
-            flow_settings.quality_level));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/min_dist",
-            flow_settings.min_dist));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/win_size",
-            flow_settings.win_size));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/max_level",
-            flow_settings.max_level));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/iters",
-            flow_settings.iters));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/scale_factor",
-            flow_settings.scale_factor));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/crop",
-            flow_settings.crop));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/crop_width",
-            flow_settings.crop_width));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/crop_height",
-            flow_settings.crop_height));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/variance",
-            flow_settings.variance));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/variance_scale",
-            flow_settings.variance_scale));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/x_cutoff_region_velocity_measurement",
-            flow_settings.x_cutoff_region_velocity_measurement));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/y_cutoff_region_velocity_measurement",
-            flow_settings.y_cutoff_region_velocity_measurement));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/debug_frameskip",
-            flow_settings.debug_frameskip));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/tf_timeout",
-            flow_settings.tf_timeout));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/max_rotational_vel",
-            flow_settings.max_rotational_vel));
-
-    std::string vector_filter_string;
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/vector_filter",
-            vector_filter_string));
-    flow_settings.set_vector_filter_str(vector_filter_string);
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/min_vectors",
-            flow_settings.min_vectors));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/max_filtered_variance",
-            flow_settings.max_filtered_variance));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/max_normalized_element_variance",
-            flow_settings.max_normalized_element_variance));
-
-    ROS_ASSERT(private_nh.getParam(
-        "optical_flow_estimator/hist_scale_factor",
-        flow_settings.hist_scale_factor));
-
-    ROS_ASSERT(private_nh.getParam(
-        "optical_flow_estimator/hist_image_size_scale",
-        flow_settings.hist_image_size_scale));
-}
-
-void getGridEstimatorSettings(const ros::NodeHandle& private_nh,
-                              iarc7_vision::GridEstimatorSettings& settings)
-{
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/theta_step",
-            settings.theta_step));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/grid_step",
-            settings.grid_step));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/grid_spacing",
-            settings.grid_spacing));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/grid_line_thickness",
-            settings.grid_line_thickness));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/grid_zero_offset_x",
-            settings.grid_zero_offset(0)));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/grid_zero_offset_y",
-            settings.grid_zero_offset(1)));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/grid_translation_mean_iterations",
-            settings.grid_translation_mean_iterations));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/line_rejection_angle_threshold",
-            settings.line_rejection_angle_threshold));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/min_extraction_altitude",
-            settings.min_extraction_altitude));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_estimator/allowed_position_stamp_error",
-            settings.allowed_position_stamp_error));
-}
-
-void getGridDebugSettings(const ros::NodeHandle& private_nh,
-                      iarc7_vision::GridLineDebugSettings& settings)
-{
-   ROS_ASSERT(private_nh.getParam(
-            "grid_line_estimator/debug_line_detector",
-            settings.debug_line_detector));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_line_estimator/debug_direction",
-            settings.debug_direction));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_line_estimator/debug_edges",
-            settings.debug_edges));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_line_estimator/debug_lines",
-            settings.debug_lines));
-    ROS_ASSERT(private_nh.getParam(
-            "grid_line_estimator/debug_line_markers",
-            settings.debug_line_markers));
-    if (private_nh.hasParam("grid_line_estimator/debug_height")) {
-        ROS_ASSERT(private_nh.getParam(
-            "grid_line_estimator/debug_height",
-            settings.debug_height));
-    } else {
-        settings.debug_height = std::numeric_limits<double>::quiet_NaN();
-    }
-}
-
-void getFlowDebugSettings(const ros::NodeHandle& private_nh,
-                          iarc7_vision::OpticalFlowDebugSettings& settings)
-{
-    ROS_ASSERT(private_nh.getParam(
-        "optical_flow_estimator/debug_average_vector_image",
-        settings.debug_average_vector_image));
-
-    ROS_ASSERT(private_nh.getParam(
-        "optical_flow_estimator/debug_intermediate_velocities",
-        settings.debug_intermediate_velocities));
-
-    ROS_ASSERT(private_nh.getParam(
-        "optical_flow_estimator/debug_orientation",
-        settings.debug_orientation));
-
-    ROS_ASSERT(private_nh.getParam(
-        "optical_flow_estimator/debug_times",
-        settings.debug_times));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/debug_vectors_image",
-            settings.debug_vectors_image));
-
-    ROS_ASSERT(private_nh.getParam(
-            "optical_flow_estimator/debug_hist",
-            settings.debug_hist));
-}
+#include "iarc7_vision/VisionSettings.hpp"
 
 void getDynamicSettings(iarc7_vision::VisionNodeConfig &config,
                         const ros::NodeHandle& private_nh,
@@ -275,8 +53,9 @@ void getDynamicSettings(iarc7_vision::VisionNodeConfig &config,
                         bool& ran)
 {
     if (!ran) {
-        getLineExtractorSettings(private_nh, line_settings);
-        getOpticalFlowEstimatorSettings(private_nh, flow_settings);
+        iarc7_vision::getLineExtractorSettings(private_nh, line_settings);
+        iarc7_vision::getOpticalFlowEstimatorSettings(private_nh,
+                                                      flow_settings);
 
         // Overwrite line extractor settings from dynamic reconfigure
         // with the ones from the param server
@@ -375,6 +154,194 @@ void getDynamicSettings(iarc7_vision::VisionNodeConfig &config,
     }
 }
 
+void fillQueueStatus(const std::string& name,
+                     const iarc7_vision::RingStats& stats,
+                     uint64_t& last_reported_drops,
+                     diagnostic_msgs::DiagnosticStatus& status)
+{
+    status.name = name;
+    status.hardware_id = "vision_node";
+
+    if (stats.dropped != last_reported_drops) {
+        status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+        status.message = "Dropping images";
+    } else {
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.message = "OK";
+    }
+    last_reported_drops = stats.dropped;
+
+    const auto add_value = [&](const std::string& key, uint64_t value) {
+        diagnostic_msgs::KeyValue key_value;
+        key_value.key = key;
+        key_value.value = std::to_string(value);
+        status.values.push_back(key_value);
+    };
+    add_value("capacity", stats.capacity);
+    add_value("occupancy", stats.occupancy);
+    add_value("max_occupancy", stats.max_occupancy);
+    add_value("pushed", stats.pushed);
+    add_value("popped", stats.popped);
+    add_value("dropped", stats.dropped);
+}
+
+void fillBufferPoolStatus(const iarc7_vision::GpuBufferPoolStats& stats,
+                          uint64_t& last_reported_misses,
+                          diagnostic_msgs::DiagnosticStatus& status)
+{
+    status.name = "vision_node: gpu buffer pool";
+    status.hardware_id = "vision_node";
+
+    // Misses are expected while the pool warms up, after that they mean
+    // something is allocating a new size every frame
+    if (stats.misses != last_reported_misses) {
+        status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+        status.message = "Allocating";
+    } else {
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.message = "OK";
+    }
+    last_reported_misses = stats.misses;
+
+    const auto add_value = [&](const std::string& key, uint64_t value) {
+        diagnostic_msgs::KeyValue key_value;
+        key_value.key = key;
+        key_value.value = std::to_string(value);
+        status.values.push_back(key_value);
+    };
+    add_value("hits", stats.hits);
+    add_value("misses", stats.misses);
+    add_value("in_use_bytes", stats.in_use_bytes);
+    add_value("cached_bytes", stats.cached_bytes);
+}
+
+/// Everything the node keeps for one camera
+struct Camera {
+    Camera(const iarc7_vision::CameraSettings& camera_settings,
+           size_t queue_limit,
+           iarc7_vision::RingPolicy queue_policy,
+           int pyramid_levels,
+           iarc7_vision::StageTimings& stage_timings,
+           bool gpu_stage_timing)
+        : settings(camera_settings),
+          queue(queue_limit, queue_policy),
+          callback_queue(),
+          transport(),
+          subscriber(),
+          spinner(),
+          last_seen_drops(0),
+          last_reported_drops(0),
+          preprocess_gpu_timer(),
+          preprocess_wait_stage(nullptr),
+          publish_stage(nullptr),
+          grid_offer_stage(nullptr),
+          gpu_wait_stage(nullptr),
+          roomba_stage(nullptr),
+          floor_stage(nullptr),
+          flow_stage(nullptr),
+          age_stage(nullptr),
+          undistortion_model(),
+          color_correction_model(),
+          preprocessor(),
+          roomba_estimator(),
+          failed(false),
+          corrected_image_pub(),
+          corrected_image_pool(4),
+          pyramid(pyramid_levels),
+          roomba_image_locations(),
+          roomba_mask_source(nullptr),
+          staging(cv::cuda::HostMem::SHARED),
+          images_skipped(false)
+    {
+        const auto add_stage = [&](const std::string& stage) {
+            return &stage_timings.addStage(settings.name + "/" + stage);
+        };
+
+        if (settings.undistort) {
+            preprocess_gpu_timer.reset(new iarc7_vision::GpuStageTimer(
+                        *add_stage("preprocess_gpu"),
+                        gpu_stage_timing));
+            preprocess_wait_stage = add_stage("preprocess_wait");
+            publish_stage = add_stage("publish_corrected");
+        }
+        if (settings.grid) {
+            grid_offer_stage = add_stage("grid_offer");
+        }
+        // Every preprocessed frame and every flow frame waits for a stream
+        if (settings.undistort || settings.flow) {
+            gpu_wait_stage = add_stage("gpu_wait");
+        }
+        if (settings.roomba) {
+            roomba_stage = add_stage("roomba");
+        }
+        if (settings.floor) {
+            floor_stage = add_stage("floor");
+        }
+        if (settings.flow) {
+            flow_stage = add_stage("flow");
+        }
+        age_stage = add_stage("age");
+    }
+
+    Camera(const Camera&) = delete;
+    Camera& operator=(const Camera&) = delete;
+
+    const iarc7_vision::CameraSettings settings;
+
+    iarc7_vision::BoundedRing<sensor_msgs::Image::ConstPtr> queue;
+    /// Only used in threaded mode
+    ros::CallbackQueue callback_queue;
+    std::unique_ptr<image_transport::ImageTransport> transport;
+    image_transport::Subscriber subscriber;
+    std::unique_ptr<ros::AsyncSpinner> spinner;
+    /// Drops between taken images already warned about
+    uint64_t last_seen_drops;
+    /// Drops already reported on the diagnostics topic
+    uint64_t last_reported_drops;
+
+    // Latency of each stage this camera runs, null for the others
+    std::unique_ptr<iarc7_vision::GpuStageTimer> preprocess_gpu_timer;
+    iarc7_vision::StageStats* preprocess_wait_stage;
+    iarc7_vision::StageStats* publish_stage;
+    iarc7_vision::StageStats* grid_offer_stage;
+    iarc7_vision::StageStats* gpu_wait_stage;
+    iarc7_vision::StageStats* roomba_stage;
+    iarc7_vision::StageStats* floor_stage;
+    iarc7_vision::StageStats* flow_stage;
+    iarc7_vision::StageStats* age_stage;
+
+    // Built from the first image of cameras which undistort, they need its
+    // size
+    std::unique_ptr<const iarc7_vision::UndistortionModel> undistortion_model;
+    std::unique_ptr<const iarc7_vision::ColorCorrectionModel>
+        color_correction_model;
+    std::unique_ptr<iarc7_vision::ImagePreprocessor> preprocessor;
+    std::unique_ptr<iarc7_vision::RoombaEstimator> roomba_estimator;
+    /// True if the first image couldn't be used, images are dropped after
+    bool failed;
+
+    ros::Publisher corrected_image_pub;
+    /// Reused for publishing the corrected image, a few in case intraprocess
+    /// subscribers hold on to them for a while
+    iarc7_vision::ImageMessagePool corrected_image_pool;
+
+    /// Built from the detection image of each frame, the grid, roomba and
+    /// floor stages each pick the level they need
+    iarc7_vision::ImagePyramid pyramid;
+
+    /// Latest roomba detections, handed to the flow camera masking them out
+    /// without either thread waiting on the other
+    iarc7_vision::TripleBuffer<std::vector<iarc7_vision::RoombaImageLocation>>
+        roomba_image_locations;
+
+    // Flow cameras
+    /// Camera whose roomba detections are masked out, may be null
+    Camera* roomba_mask_source;
+    cv::cuda::HostMem staging;
+    /// True if images were dropped since the last flow frame
+    bool images_skipped;
+};
+
 int main(int argc, char **argv)
 {
     ros::init(argc, argv, "vision");
@@ -387,41 +354,126 @@ int main(int argc, char **argv)
     ros::NodeHandle nh;
     ros::NodeHandle private_nh("~");
 
+    // Every stage with gpu work leases one of these for each frame, so more
+    // cameras share the same streams instead of each adding its own.
+    // Created first, the buffer pool records events on the streams until
+    // it and every GpuMat are gone.
+    const int gpu_streams = ros_utils::ParamUtils::getParam<int>(
+            private_nh, "gpu_streams");
+    ROS_ASSERT(gpu_streams >= 1);
+    iarc7_vision::GpuScheduler gpu_scheduler(gpu_streams);
+
+    // Created before anything allocates on the gpu so it outlives every
+    // GpuMat, including the ones owned by the estimators
+    std::unique_ptr<iarc7_vision::GpuBufferPool> gpu_buffer_pool;
+    if (ros_utils::ParamUtils::getParam<bool>(
+                private_nh, "use_gpu_buffer_pool")) {
+        const int size_mb = ros_utils::ParamUtils::getParam<int>(
+                private_nh, "gpu_buffer_pool_size_mb");
+        ROS_ASSERT(size_mb >= 0);
+        gpu_buffer_pool.reset(new iarc7_vision::GpuBufferPool(
+                    static_cast<size_t>(size_mb) << 20));
+        gpu_buffer_pool->install();
+
+        // Buffers released after use on these are only reused once that
+        // work is done
+        for (const cv::cuda::Stream& stream : gpu_scheduler.streams()) {
+            gpu_buffer_pool->addStream(stream);
+        }
+    }
+
     std::string expected_image_format
         = ros_utils::ParamUtils::getParam<std::string>(
                 private_nh, "image_format");
 
     int color_conversion_code;
-    if (expected_image_format == "RGB") {
-        color_conversion_code = 0;
-    } else if (expected_image_format == "RGBA") {
-        color_conversion_code = CV_RGBA2RGB;
-    } else if (expected_image_format == "BGR") {
-        color_conversion_code = CV_BGR2RGB;
-    } else {
+    if (!iarc7_vision::getColorConversionCode(expected_image_format,
+                                              color_conversion_code)) {
         ROS_ERROR("Invalid color conversion code");
         return 1;
     }
 
     // Create settings objects
     iarc7_vision::LineExtractorSettings line_extractor_settings;
-    getLineExtractorSettings(private_nh, line_extractor_settings);
+    iarc7_vision::getLineExtractorSettings(private_nh, line_extractor_settings);
     iarc7_vision::GridEstimatorSettings grid_estimator_settings;
-    getGridEstimatorSettings(private_nh, grid_estimator_settings);
+    iarc7_vision::getGridEstimatorSettings(private_nh, grid_estimator_settings);
     iarc7_vision::GridLineDebugSettings grid_line_debug_settings;
-    getGridDebugSettings(private_nh, grid_line_debug_settings);
+    iarc7_vision::getGridDebugSettings(private_nh, grid_line_debug_settings);
 
     iarc7_vision::OpticalFlowEstimatorSettings optical_flow_estimator_settings;
-    getOpticalFlowEstimatorSettings(private_nh, optical_flow_estimator_settings);
+    iarc7_vision::getOpticalFlowEstimatorSettings(
+            private_nh, optical_flow_estimator_settings);
     iarc7_vision::OpticalFlowDebugSettings optical_flow_debug_settings;
 
     // Load settings not in dynamic reconfigure
-    getFlowDebugSettings(private_nh, optical_flow_debug_settings);
+    iarc7_vision::getFlowDebugSettings(private_nh, optical_flow_debug_settings);
+
+    std::vector<iarc7_vision::CameraSettings> camera_settings;
+    iarc7_vision::getCameraSettings(private_nh, camera_settings);
+
+    const auto find_camera = [&](bool iarc7_vision::CameraSettings::* stage)
+            -> const iarc7_vision::CameraSettings* {
+        for (const iarc7_vision::CameraSettings& camera : camera_settings) {
+            if (camera.*stage) {
+                return &camera;
+            }
+        }
+        return nullptr;
+    };
+
+    // Grid and floor are also switched on and off as a whole, so the launch
+    // files can leave the camera list alone
+    const iarc7_vision::CameraSettings* grid_camera
+        = ros_utils::ParamUtils::getParam<bool>(
+                private_nh, "grid_stage_enabled")
+        ? find_camera(&iarc7_vision::CameraSettings::grid)
+        : nullptr;
+    const iarc7_vision::CameraSettings* floor_camera
+        = ros_utils::ParamUtils::getParam<bool>(
+                private_nh, "floor_detector_enabled")
+        ? find_camera(&iarc7_vision::CameraSettings::floor)
+        : nullptr;
+    const iarc7_vision::CameraSettings* flow_camera
+        = find_camera(&iarc7_vision::CameraSettings::flow);
+
+    // Shared by all the estimators, so there's only one tf listener
+    const iarc7_vision::TfTransformSource tf_transform_source;
+
+    // Keeps a history of the transforms the estimators look up, so frames
+    // whose pose has already arrived don't go through tf and ones whose pose
+    // hasn't are woken as soon as it does
+    std::unique_ptr<iarc7_vision::PoseCache> pose_cache;
+    if (ros_utils::ParamUtils::getParam<bool>(
+                private_nh, "pose_cache_enabled")) {
+        std::vector<iarc7_vision::PoseCache::FramePair> cached_transforms {
+            {"level_quad", "quad"}
+        };
+        for (const iarc7_vision::CameraSettings& camera : camera_settings) {
+            cached_transforms.emplace_back("map", camera.frame);
+            cached_transforms.emplace_back("level_quad", camera.frame);
+        }
+
+        pose_cache.reset(new iarc7_vision::PoseCache(
+                    tf_transform_source,
+                    cached_transforms,
+                    ros::Duration(ros_utils::ParamUtils::getParam<double>(
+                            private_nh, "pose_cache_length"))));
+    }
+    const iarc7_vision::TransformSource& transform_source
+        = pose_cache != nullptr
+        ? static_cast<const iarc7_vision::TransformSource&>(*pose_cache)
+        : tf_transform_source;
 
     std::unique_ptr<iarc7_vision::GridLineEstimator> gridline_estimator;
     std::unique_ptr<iarc7_vision::OpticalFlowEstimator> optical_flow_estimator;
 
     // Set up dynamic reconfigure
+    //
+    // Changes are staged on the estimators as snapshots, which they swap in
+    // between frames, so the callback never waits for a frame to finish and
+    // frames never wait on the callback.  The settings objects above are
+    // only touched here after the estimators are created.
     dynamic_reconfigure::Server<iarc7_vision::VisionNodeConfig> dynamic_reconfigure_server;
     bool dynamic_reconfigure_called = false;
     boost::function<void(iarc7_vision::VisionNodeConfig &config,
@@ -435,11 +487,12 @@ int main(int argc, char **argv)
             dynamic_reconfigure_called = true;
 
             if (gridline_estimator != nullptr) {
-                ROS_ASSERT(gridline_estimator->onSettingsChanged());
+                gridline_estimator->stageSettings(line_extractor_settings);
             }
 
             if (optical_flow_estimator != nullptr) {
-                ROS_ASSERT(optical_flow_estimator->onSettingsChanged());
+                optical_flow_estimator->stageSettings(
+                        optical_flow_estimator_settings);
             }
         };
     dynamic_reconfigure_server.setCallback(
@@ -453,16 +506,24 @@ int main(int argc, char **argv)
         ros::spinOnce();
     }
 
-    // Create vision processing objects
-    gridline_estimator.reset(new iarc7_vision::GridLineEstimator(
-            line_extractor_settings,
-            grid_estimator_settings,
-            grid_line_debug_settings,
-            "RGB"));
-    optical_flow_estimator.reset(new iarc7_vision::OpticalFlowEstimator(
-            optical_flow_estimator_settings,
-            optical_flow_debug_settings,
-            "RGB"));
+    // Create vision processing objects, for the stages some camera runs
+    if (grid_camera != nullptr) {
+        gridline_estimator.reset(new iarc7_vision::GridLineEstimator(
+                line_extractor_settings,
+                grid_estimator_settings,
+                grid_line_debug_settings,
+                "RGB",
+                transform_source,
+                grid_camera->frame));
+    }
+    if (flow_camera != nullptr) {
+        optical_flow_estimator.reset(new iarc7_vision::OpticalFlowEstimator(
+                optical_flow_estimator_settings,
+                optical_flow_debug_settings,
+                "RGB",
+                transform_source,
+                flow_camera->frame));
+    }
 
     // Load the parameters specific to the vision node
     double startup_timeout;
@@ -470,66 +531,118 @@ int main(int argc, char **argv)
 
     size_t message_queue_item_limit = ros_utils::ParamUtils::getParam<int>(
             private_nh, "message_queue_item_limit");
+    ROS_ASSERT(message_queue_item_limit >= 2);
+
+    iarc7_vision::RingPolicy image_queue_policy;
+    ROS_ASSERT_MSG(iarc7_vision::parseRingPolicy(
+                ros_utils::ParamUtils::getParam<std::string>(
+                    private_nh, "image_queue_policy"),
+                image_queue_policy),
+            "Invalid image_queue_policy");
+
+    const int bottom_camera_pipeline_depth
+        = ros_utils::ParamUtils::getParam<int>(
+            private_nh, "bottom_camera_pipeline_depth");
+    ROS_ASSERT(bottom_camera_pipeline_depth >= 1);
+
+    const bool threaded_mode = ros_utils::ParamUtils::getParam<bool>(
+            private_nh, "threaded_mode");
+
+    // The subscriber callbacks run on the processing thread when not in
+    // threaded mode, blocking there would never return
+    ROS_ASSERT_MSG(threaded_mode
+                || image_queue_policy != iarc7_vision::RingPolicy::Block,
+                   "image_queue_policy block requires threaded_mode");
+
+    // Latency of each stage, summarized on the diagnostics topic.  Gpu
+    // timers measure when the work actually runs, instead of when it was
+    // queued.
+    iarc7_vision::StageTimings stage_timings;
+    const bool gpu_stage_timing = ros_utils::ParamUtils::getParam<bool>(
+            private_nh, "gpu_stage_timing");
+
+    const int image_pyramid_levels = ros_utils::ParamUtils::getParam<int>(
+            private_nh, "image_pyramid_levels");
+
+    // Queues and callbacks for collecting images
+    //
+    // In threaded mode each camera gets its own callback queue and spinner,
+    // so images keep arriving while the processing threads are busy
+    std::vector<std::unique_ptr<Camera>> cameras;
+    for (const iarc7_vision::CameraSettings& settings : camera_settings) {
+        cameras.emplace_back(new Camera(settings,
+                                        message_queue_item_limit,
+                                        image_queue_policy,
+                                        image_pyramid_levels,
+                                        stage_timings,
+                                        gpu_stage_timing));
+        Camera& camera = *cameras.back();
+
+        ros::NodeHandle camera_nh = nh;
+        if (threaded_mode) {
+            camera_nh.setCallbackQueue(&camera.callback_queue);
+        }
 
-    // Queue and callback for collecting images
-    std::deque<sensor_msgs::Image::ConstPtr> message_queue;
-    std::function<void(const sensor_msgs::Image::ConstPtr&)> image_msg_handler =
-        [&](const sensor_msgs::Image::ConstPtr& message) {
-            message_queue.push_back(message);
-
-            // Make sure this doesn't grow without bound, but this will still trigger
-            // the over-limit check in the main loop
-            while (message_queue.size() > message_queue_item_limit) {
-                message_queue.pop_front();
-            }
-        };
+        camera.transport.reset(
+                new image_transport::ImageTransport(camera_nh));
+        camera.subscriber = camera.transport->subscribe(
+                settings.topic,
+                100,
+                std::function<void(const sensor_msgs::Image::ConstPtr&)>(
+                    [&camera](const sensor_msgs::Image::ConstPtr& message) {
+                        camera.queue.push(message);
+                    }));
+
+        if (threaded_mode) {
+            camera.spinner.reset(
+                    new ros::AsyncSpinner(1, &camera.callback_queue));
+            camera.spinner->start();
+        }
 
-    // Queue and callback for collecting images
-    std::deque<sensor_msgs::Image::ConstPtr> message_queue_r200;
-    std::function<void(const sensor_msgs::Image::ConstPtr&)> image_msg_handler_r200 =
-        [&](const sensor_msgs::Image::ConstPtr& message) {
-            message_queue_r200.push_back(message);
+        if (settings.undistort) {
+            camera.corrected_image_pub = nh.advertise<sensor_msgs::Image>(
+                    settings.corrected_image_topic, 1);
+        }
+    }
 
-            // Make sure this doesn't grow without bound, but this will still trigger
-            // the over-limit check in the main loop
-            while (message_queue_r200.size() > message_queue_item_limit) {
-                message_queue_r200.pop_front();
+    for (const std::unique_ptr<Camera>& camera : cameras) {
+        const std::string& source = camera->settings.flow_roomba_mask_camera;
+        for (const std::unique_ptr<Camera>& other : cameras) {
+            if (!source.empty() && other->settings.name == source) {
+                camera->roomba_mask_source = other.get();
             }
-        };
-
-    image_transport::ImageTransport image_transporter{nh};
-    image_transport::Subscriber sub = image_transporter.subscribe(
-        "/bottom_image_raw/image_raw",
-        100,
-        image_msg_handler);
-
-    image_transport::ImageTransport image_transporter_r200{nh};
-    image_transport::Subscriber sub_r200 = image_transporter_r200.subscribe(
-        "/bottom_image_raw_r200/image_raw",
-        100,
-        image_msg_handler_r200);
-
-    ros::Publisher corrected_image_pub = nh.advertise<sensor_msgs::Image>("corrected_image", 1);
+        }
+    }
 
     // Loop rate
     ros::Rate rate (100);
 
     // Initialize the vision classes
     ros::Time start_time = ros::Time::now();
-    ROS_ASSERT(gridline_estimator->waitUntilReady(ros::Duration(startup_timeout)));
-    ROS_ASSERT(optical_flow_estimator->waitUntilReady(ros::Duration(startup_timeout)));
-    while (message_queue.empty() || message_queue_r200.empty()) {
+    if (gridline_estimator != nullptr) {
+        ROS_ASSERT(gridline_estimator->waitUntilReady(ros::Duration(startup_timeout)));
+    }
+    if (optical_flow_estimator != nullptr) {
+        ROS_ASSERT(optical_flow_estimator->waitUntilReady(ros::Duration(startup_timeout)));
+    }
+
+    // Cameras which aren't required start whenever their first image comes
+    // in
+    const auto waiting_on_camera = [](const std::unique_ptr<Camera>& camera) {
+        return camera->settings.required && camera->queue.size() == 0;
+    };
+    while (std::any_of(cameras.begin(), cameras.end(), waiting_on_camera)) {
         if (!ros::ok()) {
             return 1;
         }
 
         if (ros::Time::now() > start_time + ros::Duration(startup_timeout)) {
-            if (message_queue.empty()) {
-                ROS_ERROR("Vision node timed out on startup waiting on images from leopard");
-            } else if (message_queue_r200.empty()) {
-                ROS_ERROR("Vision node timed out on startup waiting on images from r200");
-            } else {
-                ROS_ERROR("Vision node timed out on startup from both cameras");
+            for (const std::unique_ptr<Camera>& camera : cameras) {
+                if (waiting_on_camera(camera)) {
+                    ROS_ERROR("Vision node timed out on startup waiting on "
+                              "images from %s",
+                              camera->settings.name.c_str());
+                }
             }
             return 1;
         }
@@ -538,15 +651,119 @@ int main(int argc, char **argv)
         rate.sleep();
     }
 
-    const cv::Size input_size(message_queue.front()->width,
-                              message_queue.front()->height);
-    const iarc7_vision::UndistortionModel undistortion_model(
-            ros::NodeHandle("~/distortion_model"),
-            input_size);
-    iarc7_vision::RoombaEstimator roomba_estimator(
-            undistortion_model.getUndistortedSize());
-    const iarc7_vision::ColorCorrectionModel color_correction_model(
-            ros::NodeHandle("~/color_correction_model"));
+    const bool use_mapped_image_memory
+        = ros_utils::ParamUtils::getParam<bool>(
+                private_nh, "use_mapped_image_memory")
+       && iarc7_vision::cv_utils::deviceSharesHostMemory();
+    if (use_mapped_image_memory) {
+        ROS_INFO("vision_node: Using mapped memory for camera images");
+    }
+
+    const bool use_composite_undistortion_maps
+        = ros_utils::ParamUtils::getParam<bool>(
+                private_nh, "use_composite_undistortion_maps");
+
+    // Build the preprocessor and roomba estimator of a camera which
+    // undistorts, they need the size of its images
+    //
+    // Returns false if the image can't be preprocessed
+    const auto init_camera = [&](Camera& camera,
+                                 const sensor_msgs::Image::ConstPtr& message) {
+        const iarc7_vision::CameraSettings& settings = camera.settings;
+
+        camera.undistortion_model.reset(new iarc7_vision::UndistortionModel(
+                    ros::NodeHandle("~/" + settings.distortion_model_ns),
+                    cv::Size(message->width, message->height)));
+        camera.color_correction_model.reset(
+                new iarc7_vision::ColorCorrectionModel(ros::NodeHandle(
+                        "~/" + settings.color_correction_model_ns)));
+        camera.preprocessor.reset(new iarc7_vision::ImagePreprocessor(
+                    *camera.undistortion_model,
+                    *camera.color_correction_model,
+                    color_conversion_code,
+                    bottom_camera_pipeline_depth,
+                    use_composite_undistortion_maps,
+                    use_mapped_image_memory,
+                    camera.preprocess_gpu_timer.get()));
+
+        if (!camera.preprocessor->supportsEncoding(message->encoding)) {
+            ROS_ERROR("vision_node: Unsupported %s image encoding %s",
+                      settings.name.c_str(),
+                      message->encoding.c_str());
+            camera.preprocessor.reset();
+            camera.failed = true;
+            return false;
+        }
+
+        if (settings.roomba) {
+            camera.roomba_estimator.reset(new iarc7_vision::RoombaEstimator(
+                        camera.undistortion_model->getUndistortedSize(),
+                        transform_source,
+                        settings.name,
+                        settings.frame,
+                        ros::NodeHandle("~/" + settings.roomba_estimator_ns)));
+        }
+
+        // Now the sizes are known, allocate the images each frame in flight
+        // needs up front so the first frames don't wait on cudaMalloc
+        if (gpu_buffer_pool) {
+            const size_t depth = bottom_camera_pipeline_depth;
+            // Without composite maps detection runs on the full size image
+            const cv::Size image_size
+                = use_composite_undistortion_maps
+               && camera.roomba_estimator != nullptr
+                ? camera.roomba_estimator->getDetectionSize()
+                : camera.undistortion_model->getUndistortedSize();
+
+            // Undistorted and corrected rgb images, and the detection masks
+            gpu_buffer_pool->reserve(image_size.height,
+                                     image_size.width,
+                                     3,
+                                     2 * depth);
+            gpu_buffer_pool->reserve(image_size.height,
+                                     image_size.width,
+                                     1,
+                                     depth);
+        }
+        return true;
+    };
+
+    for (const std::unique_ptr<Camera>& camera : cameras) {
+        if (camera->settings.undistort && camera->settings.required) {
+            sensor_msgs::Image::ConstPtr first_message;
+            ROS_ASSERT(camera->queue.tryPop(first_message));
+            if (!init_camera(*camera, first_message)) {
+                return 1;
+            }
+        }
+    }
+
+    // Arena boundary detection, run after the roomba estimator on the same
+    // pyramid so it never delays roomba detections
+    std::unique_ptr<iarc7_vision::FloorDetector> floor_detector;
+    if (floor_camera != nullptr) {
+        iarc7_vision::FloorDetectorSettings floor_detector_settings;
+        iarc7_vision::getFloorDetectorSettings(private_nh,
+                                               floor_detector_settings);
+        floor_detector.reset(new iarc7_vision::FloorDetector(
+                    floor_detector_settings,
+                    ros::NodeHandle("~/floor_classifier"),
+                    transform_source,
+                    floor_camera->frame));
+    }
+
+    // Grid localization runs on its own thread at a reduced rate, so it
+    // doesn't add to the latency of roomba detection
+    std::unique_ptr<iarc7_vision::GridLineStage> grid_line_stage;
+    if (gridline_estimator != nullptr) {
+        grid_line_stage.reset(new iarc7_vision::GridLineStage(
+                    *gridline_estimator,
+                    ros_utils::ParamUtils::getParam<int>(
+                        private_nh, "grid_frame_interval"),
+                    ros_utils::ParamUtils::getParam<double>(
+                        private_nh, "grid_max_position_stddev"),
+                    gpu_scheduler));
+    }
 
     // Form a connection with the node monitor. If no connection can be made
     // assert because we don't know what's going on with the other nodes.
@@ -555,140 +772,349 @@ int main(int argc, char **argv)
     ROS_ASSERT_MSG(safety_client.formBond(),
                    "vision_node: Could not form bond with safety client");
 
-    message_queue.clear();
-    message_queue_r200.clear();
+    for (const std::unique_ptr<Camera>& camera : cameras) {
+        camera->queue.clear();
+        camera->last_seen_drops = camera->queue.skipped();
+        camera->last_reported_drops = camera->queue.dropped();
+    }
 
-    bool images_skipped = false;
+    // Publish queue statistics so drops show up on the diagnostics topic
+    ros::Publisher diagnostics_pub
+        = nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 10);
+    uint64_t last_reported_pool_misses = 0;
+    ros::Timer diagnostics_timer = nh.createTimer(
+            ros::Duration(1.0),
+            [&](const ros::TimerEvent&) {
+                diagnostic_msgs::DiagnosticArray diagnostics;
+                diagnostics.header.stamp = ros::Time::now();
+                for (const std::unique_ptr<Camera>& camera : cameras) {
+                    diagnostics.status.emplace_back();
+                    fillQueueStatus("vision_node: " + camera->settings.name
+                                        + " image queue",
+                                    camera->queue.stats(),
+                                    camera->last_reported_drops,
+                                    diagnostics.status.back());
+                }
+                if (gpu_buffer_pool) {
+                    diagnostics.status.emplace_back();
+                    fillBufferPoolStatus(gpu_buffer_pool->stats(),
+                                         last_reported_pool_misses,
+                                         diagnostics.status.back());
+                }
+                diagnostics.status.emplace_back();
+                stage_timings.fillStatus("vision_node: stage latency",
+                                         diagnostics.status.back());
+                diagnostics_pub.publish(diagnostics);
+            });
+
+    // Counts the gaps before the images already taken, so a drop is seen
+    // no later than the image after it
+    const auto warn_drops = [](Camera& camera) {
+        const uint64_t drops = camera.queue.skipped();
+        if (drops == camera.last_seen_drops) {
+            return false;
+        }
 
-    std::vector<iarc7_vision::RoombaImageLocation>
-                                              roomba_image_locations;
+        ROS_WARN_THROTTLE(1.0,
+                          "Image queue %s full, dropped %lu images",
+                          camera.settings.name.c_str(),
+                          drops - camera.last_seen_drops);
+        camera.last_seen_drops = drops;
+        return true;
+    };
+
+    // Move queued images from a camera which undistorts into its
+    // preprocessor, keeping up to bottom_camera_pipeline_depth frames in
+    // flight so the next frames are preprocessed while we look for roombas
+    //
+    // If wait is true, waits a short time for an image to arrive first
+    const auto take_preprocessed_frames = [&](Camera& camera, bool wait) {
+        sensor_msgs::Image::ConstPtr message;
+        while (camera.preprocessor == nullptr
+            || !camera.preprocessor->full()) {
+            const bool idle = camera.preprocessor == nullptr
+                           || camera.preprocessor->empty();
+            const bool got_message = wait && idle
+                                   ? camera.queue.popWait(
+                                         message,
+                                         std::chrono::milliseconds(10))
+                                   : camera.queue.tryPop(message);
+            if (!got_message) {
+                break;
+            }
 
-    // Main loop
-    while (ros::ok())
-    {
-        if ((!message_queue.empty() || !message_queue_r200.empty()) && ros::ok()) {
-            if (message_queue.size() > message_queue_item_limit - 1) {
-                ROS_ERROR(
-                        "Image queue has too many messages, clearing: %lu images",
-                        message_queue.size());
-                message_queue.clear();
+            if (camera.preprocessor == nullptr
+             && (camera.failed || !init_camera(camera, message))) {
+                continue;
             }
 
-            if (message_queue_r200.size() > message_queue_item_limit - 1) {
-                ROS_ERROR(
-                        "Image queue r200 has too many messages, clearing: %lu images",
-                        message_queue_r200.size());
-                message_queue_r200.clear();
-                images_skipped = true;
+            // Without a roomba estimator the other stages pick their
+            // pyramid levels from the full size
+            const cv::Size detection_size
+                = camera.roomba_estimator != nullptr
+                ? camera.roomba_estimator->getDetectionSize()
+                : camera.undistortion_model->getUndistortedSize();
+
+            // Only held while the work is queued, the frame's ready event
+            // says when it's done
+            iarc7_vision::GpuScheduler::Lease lease;
+            {
+                iarc7_vision::ScopedStageTimer timer(*camera.gpu_wait_stage);
+                lease = gpu_scheduler.acquire(
+                        iarc7_vision::GpuPriority::Throughput);
             }
+            // The grid stage wants the full size image if the detection
+            // image is too small for it
+            const bool grid_wants_corrected
+                = grid_line_stage != nullptr
+               && camera.settings.grid
+               && grid_line_stage->getTargetWidth() > detection_size.width;
+            camera.preprocessor->push(
+                    message,
+                    detection_size,
+                    grid_wants_corrected,
+                    camera.corrected_image_pub.getNumSubscribers() > 0,
+                    lease.stream());
+        }
 
-            if(!message_queue.empty()) {
-                sensor_msgs::Image::ConstPtr message = message_queue.front();
-                message_queue.pop_front();
-
-                auto cv_shared_ptr = cv_bridge::toCvShare(message);
-                cv::cuda::Stream cuda_stream = cv::cuda::Stream::Null();
-
-                const auto start = std::chrono::high_resolution_clock::now();
-                cv::cuda::GpuMat image_distorted;
-                image_distorted.upload(cv_shared_ptr->image, cuda_stream);
-
-                cv::cuda::GpuMat image_undistorted;
-                undistortion_model.undistort(image_distorted,
-                                             image_undistorted,
-                                             cuda_stream);
-                const auto distortion_time = std::chrono::high_resolution_clock::now();
-
-                cv::cuda::GpuMat image_undistorted_rgb;
-                if (color_conversion_code != 0) {
-                    cv::cuda::cvtColor(image_undistorted,
-                                       image_undistorted_rgb,
-                                       color_conversion_code,
-                                       0,
-                                       cuda_stream);
-                } else {
-                    image_undistorted_rgb = image_undistorted;
-                }
+        warn_drops(camera);
+    };
 
-                const auto color_time = std::chrono::high_resolution_clock::now();
+    // Run the grid, roomba and floor stages on the oldest preprocessed frame
+    // of a camera
+    //
+    // Returns false if there was no frame to process
+    const auto process_preprocessed_frame = [&](Camera& camera) {
+        if (camera.preprocessor == nullptr || camera.preprocessor->empty()) {
+            return false;
+        }
+        iarc7_vision::ImagePreprocessor& preprocessor = *camera.preprocessor;
 
-                cv::cuda::GpuMat image_correct;
-                color_correction_model.correct(image_undistorted_rgb,
-                                               image_correct,
-                                               cuda_stream);
+        const iarc7_vision::ImagePreprocessor::Frame* frame_ptr;
+        {
+            iarc7_vision::ScopedStageTimer timer(*camera.preprocess_wait_stage);
+            frame_ptr = &preprocessor.front();
+        }
+        const iarc7_vision::ImagePreprocessor::Frame& frame = *frame_ptr;
+        const ros::Time& stamp = frame.message->header.stamp;
 
-                {
-                    cv::Mat corrected_image_cpu;
-                    image_correct.download(corrected_image_cpu, cuda_stream);
-                    cuda_stream.waitForCompletion();
+        if (!frame.corrected_cpu.empty()) {
+            iarc7_vision::ScopedStageTimer timer(*camera.publish_stage);
 
-                    std_msgs::Header header;
-                    header.stamp = message->header.stamp;
+            std_msgs::Header header;
+            header.stamp = stamp;
 
-                    cv_bridge::CvImage cv_image {
+            camera.corrected_image_pub.publish(camera.corrected_image_pool.fill(
+                        frame.corrected_cpu,
                         header,
-                        sensor_msgs::image_encodings::RGB8,
-                        corrected_image_cpu
-                    };
-
-                    corrected_image_pub.publish(cv_image.toImageMsg());
-                }
+                        sensor_msgs::image_encodings::RGB8));
+        }
 
-                const auto color_correct_time = std::chrono::high_resolution_clock::now();
+        camera.pyramid.reset(frame.detection);
+
+        const bool offer_grid = grid_line_stage != nullptr
+                             && camera.settings.grid;
+        const bool run_floor = floor_detector != nullptr
+                            && camera.settings.floor;
+        if (offer_grid || camera.roomba_estimator != nullptr || run_floor) {
+            iarc7_vision::GpuScheduler::Lease lease;
+            {
+                iarc7_vision::ScopedStageTimer timer(*camera.gpu_wait_stage);
+                lease = gpu_scheduler.acquire(
+                        iarc7_vision::GpuPriority::Throughput);
+            }
 
-                //gridline_estimator->update(image_correct, message->header.stamp);
-                const auto grid_time = std::chrono::high_resolution_clock::now();
+            // Only copies the frame if the grid stage wants it
+            if (offer_grid) {
+                iarc7_vision::ScopedStageTimer timer(*camera.grid_offer_stage);
+                grid_line_stage->offer(camera.pyramid,
+                                       frame.has_corrected
+                                           ? frame.corrected
+                                           : cv::cuda::GpuMat(),
+                                       stamp,
+                                       lease.stream());
+            }
 
+            if (camera.roomba_estimator != nullptr) {
+                std::vector<iarc7_vision::RoombaImageLocation>&
+                    roomba_image_locations
+                        = camera.roomba_image_locations.writeBuffer();
                 roomba_image_locations.clear();
-                roomba_estimator.update(image_correct,
-                                        message->header.stamp,
-                                        roomba_image_locations);
-                const auto roomba_time = std::chrono::high_resolution_clock::now();
-
-                const auto count = [](const auto& a, const auto& b) {
-                    return std::chrono::duration_cast<std::chrono::microseconds>(
-                            b - a).count();
-                };
-
-                ROS_DEBUG_STREAM(
-                        "Distort: " << count(start, distortion_time) << std::endl
-                     << "Color: " << count(distortion_time, color_time) << std::endl
-                     << "Convert: " << count(color_time, color_correct_time) << std::endl
-                     << "Grid: " << count(color_correct_time, grid_time) << std::endl
-                     << "Roombas: " << count(grid_time, roomba_time) << std::endl);
+                {
+                    iarc7_vision::ScopedStageTimer timer(*camera.roomba_stage);
+                    camera.roomba_estimator->update(camera.pyramid,
+                                                    stamp,
+                                                    roomba_image_locations,
+                                                    lease.stream());
+                }
+                camera.roomba_image_locations.publish();
             }
 
-            if(!message_queue_r200.empty()) {
-                sensor_msgs::Image::ConstPtr message = message_queue_r200.front();
-                message_queue_r200.pop_front();
+            if (run_floor) {
+                iarc7_vision::ScopedStageTimer timer(*camera.floor_stage);
+                floor_detector->update(camera.pyramid, stamp, lease.stream());
+            }
+        }
+
+        camera.age_stage->record((ros::Time::now() - stamp).toSec());
+
+        preprocessor.pop();
+
+        return true;
+    };
+
+    // Take the next image off a flow camera's queue
+    //
+    // If wait is true, waits a short time for an image to arrive first
+    //
+    // Returns false if there was no image
+    const auto take_flow_frame = [&](Camera& camera,
+                                     bool wait,
+                                     sensor_msgs::Image::ConstPtr& message) {
+        const bool got_message = wait
+                               ? camera.queue.popWait(
+                                     message,
+                                     std::chrono::milliseconds(10))
+                               : camera.queue.tryPop(message);
+
+        // Any drop means the flow history no longer matches the next frame
+        if (warn_drops(camera)) {
+            camera.images_skipped = true;
+        }
 
-                auto cv_shared_ptr = cv_bridge::toCvShare(message);
+        return got_message;
+    };
+
+    const std::vector<iarc7_vision::RoombaImageLocation> no_roombas;
+    const auto process_flow_frame = [&](
+            Camera& camera,
+            const sensor_msgs::Image::ConstPtr& message) {
+        const std::vector<iarc7_vision::RoombaImageLocation>*
+            roomba_image_locations = &no_roombas;
+        if (camera.roomba_mask_source != nullptr) {
+            camera.roomba_mask_source->roomba_image_locations.update();
+            roomba_image_locations
+                = &camera.roomba_mask_source->roomba_image_locations
+                                             .readBuffer();
+        }
 
-                const auto start = std::chrono::high_resolution_clock::now();
-                cv::cuda::GpuMat image_r200;
-                image_r200.upload(cv_shared_ptr->image);
+        auto cv_shared_ptr = cv_bridge::toCvShare(message);
 
-                optical_flow_estimator->update(image_r200,
-                                               message->header.stamp,
-                                               roomba_image_locations,
-                                               images_skipped);
-                const auto flow_time = std::chrono::high_resolution_clock::now();
+        iarc7_vision::ScopedStageTimer timer(*camera.flow_stage);
 
-                const auto count = [](const auto& a, const auto& b) {
-                    return std::chrono::duration_cast<std::chrono::microseconds>(
-                            b - a).count();
-                };
+        // Held until the estimator is done, the upload and all of the
+        // estimator's work are queued on the leased stream
+        iarc7_vision::GpuScheduler::Lease lease;
+        {
+            iarc7_vision::ScopedStageTimer wait_timer(*camera.gpu_wait_stage);
+            lease = gpu_scheduler.acquire(iarc7_vision::GpuPriority::Latency);
+        }
 
-                images_skipped = false;
+        cv::cuda::GpuMat image;
+        if (use_mapped_image_memory) {
+            // The estimator is done with the image when update returns, so
+            // one staging buffer is enough
+            iarc7_vision::cv_utils::ingestImage(cv_shared_ptr->image,
+                                                camera.staging,
+                                                image,
+                                                lease.stream());
+        } else {
+            image.upload(cv_shared_ptr->image, lease.stream());
+        }
 
-                ROS_DEBUG_STREAM("Optical Flow: " << count(start, flow_time));
+        optical_flow_estimator->update(image,
+                                       message->header.stamp,
+                                       *roomba_image_locations,
+                                       camera.images_skipped,
+                                       lease.stream());
+
+        // The next update may get another stream, and the staging buffer
+        // gets reused for the next image
+        lease.stream().waitForCompletion();
+        lease.release();
+
+        camera.images_skipped = false;
+
+        camera.age_stage->record((ros::Time::now() - message->header.stamp)
+                                     .toSec());
+    };
+
+    if (threaded_mode) {
+        // One thread per camera, the scheduler decides whose gpu work goes
+        // first
+        std::vector<std::thread> camera_threads;
+        for (const std::unique_ptr<Camera>& camera_ptr : cameras) {
+            Camera* const camera = camera_ptr.get();
+            if (camera->settings.flow) {
+                camera_threads.emplace_back([&, camera]() {
+                    sensor_msgs::Image::ConstPtr message;
+                    while (ros::ok()) {
+                        if (take_flow_frame(*camera, true, message)) {
+                            process_flow_frame(*camera, message);
+                        }
+                    }
+                });
+            } else {
+                camera_threads.emplace_back([&, camera]() {
+                    while (ros::ok()) {
+                        take_preprocessed_frames(
+                                *camera,
+                                camera->preprocessor == nullptr
+                             || camera->preprocessor->empty());
+                        process_preprocessed_frame(*camera);
+                    }
+                });
             }
         }
-        else {
-            rate.sleep();
+
+        ros::spin();
+
+        for (const std::unique_ptr<Camera>& camera : cameras) {
+            camera->queue.close();
+        }
+        for (std::thread& thread : camera_threads) {
+            thread.join();
+        }
+    } else {
+        // Latency critical cameras go first each time around, so flow never
+        // waits behind the other cameras' frames
+        std::vector<Camera*> loop_order;
+        for (const std::unique_ptr<Camera>& camera : cameras) {
+            if (camera->settings.flow) {
+                loop_order.push_back(camera.get());
+            }
+        }
+        for (const std::unique_ptr<Camera>& camera : cameras) {
+            if (!camera->settings.flow) {
+                loop_order.push_back(camera.get());
+            }
         }
 
-        ros::spinOnce();
+        // Main loop
+        while (ros::ok())
+        {
+            bool processed_image = false;
+            for (Camera* camera : loop_order) {
+                if (camera->settings.flow) {
+                    sensor_msgs::Image::ConstPtr message;
+                    if (take_flow_frame(*camera, false, message)) {
+                        process_flow_frame(*camera, message);
+                        processed_image = true;
+                    }
+                } else {
+                    take_preprocessed_frames(*camera, false);
+                    if (process_preprocessed_frame(*camera)) {
+                        processed_image = true;
+                    }
+                }
+            }
+
+            if (!processed_image) {
+                rate.sleep();
+            }
+
+            ros::spinOnce();
+        }
     }
 
     // All is good.
@@ -0,0 +1,492 @@
+#include "iarc7_vision/VisionSettings.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <opencv2/imgproc.hpp>
+
+namespace iarc7_vision {
+
+void getLineExtractorSettings(const ros::NodeHandle& private_nh,
+                              iarc7_vision::LineExtractorSettings& line_settings)
+{
+    // Begin line extractor settings
+    ROS_ASSERT(private_nh.getParam(
+            "line_extractor/pixels_per_meter",
+            line_settings.pixels_per_meter));
+
+    ROS_ASSERT(private_nh.getParam(
+            "line_extractor/canny_high_threshold",
+            line_settings.canny_high_threshold));
+
+    double canny_threshold_ratio;
+    ROS_ASSERT(private_nh.getParam(
+            "line_extractor/canny_threshold_ratio",
+            canny_threshold_ratio));
+    line_settings.canny_low_threshold =
+        line_settings.canny_high_threshold / canny_threshold_ratio;
+
+    ROS_ASSERT(private_nh.getParam(
+            "line_extractor/canny_sobel_size",
+            line_settings.canny_sobel_size));
+
+    ROS_ASSERT(private_nh.getParam(
+            "line_extractor/hough_rho_resolution",
+            line_settings.hough_rho_resolution));
+
+    ROS_ASSERT(private_nh.getParam(
+            "line_extractor/hough_theta_resolution",
+            line_settings.hough_theta_resolution));
+
+    ROS_ASSERT(private_nh.getParam(
+            "line_extractor/hough_thresh_fraction",
+            line_settings.hough_thresh_fraction));
+
+    ROS_ASSERT(private_nh.getParam(
+            "line_extractor/fov",
+            line_settings.fov));
+}
+
+void getOpticalFlowEstimatorSettings(const ros::NodeHandle& private_nh,
+                    iarc7_vision::OpticalFlowEstimatorSettings& flow_settings)
+{
+    // Begin optical flow estimator settings
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/fov",
+            flow_settings.fov));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/min_estimation_altitude",
+            flow_settings.min_estimation_altitude));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/camera_vertical_threshold",
+            flow_settings.camera_vertical_threshold));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/points",
+            flow_settings.points));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/quality_level",
+            flow_settings.quality_level));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/min_dist",
+            flow_settings.min_dist));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/tracking_mode",
+            flow_settings.tracking_mode));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/redetect_interval",
+            flow_settings.redetect_interval));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/win_size",
+            flow_settings.win_size));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/max_level",
+            flow_settings.max_level));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/iters",
+            flow_settings.iters));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/use_cached_pyramids",
+            flow_settings.use_cached_pyramids));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/grayscale_flow",
+            flow_settings.grayscale_flow));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/gpu_vector_filter",
+            flow_settings.gpu_vector_filter));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/mask_roomba_features",
+            flow_settings.mask_roomba_features));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/scale_factor",
+            flow_settings.scale_factor));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/crop",
+            flow_settings.crop));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/crop_width",
+            flow_settings.crop_width));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/crop_height",
+            flow_settings.crop_height));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/variance",
+            flow_settings.variance));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/variance_scale",
+            flow_settings.variance_scale));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/x_cutoff_region_velocity_measurement",
+            flow_settings.x_cutoff_region_velocity_measurement));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/y_cutoff_region_velocity_measurement",
+            flow_settings.y_cutoff_region_velocity_measurement));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/debug_frameskip",
+            flow_settings.debug_frameskip));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/tf_timeout",
+            flow_settings.tf_timeout));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/max_rotational_vel",
+            flow_settings.max_rotational_vel));
+
+    std::string vector_filter_string;
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/vector_filter",
+            vector_filter_string));
+    flow_settings.set_vector_filter_str(vector_filter_string);
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/min_vectors",
+            flow_settings.min_vectors));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/max_filtered_variance",
+            flow_settings.max_filtered_variance));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/max_normalized_element_variance",
+            flow_settings.max_normalized_element_variance));
+
+    ROS_ASSERT(private_nh.getParam(
+        "optical_flow_estimator/hist_scale_factor",
+        flow_settings.hist_scale_factor));
+
+    ROS_ASSERT(private_nh.getParam(
+        "optical_flow_estimator/hist_image_size_scale",
+        flow_settings.hist_image_size_scale));
+}
+
+void getGridEstimatorSettings(const ros::NodeHandle& private_nh,
+                              iarc7_vision::GridEstimatorSettings& settings)
+{
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/theta_step",
+            settings.theta_step));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/grid_step",
+            settings.grid_step));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/exact_search",
+            settings.exact_search));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/grid_spacing",
+            settings.grid_spacing));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/grid_line_thickness",
+            settings.grid_line_thickness));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/grid_zero_offset_x",
+            settings.grid_zero_offset(0)));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/grid_zero_offset_y",
+            settings.grid_zero_offset(1)));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/grid_translation_mean_iterations",
+            settings.grid_translation_mean_iterations));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/line_rejection_angle_threshold",
+            settings.line_rejection_angle_threshold));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/min_extraction_altitude",
+            settings.min_extraction_altitude));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_estimator/allowed_position_stamp_error",
+            settings.allowed_position_stamp_error));
+}
+
+void getGridDebugSettings(const ros::NodeHandle& private_nh,
+                      iarc7_vision::GridLineDebugSettings& settings)
+{
+   ROS_ASSERT(private_nh.getParam(
+            "grid_line_estimator/debug_line_detector",
+            settings.debug_line_detector));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_line_estimator/debug_direction",
+            settings.debug_direction));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_line_estimator/debug_edges",
+            settings.debug_edges));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_line_estimator/debug_lines",
+            settings.debug_lines));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_line_estimator/debug_line_markers",
+            settings.debug_line_markers));
+    ROS_ASSERT(private_nh.getParam(
+            "grid_line_estimator/debug_image_max_rate",
+            settings.debug_image_max_rate));
+    if (private_nh.hasParam("grid_line_estimator/debug_height")) {
+        ROS_ASSERT(private_nh.getParam(
+            "grid_line_estimator/debug_height",
+            settings.debug_height));
+    } else {
+        settings.debug_height = std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+void getFlowDebugSettings(const ros::NodeHandle& private_nh,
+                          iarc7_vision::OpticalFlowDebugSettings& settings)
+{
+    ROS_ASSERT(private_nh.getParam(
+        "optical_flow_estimator/debug_average_vector_image",
+        settings.debug_average_vector_image));
+
+    ROS_ASSERT(private_nh.getParam(
+        "optical_flow_estimator/debug_intermediate_velocities",
+        settings.debug_intermediate_velocities));
+
+    ROS_ASSERT(private_nh.getParam(
+        "optical_flow_estimator/debug_orientation",
+        settings.debug_orientation));
+
+    ROS_ASSERT(private_nh.getParam(
+        "optical_flow_estimator/debug_times",
+        settings.debug_times));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/debug_vectors_image",
+            settings.debug_vectors_image));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/debug_hist",
+            settings.debug_hist));
+
+    ROS_ASSERT(private_nh.getParam(
+            "optical_flow_estimator/debug_image_max_rate",
+            settings.debug_image_max_rate));
+}
+
+void getFloorDetectorSettings(const ros::NodeHandle& private_nh,
+                              iarc7_vision::FloorDetectorSettings& settings)
+{
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/min_floor_patches",
+            settings.min_floor_patches));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/min_floor_appearance_ratio",
+            settings.min_floor_appearance_ratio));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/min_anti_floor_patches",
+            settings.min_anti_floor_patches));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/min_anti_floor_appearance_ratio",
+            settings.min_anti_floor_appearance_ratio));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/min_anti_floor_on_edge",
+            settings.min_anti_floor_on_edge));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/boundary_svm_c",
+            settings.boundary_svm_c));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/afov",
+            settings.afov));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/min_boundary_detections",
+            settings.min_boundary_detections));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/max_detections_queued",
+            settings.max_detections_queued));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/max_detection_lag",
+            settings.max_detection_lag));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/max_boundary_std_dev",
+            settings.max_boundary_std_dev));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/transform_timeout",
+            settings.transform_timeout));
+
+    ROS_ASSERT(private_nh.getParam(
+            "floor_detector/debug_image_max_rate",
+            settings.debug_image_max_rate));
+}
+
+void getCameraSettings(const ros::NodeHandle& private_nh,
+                       std::vector<CameraSettings>& cameras)
+{
+    std::vector<std::string> names;
+    ROS_ASSERT(private_nh.getParam("camera_names", names));
+    ROS_ASSERT_MSG(!names.empty(), "camera_names is empty");
+
+    cameras.clear();
+    for (const std::string& name : names) {
+        const std::string prefix = "cameras/" + name + "/";
+
+        CameraSettings camera {};
+        camera.name = name;
+        ROS_ASSERT(private_nh.getParam(prefix + "topic", camera.topic));
+        ROS_ASSERT(private_nh.getParam(prefix + "frame", camera.frame));
+        ROS_ASSERT(private_nh.getParam(prefix + "required", camera.required));
+
+        std::vector<std::string> pipeline;
+        ROS_ASSERT(private_nh.getParam(prefix + "pipeline", pipeline));
+        for (const std::string& stage : pipeline) {
+            if (stage == "undistort") {
+                camera.undistort = true;
+            } else if (stage == "color") {
+                camera.color_correct = true;
+            } else if (stage == "roomba") {
+                camera.roomba = true;
+            } else if (stage == "grid") {
+                camera.grid = true;
+            } else if (stage == "floor") {
+                camera.floor = true;
+            } else if (stage == "flow") {
+                camera.flow = true;
+            } else {
+                ROS_ASSERT_MSG(false,
+                               "Unknown stage %s for camera %s",
+                               stage.c_str(),
+                               name.c_str());
+            }
+        }
+
+        // The preprocessor always does both, and the detectors run on its
+        // output
+        ROS_ASSERT_MSG(camera.undistort == camera.color_correct,
+                       "Camera %s must have both undistort and color or "
+                       "neither",
+                       name.c_str());
+        ROS_ASSERT_MSG(camera.undistort
+                   || !(camera.roomba || camera.grid || camera.floor),
+                       "Camera %s needs undistort and color for roomba, grid "
+                       "or floor",
+                       name.c_str());
+        // The flow estimator does its own resizing and conversion on the
+        // raw image
+        ROS_ASSERT_MSG(!camera.flow || pipeline.size() == 1,
+                       "Camera %s can't run other stages with flow",
+                       name.c_str());
+        ROS_ASSERT_MSG(!pipeline.empty(),
+                       "Camera %s has no stages",
+                       name.c_str());
+
+        if (camera.undistort) {
+            ROS_ASSERT(private_nh.getParam(prefix + "distortion_model",
+                                           camera.distortion_model_ns));
+            ROS_ASSERT(private_nh.getParam(prefix + "color_correction_model",
+                                           camera.color_correction_model_ns));
+            ROS_ASSERT(private_nh.getParam(prefix + "corrected_image_topic",
+                                           camera.corrected_image_topic));
+        }
+
+        if (camera.roomba) {
+            ROS_ASSERT(private_nh.getParam(prefix + "roomba_estimator",
+                                           camera.roomba_estimator_ns));
+        }
+
+        if (camera.flow) {
+            ROS_ASSERT(private_nh.getParam(prefix + "flow_roomba_mask_camera",
+                                           camera.flow_roomba_mask_camera));
+        }
+
+        cameras.push_back(camera);
+    }
+
+    const auto count = [&](bool CameraSettings::* stage) {
+        return std::count_if(cameras.begin(),
+                             cameras.end(),
+                             [&](const CameraSettings& camera) {
+                                 return camera.*stage;
+                             });
+    };
+    ROS_ASSERT_MSG(count(&CameraSettings::grid) <= 1,
+                   "Only one camera can run grid");
+    ROS_ASSERT_MSG(count(&CameraSettings::floor) <= 1,
+                   "Only one camera can run floor");
+    ROS_ASSERT_MSG(count(&CameraSettings::flow) <= 1,
+                   "Only one camera can run flow");
+
+    for (const CameraSettings& camera : cameras) {
+        ROS_ASSERT_MSG(std::count_if(cameras.begin(),
+                                     cameras.end(),
+                                     [&](const CameraSettings& other) {
+                                         return other.name == camera.name;
+                                     }) == 1,
+                       "Camera %s is listed twice",
+                       camera.name.c_str());
+
+        if (camera.roomba) {
+            ROS_ASSERT_MSG(std::none_of(
+                        cameras.begin(),
+                        cameras.end(),
+                        [&](const CameraSettings& other) {
+                            return &other != &camera
+                                && other.roomba
+                                && other.roomba_estimator_ns
+                                       == camera.roomba_estimator_ns;
+                        }),
+                    "Cameras share the roomba estimator namespace %s",
+                    camera.roomba_estimator_ns.c_str());
+        }
+
+        if (!camera.flow_roomba_mask_camera.empty()) {
+            ROS_ASSERT_MSG(std::any_of(
+                        cameras.begin(),
+                        cameras.end(),
+                        [&](const CameraSettings& other) {
+                            return other.name
+                                       == camera.flow_roomba_mask_camera
+                                && other.roomba;
+                        }),
+                    "flow_roomba_mask_camera of %s isn't a roomba camera",
+                    camera.name.c_str());
+        }
+    }
+}
+
+bool getColorConversionCode(const std::string& image_format,
+                            int& color_conversion_code)
+{
+    if (image_format == "RGB") {
+        color_conversion_code = 0;
+    } else if (image_format == "RGBA") {
+        color_conversion_code = CV_RGBA2RGB;
+    } else if (image_format == "BGR") {
+        color_conversion_code = CV_BGR2RGB;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+} // namespace iarc7_vision
@@ -8,19 +8,45 @@ namespace iarc7_vision {
 namespace cv_utils {
 
 void downloadVector(const cv::cuda::GpuMat& mat,
-                    std::vector<cv::Point2f>& vector)
+                    std::vector<cv::Point2f>& vector,
+                    cv::cuda::Stream& stream)
 {
     vector.resize(mat.cols);
     cv::Mat cpu_mat(1, mat.cols, CV_32FC2, (void*)&vector[0]);
-    mat.download(cpu_mat);
+    mat.download(cpu_mat, stream);
+    stream.waitForCompletion();
 }
 
 void downloadVector(const cv::cuda::GpuMat& mat,
-                    std::vector<uchar>& vector)
+                    std::vector<uchar>& vector,
+                    cv::cuda::Stream& stream)
 {
     vector.resize(mat.cols);
     cv::Mat cpu_mat(1, mat.cols, CV_8UC1, (void*)&vector[0]);
-    mat.download(cpu_mat);
+    mat.download(cpu_mat, stream);
+    stream.waitForCompletion();
+}
+
+bool deviceSharesHostMemory()
+{
+    const cv::cuda::DeviceInfo device_info;
+    return device_info.integrated() && device_info.canMapHostMemory();
+}
+
+void ingestImage(const cv::Mat& image,
+                 cv::cuda::HostMem& staging,
+                 cv::cuda::GpuMat& out,
+                 cv::cuda::Stream& stream)
+{
+    staging.create(image.rows, image.cols, image.type());
+    cv::Mat staging_header = staging.createMatHeader();
+    image.copyTo(staging_header);
+
+    if (staging.alloc_type == cv::cuda::HostMem::SHARED) {
+        out = staging.createGpuMatHeader();
+    } else {
+        out.upload(staging, stream);
+    }
 }
 
 void drawArrows(cv::Mat& image,
@@ -131,27 +157,40 @@ void inRange(const cv::cuda::GpuMat& src,
              cv::Scalar lowerb,
              cv::Scalar upperb,
              cv::cuda::GpuMat& dst,
-             InRangeBuf& buf)
+             InRangeBuf& buf,
+             cv::cuda::Stream& stream)
 {
     ROS_ASSERT(src.type() == CV_8UC3 || src.type() == CV_8UC4);
 
-    cv::cuda::split(src, buf.channels);
+    cv::cuda::split(src, buf.channels, stream);
 
-    cv::cuda::subtract(cv::Scalar(255), buf.channels[0], buf.inverse);
+    cv::cuda::subtract(cv::Scalar(255),
+                       buf.channels[0],
+                       buf.inverse,
+                       cv::noArray(),
+                       -1,
+                       stream);
     cv::cuda::threshold(buf.inverse,
                         buf.buf,
                         255 - lowerb[0],
                         255,
-                        cv::THRESH_BINARY_INV);
-    cv::cuda::bitwise_and(buf.buf, buf.buf, dst);
+                        cv::THRESH_BINARY_INV,
+                        stream);
+    cv::cuda::bitwise_and(buf.buf, buf.buf, dst, cv::noArray(), stream);
     for (int i = 1; i < 3; i++) {
-        cv::cuda::subtract(cv::Scalar(255), buf.channels[i], buf.inverse);
+        cv::cuda::subtract(cv::Scalar(255),
+                           buf.channels[i],
+                           buf.inverse,
+                           cv::noArray(),
+                           -1,
+                           stream);
         cv::cuda::threshold(buf.inverse,
                             buf.buf,
                             255 - lowerb[i],
                             255,
-                            cv::THRESH_BINARY_INV);
-        cv::cuda::bitwise_and(buf.buf, dst, dst);
+                            cv::THRESH_BINARY_INV,
+                            stream);
+        cv::cuda::bitwise_and(buf.buf, dst, dst, cv::noArray(), stream);
     }
 
     for (int i = 0; i < 3; i++) {
@@ -159,11 +198,33 @@ void inRange(const cv::cuda::GpuMat& src,
                             buf.buf,
                             upperb[i],
                             255,
-                            cv::THRESH_BINARY_INV);
-        cv::cuda::bitwise_and(buf.buf, dst, dst);
+                            cv::THRESH_BINARY_INV,
+                            stream);
+        cv::cuda::bitwise_and(buf.buf, dst, dst, cv::noArray(), stream);
     }
 }
 
+void meanStdDev(const cv::cuda::GpuMat& src,
+                double& mean,
+                double& stddev,
+                MeanStdDevBuf& buf,
+                cv::cuda::Stream& stream)
+{
+    ROS_ASSERT(src.channels() == 1);
+
+    cv::cuda::calcSum(src, buf.sum, cv::noArray(), stream);
+    cv::cuda::calcSqrSum(src, buf.sqr_sum, cv::noArray(), stream);
+    buf.sum.download(buf.sum_cpu, stream);
+    buf.sqr_sum.download(buf.sqr_sum_cpu, stream);
+    stream.waitForCompletion();
+
+    const double n = static_cast<double>(src.size().area());
+    mean = buf.sum_cpu.at<double>(0, 0) / n;
+    const double variance = buf.sqr_sum_cpu.at<double>(0, 0) / n
+                          - mean * mean;
+    stddev = std::sqrt(std::max(0., variance));
+}
+
 cv::Vec3d sumPatch(const cv::Mat& image, const cv::RotatedRect& rect)
 {
     ROS_ASSERT(image.type() == CV_8UC3);
@@ -171,7 +232,7 @@ cv::Vec3d sumPatch(const cv::Mat& image, const cv::RotatedRect& rect)
     cv::Rect bounding_rect = rect.boundingRect2f();
     size_t count = 0;
     cv::Vec3d total (0, 0, 0);
-    for (int y = bounding_rect.y; y <= bounding_rect.y + bounding_rect.width; y++) {
+    for (int y = bounding_rect.y; y <= bounding_rect.y + bounding_rect.height; y++) {
         for (int x = bounding_rect.x; x <= bounding_rect.x + bounding_rect.width; x++) {
             if (cv_utils::insideImage(image.size(), x, y)
              && cv_utils::insideRotatedRect(rect, x, y)) {
@@ -184,6 +245,56 @@ cv::Vec3d sumPatch(const cv::Mat& image, const cv::RotatedRect& rect)
     return total / double(count);
 }
 
+cv::Vec3b rgbToHsv(const cv::Vec3b& rgb)
+{
+    // Same fixed point math as cvtColor for 8 bit images
+    constexpr int hsv_shift = 12;
+    static const struct DivTables {
+        DivTables()
+        {
+            sat[0] = 0;
+            hue[0] = 0;
+            for (int i = 1; i < 256; i++) {
+                sat[i] = cv::saturate_cast<int>((255 << hsv_shift) / (1. * i));
+                hue[i] = cv::saturate_cast<int>((180 << hsv_shift) / (6. * i));
+            }
+        }
+
+        int sat[256];
+        int hue[256];
+    } tables;
+
+    const int r = rgb[0];
+    const int g = rgb[1];
+    const int b = rgb[2];
+
+    const int v = std::max(std::max(r, g), b);
+    const int diff = v - std::min(std::min(r, g), b);
+    const int vr = v == r ? -1 : 0;
+    const int vg = v == g ? -1 : 0;
+
+    const int s = (diff * tables.sat[v] + (1 << (hsv_shift - 1))) >> hsv_shift;
+    int h = (vr & (g - b))
+          + (~vr & ((vg & (b - r + 2 * diff)) + (~vg & (r - g + 4 * diff))));
+    h = (h * tables.hue[diff] + (1 << (hsv_shift - 1))) >> hsv_shift;
+    h += h < 0 ? 180 : 0;
+
+    return cv::Vec3b(cv::saturate_cast<uchar>(h), s, v);
+}
+
+bool inRange(const cv::Vec3b& pixel,
+             const cv::Scalar& lowerb,
+             const cv::Scalar& upperb)
+{
+    for (int i = 0; i < 3; i++) {
+        // cv::inRange rounds the bounds to the pixel type's integers
+        if (pixel[i] < cvRound(lowerb[i]) || pixel[i] > cvRound(upperb[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
 } // end namespace cv_utils
 
 } // end namespace iarc7_vision
@@ -5,6 +5,12 @@ distinct from their black & white peppered background. This node does not take
 advantage of the GPU in its current implementation. It is ideal for using as a
 side camera node.
 
+For the bottom camera, use the vision node's roomba estimator instead, with
+`roomba_estimator/publish_roomba_odometry` set for the /roombas output and
+`roomba_estimator/debug_roomba_rays` for the rviz lines.  It shares the
+frame upload and segmentation with the rest of the vision node rather than
+decoding and filtering every frame again on the CPU.
+
 Algorithm:
 
     1. Perform HSV color filtering to select only the relevant red and green
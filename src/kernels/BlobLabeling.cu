@@ -0,0 +1,450 @@
+#include "iarc7_vision/kernels/BlobLabeling.hpp"
+
+#include <math_constants.h>
+
+#include <opencv2/core/cuda/common.hpp>
+#include <opencv2/core/cuda_stream_accessor.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+namespace {
+
+constexpr int kUnlabeled = -1;
+
+struct LabelStats {
+    unsigned long long m00;
+    /// Pixels on the blob's outer boundary
+    unsigned long long boundary;
+    unsigned long long m10;
+    unsigned long long m01;
+    unsigned long long m20;
+    unsigned long long m11;
+    unsigned long long m02;
+    /// Index into BlobList::blobs, or -1 if the blob was rejected
+    int blob;
+};
+
+// Labels are union-find trees over pixel indices, every pixel's label
+// points at a pixel in the same blob with a smaller index
+__device__ __forceinline__ int findRoot(const int* labels, int i)
+{
+    int parent = labels[i];
+    while (parent != i) {
+        i = parent;
+        parent = labels[i];
+    }
+    return i;
+}
+
+__device__ void unite(int* labels, int a, int b)
+{
+    while (true) {
+        a = findRoot(labels, a);
+        b = findRoot(labels, b);
+        if (a == b) {
+            return;
+        }
+
+        // Hang the larger root under the smaller one, if someone else
+        // changed it first try again from where it points now
+        const int high = ::max(a, b);
+        const int low = ::min(a, b);
+        const int old = atomicMin(&labels[high], low);
+        if (old == high) {
+            return;
+        }
+        a = old;
+        b = low;
+    }
+}
+
+// Order preserving mapping from float to int, so atomicMin and atomicMax
+// on ints work for floats
+__device__ __forceinline__ int orderedFloat(float value)
+{
+    const int bits = __float_as_int(value);
+    return bits >= 0 ? bits : bits ^ 0x7FFFFFFF;
+}
+
+__device__ __forceinline__ float unorderFloat(int bits)
+{
+    return __int_as_float(bits >= 0 ? bits : bits ^ 0x7FFFFFFF);
+}
+
+// Labels the nonzero pixels with kForeground, or the zero pixels without
+template <bool kForeground>
+__global__ void initLabelsKernel(const cv::cuda::PtrStepSz<unsigned char> mask,
+                                 int* labels)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= mask.cols || y >= mask.rows) {
+        return;
+    }
+
+    const int i = y * mask.cols + x;
+    labels[i] = (mask(y, x) != 0) == kForeground ? i : kUnlabeled;
+}
+
+// Foreground is 8-connected, like findContours sees it, so background is
+// 4-connected.  Otherwise a hole could leak out through a diagonal gap in
+// the blob around it.
+template <bool kForeground>
+__global__ void mergeLabelsKernel(const cv::cuda::PtrStepSz<unsigned char> mask,
+                                  int* labels)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= mask.cols || y >= mask.rows) {
+        return;
+    }
+
+    const auto same = [&](int row, int col) {
+        return (mask(row, col) != 0) == kForeground;
+    };
+    if (!same(y, x)) {
+        return;
+    }
+
+    const int i = y * mask.cols + x;
+    if (x > 0 && same(y, x - 1)) {
+        unite(labels, i, i - 1);
+    }
+    if (y > 0) {
+        const int up = i - mask.cols;
+        if (kForeground && x > 0 && same(y - 1, x - 1)) {
+            unite(labels, i, up - 1);
+        }
+        if (same(y - 1, x)) {
+            unite(labels, i, up);
+        }
+        if (kForeground && x + 1 < mask.cols && same(y - 1, x + 1)) {
+            unite(labels, i, up + 1);
+        }
+    }
+}
+
+__global__ void compressLabelsKernel(int rows, int cols, int* labels)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= cols || y >= rows) {
+        return;
+    }
+
+    const int i = y * cols + x;
+    if (labels[i] != kUnlabeled) {
+        labels[i] = findRoot(labels, i);
+    }
+}
+
+// Flags the background components that touch the edge of the image,
+// outside the image counts as background the same as for findContours
+__global__ void markOutsideKernel(int rows,
+                                  int cols,
+                                  const int* labels,
+                                  int* outside)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= cols || y >= rows) {
+        return;
+    }
+    if (x != 0 && y != 0 && x != cols - 1 && y != rows - 1) {
+        return;
+    }
+
+    const int label = labels[y * cols + x];
+    if (label != kUnlabeled) {
+        outside[label] = 1;
+    }
+}
+
+// Sets every background pixel that isn't connected to the outside, so each
+// blob covers everything inside its outer contour
+__global__ void fillHolesKernel(const cv::cuda::PtrStepSz<unsigned char> mask,
+                                const int* labels,
+                                const int* outside,
+                                cv::cuda::PtrStep<unsigned char> filled)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= mask.cols || y >= mask.rows) {
+        return;
+    }
+
+    const int label = labels[y * mask.cols + x];
+    filled(y, x) = mask(y, x) || !outside[label] ? 255 : 0;
+}
+
+__global__ void assignIdsKernel(int rows,
+                                int cols,
+                                const int* labels,
+                                int* ids,
+                                LabelStats* stats,
+                                BlobList* blob_list)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= cols || y >= rows) {
+        return;
+    }
+
+    const int i = y * cols + x;
+    if (labels[i] != i) {
+        return;
+    }
+
+    const int id = atomicAdd(&blob_list->label_count, 1);
+    if (id < kMaxBlobLabels) {
+        ids[i] = id;
+        LabelStats zero = {0, 0, 0, 0, 0, 0, 0, -1};
+        stats[id] = zero;
+    } else {
+        ids[i] = kUnlabeled;
+    }
+}
+
+__global__ void accumulateMomentsKernel(
+        const cv::cuda::PtrStepSz<unsigned char> mask,
+        const int* labels,
+        const int* ids,
+        LabelStats* stats)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= mask.cols || y >= mask.rows) {
+        return;
+    }
+
+    const int label = labels[y * mask.cols + x];
+    if (label == kUnlabeled) {
+        return;
+    }
+    const int id = ids[label];
+    if (id == kUnlabeled) {
+        return;
+    }
+
+    const unsigned long long ux = x;
+    const unsigned long long uy = y;
+    LabelStats& s = stats[id];
+    atomicAdd(&s.m00, 1ull);
+
+    // The pixels findContours traces, with 8-connected foreground those are
+    // the ones with a 4-neighbor outside the blob
+    if (x == 0 || y == 0 || x == mask.cols - 1 || y == mask.rows - 1
+     || !mask(y, x - 1) || !mask(y, x + 1)
+     || !mask(y - 1, x) || !mask(y + 1, x)) {
+        atomicAdd(&s.boundary, 1ull);
+    }
+    atomicAdd(&s.m10, ux);
+    atomicAdd(&s.m01, uy);
+    atomicAdd(&s.m20, ux * ux);
+    atomicAdd(&s.m11, ux * uy);
+    atomicAdd(&s.m02, uy * uy);
+}
+
+__global__ void selectBlobsKernel(double min_area,
+                                  double max_area,
+                                  LabelStats* stats,
+                                  BlobList* blob_list)
+{
+    const int id = blockIdx.x * blockDim.x + threadIdx.x;
+    if (id >= ::min(blob_list->label_count, kMaxBlobLabels)) {
+        return;
+    }
+
+    LabelStats& s = stats[id];
+
+    // Area of the polygon through the boundary pixels' centers by Pick's
+    // theorem, which is what cv::moments gives for the contour.  Every
+    // pixel not on the boundary is inside it.
+    const double area = ::max(0.0, s.m00 - s.boundary / 2.0 - 1);
+    if (area < min_area || area > max_area) {
+        return;
+    }
+
+    const int blob = atomicAdd(&blob_list->blob_count, 1);
+    if (blob >= kMaxBlobs) {
+        return;
+    }
+    s.blob = blob;
+
+    const double m00 = s.m00;
+    const double cx = s.m10 / m00;
+    const double cy = s.m01 / m00;
+    const double mu20 = s.m20 / m00 - cx * cx;
+    const double mu11 = s.m11 / m00 - cx * cy;
+    const double mu02 = s.m02 / m00 - cy * cy;
+
+    // Eigenvector of the smaller eigenvalue of [mu20 mu11; mu11 mu02]
+    double v0x, v0y;
+    if (mu11 == 0) {
+        v0x = mu20 <= mu02 ? 1 : 0;
+        v0y = mu20 <= mu02 ? 0 : 1;
+    } else {
+        const double half_diff = (mu20 - mu02) / 2;
+        const double lambda0 = (mu20 + mu02) / 2
+                             - sqrt(half_diff * half_diff + mu11 * mu11);
+        v0x = lambda0 - mu02;
+        v0y = mu11;
+        const double norm = sqrt(v0x * v0x + v0y * v0y);
+        v0x /= norm;
+        v0y /= norm;
+    }
+
+    BlobRecord& record = blob_list->blobs[blob];
+    record.area = area;
+    record.axes[0][0] = v0x;
+    record.axes[0][1] = v0y;
+    record.axes[1][0] = -v0y;
+    record.axes[1][1] = v0x;
+
+    // Extents are accumulated as ordered ints until finishBlobsKernel
+    int* extent_min = reinterpret_cast<int*>(record.extent_min);
+    int* extent_max = reinterpret_cast<int*>(record.extent_max);
+    extent_min[0] = extent_min[1] = orderedFloat(CUDART_INF_F);
+    extent_max[0] = extent_max[1] = orderedFloat(-CUDART_INF_F);
+}
+
+__global__ void accumulateExtentsKernel(int rows,
+                                        int cols,
+                                        const int* labels,
+                                        const int* ids,
+                                        const LabelStats* stats,
+                                        BlobList* blob_list)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= cols || y >= rows) {
+        return;
+    }
+
+    const int label = labels[y * cols + x];
+    if (label == kUnlabeled) {
+        return;
+    }
+    const int id = ids[label];
+    if (id == kUnlabeled || stats[id].blob < 0) {
+        return;
+    }
+
+    BlobRecord& record = blob_list->blobs[stats[id].blob];
+    int* extent_min = reinterpret_cast<int*>(record.extent_min);
+    int* extent_max = reinterpret_cast<int*>(record.extent_max);
+    for (int axis = 0; axis < 2; axis++) {
+        const int d = orderedFloat(record.axes[axis][0] * x
+                                 + record.axes[axis][1] * y);
+        atomicMin(&extent_min[axis], d);
+        atomicMax(&extent_max[axis], d);
+    }
+}
+
+__global__ void finishBlobsKernel(BlobList* blob_list)
+{
+    const int blob = blockIdx.x * blockDim.x + threadIdx.x;
+    if (blob >= ::min(blob_list->blob_count, kMaxBlobs)) {
+        return;
+    }
+
+    BlobRecord& record = blob_list->blobs[blob];
+    for (int axis = 0; axis < 2; axis++) {
+        record.extent_min[axis] = unorderFloat(
+                reinterpret_cast<const int*>(record.extent_min)[axis]);
+        record.extent_max[axis] = unorderFloat(
+                reinterpret_cast<const int*>(record.extent_max)[axis]);
+    }
+}
+
+} // namespace
+
+void findBlobs(const cv::cuda::GpuMat& mask,
+               int min_area,
+               int max_area,
+               cv::cuda::GpuMat& blob_list,
+               BlobLabelingBuf& buf,
+               cv::cuda::Stream& stream)
+{
+    CV_Assert(mask.type() == CV_8UC1);
+    CV_Assert(min_area >= 0 && max_area >= min_area);
+
+    // Labels are indexed as flat arrays
+    cv::cuda::ensureSizeIsEnough(1, mask.size().area(), CV_32SC1, buf.labels);
+    cv::cuda::ensureSizeIsEnough(1, mask.size().area(), CV_32SC1, buf.ids);
+    cv::cuda::ensureSizeIsEnough(mask.size(), CV_8UC1, buf.filled);
+    cv::cuda::ensureSizeIsEnough(1,
+                                 kMaxBlobLabels * sizeof(LabelStats),
+                                 CV_8UC1,
+                                 buf.label_stats);
+    blob_list.create(1, sizeof(BlobList), CV_8UC1);
+
+    int* labels = buf.labels.ptr<int>();
+    int* ids = buf.ids.ptr<int>();
+    LabelStats* stats = reinterpret_cast<LabelStats*>(buf.label_stats.data);
+    BlobList* list = reinterpret_cast<BlobList*>(blob_list.data);
+
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+    cudaSafeCall(cudaMemsetAsync(list,
+                                 0,
+                                 2 * sizeof(int),
+                                 cuda_stream));
+
+    const dim3 block(32, 8);
+    const dim3 grid(cv::cuda::device::divUp(mask.cols, block.x),
+                    cv::cuda::device::divUp(mask.rows, block.y));
+
+    // Fill holes first, findContours with CV_RETR_EXTERNAL only sees the
+    // outer boundary.  ids flags the outside background until the blobs
+    // are given ids.
+    cudaSafeCall(cudaMemsetAsync(ids,
+                                 0,
+                                 mask.size().area() * sizeof(int),
+                                 cuda_stream));
+    initLabelsKernel<false><<<grid, block, 0, cuda_stream>>>(mask, labels);
+    cudaSafeCall(cudaGetLastError());
+    mergeLabelsKernel<false><<<grid, block, 0, cuda_stream>>>(mask, labels);
+    cudaSafeCall(cudaGetLastError());
+    compressLabelsKernel<<<grid, block, 0, cuda_stream>>>(
+            mask.rows, mask.cols, labels);
+    cudaSafeCall(cudaGetLastError());
+    markOutsideKernel<<<grid, block, 0, cuda_stream>>>(
+            mask.rows, mask.cols, labels, ids);
+    cudaSafeCall(cudaGetLastError());
+    fillHolesKernel<<<grid, block, 0, cuda_stream>>>(
+            mask, labels, ids, buf.filled);
+    cudaSafeCall(cudaGetLastError());
+
+    const cv::cuda::PtrStepSz<unsigned char> filled = buf.filled;
+    initLabelsKernel<true><<<grid, block, 0, cuda_stream>>>(filled, labels);
+    cudaSafeCall(cudaGetLastError());
+    mergeLabelsKernel<true><<<grid, block, 0, cuda_stream>>>(filled, labels);
+    cudaSafeCall(cudaGetLastError());
+    compressLabelsKernel<<<grid, block, 0, cuda_stream>>>(
+            mask.rows, mask.cols, labels);
+    cudaSafeCall(cudaGetLastError());
+    assignIdsKernel<<<grid, block, 0, cuda_stream>>>(
+            mask.rows, mask.cols, labels, ids, stats, list);
+    cudaSafeCall(cudaGetLastError());
+    accumulateMomentsKernel<<<grid, block, 0, cuda_stream>>>(
+            filled, labels, ids, stats);
+    cudaSafeCall(cudaGetLastError());
+
+    const int label_block = 128;
+    selectBlobsKernel<<<cv::cuda::device::divUp(kMaxBlobLabels, label_block),
+                        label_block,
+                        0,
+                        cuda_stream>>>(min_area, max_area, stats, list);
+    cudaSafeCall(cudaGetLastError());
+    accumulateExtentsKernel<<<grid, block, 0, cuda_stream>>>(
+            mask.rows, mask.cols, labels, ids, stats, list);
+    cudaSafeCall(cudaGetLastError());
+    finishBlobsKernel<<<1, kMaxBlobs, 0, cuda_stream>>>(list);
+    cudaSafeCall(cudaGetLastError());
+}
+
+} // namespace kernels
+
+} // namespace iarc7_vision
@@ -0,0 +1,90 @@
+#include "iarc7_vision/kernels/ColorCorrection.hpp"
+
+#include <opencv2/core/cuda/common.hpp>
+#include <opencv2/core/cuda_stream_accessor.hpp>
+
+#include "DeviceUtils.cuh"
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+namespace {
+
+using device::roundToUchar;
+
+__global__ void colorCorrectKernel(const cv::cuda::PtrStepSz<uchar3> in,
+                                   cv::cuda::PtrStep<uchar3> out,
+                                   const unsigned char* __restrict__ gamma_lut,
+                                   const unsigned char* __restrict__ final_lut,
+                                   const ColorCorrectionParams params)
+{
+    __shared__ unsigned char s_gamma_lut[256];
+    __shared__ unsigned char s_final_lut[256];
+
+    const int tid = threadIdx.y * blockDim.x + threadIdx.x;
+    for (int i = tid; i < 256; i += blockDim.x * blockDim.y) {
+        s_gamma_lut[i] = gamma_lut[i];
+        s_final_lut[i] = final_lut[i];
+    }
+    __syncthreads();
+
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= in.cols || y >= in.rows) {
+        return;
+    }
+
+    const uchar3 pixel = in(y, x);
+    const unsigned char g0 = s_gamma_lut[pixel.x];
+    const unsigned char g1 = s_gamma_lut[pixel.y];
+    const unsigned char g2 = s_gamma_lut[pixel.z];
+
+    const float* a = params.matrix;
+    const float* offset = params.offset;
+
+    // Sums are grouped the same way as in the multi-pass version
+    const float c0 = (a[0] * g0 + a[1] * g1) + (a[2] * g2 + offset[0]);
+    const float c1 = (a[4] * g1 + a[5] * g2) + (a[3] * g0 + offset[1]);
+    const float c2 = (a[8] * g2 + a[6] * g0) + (a[7] * g1 + offset[2]);
+
+    uchar3 result;
+    result.x = g0 == 255 ? 255 : s_final_lut[roundToUchar(c0)];
+    result.y = g1 == 255 ? 255 : s_final_lut[roundToUchar(c1)];
+    result.z = g2 == 255 ? 255 : s_final_lut[roundToUchar(c2)];
+    out(y, x) = result;
+}
+
+} // namespace
+
+void colorCorrect(const cv::cuda::GpuMat& in,
+                  cv::cuda::GpuMat& out,
+                  const cv::cuda::GpuMat& gamma_lut,
+                  const cv::cuda::GpuMat& final_lut,
+                  const ColorCorrectionParams& params,
+                  cv::cuda::Stream& stream)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(gamma_lut.type() == CV_8UC1 && gamma_lut.size().area() == 256);
+    CV_Assert(final_lut.type() == CV_8UC1 && final_lut.size().area() == 256);
+
+    out.create(in.size(), CV_8UC3);
+    CV_Assert(out.data != in.data);
+
+    const dim3 block(32, 8);
+    const dim3 grid(cv::cuda::device::divUp(in.cols, block.x),
+                    cv::cuda::device::divUp(in.rows, block.y));
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+
+    colorCorrectKernel<<<grid, block, 0, cuda_stream>>>(
+            in,
+            out,
+            gamma_lut.ptr<unsigned char>(),
+            final_lut.ptr<unsigned char>(),
+            params);
+    cudaSafeCall(cudaGetLastError());
+}
+
+} // namespace kernels
+
+} // namespace iarc7_vision
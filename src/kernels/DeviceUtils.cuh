@@ -0,0 +1,25 @@
+#ifndef IARC7_VISION_KERNELS_DEVICE_UTILS_CUH_
+#define IARC7_VISION_KERNELS_DEVICE_UTILS_CUH_
+
+// Device helpers shared between the kernels in src/kernels
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+namespace device {
+
+/// Same rounding and clamping as saturate_cast<uchar>(float)
+__device__ __forceinline__ unsigned char roundToUchar(float value)
+{
+    const int rounded = __float2int_rn(value);
+    return static_cast<unsigned char>(::min(::max(rounded, 0), 255));
+}
+
+} // namespace device
+
+} // namespace kernels
+
+} // namespace iarc7_vision
+
+#endif // include guard
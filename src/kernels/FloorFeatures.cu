@@ -0,0 +1,231 @@
+#include "iarc7_vision/kernels/FloorFeatures.hpp"
+
+#include <algorithm>
+
+#include <opencv2/core/cuda/common.hpp>
+#include <opencv2/core/cuda_stream_accessor.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+namespace {
+
+constexpr int kFloorBlockSize = kMaxFloorFilters + 3;
+constexpr int kSvmBlockSize = 128;
+
+// Weights used by tf.image.rgb_to_grayscale
+constexpr float kGrayR = 0.2989f;
+constexpr float kGrayG = 0.5870f;
+constexpr float kGrayB = 0.1140f;
+
+/// Side length of the pixels the filters see for one patch
+__host__ __device__ int filterTileSize(const FloorFeatureParams& params)
+{
+    return (params.average_size - 1) * params.stride + params.kernel_size;
+}
+
+__global__ void floorFeaturesKernel(const cv::cuda::PtrStepSzb image,
+                                    const cv::cuda::PtrStepSzf filters,
+                                    const FloorFeatureParams params,
+                                    const int grid_cols,
+                                    cv::cuda::PtrStepSzf features)
+{
+    __shared__ float s_gray[kMaxFloorPatchSize][kMaxFloorPatchSize + 1];
+
+    const int patch_pixels = params.average_size * params.stride;
+    const int origin_x = (blockIdx.x % grid_cols) * patch_pixels;
+    const int origin_y = (blockIdx.x / grid_cols) * patch_pixels;
+
+    const int tile = filterTileSize(params);
+    for (int i = threadIdx.x; i < tile * tile; i += blockDim.x) {
+        const int x = i % tile;
+        const int y = i / tile;
+        const unsigned char* pixel = image.ptr(origin_y + y)
+                                   + (origin_x + x) * 3;
+        s_gray[y][x] = kGrayR * (pixel[0] / 255.0f)
+                     + kGrayG * (pixel[1] / 255.0f)
+                     + kGrayB * (pixel[2] / 255.0f);
+    }
+    __syncthreads();
+
+    float* const out = features.ptr(blockIdx.x);
+    if (threadIdx.x < params.num_filters) {
+        const float* filter = filters.ptr(threadIdx.x);
+
+        float sum = 0;
+        for (int py = 0; py < params.average_size; py++) {
+            for (int px = 0; px < params.average_size; px++) {
+                float response = 0;
+                for (int ky = 0; ky < params.kernel_size; ky++) {
+                    for (int kx = 0; kx < params.kernel_size; kx++) {
+                        response += s_gray[py * params.stride + ky]
+                                          [px * params.stride + kx]
+                                  * filter[ky * params.kernel_size + kx];
+                    }
+                }
+                sum += response * response;
+            }
+        }
+        out[threadIdx.x] = sum
+                         / (params.average_size * params.average_size);
+    } else if (threadIdx.x < params.num_filters + 3) {
+        const int channel = threadIdx.x - params.num_filters;
+
+        float sum = 0;
+        for (int y = 0; y < patch_pixels; y++) {
+            const unsigned char* row = image.ptr(origin_y + y);
+            for (int x = 0; x < patch_pixels; x++) {
+                sum += row[(origin_x + x) * 3 + channel];
+            }
+        }
+        out[threadIdx.x] = sum / (255.0f * patch_pixels * patch_pixels);
+    }
+}
+
+__global__ void svmDecisionsKernel(const cv::cuda::PtrStepSzf features,
+                                   const cv::cuda::PtrStepSzf support_vectors,
+                                   const float* dual_coefs,
+                                   const float gamma,
+                                   const float intercept,
+                                   const bool rbf,
+                                   float* decisions)
+{
+    extern __shared__ float s_feature[];
+    __shared__ float s_sums[kSvmBlockSize];
+
+    const int dims = features.cols;
+    const float* feature = features.ptr(blockIdx.x);
+    for (int i = threadIdx.x; i < dims; i += blockDim.x) {
+        s_feature[i] = feature[i];
+    }
+    __syncthreads();
+
+    float sum = 0;
+    for (int i = threadIdx.x; i < support_vectors.rows; i += blockDim.x) {
+        const float* support_vector = support_vectors.ptr(i);
+
+        float k = 0;
+        if (rbf) {
+            for (int j = 0; j < dims; j++) {
+                const float diff = s_feature[j] - support_vector[j];
+                k += diff * diff;
+            }
+            k = ::expf(-gamma * k);
+        } else {
+            for (int j = 0; j < dims; j++) {
+                k += s_feature[j] * support_vector[j];
+            }
+        }
+        sum += dual_coefs[i] * k;
+    }
+
+    s_sums[threadIdx.x] = sum;
+    __syncthreads();
+
+    for (int stride = blockDim.x / 2; stride > 0; stride /= 2) {
+        if (threadIdx.x < stride) {
+            s_sums[threadIdx.x] += s_sums[threadIdx.x + stride];
+        }
+        __syncthreads();
+    }
+
+    if (threadIdx.x == 0) {
+        decisions[blockIdx.x] = s_sums[0] + intercept;
+    }
+}
+
+} // namespace
+
+cv::Size floorPatchGrid(const cv::Size& image_size,
+                        const FloorFeatureParams& params)
+{
+    // Filter responses and color means are pooled separately, a patch needs
+    // both
+    const int patch_pixels = params.average_size * params.stride;
+    const auto patches = [&](int pixels) {
+        if (pixels < params.kernel_size) {
+            return 0;
+        }
+        const int responses = (pixels - params.kernel_size) / params.stride
+                            + 1;
+        return std::min(responses / params.average_size,
+                        pixels / patch_pixels);
+    };
+    return cv::Size(patches(image_size.width), patches(image_size.height));
+}
+
+void floorFeatures(const cv::cuda::GpuMat& image,
+                   const cv::cuda::GpuMat& filters,
+                   const FloorFeatureParams& params,
+                   cv::cuda::GpuMat& features,
+                   cv::cuda::Stream& stream)
+{
+    CV_Assert(image.type() == CV_8UC3);
+    CV_Assert(params.num_filters > 0
+           && params.num_filters <= kMaxFloorFilters);
+    CV_Assert(params.kernel_size > 0
+           && params.stride > 0
+           && params.average_size > 0);
+    CV_Assert(filterTileSize(params) <= kMaxFloorPatchSize
+           && params.average_size * params.stride <= kMaxFloorPatchSize);
+    CV_Assert(filters.type() == CV_32FC1
+           && filters.rows == params.num_filters
+           && filters.cols == params.kernel_size * params.kernel_size);
+
+    const cv::Size grid = floorPatchGrid(image.size(), params);
+    features.create(grid.area(), params.num_filters + 3, CV_32FC1);
+    if (grid.area() == 0) {
+        return;
+    }
+
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+    floorFeaturesKernel<<<grid.area(), kFloorBlockSize, 0, cuda_stream>>>(
+            image,
+            filters,
+            params,
+            grid.width,
+            features);
+    cudaSafeCall(cudaGetLastError());
+}
+
+void svmDecisions(const cv::cuda::GpuMat& features,
+                  const cv::cuda::GpuMat& support_vectors,
+                  const cv::cuda::GpuMat& dual_coefs,
+                  float gamma,
+                  float intercept,
+                  bool rbf,
+                  cv::cuda::GpuMat& decisions,
+                  cv::cuda::Stream& stream)
+{
+    CV_Assert(features.type() == CV_32FC1);
+    CV_Assert(support_vectors.type() == CV_32FC1
+           && support_vectors.cols == features.cols);
+    CV_Assert(dual_coefs.type() == CV_32FC1
+           && dual_coefs.isContinuous()
+           && dual_coefs.rows == 1
+           && dual_coefs.cols == support_vectors.rows);
+
+    decisions.create(1, features.rows, CV_32FC1);
+    if (features.rows == 0) {
+        return;
+    }
+
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+    svmDecisionsKernel<<<features.rows,
+                         kSvmBlockSize,
+                         features.cols * sizeof(float),
+                         cuda_stream>>>(
+            features,
+            support_vectors,
+            dual_coefs.ptr<float>(),
+            gamma,
+            intercept,
+            rbf,
+            decisions.ptr<float>());
+    cudaSafeCall(cudaGetLastError());
+}
+
+} // namespace kernels
+
+} // namespace iarc7_vision
@@ -0,0 +1,150 @@
+#include "iarc7_vision/kernels/FlowVectorFilter.hpp"
+
+#include <opencv2/core/cuda/common.hpp>
+#include <opencv2/core/cuda_stream_accessor.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+namespace {
+
+constexpr int kFilterBlockSize = 256;
+
+__device__ __forceinline__ bool inBounds(const float2 point,
+                                         const FlowFilterParams& params)
+{
+    return point.x > params.min_x && point.x < params.max_x
+        && point.y > params.min_y && point.y < params.max_y;
+}
+
+__device__ __forceinline__ bool onRoomba(const float2 point,
+                                         const FlowFilterParams& params)
+{
+    const float s_x = point.x * params.roomba_scale + params.roomba_offset_x;
+    const float s_y = point.y * params.roomba_scale + params.roomba_offset_y;
+    for (int i = 0; i < params.roomba_count; i++) {
+        const float d_x = s_x - params.roomba_x[i];
+        const float d_y = s_y - params.roomba_y[i];
+        if (d_x * d_x + d_y * d_y <= params.roomba_radius_sq[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A single block walks over the vectors, there are only a few hundred of
+// them and this keeps the output in order without a separate scan pass
+__global__ void filterFlowVectorsKernel(const float2* tails,
+                                        const float2* heads,
+                                        const unsigned char* status,
+                                        const int count,
+                                        const FlowFilterParams params,
+                                        float2* filtered_tails,
+                                        float2* filtered_heads,
+                                        FlowFilterCounts* counts)
+{
+    __shared__ int s_scan[kFilterBlockSize];
+    __shared__ int s_base;
+    __shared__ unsigned int s_rejection_region;
+    __shared__ unsigned int s_roomba_region;
+
+    const int tid = threadIdx.x;
+    if (tid == 0) {
+        s_base = 0;
+        s_rejection_region = 0;
+        s_roomba_region = 0;
+    }
+    __syncthreads();
+
+    for (int start = 0; start < count; start += kFilterBlockSize) {
+        const int i = start + tid;
+
+        bool keep = false;
+        float2 tail = make_float2(0.0f, 0.0f);
+        float2 head = make_float2(0.0f, 0.0f);
+        if (i < count && status[i]) {
+            tail = tails[i];
+            head = heads[i];
+
+            const bool in_bounds = inBounds(tail, params)
+                                && inBounds(head, params);
+            const bool on_roomba = onRoomba(tail, params)
+                                || onRoomba(head, params);
+
+            if (!in_bounds) {
+                atomicAdd(&s_rejection_region, 1u);
+            }
+            if (on_roomba) {
+                atomicAdd(&s_roomba_region, 1u);
+            }
+            keep = in_bounds && !on_roomba;
+        }
+
+        // Inclusive scan of keep to find each output index
+        s_scan[tid] = keep;
+        __syncthreads();
+        for (int offset = 1; offset < kFilterBlockSize; offset *= 2) {
+            const int value = tid >= offset ? s_scan[tid - offset] : 0;
+            __syncthreads();
+            s_scan[tid] += value;
+            __syncthreads();
+        }
+
+        if (keep) {
+            const int out = s_base + s_scan[tid] - 1;
+            filtered_tails[out] = tail;
+            filtered_heads[out] = head;
+        }
+        __syncthreads();
+
+        if (tid == kFilterBlockSize - 1) {
+            s_base += s_scan[tid];
+        }
+        __syncthreads();
+    }
+
+    if (tid == 0) {
+        counts->accepted = s_base;
+        counts->rejection_region = s_rejection_region;
+        counts->roomba_region = s_roomba_region;
+    }
+}
+
+} // namespace
+
+void filterFlowVectors(const cv::cuda::GpuMat& tails,
+                       const cv::cuda::GpuMat& heads,
+                       const cv::cuda::GpuMat& status,
+                       const FlowFilterParams& params,
+                       cv::cuda::GpuMat& filtered_tails,
+                       cv::cuda::GpuMat& filtered_heads,
+                       cv::cuda::GpuMat& counts,
+                       cv::cuda::Stream& stream)
+{
+    CV_Assert(tails.type() == CV_32FC2 && tails.rows == 1);
+    CV_Assert(heads.type() == CV_32FC2 && heads.size() == tails.size());
+    CV_Assert(status.type() == CV_8UC1 && status.size() == tails.size());
+    CV_Assert(params.roomba_count >= 0
+           && params.roomba_count <= kMaxFilterRoombas);
+
+    filtered_tails.create(tails.size(), CV_32FC2);
+    filtered_heads.create(tails.size(), CV_32FC2);
+    counts.create(1, sizeof(FlowFilterCounts), CV_8UC1);
+
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+    filterFlowVectorsKernel<<<1, kFilterBlockSize, 0, cuda_stream>>>(
+            tails.ptr<float2>(),
+            heads.ptr<float2>(),
+            status.ptr<unsigned char>(),
+            tails.cols,
+            params,
+            filtered_tails.ptr<float2>(),
+            filtered_heads.ptr<float2>(),
+            reinterpret_cast<FlowFilterCounts*>(counts.data));
+    cudaSafeCall(cudaGetLastError());
+}
+
+} // namespace kernels
+
+} // namespace iarc7_vision
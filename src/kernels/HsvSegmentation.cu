@@ -0,0 +1,225 @@
+#include "iarc7_vision/kernels/HsvSegmentation.hpp"
+
+#include <cmath>
+#include <mutex>
+
+#include <opencv2/core/cuda/common.hpp>
+#include <opencv2/core/cuda_stream_accessor.hpp>
+
+#include "DeviceUtils.cuh"
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+namespace {
+
+using device::roundToUchar;
+
+constexpr int kHsvShift = 12;
+constexpr int kSumsBlockSize = 256;
+constexpr int kSumsPixelsPerThread = 16;
+
+// Same fixed point division tables as OpenCV's RGB2HSV for 8 bit images
+__constant__ int c_sat_div_table[256];
+__constant__ int c_hue_div_table[256];
+
+void uploadDivTables()
+{
+    int sat_div_table[256];
+    int hue_div_table[256];
+    sat_div_table[0] = 0;
+    hue_div_table[0] = 0;
+    for (int i = 1; i < 256; i++) {
+        sat_div_table[i] = static_cast<int>(
+                std::round((255 << kHsvShift) / static_cast<double>(i)));
+        hue_div_table[i] = static_cast<int>(
+                std::round((180 << kHsvShift) / (6. * i)));
+    }
+
+    cudaSafeCall(cudaMemcpyToSymbol(c_sat_div_table,
+                                    sat_div_table,
+                                    sizeof(sat_div_table)));
+    cudaSafeCall(cudaMemcpyToSymbol(c_hue_div_table,
+                                    hue_div_table,
+                                    sizeof(hue_div_table)));
+}
+
+void ensureDivTables()
+{
+    static std::once_flag once;
+    std::call_once(once, uploadDivTables);
+}
+
+__device__ __forceinline__ int saturation(const uchar3 pixel)
+{
+    const int v = ::max(::max(pixel.x, pixel.y), pixel.z);
+    const int diff = v - ::min(::min(pixel.x, pixel.y), pixel.z);
+    return (diff * c_sat_div_table[v] + (1 << (kHsvShift - 1))) >> kHsvShift;
+}
+
+__device__ __forceinline__ void rgbToHsv(const uchar3 pixel,
+                                         int& h,
+                                         int& s,
+                                         int& v)
+{
+    const int r = pixel.x;
+    const int g = pixel.y;
+    const int b = pixel.z;
+
+    v = ::max(::max(r, g), b);
+    const int diff = v - ::min(::min(r, g), b);
+    const int vr = v == r ? -1 : 0;
+    const int vg = v == g ? -1 : 0;
+
+    s = (diff * c_sat_div_table[v] + (1 << (kHsvShift - 1))) >> kHsvShift;
+    h = (vr & (g - b))
+      + (~vr & ((vg & (b - r + 2 * diff)) + (~vg & (r - g + 4 * diff))));
+    h = (h * c_hue_div_table[diff] + (1 << (kHsvShift - 1))) >> kHsvShift;
+    h += h < 0 ? 180 : 0;
+}
+
+__device__ __forceinline__ bool inSlice(const HsvSlice& slice,
+                                        int h,
+                                        int s,
+                                        int v)
+{
+    return h >= slice.min[0] && h <= slice.max[0]
+        && s >= slice.min[1] && s <= slice.max[1]
+        && v >= slice.min[2] && v <= slice.max[2];
+}
+
+__global__ void saturationSumsKernel(const cv::cuda::PtrStepSz<uchar3> in,
+                                     SaturationSums* sums)
+{
+    __shared__ unsigned long long s_sum[kSumsBlockSize];
+    __shared__ unsigned long long s_sqr_sum[kSumsBlockSize];
+
+    unsigned int sum = 0;
+    unsigned int sqr_sum = 0;
+
+    // Each thread handles at most kSumsPixelsPerThread pixels, so the per
+    // thread sums fit in 32 bits
+    const int n = in.rows * in.cols;
+    for (int i = blockIdx.x * blockDim.x + threadIdx.x;
+         i < n;
+         i += gridDim.x * blockDim.x) {
+        const int s = saturation(in(i / in.cols, i % in.cols));
+        sum += s;
+        sqr_sum += s * s;
+    }
+
+    s_sum[threadIdx.x] = sum;
+    s_sqr_sum[threadIdx.x] = sqr_sum;
+    __syncthreads();
+
+    for (int stride = blockDim.x / 2; stride > 0; stride /= 2) {
+        if (threadIdx.x < stride) {
+            s_sum[threadIdx.x] += s_sum[threadIdx.x + stride];
+            s_sqr_sum[threadIdx.x] += s_sqr_sum[threadIdx.x + stride];
+        }
+        __syncthreads();
+    }
+
+    if (threadIdx.x == 0) {
+        atomicAdd(&sums->sum, s_sum[0]);
+        atomicAdd(&sums->sqr_sum, s_sqr_sum[0]);
+    }
+}
+
+__global__ void hsvSegmentationKernel(const cv::cuda::PtrStepSz<uchar3> in,
+                                      const SaturationSums* sums,
+                                      const double n,
+                                      const HsvSegmentationParams params,
+                                      cv::cuda::PtrStep<unsigned char> mask)
+{
+    __shared__ float s_mean;
+    __shared__ float s_scale;
+
+    if (threadIdx.x == 0 && threadIdx.y == 0) {
+        const double mean = sums->sum / n;
+        const double variance = sums->sqr_sum / n - mean * mean;
+        s_mean = mean;
+        s_scale = 42.5 / sqrt(::fmax(0., variance));
+    }
+    __syncthreads();
+
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= in.cols || y >= in.rows) {
+        return;
+    }
+
+    int h, s, v;
+    rgbToHsv(in(y, x), h, s, v);
+
+    // Same order of float operations as the multi-pass version
+    const int normalized_s = roundToUchar((s - s_mean) * s_scale + 128.f);
+
+    bool inside = false;
+    #pragma unroll
+    for (int i = 0; i < 3; i++) {
+        inside |= inSlice(params.slices[i], h, normalized_s, v);
+    }
+
+    mask(y, x) = inside ? 255 : 0;
+}
+
+} // namespace
+
+void saturationSums(const cv::cuda::GpuMat& rgb,
+                    cv::cuda::GpuMat& sums,
+                    cv::cuda::Stream& stream)
+{
+    CV_Assert(rgb.type() == CV_8UC3);
+    ensureDivTables();
+
+    sums.create(1, sizeof(SaturationSums), CV_8UC1);
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+    cudaSafeCall(cudaMemsetAsync(sums.data,
+                                 0,
+                                 sizeof(SaturationSums),
+                                 cuda_stream));
+
+    const int n = rgb.rows * rgb.cols;
+    const int grid = cv::cuda::device::divUp(
+            n, kSumsBlockSize * kSumsPixelsPerThread);
+
+    saturationSumsKernel<<<grid, kSumsBlockSize, 0, cuda_stream>>>(
+            rgb,
+            reinterpret_cast<SaturationSums*>(sums.data));
+    cudaSafeCall(cudaGetLastError());
+}
+
+void hsvSegmentation(const cv::cuda::GpuMat& rgb,
+                     const cv::cuda::GpuMat& sums,
+                     int sums_area,
+                     const HsvSegmentationParams& params,
+                     cv::cuda::GpuMat& mask,
+                     cv::cuda::Stream& stream)
+{
+    CV_Assert(rgb.type() == CV_8UC3);
+    CV_Assert(sums.type() == CV_8UC1
+           && sums.size().area() == sizeof(SaturationSums));
+    CV_Assert(sums_area > 0);
+    ensureDivTables();
+
+    mask.create(rgb.size(), CV_8UC1);
+
+    const dim3 block(32, 8);
+    const dim3 grid(cv::cuda::device::divUp(rgb.cols, block.x),
+                    cv::cuda::device::divUp(rgb.rows, block.y));
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+
+    hsvSegmentationKernel<<<grid, block, 0, cuda_stream>>>(
+            rgb,
+            reinterpret_cast<const SaturationSums*>(sums.data),
+            static_cast<double>(sums_area),
+            params,
+            mask);
+    cudaSafeCall(cudaGetLastError());
+}
+
+} // namespace kernels
+
+} // namespace iarc7_vision
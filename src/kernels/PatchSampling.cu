@@ -0,0 +1,100 @@
+#include "iarc7_vision/kernels/PatchSampling.hpp"
+
+#include <opencv2/core/cuda/common.hpp>
+#include <opencv2/core/cuda_stream_accessor.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+namespace {
+
+constexpr int kPatchBlockSize = 128;
+
+__global__ void patchSumsKernel(const cv::cuda::PtrStepSz<uchar3> image,
+                                const PatchParams* patches,
+                                PatchSum* sums)
+{
+    __shared__ unsigned int s_sums[4][kPatchBlockSize];
+
+    const PatchParams patch = patches[blockIdx.x];
+    const int width = ::max(patch.max_x - patch.min_x + 1, 0);
+    const int height = ::max(patch.max_y - patch.min_y + 1, 0);
+
+    unsigned int sum[3] = {0, 0, 0};
+    unsigned int count = 0;
+    for (int i = threadIdx.x; i < width * height; i += blockDim.x) {
+        const int x = patch.min_x + i % width;
+        const int y = patch.min_y + i / width;
+
+        // Explicit rounding so nvcc doesn't contract these into fmas, this
+        // keeps the test on patch edges the same as insideRotatedRect
+        const float offset_x = __fsub_rn(x, patch.center_x);
+        const float offset_y = __fsub_rn(y, patch.center_y);
+        const float dx = __fadd_rn(__fmul_rn(patch.cos_angle, offset_x),
+                                   __fmul_rn(patch.sin_angle, offset_y));
+        const float dy = __fadd_rn(__fmul_rn(-patch.sin_angle, offset_x),
+                                   __fmul_rn(patch.cos_angle, offset_y));
+
+        if (::fabsf(dx) <= patch.half_width
+         && ::fabsf(dy) <= patch.half_height) {
+            const uchar3 pixel = image(y, x);
+            sum[0] += pixel.x;
+            sum[1] += pixel.y;
+            sum[2] += pixel.z;
+            count++;
+        }
+    }
+
+    s_sums[0][threadIdx.x] = sum[0];
+    s_sums[1][threadIdx.x] = sum[1];
+    s_sums[2][threadIdx.x] = sum[2];
+    s_sums[3][threadIdx.x] = count;
+    __syncthreads();
+
+    for (int stride = blockDim.x / 2; stride > 0; stride /= 2) {
+        if (threadIdx.x < stride) {
+            for (int j = 0; j < 4; j++) {
+                s_sums[j][threadIdx.x] += s_sums[j][threadIdx.x + stride];
+            }
+        }
+        __syncthreads();
+    }
+
+    if (threadIdx.x == 0) {
+        PatchSum& result = sums[blockIdx.x];
+        result.sum[0] = s_sums[0][0];
+        result.sum[1] = s_sums[1][0];
+        result.sum[2] = s_sums[2][0];
+        result.count = s_sums[3][0];
+    }
+}
+
+} // namespace
+
+void patchSums(const cv::cuda::GpuMat& image,
+               const cv::cuda::GpuMat& patches,
+               int count,
+               cv::cuda::GpuMat& sums,
+               cv::cuda::Stream& stream)
+{
+    CV_Assert(image.type() == CV_8UC3);
+    CV_Assert(patches.type() == CV_8UC1
+           && patches.size().area() >= count * sizeof(PatchParams));
+
+    sums.create(1, count * sizeof(PatchSum), CV_8UC1);
+    if (count == 0) {
+        return;
+    }
+
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+    patchSumsKernel<<<count, kPatchBlockSize, 0, cuda_stream>>>(
+            image,
+            reinterpret_cast<const PatchParams*>(patches.data),
+            reinterpret_cast<PatchSum*>(sums.data));
+    cudaSafeCall(cudaGetLastError());
+}
+
+} // namespace kernels
+
+} // namespace iarc7_vision
@@ -0,0 +1,365 @@
+#include "iarc7_vision/kernels/PyrLK.hpp"
+
+#include <opencv2/core/cuda/common.hpp>
+#include <opencv2/core/cuda_stream_accessor.hpp>
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+namespace {
+
+struct Pyramid {
+    cv::cuda::PtrStepSzb levels[kMaxPyrLKLevel + 1];
+};
+
+template<int cn>
+__device__ __forceinline__ float pixel(const cv::cuda::PtrStepSzb& image,
+                                       int x,
+                                       int y,
+                                       int c)
+{
+    // Replicate the border
+    x = ::min(::max(x, 0), image.cols - 1);
+    y = ::min(::max(y, 0), image.rows - 1);
+    return image.ptr(y)[x * cn + c];
+}
+
+template<int cn>
+__device__ __forceinline__ float bilinear(const cv::cuda::PtrStepSzb& image,
+                                          float x,
+                                          float y,
+                                          int c)
+{
+    const float x0 = ::floorf(x);
+    const float y0 = ::floorf(y);
+    const int ix = x0;
+    const int iy = y0;
+    const float ax = x - x0;
+    const float ay = y - y0;
+
+    return (1 - ay) * ((1 - ax) * pixel<cn>(image, ix, iy, c)
+                     + ax * pixel<cn>(image, ix + 1, iy, c))
+         + ay * ((1 - ax) * pixel<cn>(image, ix, iy + 1, c)
+               + ax * pixel<cn>(image, ix + 1, iy + 1, c));
+}
+
+/// Normalized Scharr derivatives of the image at a subpixel location
+template<int cn>
+__device__ __forceinline__ void gradient(const cv::cuda::PtrStepSzb& image,
+                                         float x,
+                                         float y,
+                                         int c,
+                                         float& dx,
+                                         float& dy)
+{
+    float s[3][3];
+    #pragma unroll
+    for (int j = 0; j < 3; j++) {
+        #pragma unroll
+        for (int i = 0; i < 3; i++) {
+            s[j][i] = bilinear<cn>(image, x + i - 1, y + j - 1, c);
+        }
+    }
+
+    dx = (3 * (s[0][2] - s[0][0])
+       + 10 * (s[1][2] - s[1][0])
+        + 3 * (s[2][2] - s[2][0])) / 32.f;
+    dy = (3 * (s[2][0] - s[0][0])
+       + 10 * (s[2][1] - s[0][1])
+        + 3 * (s[2][2] - s[0][2])) / 32.f;
+}
+
+/// Threads tracking each point with a window size only known at runtime,
+/// they split the window between them
+constexpr int kPyrLKThreads = 128;
+
+/// Threads tracking each point for a window of n samples known at compile
+/// time, enough for each to get at least one sample without a block much
+/// wider than the window
+constexpr int pyrLKThreadsFor(int n)
+{
+    return n <= 32 ? 32 : n <= 128 ? 64 : kPyrLKThreads;
+}
+
+/// Sum each value over a block of kThreads threads, every thread gets the
+/// sums back
+///
+/// s_scratch needs room for n * kThreads floats.  Also acts as a barrier,
+/// so shared memory written before it is visible to every thread after it.
+template<int kThreads, int n>
+__device__ __forceinline__ void blockSum(float (&values)[n], float* s_scratch)
+{
+    #pragma unroll
+    for (int j = 0; j < n; j++) {
+        s_scratch[j * kThreads + threadIdx.x] = values[j];
+    }
+    __syncthreads();
+
+    #pragma unroll
+    for (int stride = kThreads / 2; stride > 0; stride /= 2) {
+        if (threadIdx.x < stride) {
+            #pragma unroll
+            for (int j = 0; j < n; j++) {
+                s_scratch[j * kThreads + threadIdx.x]
+                    += s_scratch[j * kThreads + threadIdx.x + stride];
+            }
+        }
+        __syncthreads();
+    }
+
+    #pragma unroll
+    for (int j = 0; j < n; j++) {
+        values[j] = s_scratch[j * kThreads];
+    }
+    // Nobody writes the scratch again until everyone has read the sums
+    __syncthreads();
+}
+
+/// One block of kThreads threads per point, kWin is the window size, or 0
+/// to take it from params at runtime
+///
+/// The previous image's window and its gradients are sampled into shared
+/// memory once per level, the solver iterations only sample the next image.
+/// With kWin set the cache is sized at compile time and the loops over the
+/// window are unrolled, otherwise it needs 3 * win * win * cn floats of
+/// dynamic shared memory.
+template<int cn, int kWin, int kThreads>
+__global__ void pyrLKKernel(const Pyramid prev_pyramid,
+                            const Pyramid next_pyramid,
+                            const float2* prev_pts,
+                            const PyrLKParams params,
+                            float2* next_pts,
+                            unsigned char* status)
+{
+    constexpr int kN = kWin * kWin * cn;
+    extern __shared__ float s_dynamic_window[];
+    __shared__ float s_static_window[kWin > 0 ? 3 * kN : 1];
+    __shared__ float s_sums[3 * kThreads];
+
+    const int point = blockIdx.x;
+
+    const int win = kWin > 0 ? kWin : params.win_size;
+    const int n = kWin > 0 ? kN : win * win * cn;
+    // Samples each thread takes from the window
+    const int steps = (n + kThreads - 1) / kThreads;
+    float* const s_window = kWin > 0 ? s_static_window : s_dynamic_window;
+    float* const s_prev = s_window;
+    float* const s_dx = s_window + n;
+    float* const s_dy = s_window + 2 * n;
+
+    // Even windows are centered between pixels, the same as OpenCV's
+    const float half_win = (win - 1) * 0.5f;
+    const float2 base_prev = prev_pts[point];
+    float2 next;
+    bool tracked = true;
+
+    for (int level = params.max_level; level >= 0; level--) {
+        const cv::cuda::PtrStepSzb& prev_image = prev_pyramid.levels[level];
+        const cv::cuda::PtrStepSzb& next_image = next_pyramid.levels[level];
+
+        const float scale = 1.f / (1 << level);
+        const float2 prev = make_float2(base_prev.x * scale - half_win,
+                                        base_prev.y * scale - half_win);
+        if (level == params.max_level) {
+            next = make_float2(prev.x + half_win, prev.y + half_win);
+        } else {
+            next.x *= 2;
+            next.y *= 2;
+        }
+
+        // Spatial gradient matrix over the window in the previous image
+        float a[3] = {0, 0, 0};
+        #pragma unroll
+        for (int step = 0; step < steps; step++) {
+            const int i = step * kThreads + threadIdx.x;
+            if (i >= n) {
+                break;
+            }
+
+            const int c = i % cn;
+            const float x = prev.x + (i / cn) % win;
+            const float y = prev.y + (i / cn) / win;
+
+            float dx, dy;
+            gradient<cn>(prev_image, x, y, c, dx, dy);
+            s_prev[i] = bilinear<cn>(prev_image, x, y, c);
+            s_dx[i] = dx;
+            s_dy[i] = dy;
+
+            a[0] += dx * dx;
+            a[1] += dx * dy;
+            a[2] += dy * dy;
+        }
+        blockSum<kThreads>(a, s_sums);
+        const float a11 = a[0];
+        const float a12 = a[1];
+        const float a22 = a[2];
+
+        // OpenCV's checks, in its units.  Its derivatives are 32 times ours
+        // and it scales the matrix by 2^-20.
+        const float cv_a11 = a11 / 1024;
+        const float cv_a12 = a12 / 1024;
+        const float cv_a22 = a22 / 1024;
+        const float cv_det = cv_a11 * cv_a22 - cv_a12 * cv_a12;
+        const float min_eig = (cv_a22 + cv_a11
+                             - ::sqrtf((cv_a11 - cv_a22) * (cv_a11 - cv_a22)
+                                     + 4 * cv_a12 * cv_a12))
+                            / (2 * win * win);
+        if (min_eig < params.min_eig_threshold
+         || cv_det < 1.192092896e-07f) {
+            // Like OpenCV only the base level decides, the coarser levels
+            // just don't move the guess
+            if (level == 0) {
+                tracked = false;
+            }
+            continue;
+        }
+        const float inv_det = 1.f / (a11 * a22 - a12 * a12);
+
+        for (int k = 0; k < params.iters; k++) {
+            if (next.x < -half_win || next.x >= next_image.cols + half_win
+             || next.y < -half_win || next.y >= next_image.rows + half_win) {
+                if (level == 0) {
+                    tracked = false;
+                }
+                break;
+            }
+
+            // Top left of the window in the next image
+            const float next_x = next.x - half_win;
+            const float next_y = next.y - half_win;
+
+            float b[2] = {0, 0};
+            #pragma unroll
+            for (int step = 0; step < steps; step++) {
+                const int i = step * kThreads + threadIdx.x;
+                if (i >= n) {
+                    break;
+                }
+
+                const int c = i % cn;
+                const float diff
+                    = bilinear<cn>(next_image,
+                                   next_x + (i / cn) % win,
+                                   next_y + (i / cn) / win,
+                                   c)
+                    - s_prev[i];
+                b[0] += diff * s_dx[i];
+                b[1] += diff * s_dy[i];
+            }
+            blockSum<kThreads>(b, s_sums);
+
+            // Every thread has the same sums, so they all take the same
+            // step and stop together
+            const float delta_x = (a12 * b[1] - a22 * b[0]) * inv_det;
+            const float delta_y = (a12 * b[0] - a11 * b[1]) * inv_det;
+            next.x += delta_x;
+            next.y += delta_y;
+
+            if (::fabsf(delta_x) < 0.01f && ::fabsf(delta_y) < 0.01f) {
+                break;
+            }
+        }
+    }
+
+    if (threadIdx.x == 0) {
+        const cv::cuda::PtrStepSzb& base = next_pyramid.levels[0];
+        status[point] = tracked
+                     && next.x >= 0 && next.x < base.cols
+                     && next.y >= 0 && next.y < base.rows;
+        next_pts[point] = next;
+    }
+}
+
+Pyramid makePyramid(const std::vector<cv::cuda::GpuMat>& levels,
+                    int max_level,
+                    int type)
+{
+    CV_Assert(static_cast<int>(levels.size()) > max_level);
+
+    Pyramid pyramid;
+    for (int i = 0; i <= max_level; i++) {
+        CV_Assert(levels[i].type() == type);
+        pyramid.levels[i] = levels[i];
+    }
+    return pyramid;
+}
+
+} // namespace
+
+bool pyrLKHasFastPath(int win_size, int type)
+{
+    return (type == CV_8UC1 || type == CV_8UC3)
+        && (win_size == 5 || win_size == 20);
+}
+
+void pyrLK(const std::vector<cv::cuda::GpuMat>& prev_pyramid,
+           const std::vector<cv::cuda::GpuMat>& next_pyramid,
+           const cv::cuda::GpuMat& prev_pts,
+           cv::cuda::GpuMat& next_pts,
+           cv::cuda::GpuMat& status,
+           const PyrLKParams& params,
+           cv::cuda::Stream& stream)
+{
+    CV_Assert(params.max_level >= 0 && params.max_level <= kMaxPyrLKLevel);
+    CV_Assert(params.win_size > 0 && params.win_size <= kMaxPyrLKWinSize);
+    CV_Assert(prev_pts.empty()
+           || (prev_pts.rows == 1 && prev_pts.type() == CV_32FC2));
+
+    const int type = prev_pyramid.at(0).type();
+    CV_Assert(type == CV_8UC1 || type == CV_8UC3);
+    CV_Assert(next_pyramid.at(0).size() == prev_pyramid[0].size());
+
+    const int count = prev_pts.cols;
+    next_pts.create(1, count, CV_32FC2);
+    status.create(1, count, CV_8UC1);
+    if (count == 0) {
+        return;
+    }
+
+    const Pyramid prev = makePyramid(prev_pyramid, params.max_level, type);
+    const Pyramid next = makePyramid(next_pyramid, params.max_level, type);
+
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+
+    // Window sizes of the flight configs get their own kernels, see
+    // pyrLKHasFastPath.  Those cache the window in static shared memory,
+    // the generic ones need the previous image's window and its x and y
+    // gradients in dynamic shared memory.
+    const int cn = type == CV_8UC1 ? 1 : 3;
+    decltype(&pyrLKKernel<1, 0, kPyrLKThreads>) kernel;
+    int threads = kPyrLKThreads;
+    size_t window_bytes = 0;
+    if (cn == 1 && params.win_size == 5) {
+        kernel = pyrLKKernel<1, 5, pyrLKThreadsFor(5 * 5)>;
+        threads = pyrLKThreadsFor(5 * 5);
+    } else if (cn == 1 && params.win_size == 20) {
+        kernel = pyrLKKernel<1, 20, pyrLKThreadsFor(20 * 20)>;
+        threads = pyrLKThreadsFor(20 * 20);
+    } else if (cn == 3 && params.win_size == 5) {
+        kernel = pyrLKKernel<3, 5, pyrLKThreadsFor(5 * 5 * 3)>;
+        threads = pyrLKThreadsFor(5 * 5 * 3);
+    } else if (cn == 3 && params.win_size == 20) {
+        kernel = pyrLKKernel<3, 20, pyrLKThreadsFor(20 * 20 * 3)>;
+        threads = pyrLKThreadsFor(20 * 20 * 3);
+    } else {
+        kernel = cn == 1 ? pyrLKKernel<1, 0, kPyrLKThreads>
+                         : pyrLKKernel<3, 0, kPyrLKThreads>;
+        window_bytes = 3 * params.win_size * params.win_size * cn
+                     * sizeof(float);
+    }
+
+    kernel<<<count, threads, window_bytes, cuda_stream>>>(
+            prev,
+            next,
+            prev_pts.ptr<float2>(),
+            params,
+            next_pts.ptr<float2>(),
+            status.ptr<unsigned char>());
+    cudaSafeCall(cudaGetLastError());
+}
+
+} // namespace kernels
+
+} // namespace iarc7_vision
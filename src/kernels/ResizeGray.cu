@@ -0,0 +1,99 @@
+#include "iarc7_vision/kernels/ResizeGray.hpp"
+
+#include <opencv2/core/cuda/common.hpp>
+#include <opencv2/core/cuda_stream_accessor.hpp>
+
+#include "DeviceUtils.cuh"
+
+namespace iarc7_vision {
+
+namespace kernels {
+
+namespace {
+
+using device::roundToUchar;
+
+// Fixed point coefficients used by cvtColor for 8 bit images
+constexpr int kYuvShift = 14;
+constexpr int kR2Y = 4899;
+constexpr int kG2Y = 9617;
+constexpr int kB2Y = 1868;
+
+template<int cn>
+__global__ void cropResizeGrayKernel(const cv::cuda::PtrStepSzb in,
+                                     const float fx,
+                                     const float fy,
+                                     cv::cuda::PtrStepSzb gray)
+{
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= gray.cols || y >= gray.rows) {
+        return;
+    }
+
+    // Same sampling as cv::cuda::resize with INTER_LINEAR
+    const float src_x = x * fx;
+    const float src_y = y * fy;
+    const int x1 = __float2int_rd(src_x);
+    const int y1 = __float2int_rd(src_y);
+    const int x2 = x1 + 1;
+    const int y2 = y1 + 1;
+    const int x2_read = ::min(x2, in.cols - 1);
+    const int y2_read = ::min(y2, in.rows - 1);
+
+    const unsigned char* row1 = in.ptr(y1);
+    const unsigned char* row2 = in.ptr(y2_read);
+
+    int channels[3];
+    #pragma unroll
+    for (int c = 0; c < 3; c++) {
+        float out = 0;
+        out += row1[x1 * cn + c] * ((x2 - src_x) * (y2 - src_y));
+        out += row1[x2_read * cn + c] * ((src_x - x1) * (y2 - src_y));
+        out += row2[x1 * cn + c] * ((x2 - src_x) * (src_y - y1));
+        out += row2[x2_read * cn + c] * ((src_x - x1) * (src_y - y1));
+        channels[c] = roundToUchar(out);
+    }
+
+    gray.ptr(y)[x] = (channels[0] * kR2Y
+                    + channels[1] * kG2Y
+                    + channels[2] * kB2Y
+                    + (1 << (kYuvShift - 1))) >> kYuvShift;
+}
+
+} // namespace
+
+void cropResizeGray(const cv::cuda::GpuMat& in,
+                    const cv::Rect& roi,
+                    const cv::Size& size,
+                    cv::cuda::GpuMat& gray,
+                    cv::cuda::Stream& stream)
+{
+    CV_Assert(in.type() == CV_8UC3 || in.type() == CV_8UC4);
+    CV_Assert(size.area() > 0);
+
+    const cv::cuda::GpuMat cropped (in, roi);
+    gray.create(size, CV_8UC1);
+    CV_Assert(gray.data != in.data);
+
+    const float fx = static_cast<float>(cropped.cols) / size.width;
+    const float fy = static_cast<float>(cropped.rows) / size.height;
+
+    const dim3 block(32, 8);
+    const dim3 grid(cv::cuda::device::divUp(size.width, block.x),
+                    cv::cuda::device::divUp(size.height, block.y));
+    const cudaStream_t cuda_stream = cv::cuda::StreamAccessor::getStream(stream);
+
+    if (in.channels() == 3) {
+        cropResizeGrayKernel<3><<<grid, block, 0, cuda_stream>>>(
+                cropped, fx, fy, gray);
+    } else {
+        cropResizeGrayKernel<4><<<grid, block, 0, cuda_stream>>>(
+                cropped, fx, fy, gray);
+    }
+    cudaSafeCall(cudaGetLastError());
+}
+
+} // namespace kernels
+
+} // namespace iarc7_vision